@@ -0,0 +1,356 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Benchmarks of backup, restore, listing, diff, validate, and gc, on synthetic trees.
+//!
+//! Run with `cargo bench`, or e.g. `cargo bench -- backup/` for one group. Throughput
+//! is reported in bytes per second for operations that read or write file content,
+//! and in entries per second for those that mostly walk trees or indexes.
+
+use criterion::{criterion_group, criterion_main, BatchSize, Criterion, Throughput};
+use tempfile::TempDir;
+
+use conserve::test_fixtures::{ScratchArchive, TreeFixture};
+use conserve::*;
+
+/// A synthetic source tree, with its total size and number of entries.
+struct Fixture {
+    name: &'static str,
+    tree: TreeFixture,
+    bytes: u64,
+    entries: u64,
+}
+
+/// Deterministic incompressible content, so that results are reproducible and
+/// blocks aren't all deduplicated.
+fn pseudorandom_bytes(seed: u64, len: usize) -> Vec<u8> {
+    let mut x = seed.wrapping_mul(0x9E37_79B9_7F4A_7C15) | 1;
+    let mut buf = Vec::with_capacity(len + 8);
+    while buf.len() < len {
+        // xorshift64
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf.extend_from_slice(&x.to_le_bytes());
+    }
+    buf.truncate(len);
+    buf
+}
+
+/// Text-like content, which compresses reasonably.
+fn text_bytes(seed: u64, len: usize) -> Vec<u8> {
+    format!("line {} of some fairly ordinary file content\n", seed)
+        .into_bytes()
+        .into_iter()
+        .cycle()
+        .take(len)
+        .collect()
+}
+
+/// Many small files spread across a few directories.
+fn many_small_files() -> Fixture {
+    let tree = TreeFixture::new();
+    let mut bytes = 0;
+    let mut entries = 1;
+    for d in 0..20 {
+        let dir = format!("dir{:02}", d);
+        tree.create_dir(&dir);
+        entries += 1;
+        for f in 0..100 {
+            let i = d * 100 + f;
+            let content = text_bytes(i, 1000 + (i as usize % 4) * 1000);
+            tree.create_file_with_contents(&format!("{}/file{:03}", dir, f), &content);
+            bytes += content.len() as u64;
+            entries += 1;
+        }
+    }
+    Fixture {
+        name: "small_files",
+        tree,
+        bytes,
+        entries,
+    }
+}
+
+/// A few large files of incompressible content.
+fn large_files() -> Fixture {
+    let tree = TreeFixture::new();
+    let mut bytes = 0;
+    for i in 0..2 {
+        let content = pseudorandom_bytes(i, 16 << 20);
+        tree.create_file_with_contents(&format!("large{}", i), &content);
+        bytes += content.len() as u64;
+    }
+    Fixture {
+        name: "large_files",
+        tree,
+        bytes,
+        entries: 3,
+    }
+}
+
+/// A deeply nested tree with a few files at each level.
+fn deep_tree() -> Fixture {
+    let tree = TreeFixture::new();
+    let mut bytes = 0;
+    let mut entries = 1;
+    let mut dir = String::new();
+    for depth in 0..30 {
+        dir.push_str(&format!("level{:02}/", depth));
+        tree.create_dir(&dir);
+        entries += 1;
+        for f in 0..5 {
+            let content = text_bytes(depth * 10 + f, 2000);
+            tree.create_file_with_contents(&format!("{}file{}", dir, f), &content);
+            bytes += content.len() as u64;
+            entries += 1;
+        }
+    }
+    Fixture {
+        name: "deep_tree",
+        tree,
+        bytes,
+        entries,
+    }
+}
+
+fn fixtures() -> Vec<Fixture> {
+    vec![many_small_files(), large_files(), deep_tree()]
+}
+
+/// Make an archive holding one backup of the fixture.
+fn backed_up(fixture: &Fixture) -> ScratchArchive {
+    let archive = ScratchArchive::new();
+    backup(
+        &archive,
+        &fixture.tree.live_tree(),
+        &BackupOptions::default(),
+    )
+    .unwrap();
+    archive
+}
+
+fn bench_backup(c: &mut Criterion) {
+    let mut group = c.benchmark_group("backup");
+    group.sample_size(10);
+    for fixture in fixtures() {
+        group.throughput(Throughput::Bytes(fixture.bytes));
+        group.bench_function(fixture.name, |b| {
+            b.iter_batched(
+                ScratchArchive::new,
+                |archive| {
+                    backup(
+                        &archive,
+                        &fixture.tree.live_tree(),
+                        &BackupOptions::default(),
+                    )
+                    .unwrap()
+                },
+                BatchSize::PerIteration,
+            )
+        });
+    }
+
+    // An incremental backup where a few files changed since the last one.
+    let fixture = many_small_files();
+    let changed = 10;
+    group.throughput(Throughput::Elements(fixture.entries));
+    let mut generation = 0;
+    group.bench_function("incremental_few_changes", |b| {
+        b.iter_batched(
+            || {
+                let archive = backed_up(&fixture);
+                generation += 1;
+                for i in 0..changed {
+                    fixture.tree.create_file_with_contents(
+                        &format!("dir{:02}/file000", i),
+                        &text_bytes(generation * 1000 + i, 1500),
+                    );
+                }
+                archive
+            },
+            |archive| {
+                backup(
+                    &archive,
+                    &fixture.tree.live_tree(),
+                    &BackupOptions::default(),
+                )
+                .unwrap()
+            },
+            BatchSize::PerIteration,
+        )
+    });
+    group.finish();
+}
+
+fn bench_restore(c: &mut Criterion) {
+    let mut group = c.benchmark_group("restore");
+    group.sample_size(10);
+    for fixture in fixtures() {
+        let archive = backed_up(&fixture);
+        group.throughput(Throughput::Bytes(fixture.bytes));
+        group.bench_function(fixture.name, |b| {
+            b.iter_batched(
+                || TempDir::new().unwrap(),
+                |dest| restore(&archive, dest.path(), &RestoreOptions::default()).unwrap(),
+                BatchSize::PerIteration,
+            )
+        });
+    }
+    group.finish();
+}
+
+/// Walking the source tree, as done at the start of every backup and diff.
+fn bench_walk(c: &mut Criterion) {
+    let mut group = c.benchmark_group("walk_live_tree");
+    for fixture in fixtures() {
+        let live_tree = fixture.tree.live_tree();
+        group.throughput(Throughput::Elements(fixture.entries));
+        group.bench_function(fixture.name, |b| {
+            b.iter(|| {
+                live_tree
+                    .iter_entries(None, excludes_nothing())
+                    .unwrap()
+                    .count()
+            })
+        });
+    }
+    group.finish();
+}
+
+/// Reading and parsing the index, as in `conserve ls`, for each index format.
+fn bench_ls(c: &mut Criterion) {
+    let mut group = c.benchmark_group("ls");
+    let fixture = many_small_files();
+    group.throughput(Throughput::Elements(fixture.entries));
+    for (name, index_format) in &[("json", IndexFormat::Json), ("binary", IndexFormat::Binary)] {
+        let archive = ScratchArchive::new();
+        let options = BackupOptions {
+            index_format: *index_format,
+            ..BackupOptions::default()
+        };
+        backup(&archive, &fixture.tree.live_tree(), &options).unwrap();
+        group.bench_function(*name, |b| {
+            b.iter(|| {
+                archive
+                    .open_stored_tree(BandSelectionPolicy::Latest)
+                    .unwrap()
+                    .iter_entries(None, excludes_nothing())
+                    .unwrap()
+                    .count()
+            })
+        });
+    }
+    group.finish();
+}
+
+fn bench_diff(c: &mut Criterion) {
+    let mut group = c.benchmark_group("diff");
+    for fixture in fixtures() {
+        let archive = backed_up(&fixture);
+        let live_tree = fixture.tree.live_tree();
+        group.throughput(Throughput::Elements(fixture.entries));
+        group.bench_function(fixture.name, |b| {
+            b.iter(|| {
+                let stored_tree = archive
+                    .open_stored_tree(BandSelectionPolicy::Latest)
+                    .unwrap();
+                diff(&stored_tree, &live_tree, &DiffOptions::default())
+                    .unwrap()
+                    .count()
+            })
+        });
+    }
+    group.finish();
+}
+
+fn bench_validate(c: &mut Criterion) {
+    let mut group = c.benchmark_group("validate");
+    group.sample_size(10);
+    for fixture in fixtures() {
+        let archive = backed_up(&fixture);
+        group.throughput(Throughput::Bytes(fixture.bytes));
+        group.bench_function(fixture.name, |b| {
+            b.iter(|| archive.validate(&ValidateOptions::default()).unwrap())
+        });
+    }
+    group.finish();
+}
+
+/// Reading every block directly from the block directory.
+fn bench_blockdir(c: &mut Criterion) {
+    let mut group = c.benchmark_group("blockdir");
+    let fixture = large_files();
+    let archive = backed_up(&fixture);
+    let block_dir = archive.block_dir();
+    let hashes: Vec<BlockHash> = block_dir.block_names().unwrap().collect();
+    group.throughput(Throughput::Bytes(fixture.bytes));
+    group.bench_function("get_block_content", |b| {
+        b.iter(|| {
+            for hash in &hashes {
+                block_dir.get_block_content(hash).unwrap();
+            }
+        })
+    });
+    group.finish();
+}
+
+/// Deleting the older of two backups, and the blocks only it referenced.
+fn bench_gc(c: &mut Criterion) {
+    let mut group = c.benchmark_group("gc");
+    group.sample_size(10);
+    let fixture = many_small_files();
+    group.throughput(Throughput::Elements(fixture.entries));
+    let mut generation = 0;
+    group.bench_function("delete_old_band", |b| {
+        b.iter_batched(
+            || {
+                let archive = backed_up(&fixture);
+                generation += 1;
+                for d in 0..20 {
+                    fixture.tree.create_file_with_contents(
+                        &format!("dir{:02}/file001", d),
+                        &text_bytes(generation * 1000 + d, 3000),
+                    );
+                }
+                backup(
+                    &archive,
+                    &fixture.tree.live_tree(),
+                    &BackupOptions::default(),
+                )
+                .unwrap();
+                archive
+            },
+            |archive| {
+                archive
+                    .delete_bands(&[BandId::new(&[0])], &DeleteOptions::default())
+                    .unwrap()
+            },
+            BatchSize::PerIteration,
+        )
+    });
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_backup,
+    bench_restore,
+    bench_walk,
+    bench_ls,
+    bench_diff,
+    bench_validate,
+    bench_blockdir,
+    bench_gc
+);
+criterion_main!(benches);
@@ -16,7 +16,8 @@
 //!
 //! The format and semantics of apaths are defined in ../doc/format.md.
 //!
-//! Apaths in memory are simply strings.
+//! Apaths in memory are immutable reference-counted strings, so that they can be
+//! cheaply cloned as entries pass through iterators, merges, and order checks.
 
 use std::cmp::{Ord, Ordering, PartialEq, PartialOrd};
 use std::fmt;
@@ -24,8 +25,10 @@ use std::fmt::{Display, Formatter};
 use std::ops::Deref;
 use std::path::Path;
 use std::str::FromStr;
+use std::sync::Arc;
 
-use serde::{Deserialize, Serialize};
+use serde::de::{self, Deserializer, Visitor};
+use serde::{Deserialize, Serialize, Serializer};
 
 /// An ordered archive path.
 ///
@@ -36,8 +39,8 @@ use serde::{Deserialize, Serialize};
 /// string ordering.
 ///
 /// Apaths must start with `/` and not end with `/` unless they have length 1.
-#[derive(Clone, Debug, Eq, PartialEq, Serialize, Deserialize)]
-pub struct Apath(String);
+#[derive(Clone, Debug, Eq, Hash, PartialEq)]
+pub struct Apath(Arc<str>);
 
 impl Apath {
     /// True if this string is a well-formed apath.
@@ -58,15 +61,30 @@ impl Apath {
         true
     }
 
+    /// Return a key that sorts after every apath preceding the descendants of this
+    /// directory, and before all the descendants.
+    ///
+    /// The key is not itself a valid apath, and is only useful for comparison and seeking.
+    /// For the root directory, which is ordered before all its descendants, this is just
+    /// the root.
+    pub(crate) fn descendants_start(&self) -> Apath {
+        if &*self.0 == "/" {
+            self.clone()
+        } else {
+            Apath(format!("{}/", self.0).into())
+        }
+    }
+
     /// True if self is a parent directory of, or equal to, `a`.
     pub fn is_prefix_of(&self, a: &Apath) -> bool {
-        let len = self.0.len();
-        match len.cmp(&a.0.len()) {
+        let (prefix, a): (&str, &str) = (&self.0, &a.0);
+        let len = prefix.len();
+        match len.cmp(&a.len()) {
             Ordering::Greater => false,
-            Ordering::Equal => self.0 == a.0,
+            Ordering::Equal => prefix == a,
             Ordering::Less => {
-                a.0.starts_with(&self.0)
-                    && (self.0.ends_with('/') || a.0.chars().nth(self.0.len()) == Some('/'))
+                a.starts_with(prefix)
+                    && (prefix.ends_with('/') || a.chars().nth(prefix.len()) == Some('/'))
             }
         }
     }
@@ -79,7 +97,7 @@ impl FromStr for Apath {
         if !Apath::is_valid(s) {
             Err(ApathParseError {})
         } else {
-            Ok(Apath(s.to_owned()))
+            Ok(Apath(s.into()))
         }
     }
 }
@@ -95,7 +113,7 @@ impl fmt::Display for ApathParseError {
 
 impl From<Apath> for String {
     fn from(a: Apath) -> String {
-        a.0
+        a.0.to_string()
     }
 }
 
@@ -108,14 +126,14 @@ impl<'a> From<&'a Apath> for &'a str {
 impl<'a> From<&'a str> for Apath {
     fn from(s: &'a str) -> Apath {
         assert!(Apath::is_valid(s), "invalid apath: {:?}", s);
-        Apath(s.to_string())
+        Apath(s.into())
     }
 }
 
 impl From<String> for Apath {
     fn from(s: String) -> Apath {
         assert!(Apath::is_valid(&s), "invalid apath: {:?}", s);
-        Apath(s)
+        Apath(s.into())
     }
 }
 
@@ -128,13 +146,13 @@ impl Display for Apath {
 /// Compare for equality an Apath to a str.
 impl PartialEq<str> for Apath {
     fn eq(&self, other: &str) -> bool {
-        self.0 == *other
+        *self.0 == *other
     }
 }
 
 impl PartialEq<&str> for Apath {
     fn eq(&self, other: &&str) -> bool {
-        self.0 == **other
+        *self.0 == **other
     }
 }
 
@@ -159,7 +177,34 @@ impl AsRef<str> for Apath {
 
 impl AsRef<Path> for Apath {
     fn as_ref(&self) -> &Path {
-        self.0.as_ref()
+        Path::new(&*self.0)
+    }
+}
+
+impl Serialize for Apath {
+    fn serialize<S: Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        serializer.serialize_str(&self.0)
+    }
+}
+
+impl<'de> Deserialize<'de> for Apath {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> Result<Apath, D::Error> {
+        deserializer.deserialize_str(ApathVisitor)
+    }
+}
+
+/// Deserializes an apath with one allocation, from either a borrowed or owned string.
+struct ApathVisitor;
+
+impl<'de> Visitor<'de> for ApathVisitor {
+    type Value = Apath;
+
+    fn expecting(&self, f: &mut Formatter) -> fmt::Result {
+        f.write_str("an apath string")
+    }
+
+    fn visit_str<E: de::Error>(self, s: &str) -> Result<Apath, E> {
+        Ok(Apath(s.into()))
     }
 }
 
@@ -268,3 +313,23 @@ impl DebugCheckOrder {
 
     pub fn check(&mut self, _apath: &Apath) {}
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn clones_share_storage() {
+        let a = Apath::from("/a/b");
+        let b = a.clone();
+        assert!(Arc::ptr_eq(&a.0, &b.0));
+    }
+
+    #[test]
+    fn serde_round_trip() {
+        let a = Apath::from("/a/\"quoted\"");
+        let json = serde_json::to_string(&a).unwrap();
+        assert_eq!(json, r#""/a/\"quoted\"""#);
+        assert_eq!(serde_json::from_str::<Apath>(&json).unwrap(), a);
+    }
+}
@@ -13,30 +13,43 @@
 
 //! Archives holding backup material.
 
-use std::collections::{HashMap, HashSet};
+use std::collections::HashSet;
 use std::io::ErrorKind;
 use std::path::Path;
 use std::sync::Mutex;
-use std::time::Instant;
+use std::time::{Instant, SystemTime};
 
 use itertools::Itertools;
 use rayon::prelude::*;
 use serde::{Deserialize, Serialize};
+use thousands::Separable;
 
-use crate::blockhash::BlockHash;
+use crate::blockhash::{BlockHash, HashAlgorithm};
 use crate::errors::Error;
 use crate::jsonio::{read_json, write_json};
 use crate::kind::Kind;
 use crate::misc::remove_item;
+use crate::referenced::ReferencedBlocks;
 use crate::stats::ValidateStats;
 use crate::stitch::IterStitchedIndexHunks;
 use crate::transport::local::LocalTransport;
 use crate::transport::{DirEntry, Transport};
+use crate::validate::{BlockLenSorter, SortedBlockLens};
+use crate::verified::{self, Reverify, Verified, VerifiedBlocks, VERIFIED_FILENAME};
 use crate::*;
 
 const HEADER_FILENAME: &str = "CONSERVE";
 static BLOCK_DIR: &str = "d";
 
+/// Archive version for archives using features that older versions can't read, such
+/// as a BLAKE3 block hash, zstd-compressed blocks, or pack files.
+///
+/// Older versions only open archives whose version is exactly `ARCHIVE_VERSION`.
+pub const NEW_FEATURES_ARCHIVE_VERSION: &str = "0.6.15";
+
+/// Measure and delete unreferenced blocks in batches of this many.
+const DELETE_BATCH_BLOCKS: usize = 1_000;
+
 /// An archive holding backup material.
 #[derive(Clone, Debug)]
 pub struct Archive {
@@ -49,6 +62,16 @@ pub struct Archive {
 #[derive(Debug, Serialize, Deserialize)]
 struct ArchiveHeader {
     conserve_archive_version: String,
+    /// Hash of block content; absent in archives using BLAKE2b.
+    #[serde(default, skip_serializing_if = "HashAlgorithm::is_default")]
+    block_hash: HashAlgorithm,
+}
+
+/// Settings for a new archive, which are recorded in its header.
+#[derive(Debug, Clone, Default)]
+pub struct ArchiveOptions {
+    /// Hash used to name and check data blocks.
+    pub block_hash: HashAlgorithm,
 }
 
 #[derive(Default, Debug)]
@@ -65,6 +88,15 @@ impl Archive {
 
     /// Make a new archive in a new directory accessed by a Transport.
     pub fn create(transport: Box<dyn Transport>) -> Result<Archive> {
+        Archive::create_with_options(transport, &ArchiveOptions::default())
+    }
+
+    /// Make a new archive with the given settings, in a new directory accessed by a
+    /// Transport.
+    pub fn create_with_options(
+        transport: Box<dyn Transport>,
+        options: &ArchiveOptions,
+    ) -> Result<Archive> {
         transport
             .create_dir("")
             .map_err(|source| Error::CreateArchiveDirectory { source })?;
@@ -72,12 +104,19 @@ impl Archive {
         if !names.files.is_empty() || !names.dirs.is_empty() {
             return Err(Error::NewArchiveDirectoryNotEmpty);
         }
-        let block_dir = BlockDir::create(transport.sub_transport(BLOCK_DIR))?;
+        let mut block_dir = BlockDir::create(transport.sub_transport(BLOCK_DIR))?;
+        block_dir.set_hash_algorithm(options.block_hash);
+        let conserve_archive_version = if options.block_hash.is_default() {
+            ARCHIVE_VERSION
+        } else {
+            NEW_FEATURES_ARCHIVE_VERSION
+        };
         write_json(
             &transport,
             HEADER_FILENAME,
             &ArchiveHeader {
-                conserve_archive_version: String::from(ARCHIVE_VERSION),
+                conserve_archive_version: String::from(conserve_archive_version),
+                block_hash: options.block_hash,
             },
         )?;
         Ok(Archive {
@@ -102,18 +141,35 @@ impl Archive {
                 Error::IOError { source } => Error::ReadArchiveHeader { source },
                 other => other,
             })?;
-        if header.conserve_archive_version != ARCHIVE_VERSION {
+        if header.conserve_archive_version != ARCHIVE_VERSION
+            && header.conserve_archive_version != NEW_FEATURES_ARCHIVE_VERSION
+        {
             return Err(Error::UnsupportedArchiveVersion {
                 version: header.conserve_archive_version,
             });
         }
-        let block_dir = BlockDir::open(transport.sub_transport(BLOCK_DIR));
+        let mut block_dir = BlockDir::open(transport.sub_transport(BLOCK_DIR));
+        block_dir.set_hash_algorithm(header.block_hash);
         Ok(Archive {
             block_dir,
             transport,
         })
     }
 
+    /// Record in the header that this archive has blocks older versions can't read, such
+    /// as zstd-compressed or packed blocks.
+    ///
+    /// Any later band can refer to those blocks, so older versions must not read any
+    /// band of the archive, not only the band that wrote them.
+    pub(crate) fn require_new_features(&self) -> Result<()> {
+        let mut header: ArchiveHeader = read_json(&self.transport, HEADER_FILENAME)?;
+        if header.conserve_archive_version != NEW_FEATURES_ARCHIVE_VERSION {
+            header.conserve_archive_version = NEW_FEATURES_ARCHIVE_VERSION.to_owned();
+            write_json(&self.transport, HEADER_FILENAME, &header)?;
+        }
+        Ok(())
+    }
+
     pub fn block_dir(&self) -> &BlockDir {
         &self.block_dir
     }
@@ -219,7 +275,7 @@ impl Archive {
 
     /// Returns an iterator of blocks that are present and referenced by no index.
     pub fn unreferenced_blocks(&self) -> Result<impl Iterator<Item = BlockHash>> {
-        let referenced = self.referenced_blocks(&self.list_band_ids()?)?;
+        let referenced = ReferencedBlocks::collect(self, &self.list_band_ids()?)?;
         Ok(self
             .block_dir()
             .block_names()?
@@ -230,13 +286,21 @@ impl Archive {
     ///
     /// If `delete_band_ids` is empty, this deletes no bands, but will delete any garbage
     /// blocks referenced by no existing bands.
+    ///
+    /// Unreferenced blocks are found, measured, and deleted in batches while the block
+    /// directory is being listed, rather than collecting the whole list first.
+    /// Packs holding unreferenced blocks are then rewritten without them.
     pub fn delete_bands(
         &self,
         delete_band_ids: &[BandId],
         options: &DeleteOptions,
     ) -> Result<DeleteStats> {
+        trace_span!("delete_bands");
         let mut stats = DeleteStats::default();
         let start = Instant::now();
+        // A pack without an index that was modified after this may still be being
+        // written by a concurrent backup.
+        let gc_start = SystemTime::now();
 
         let delete_guard = if options.break_lock {
             gc_lock::GarbageCollectionLock::break_lock(self)?
@@ -248,29 +312,7 @@ impl Archive {
         let mut keep_band_ids = self.list_band_ids()?;
         keep_band_ids.retain(|b| !delete_band_ids.contains(b));
 
-        let referenced = self.referenced_blocks(&keep_band_ids)?;
-        let unref = self
-            .block_dir()
-            .block_names()?
-            .filter(|bh| !referenced.contains(bh))
-            .collect_vec();
-        let unref_count = unref.len();
-        stats.unreferenced_block_count = unref_count;
-
-        let mut pb = ProgressBar::new();
-        pb.set_phase("Measure unreferenced blocks".to_owned());
-        pb.set_total_work(unref.len());
-        let pb_mutex = Mutex::new(pb);
-        let total_bytes = unref
-            .par_iter()
-            .inspect(|_| pb_mutex.lock().unwrap().increment_work_done(1))
-            .map(|block_id| {
-                let size = block_dir.compressed_size(&block_id).unwrap_or_default();
-                pb_mutex.lock().unwrap().increment_bytes_done(size);
-                size
-            })
-            .sum();
-        stats.unreferenced_block_bytes = total_bytes;
+        let referenced = ReferencedBlocks::collect(self, &keep_band_ids)?;
 
         if !options.dry_run {
             delete_guard.check()?;
@@ -283,25 +325,56 @@ impl Archive {
                 stats.deleted_band_count += 1;
                 pb.increment_work_done(1);
             }
+        }
 
-            let mut pb = ProgressBar::new();
-            pb.set_phase("Deleting unreferenced blocks");
-            pb.set_total_work(unref_count);
-            let progress_bar_mutex = Mutex::new(pb);
-            let error_count = unref
-                .par_iter()
-                .inspect(|_| progress_bar_mutex.lock().unwrap().increment_work_done(1))
-                .filter(|block_hash| block_dir.delete_block(&block_hash).is_err())
-                .count();
-            stats.deletion_errors += error_count;
-            stats.deleted_block_count += unref_count - error_count;
+        let mut pb = ProgressBar::new();
+        pb.set_phase(if options.dry_run {
+            "Measure unreferenced blocks"
+        } else {
+            "Deleting unreferenced blocks"
+        });
+        let unref_chunks = block_dir
+            .loose_block_names()?
+            .filter(|bh| !referenced.contains(bh))
+            .chunks(DELETE_BATCH_BLOCKS);
+        for chunk in &unref_chunks {
+            let unref = chunk.collect_vec();
+            let bytes: u64 = block_dir
+                .compressed_sizes(&unref)
+                .into_iter()
+                .map(|size| size.unwrap_or_default())
+                .sum();
+            stats.unreferenced_block_count += unref.len();
+            stats.unreferenced_block_bytes += bytes;
+            if !options.dry_run {
+                // Another backup may have started since the last batch, and could be
+                // about to reference some of these blocks.
+                delete_guard.check()?;
+                let error_count = block_dir
+                    .delete_blocks(&unref)
+                    .iter()
+                    .filter(|result| result.is_err())
+                    .count();
+                stats.deletion_errors += error_count;
+                stats.deleted_block_count += unref.len() - error_count;
+            }
+            pb.increment_work_done(unref.len());
+            pb.increment_bytes_done(bytes);
         }
+        block_dir.compact_packs(
+            &referenced,
+            &delete_guard,
+            gc_start,
+            options.dry_run,
+            &mut stats,
+        )?;
 
         stats.elapsed = start.elapsed();
         Ok(stats)
     }
 
     pub fn validate(&self, options: &ValidateOptions) -> Result<ValidateStats> {
+        trace_span!("validate");
         let start = Instant::now();
         let mut stats = self.validate_archive_dir()?;
 
@@ -309,48 +382,99 @@ impl Archive {
         let band_ids = self.list_band_ids()?;
 
         // 1. Walk all indexes, collecting a list of (block_hash6, min_length)
-        //    values referenced by all the indexes.
-        let (referenced_lens, ref_stats) = validate::validate_bands(self, &band_ids);
+        //    values referenced by all the indexes, sorted by hash.
+        let (mut referenced_lens, ref_stats) = validate::validate_bands(self, &band_ids)?;
         stats += ref_stats;
 
-        if options.skip_block_hashes {
-            // 3a. Check that all referenced blocks are present, without spending time reading their
-            // content.
+        let mut present_lens = if options.skip_block_hashes {
+            // 2a. List the present blocks, without spending time reading their content.
             ui::println("List present blocks...");
             // TODO: Just validate blockdir structure.
-            let present_blocks: HashSet<BlockHash> = self.block_dir.block_names_set()?;
-            for block_hash in referenced_lens
-                .0
-                .keys()
-                .filter(|&bh| !present_blocks.contains(bh))
-            {
-                ui::problem(&format!("Block {:?} is missing", block_hash));
-                stats.block_missing_count += 1;
+            let mut present = BlockLenSorter::new();
+            for block_hash in self.block_dir.block_names()? {
+                // Lengths are unknown, so only presence is checked.
+                present.push(block_hash, u64::MAX)?;
             }
+            present.finish()?
         } else {
-            // 2. Check the hash of all blocks are correct, and remember how long
+            // 2b. Check the hash of all blocks are correct, and remember how long
             //    the uncompressed data is.
             ui::println("Check blockdir...");
-            let block_lengths: HashMap<BlockHash, usize> = self.block_dir.validate(&mut stats)?;
-            // 3b. Check that all referenced ranges are inside the present data.
-            for (block_hash, referenced_len) in referenced_lens.0 {
-                if let Some(actual_len) = block_lengths.get(&block_hash) {
-                    if referenced_len > (*actual_len as u64) {
-                        ui::problem(&format!("Block {:?} is too short", block_hash,));
-                        // TODO: A separate counter; this is worse than just being missing
-                        stats.block_missing_count += 1;
-                    }
-                } else {
-                    ui::problem(&format!("Block {:?} is missing", block_hash));
-                    stats.block_missing_count += 1;
-                }
+            if options.incremental {
+                self.validate_blocks_incremental(options, &mut stats)?
+            } else {
+                self.block_dir.validate(&mut stats)?
             }
-        }
+        };
+        // 3. Check that all referenced blocks are present, and that referenced ranges
+        //    are inside the present data.
+        validate::check_block_lengths(&mut referenced_lens, &mut present_lens, &mut stats)?;
 
         stats.elapsed = start.elapsed();
         Ok(stats)
     }
 
+    /// Check the content of blocks not already checked by an earlier incremental
+    /// validation, then record all the blocks now known to be correct.
+    ///
+    /// Return the uncompressed length of every present, correct block.
+    fn validate_blocks_incremental(
+        &self,
+        options: &ValidateOptions,
+        stats: &mut ValidateStats,
+    ) -> Result<SortedBlockLens> {
+        let previous = VerifiedBlocks::read(self.transport.as_ref())?;
+        let reverify = Reverify::new(options.reverify_fraction, options.reverify_older_than);
+        ui::println("Count blocks...");
+        let (trusted, mut to_check): (Vec<BlockHash>, Vec<BlockHash>) = self
+            .block_dir
+            .block_names()?
+            .partition(|hash| match previous.blocks.get(hash) {
+                Some(verified) => !reverify.should_reverify(hash, verified),
+                None => false,
+            });
+        // A block whose file has changed size since it was checked must be checked again.
+        let (trusted, changed): (Vec<BlockHash>, Vec<BlockHash>) =
+            trusted.into_par_iter().partition(|hash| {
+                self.block_dir.compressed_size(hash).ok()
+                    == Some(previous.blocks[hash].compressed_len)
+            });
+        to_check.extend(changed);
+        stats.block_previously_verified_count += trusted.len() as u64;
+
+        let now = verified::unix_now();
+        let mut ledger = VerifiedBlocks::default();
+        ledger.blocks.extend(
+            trusted
+                .into_iter()
+                .map(|hash| (hash.clone(), previous.blocks[&hash])),
+        );
+        ui::println(&format!(
+            "Check {} blocks...",
+            to_check.len().separate_with_commas()
+        ));
+        let mut progress_bar = ProgressBar::new();
+        progress_bar.set_phase("Check block hashes");
+        progress_bar.set_total_work(to_check.len());
+        let pb_mutex = Mutex::new(progress_bar);
+        for (hash, sizes) in self.block_dir.check_blocks(to_check, stats, &pb_mutex) {
+            ledger.blocks.insert(
+                hash,
+                Verified {
+                    time: now,
+                    compressed_len: sizes.compressed,
+                    uncompressed_len: sizes.uncompressed,
+                },
+            );
+        }
+        ledger.write(self.transport.as_ref())?;
+        let mut lens = BlockLenSorter::new();
+        for (hash, verified) in ledger.blocks {
+            lens.push(hash, verified.uncompressed_len)?;
+        }
+        lens.finish()
+    }
+
     fn validate_archive_dir(&self) -> Result<ValidateStats> {
         // TODO: Tests for the problems detected here.
         let mut stats = ValidateStats::default();
@@ -382,6 +506,7 @@ impl Archive {
             }
         }
         remove_item(&mut files, &HEADER_FILENAME);
+        remove_item(&mut files, &VERIFIED_FILENAME);
         if !files.is_empty() {
             stats.unexpected_files += 1;
             ui::problem(&format!(
@@ -501,6 +626,24 @@ mod tests {
         assert_eq!(af.block_dir.block_names().unwrap().count(), 0);
     }
 
+    #[test]
+    fn blake3_archive_header() {
+        let testdir = TempDir::new().unwrap();
+        let arch_path = testdir.path().join("arch");
+        let options = ArchiveOptions {
+            block_hash: HashAlgorithm::Blake3,
+        };
+        Archive::create_with_options(Box::new(LocalTransport::new(&arch_path)), &options).unwrap();
+        let contents = fs::read_to_string(arch_path.join("CONSERVE")).unwrap();
+        assert_eq!(
+            contents,
+            "{\"conserve_archive_version\":\"0.6.15\",\"block_hash\":\"blake3\"}\n"
+        );
+
+        let archive = Archive::open_path(&arch_path).unwrap();
+        assert_eq!(archive.block_dir().hash_algorithm(), HashAlgorithm::Blake3);
+    }
+
     #[test]
     fn create_bands() {
         let af = ScratchArchive::new();
@@ -14,14 +14,21 @@
 //! Make a backup by walking a source directory and copying the contents
 //! into an archive.
 
+use std::collections::{HashMap, HashSet};
 use std::io::prelude::*;
+use std::path::PathBuf;
 use std::{convert::TryInto, time::Instant};
 
 use globset::GlobSet;
 use itertools::Itertools;
+use rayon::prelude::*;
+use rayon::ThreadPool;
 
 use crate::blockdir::Address;
-use crate::io::read_with_retries;
+use crate::chunker::Chunker;
+use crate::io::SourceFile;
+use crate::metrics::{Phase, Timer};
+use crate::stat_cache::{StatCache, StatCacheWriter};
 use crate::stats::BackupStats;
 use crate::tree::ReadTree;
 use crate::*;
@@ -36,6 +43,66 @@ pub struct BackupOptions {
     pub excludes: GlobSet,
 
     pub max_entries_per_hunk: usize,
+
+    /// Number of threads used to hash, compress and write the blocks of large files.
+    ///
+    /// 0 means one per CPU.
+    pub jobs: usize,
+
+    /// Cut large files at content-defined boundaries with these sizes, rather than at fixed
+    /// multiples of the maximum block size.
+    pub content_chunking: Option<ContentChunking>,
+
+    /// List all the blocks in the archive before starting, so that new blocks can be written
+    /// without first checking whether each one already exists.
+    ///
+    /// This is a win on archives where each `exists` check is slow, unless the archive
+    /// has many more blocks than the backup will write.
+    pub preload_block_names: bool,
+
+    /// Encoding for the new band's index hunks.
+    pub index_format: IndexFormat,
+
+    /// Compression for new data blocks.
+    pub compression: Compression,
+
+    /// Write new data blocks into large pack files, rather than one file per block.
+    ///
+    /// This makes far fewer files, which helps on filesystems and object stores with
+    /// a high per-file cost.
+    pub pack_blocks: bool,
+
+    /// When a small file's mtime changed but its size didn't, read back its content from
+    /// the basis band, and if it's the same, refer to the existing copy rather than
+    /// storing it again.
+    ///
+    /// This saves rewriting combined blocks when files are touched or reinstalled, at the
+    /// cost of reading some blocks from the archive.
+    pub dedup_small_files_from_basis: bool,
+
+    /// Keep the device, inode and ctime of each file in this local file, outside the
+    /// source tree, and read files again if they don't match even though their mtime and
+    /// size are unchanged.
+    ///
+    /// This catches files rewritten with their mtime preserved. The cache is replaced
+    /// at the end of each backup; if it doesn't exist yet, only mtime and size are
+    /// compared. It's ignored on platforms without inode numbers.
+    pub stat_cache: Option<PathBuf>,
+
+    /// If the last band is incomplete, continue writing it rather than starting a new
+    /// band, skipping the source tree up to the last entry already in its index.
+    ///
+    /// The band keeps the chunking, index format, compression and packing it was started
+    /// with, regardless of these options.
+    pub resume: bool,
+
+    /// Advise the OS that source files are read once, sequentially, and drop their pages
+    /// from the cache after they're read.
+    ///
+    /// This keeps a large backup from pushing other programs' data out of the cache, but
+    /// makes reading the same files again soon afterwards slower. It has no effect on
+    /// platforms without `posix_fadvise`.
+    pub drop_source_cache: bool,
 }
 
 impl Default for BackupOptions {
@@ -44,6 +111,16 @@ impl Default for BackupOptions {
             print_filenames: false,
             excludes: GlobSet::empty(),
             max_entries_per_hunk: crate::index::MAX_ENTRIES_PER_HUNK,
+            jobs: 1,
+            content_chunking: None,
+            preload_block_names: false,
+            index_format: IndexFormat::Json,
+            compression: Compression::Snappy,
+            pack_blocks: false,
+            dedup_small_files_from_basis: false,
+            stat_cache: None,
+            resume: false,
+            drop_source_cache: false,
         }
     }
 }
@@ -68,13 +145,17 @@ pub fn backup(
     source: &LiveTree,
     options: &BackupOptions,
 ) -> Result<BackupStats> {
+    trace_span!("backup");
     let start = Instant::now();
     let mut writer = BackupWriter::begin(archive, options.clone())?;
     let mut stats = BackupStats::default();
     let mut progress_bar = ProgressBar::new();
 
     progress_bar.set_phase("Copying");
-    let entry_iter = source.iter_entries(None, options.excludes.clone())?;
+    let mut entry_iter = source.iter_entries(None, options.excludes.clone())?;
+    if let Some(last_apath) = writer.index_builder.last_apath() {
+        entry_iter = entry_iter.advance_to_after(last_apath);
+    }
     for entry_group in entry_iter.chunks(options.max_entries_per_hunk).into_iter() {
         for entry in entry_group {
             progress_bar.set_filename(entry.apath().to_string());
@@ -106,49 +187,136 @@ struct BackupWriter {
 
     file_combiner: FileCombiner,
 
+    /// Threads used to store the blocks of large files.
+    pool: ThreadPool,
+
+    /// The number of hunks already in the band, if it was resumed.
+    resumed_hunks: u32,
+
+    /// The stat cache from the last backup, if any.
+    stat_cache: Option<StatCache>,
+
+    /// A new stat cache, recording files as they're backed up.
+    new_stat_cache: Option<StatCacheWriter>,
+
     options: BackupOptions,
 }
 
 impl BackupWriter {
     /// Create a new BackupWriter.
     ///
-    /// This currently makes a new top-level band.
-    pub fn begin(archive: &Archive, options: BackupOptions) -> Result<BackupWriter> {
+    /// This makes a new top-level band, or with `options.resume`, reopens the last band
+    /// if it's incomplete.
+    pub fn begin(archive: &Archive, mut options: BackupOptions) -> Result<BackupWriter> {
         if gc_lock::GarbageCollectionLock::is_locked(archive)? {
             return Err(Error::GarbageCollectionLockHeld);
         }
-        let basis_index = archive.last_band_id()?.map(|band_id| {
+        let last_band_id = archive.last_band_id()?;
+        // If the band is resumed, its own entries come first in the stitched index,
+        // followed by the previous band's entries after the point it reached.
+        let basis_index = last_band_id.as_ref().map(|band_id| {
             archive
-                .iter_stitched_index_hunks(&band_id)
+                .iter_stitched_index_hunks(band_id)
                 .iter_entries(None, excludes_nothing())
         });
-        // Create the new band only after finding the basis band!
-        let band = Band::create(archive)?;
-        let index_builder = band.index_builder();
+        let resume_band = match &last_band_id {
+            Some(band_id) if options.resume => {
+                let band = Band::open(archive, band_id)?;
+                if band.is_closed()? {
+                    None
+                } else {
+                    Some(band)
+                }
+            }
+            _ => None,
+        };
+        let (band, index_builder) = if let Some(band) = resume_band {
+            let band_options = band.options()?;
+            options.content_chunking = band_options.content_chunking;
+            options.index_format = band_options.index_format;
+            options.compression = band_options.compression;
+            options.pack_blocks = band_options.packed_blocks;
+            let index_builder = band.resume_index_builder()?;
+            (band, index_builder)
+        } else {
+            // Create the new band only after finding the basis band!
+            let band = Band::create_with_options(
+                archive,
+                &BandOptions {
+                    content_chunking: options.content_chunking,
+                    index_format: options.index_format,
+                    compression: options.compression,
+                    packed_blocks: options.pack_blocks,
+                },
+            )?;
+            let index_builder = band.index_builder();
+            (band, index_builder)
+        };
+        let resumed_hunks = index_builder.hunk_count();
+        let mut block_dir = archive.block_dir().clone();
+        block_dir.set_compression(options.compression);
+        block_dir.set_packing(options.pack_blocks);
+        if options.preload_block_names {
+            block_dir.preload_block_names()?;
+        }
+        let (stat_cache, new_stat_cache) = match &options.stat_cache {
+            Some(path) if cfg!(unix) => {
+                (StatCache::open(path)?, Some(StatCacheWriter::create(path)?))
+            }
+            Some(_) => {
+                ui::problem("The stat cache isn't supported on this platform");
+                (None, None)
+            }
+            None => (None, None),
+        };
+        let pool = rayon::ThreadPoolBuilder::new()
+            .num_threads(options.jobs)
+            .thread_name(|i| format!("conserve-backup-{}", i))
+            .build()
+            .expect("Failed to start backup threads");
         Ok(BackupWriter {
             band,
             index_builder,
-            block_dir: archive.block_dir().clone(),
+            file_combiner: FileCombiner::new(block_dir.clone()),
+            block_dir,
             stats: BackupStats::default(),
             basis_index,
-            file_combiner: FileCombiner::new(archive.block_dir().clone()),
+            pool,
+            resumed_hunks,
+            stat_cache,
+            new_stat_cache,
             options,
         })
     }
 
     fn finish(self) -> Result<BackupStats> {
+        self.block_dir.flush_pack()?;
         let index_builder_stats = self.index_builder.finish()?;
-        self.band.close(index_builder_stats.index_hunks as u64)?;
+        self.band.close_with_tree_stats(
+            u64::from(self.resumed_hunks) + index_builder_stats.index_hunks as u64,
+            index_builder_stats.tree.clone(),
+        )?;
+        if let Some(new_stat_cache) = self.new_stat_cache {
+            // The backup is complete even if the cache can't be saved; the old one, if
+            // any, is still safe to use.
+            if let Err(err) = new_stat_cache.finish() {
+                ui::show_error(&err);
+            }
+        }
         Ok(BackupStats {
             index_builder_stats,
+            resumed_index_hunks: self.resumed_hunks as usize,
             ..self.stats
         })
     }
 
     /// Write out any pending data blocks, and then the pending index entries.
     fn flush_group(&mut self) -> Result<()> {
+        trace_span!("flush_group");
         let (stats, mut entries) = self.file_combiner.drain()?;
         self.stats += stats;
+        // Index hunks must only be written after the packs holding their blocks.
+        self.block_dir.flush_pack()?;
         self.index_builder.append_entries(&mut entries);
         self.index_builder.finish_hunk()
     }
@@ -156,7 +324,13 @@ impl BackupWriter {
     fn copy_entry(&mut self, entry: &LiveEntry, source: &LiveTree) -> Result<()> {
         match entry.kind() {
             Kind::Dir => self.copy_dir(entry),
-            Kind::File => self.copy_file(entry, source),
+            Kind::File => {
+                self.copy_file(entry, source)?;
+                match &mut self.new_stat_cache {
+                    Some(new_stat_cache) => new_stat_cache.record(entry),
+                    None => Ok(()),
+                }
+            }
             Kind::Symlink => self.copy_symlink(entry),
             Kind::Unknown => {
                 self.stats.unknown_kind += 1;
@@ -183,13 +357,16 @@ impl BackupWriter {
     fn copy_file(&mut self, source_entry: &LiveEntry, from_tree: &LiveTree) -> Result<()> {
         self.stats.files += 1;
         let apath = source_entry.apath();
+        trace_span!("backup_file", apath = %apath);
+        let mut basis_address = None;
         if let Some(basis_entry) = self
             .basis_index
             .as_mut()
             .map(|bi| bi.advance_to(&apath))
             .flatten()
         {
-            if source_entry.is_unchanged_from(&basis_entry) {
+            if source_entry.is_unchanged_from(&basis_entry) && self.stat_cache_agrees(source_entry)
+            {
                 if self.options.print_filenames {
                     crate::ui::println(&format!("{} (unchanged)", apath));
                 }
@@ -201,6 +378,9 @@ impl BackupWriter {
                     crate::ui::println(&format!("{} (modified)", apath));
                 }
                 self.stats.modified_files += 1;
+                if self.options.dedup_small_files_from_basis {
+                    basis_address = single_address(basis_entry, source_entry.size());
+                }
             }
         } else {
             if self.options.print_filenames {
@@ -208,7 +388,10 @@ impl BackupWriter {
             }
             self.stats.new_files += 1;
         }
-        let mut read_source = from_tree.file_contents(&source_entry)?;
+        let mut read_source = SourceFile::new(
+            from_tree.file_contents(&source_entry)?,
+            self.options.drop_source_cache,
+        );
         let size = source_entry.size().expect("LiveEntry has a size");
         if size == 0 {
             self.index_builder
@@ -217,13 +400,19 @@ impl BackupWriter {
             return Ok(());
         }
         if size <= SMALL_FILE_CAP {
-            return self.file_combiner.push_file(source_entry, &mut read_source);
+            return self.file_combiner.push_file(
+                source_entry,
+                &mut read_source,
+                basis_address.as_ref(),
+            );
         }
         let addrs = store_file_content(
             &apath,
             &mut read_source,
-            &mut self.block_dir,
+            &mut Chunker::new(self.options.content_chunking),
+            &self.block_dir,
             &mut self.stats,
+            &self.pool,
         )?;
         self.index_builder.push_entry(IndexEntry {
             addrs,
@@ -232,6 +421,21 @@ impl BackupWriter {
         Ok(())
     }
 
+    /// True unless the stat cache shows that a file was changed, although its mtime and
+    /// size are the same as in the basis.
+    fn stat_cache_agrees(&mut self, source_entry: &LiveEntry) -> bool {
+        match &mut self.stat_cache {
+            None => true,
+            Some(stat_cache) => {
+                let unchanged = stat_cache.is_unchanged(source_entry);
+                if !unchanged {
+                    self.stats.stat_cache_changed_files += 1;
+                }
+                unchanged
+            }
+        }
+    }
+
     fn copy_symlink<E: Entry>(&mut self, source_entry: &E) -> Result<()> {
         let target = source_entry.symlink_target().clone();
         self.stats.symlinks += 1;
@@ -245,30 +449,51 @@ impl BackupWriter {
     }
 }
 
+/// The address of a basis entry's content, if it's held in one address of the given size.
+fn single_address(mut basis_entry: IndexEntry, size: Option<u64>) -> Option<Address> {
+    if basis_entry.addrs.len() == 1 && Some(basis_entry.addrs[0].len) == size {
+        basis_entry.addrs.pop()
+    } else {
+        None
+    }
+}
+
+/// Store the contents of a large file in blocks, and return their addresses in order.
+///
+/// Blocks are read in batches of one per pool thread. Each batch is hashed, compressed and
+/// written in parallel while the next batch is read from the source, so at most two batches
+/// are in memory at any time.
 fn store_file_content(
     apath: &Apath,
-    from_file: &mut dyn Read,
-    block_dir: &mut BlockDir,
+    from_file: &mut (dyn Read + Send),
+    chunker: &mut Chunker,
+    block_dir: &BlockDir,
     stats: &mut BackupStats,
+    pool: &ThreadPool,
 ) -> Result<Vec<Address>> {
-    let mut buffer = Vec::new();
+    let batch_size = pool.current_num_threads();
     let mut addresses = Vec::<Address>::with_capacity(1);
-    loop {
-        read_with_retries(&mut buffer, MAX_BLOCK_SIZE, from_file).map_err(|source| {
-            Error::StoreFile {
-                apath: apath.to_owned(),
-                source,
-            }
-        })?;
-        if buffer.is_empty() {
-            break;
-        }
-        let hash = block_dir.store_or_deduplicate(buffer.as_slice(), stats)?;
-        addresses.push(Address {
-            hash,
-            start: 0,
-            len: buffer.len() as u64,
+    let mut batch = read_block_batch(apath, from_file, chunker, batch_size)?;
+    while !batch.is_empty() {
+        let (next_batch, stored) = pool.install(|| {
+            rayon::join(
+                || read_block_batch(apath, from_file, chunker, batch_size),
+                || store_block_batch(&batch, block_dir),
+            )
         });
+        let (hashes, batch_stats) = stored?;
+        *stats += batch_stats;
+        addresses.extend(
+            hashes
+                .into_iter()
+                .zip(batch.iter())
+                .map(|(hash, block)| Address {
+                    hash,
+                    start: 0,
+                    len: block.len() as u64,
+                }),
+        );
+        batch = next_batch?;
     }
     match addresses.len() {
         0 => stats.empty_files += 1,
@@ -278,6 +503,63 @@ fn store_file_content(
     Ok(addresses)
 }
 
+/// Read up to `max_blocks` blocks from a file.
+///
+/// A batch that's empty, or shorter than requested, means the end of the file was reached.
+fn read_block_batch(
+    apath: &Apath,
+    from_file: &mut dyn Read,
+    chunker: &mut Chunker,
+    max_blocks: usize,
+) -> Result<Vec<Vec<u8>>> {
+    let mut timer = Timer::start(Phase::ReadSource);
+    let mut batch = Vec::with_capacity(max_blocks);
+    while batch.len() < max_blocks {
+        let block = chunker
+            .next_chunk(from_file)
+            .map_err(|source| Error::StoreFile {
+                apath: apath.to_owned(),
+                source,
+            })?;
+        if block.is_empty() {
+            break;
+        }
+        timer.add_bytes(block.len() as u64);
+        batch.push(block);
+    }
+    Ok(batch)
+}
+
+/// Hash, compress and store a batch of blocks in parallel.
+///
+/// Returns the hashes of the blocks in the same order as the batch.
+fn store_block_batch(
+    batch: &[Vec<u8>],
+    block_dir: &BlockDir,
+) -> Result<(Vec<BlockHash>, BackupStats)> {
+    let hashes: Vec<BlockHash> = batch
+        .par_iter()
+        .map(|block| block_dir.hash_bytes(block))
+        .collect();
+    // Blocks repeated within one batch are only stored once, so that concurrent
+    // writers don't race to write the same block.
+    let mut stats = BackupStats::default();
+    let mut unique = Vec::with_capacity(batch.len());
+    {
+        let mut seen = HashSet::new();
+        for (block, hash) in batch.iter().zip(hashes.iter()) {
+            if seen.insert(hash) {
+                unique.push((block.as_slice(), hash));
+            } else {
+                stats.deduplicated_blocks += 1;
+                stats.deduplicated_bytes += block.len() as u64;
+            }
+        }
+    }
+    block_dir.store_batch(&unique, &mut stats)?;
+    Ok((hashes, stats))
+}
+
 /// Combines multiple small files into a single block.
 ///
 /// When the block is finished, and only then, this returns the index entries with the addresses
@@ -288,24 +570,54 @@ struct FileCombiner {
     queue: Vec<QueuedFile>,
     /// Entries for files that have been written to the blockdir, and that have complete addresses.
     finished: Vec<IndexEntry>,
+    /// The position in `buf` of the content of each small file queued there, by the hash
+    /// of its content.
+    in_buffer: HashMap<BlockHash, (usize, usize)>,
+    /// Small files already stored during this backup, by the first 64 bits of the hash
+    /// of their content, up to `SMALL_FILE_DEDUP_LIMIT` files.
+    ///
+    /// Since the key isn't the whole hash, a match is only used after comparing the
+    /// stored content.
+    stored: HashMap<u64, StoredSmallFile>,
+    /// Hashes of the blocks holding `stored` files, each kept once.
+    stored_blocks: Vec<BlockHash>,
     stats: BackupStats,
     block_dir: BlockDir,
 }
 
+/// Remember at most this many stored small files for deduplication, to bound memory use
+/// to roughly 40MB.
+const SMALL_FILE_DEDUP_LIMIT: usize = 1 << 20;
+
+/// Where a small file stored during this backup can be found.
+struct StoredSmallFile {
+    /// Index into `FileCombiner::stored_blocks`.
+    block: u32,
+    start: u64,
+    len: u64,
+}
+
 /// A file in the process of being written into a combined block.
 ///
-/// While this exists, the data has been stored into the combine buffer, and we know
-/// the offset and length. But since the combine buffer hasn't been finished and hashed,
-/// we do not yet know a full address.
+/// While this exists, either the data has been stored into the combine buffer, and we
+/// know the offset and length, but since the combine buffer hasn't been finished and
+/// hashed, we do not yet know a full address; or the file is identical to one already
+/// stored.
 struct QueuedFile {
-    /// Offset of the start of the data from this file within `buf`.
-    start: usize,
-    /// Length of data in this file.
-    len: usize,
+    /// Where this file's content is stored.
+    placement: Placement,
     /// IndexEntry without addresses.
     entry: IndexEntry,
 }
 
+enum Placement {
+    /// In the combine buffer, at this offset and length, possibly shared with an earlier
+    /// identical file.
+    InBuffer { start: usize, len: usize },
+    /// Identical to a file already stored at this address.
+    Stored(Address),
+}
+
 impl FileCombiner {
     fn new(block_dir: BlockDir) -> FileCombiner {
         FileCombiner {
@@ -313,6 +625,9 @@ impl FileCombiner {
             buf: Vec::new(),
             queue: Vec::new(),
             finished: Vec::new(),
+            in_buffer: HashMap::new(),
+            stored: HashMap::new(),
+            stored_blocks: Vec::new(),
             stats: BackupStats::default(),
         }
     }
@@ -340,17 +655,32 @@ impl FileCombiner {
             debug_assert!(self.buf.is_empty());
             return Ok(());
         }
-        let hash = self
-            .block_dir
-            .store_or_deduplicate(&self.buf, &mut self.stats)?;
-        self.stats.combined_blocks += 1;
-        self.buf.clear();
+        // The buffer is empty if every queued file was already stored.
+        let hash = if self.buf.is_empty() {
+            None
+        } else {
+            let hash = self
+                .block_dir
+                .store_or_deduplicate(&self.buf, &mut self.stats)?;
+            self.stats.combined_blocks += 1;
+            self.buf.clear();
+            Some(hash)
+        };
+        let mut in_buffer = std::mem::take(&mut self.in_buffer);
+        for (content_hash, (start, len)) in in_buffer.drain() {
+            let hash = hash.as_ref().expect("combined block was stored");
+            self.remember_stored(&content_hash, &combined_address(hash, start, len));
+        }
+        self.in_buffer = in_buffer;
         self.finished
             .extend(self.queue.drain(..).map(|qf| IndexEntry {
-                addrs: vec![Address {
-                    hash: hash.clone(),
-                    start: qf.start.try_into().unwrap(),
-                    len: qf.len.try_into().unwrap(),
+                addrs: vec![match qf.placement {
+                    Placement::InBuffer { start, len } => combined_address(
+                        hash.as_ref().expect("combined block was stored"),
+                        start,
+                        len,
+                    ),
+                    Placement::Stored(address) => address,
                 }],
                 ..qf.entry
             }));
@@ -360,7 +690,16 @@ impl FileCombiner {
     /// Add the contents of a small file into this combiner.
     ///
     /// `entry` should be an IndexEntry that's complete apart from the block addresses.
-    fn push_file(&mut self, live_entry: &LiveEntry, from_file: &mut dyn Read) -> Result<()> {
+    ///
+    /// If the file's content is the same as a file already in this combiner, or already
+    /// stored during this backup, or at `basis_address`, it refers to that copy rather
+    /// than being stored again.
+    fn push_file(
+        &mut self,
+        live_entry: &LiveEntry,
+        from_file: &mut dyn Read,
+        basis_address: Option<&Address>,
+    ) -> Result<()> {
         let start = self.buf.len();
         let expected_len: usize = live_entry
             .size()
@@ -374,6 +713,7 @@ impl FileCombiner {
             return Ok(());
         }
         self.buf.resize(start + expected_len, 0);
+        let mut timer = Timer::start(Phase::ReadSource);
         let len = from_file
             .read(&mut self.buf[start..])
             .map_err(|source| Error::StoreFile {
@@ -381,18 +721,30 @@ impl FileCombiner {
                 source,
             })?;
         self.buf.truncate(start + len);
+        timer.add_bytes(len as u64);
+        drop(timer);
         if len == 0 {
             self.stats.empty_files += 1;
             self.finished.push(index_entry);
             return Ok(());
         }
-        // TODO: Check whether this file is exactly the same as, or a prefix of,
-        // one already stored inside this block. In that case trim the buffer and
-        // use the existing start/len.
         self.stats.small_combined_files += 1;
+        let content_hash = self.block_dir.hash_bytes(&self.buf[start..]);
+        let placement = match self.find_duplicate(&content_hash, start, basis_address) {
+            Some(placement) => {
+                // Drop the duplicate content from the end of the buffer.
+                self.buf.truncate(start);
+                self.stats.deduplicated_small_files += 1;
+                self.stats.deduplicated_bytes += len as u64;
+                placement
+            }
+            None => {
+                self.in_buffer.insert(content_hash, (start, len));
+                Placement::InBuffer { start, len }
+            }
+        };
         self.queue.push(QueuedFile {
-            start,
-            len,
+            placement,
             entry: index_entry,
         });
         if self.buf.len() >= TARGET_COMBINED_BLOCK_SIZE {
@@ -401,4 +753,73 @@ impl FileCombiner {
             Ok(())
         }
     }
+
+    /// Find an existing copy of the small file whose content is in `buf` from `start` to
+    /// the end, and that has the given hash.
+    fn find_duplicate(
+        &mut self,
+        content_hash: &BlockHash,
+        start: usize,
+        basis_address: Option<&Address>,
+    ) -> Option<Placement> {
+        if let Some(&(start, len)) = self.in_buffer.get(content_hash) {
+            return Some(Placement::InBuffer { start, len });
+        }
+        if let Some(stored) = self.stored.get(&content_hash.prefix_u64()) {
+            let address = Address {
+                hash: self.stored_blocks[stored.block as usize].clone(),
+                start: stored.start,
+                len: stored.len,
+            };
+            if self.content_matches(&address, start) {
+                return Some(Placement::Stored(address));
+            }
+        }
+        let address = basis_address?;
+        if self.content_matches(address, start) {
+            self.remember_stored(content_hash, address);
+            Some(Placement::Stored(address.clone()))
+        } else {
+            None
+        }
+    }
+
+    /// True if the content at `address` is the same as `buf` from `start` to the end.
+    ///
+    /// If the content can't be read, it's treated as different, so that this copy is
+    /// just stored.
+    fn content_matches(&self, address: &Address, start: usize) -> bool {
+        matches!(
+            self.block_dir.get_slice(address),
+            Ok((slice, _sizes)) if *slice == self.buf[start..]
+        )
+    }
+
+    /// Remember where a small file with this content hash is stored, unless the limit is
+    /// reached.
+    fn remember_stored(&mut self, content_hash: &BlockHash, address: &Address) {
+        let key = content_hash.prefix_u64();
+        if self.stored.len() >= SMALL_FILE_DEDUP_LIMIT || self.stored.contains_key(&key) {
+            return;
+        }
+        if self.stored_blocks.last() != Some(&address.hash) {
+            self.stored_blocks.push(address.hash.clone());
+        }
+        self.stored.insert(
+            key,
+            StoredSmallFile {
+                block: (self.stored_blocks.len() - 1) as u32,
+                start: address.start,
+                len: address.len,
+            },
+        );
+    }
+}
+
+fn combined_address(hash: &BlockHash, start: usize, len: usize) -> Address {
+    Address {
+        hash: hash.clone(),
+        start: start.try_into().unwrap(),
+        len: len.try_into().unwrap(),
+    }
 }
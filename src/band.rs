@@ -24,6 +24,8 @@
 use chrono::{DateTime, TimeZone, Utc};
 use serde::{Deserialize, Serialize};
 
+use crate::chunker::ContentChunking;
+use crate::index::IndexFormat;
 use crate::jsonio::{read_json, write_json};
 use crate::misc::remove_item;
 use crate::transport::{ListDirNames, Transport};
@@ -35,6 +37,10 @@ static INDEX_DIR: &str = "i";
 /// read correctly by versions equal or later than the stated version.
 pub const BAND_FORMAT_VERSION: &str = "0.6.3";
 
+/// Band format version for bands using features that older versions can't read,
+/// such as binary index hunks or zstd-compressed blocks.
+pub const NEW_FEATURES_BAND_FORMAT_VERSION: &str = "0.6.15";
+
 /// Describes how to select a band from an archive.
 #[derive(Debug, Clone, Eq, PartialEq)]
 pub enum BandSelectionPolicy {
@@ -47,7 +53,7 @@ pub enum BandSelectionPolicy {
 }
 
 fn band_version_requirement() -> semver::VersionReq {
-    semver::VersionReq::parse("<=0.6.3").unwrap()
+    semver::VersionReq::parse("<=0.6.15").unwrap()
 }
 
 fn band_version_supported(version: &str) -> bool {
@@ -63,6 +69,9 @@ pub struct Band {
 
     /// Transport pointing to the archive directory.
     transport: Box<dyn Transport>,
+
+    /// Encoding for index hunks written into this band.
+    index_format: IndexFormat,
 }
 
 #[derive(Debug, Serialize, Deserialize)]
@@ -73,6 +82,38 @@ struct Head {
     /// Semver string for the minimum Conserve version to read this band
     /// correctly.
     band_format_version: Option<String>,
+
+    /// Sizes used to cut large files into content-defined chunks, if they were.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    content_chunking: Option<ContentChunking>,
+
+    /// Encoding of the index hunks, if not JSON.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    index_format: Option<IndexFormat>,
+
+    /// Compression of new data blocks written for this band, if not Snappy.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    compression: Option<Compression>,
+
+    /// True if new data blocks for this band were written into pack files.
+    #[serde(default, skip_serializing_if = "std::ops::Not::not")]
+    packed_blocks: bool,
+}
+
+/// Settings for a new band, which are recorded in its head.
+#[derive(Debug, Clone, Default)]
+pub struct BandOptions {
+    /// Content-defined chunking used for large files, or None for fixed-size blocks.
+    pub content_chunking: Option<ContentChunking>,
+
+    /// Encoding for index hunks.
+    pub index_format: IndexFormat,
+
+    /// Compression of new data blocks.
+    pub compression: Compression,
+
+    /// Write new data blocks into pack files.
+    pub packed_blocks: bool,
 }
 
 /// Format of the on-disk tail file.
@@ -85,6 +126,12 @@ struct Tail {
     ///
     /// Present from 0.6.4 onwards.
     index_hunk_count: Option<u64>,
+
+    /// Counts and sizes of the entries in the index.
+    ///
+    /// Present from 0.6.15 onwards.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    tree_stats: Option<TreeStats>,
 }
 
 /// Readonly summary info about a band, from `Band::get_info`.
@@ -100,6 +147,13 @@ pub struct Info {
 
     /// Number of hunks present in the index, if that is known.
     pub index_hunk_count: Option<u64>,
+
+    /// Counts and sizes of the entries in the index, if the band is complete and they
+    /// were recorded.
+    pub tree_stats: Option<TreeStats>,
+
+    /// Content-defined chunking used for large files, if any.
+    pub content_chunking: Option<ContentChunking>,
 }
 
 // TODO: Maybe merge Band with StoredTree and/or with the Index classes? The distinction seems
@@ -109,6 +163,12 @@ impl Band {
     ///
     /// The Band gets the next id after those that already exist.
     pub fn create(archive: &Archive) -> Result<Band> {
+        Band::create_with_options(archive, &BandOptions::default())
+    }
+
+    /// Make a new band, recording the given options in its head.
+    pub fn create_with_options(archive: &Archive, options: &BandOptions) -> Result<Band> {
+        trace_span!("create_band");
         let band_id = archive
             .last_band_id()?
             .map_or_else(BandId::zero, |b| b.next_sibling());
@@ -117,34 +177,72 @@ impl Band {
             .create_dir("")
             .and_then(|()| transport.create_dir(INDEX_DIR))
             .map_err(|source| Error::CreateBand { source })?;
+        if options.compression != Compression::Snappy || options.packed_blocks {
+            archive.require_new_features()?;
+        }
+        let index_format = options.index_format;
+        let band_format_version = if index_format == IndexFormat::Json
+            && options.compression == Compression::Snappy
+            && !options.packed_blocks
+        {
+            BAND_FORMAT_VERSION
+        } else {
+            NEW_FEATURES_BAND_FORMAT_VERSION
+        };
         let head = Head {
             start_time: Utc::now().timestamp(),
-            band_format_version: Some(BAND_FORMAT_VERSION.to_owned()),
+            band_format_version: Some(band_format_version.to_owned()),
+            content_chunking: options.content_chunking,
+            index_format: Some(index_format).filter(|f| *f != IndexFormat::Json),
+            compression: Some(options.compression).filter(|c| *c != Compression::Snappy),
+            packed_blocks: options.packed_blocks,
         };
         write_json(&transport, BAND_HEAD_FILENAME, &head)?;
-        Ok(Band { band_id, transport })
+        Ok(Band {
+            band_id,
+            transport,
+            index_format,
+        })
     }
 
     /// Mark this band closed: no more blocks should be written after this.
     pub fn close(&self, index_hunk_count: u64) -> Result<()> {
+        self.write_tail(index_hunk_count, None)
+    }
+
+    /// Mark this band closed, recording the counts of its index entries so that they
+    /// can be read back quickly.
+    pub fn close_with_tree_stats(
+        &self,
+        index_hunk_count: u64,
+        tree_stats: TreeStats,
+    ) -> Result<()> {
+        self.write_tail(index_hunk_count, Some(tree_stats))
+    }
+
+    fn write_tail(&self, index_hunk_count: u64, tree_stats: Option<TreeStats>) -> Result<()> {
         write_json(
             &self.transport,
             BAND_TAIL_FILENAME,
             &Tail {
                 end_time: Utc::now().timestamp(),
                 index_hunk_count: Some(index_hunk_count),
+                tree_stats,
             },
         )
     }
 
     /// Open the band with the given id.
     pub fn open(archive: &Archive, band_id: &BandId) -> Result<Band> {
+        trace_span!("open_band", band_id = %band_id);
         let transport: Box<dyn Transport> = archive.transport().sub_transport(&band_id.to_string());
-        let new = Band {
+        let mut new = Band {
             band_id: band_id.to_owned(),
             transport,
+            index_format: IndexFormat::Json,
         };
         let head = new.read_head()?;
+        new.index_format = head.index_format.unwrap_or_default();
         if let Some(version) = head.band_format_version {
             if !band_version_supported(&version) {
                 return Err(Error::UnsupportedBandVersion {
@@ -182,7 +280,24 @@ impl Band {
     }
 
     pub fn index_builder(&self) -> IndexWriter {
-        IndexWriter::new(self.transport.sub_transport(INDEX_DIR))
+        IndexWriter::with_format(self.transport.sub_transport(INDEX_DIR), self.index_format)
+    }
+
+    /// Reopen the index of an incomplete band, to write more hunks after those already
+    /// present.
+    pub(crate) fn resume_index_builder(&self) -> Result<IndexWriter> {
+        IndexWriter::resume(self.transport.sub_transport(INDEX_DIR), self.index_format)
+    }
+
+    /// Return the options recorded in this band's head when it was created.
+    pub fn options(&self) -> Result<BandOptions> {
+        let head = self.read_head()?;
+        Ok(BandOptions {
+            content_chunking: head.content_chunking,
+            index_format: head.index_format.unwrap_or_default(),
+            compression: head.compression.unwrap_or_default(),
+            packed_blocks: head.packed_blocks,
+        })
     }
 
     /// Get read-only access to the index of this band.
@@ -219,6 +334,8 @@ impl Band {
                 .as_ref()
                 .map(|tail| Utc.timestamp(tail.end_time, 0)),
             index_hunk_count: tail_option.as_ref().and_then(|tail| tail.index_hunk_count),
+            tree_stats: tail_option.and_then(|tail| tail.tree_stats),
+            content_chunking: head.content_chunking,
         })
     }
 
@@ -291,19 +408,71 @@ mod tests {
         assert_eq!(info.id.to_string(), "b0000");
         assert_eq!(info.is_closed, true);
         assert_eq!(info.index_hunk_count, Some(0));
+        assert_eq!(info.tree_stats, None);
         let dur = info.end_time.expect("info has an end_time") - info.start_time;
         // Test should have taken (much) less than 5s between starting and finishing
         // the band.  (It might fail if you set a breakpoint right there.)
         assert!(dur < Duration::seconds(5));
     }
 
+    #[test]
+    fn binary_index_format_recorded_in_head() {
+        let af = ScratchArchive::new();
+        let options = BandOptions {
+            index_format: IndexFormat::Binary,
+            ..BandOptions::default()
+        };
+        let band = Band::create_with_options(&af, &options).unwrap();
+        let head = band.read_head().unwrap();
+        assert_eq!(head.index_format, Some(IndexFormat::Binary));
+        assert_eq!(
+            head.band_format_version.as_deref(),
+            Some(NEW_FEATURES_BAND_FORMAT_VERSION)
+        );
+
+        let mut writer = band.index_builder();
+        writer.push_entry(IndexEntry {
+            apath: "/".into(),
+            kind: Kind::Dir,
+            mtime: 0,
+            mtime_nanos: 0,
+            addrs: Vec::new(),
+            target: None,
+        });
+        writer.finish().unwrap();
+        band.close(1).unwrap();
+
+        let band = Band::open(&af, band.id()).unwrap();
+        assert_eq!(band.index_format, IndexFormat::Binary);
+        let entries: Vec<IndexEntry> = band.index().iter_entries().collect();
+        assert_eq!(entries.len(), 1);
+        assert_eq!(entries[0].apath, "/");
+    }
+
+    #[test]
+    fn content_chunking_recorded_in_head() {
+        let af = ScratchArchive::new();
+        let options = BandOptions {
+            content_chunking: Some(ContentChunking::default()),
+            ..BandOptions::default()
+        };
+        let band = Band::create_with_options(&af, &options).unwrap();
+        let info = band.get_info().unwrap();
+        assert_eq!(info.content_chunking, Some(ContentChunking::default()));
+
+        let band = Band::create(&af).unwrap();
+        assert_eq!(band.get_info().unwrap().content_chunking, None);
+        let head = fs::read_to_string(af.path().join("b0001").join(BAND_HEAD_FILENAME)).unwrap();
+        assert!(!head.contains("content_chunking"));
+    }
+
     #[test]
     fn delete_band() {
         let af = ScratchArchive::new();
         let _band = Band::create(&af).unwrap();
         Band::delete(&af, &BandId::new(&[0])).expect("delete band");
 
-        assert_eq!(af.transport().exists("b0000").unwrap(), false);
+        assert_eq!(af.transport().dir_exists("b0000").unwrap(), false);
     }
 
     #[test]
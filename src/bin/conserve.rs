@@ -19,6 +19,7 @@ use std::path::{Path, PathBuf};
 use structopt::StructOpt;
 
 use conserve::backup::BackupOptions;
+use conserve::metrics::Metrics;
 use conserve::ReadTree;
 use conserve::RestoreOptions;
 use conserve::*;
@@ -29,6 +30,70 @@ use conserve::*;
     about = "A robust backup tool <https://github.com/sourcefrog/conserve/>",
     author
 )]
+struct Args {
+    #[structopt(subcommand)]
+    command: Command,
+
+    /// Write the time, operations, and bytes of each phase of work to this file as JSON.
+    #[structopt(long, global = true)]
+    metrics_json: Option<PathBuf>,
+
+    /// Limit reading source files and local archive IO to this many megabytes per second.
+    #[structopt(long, global = true)]
+    limit_mb_per_sec: Option<u64>,
+
+    /// Limit source file reads and local archive operations to this many per second.
+    #[structopt(long, global = true)]
+    limit_ops_per_sec: Option<u64>,
+
+    /// Pause between source file reads while their latency is higher than usual.
+    #[structopt(long, global = true)]
+    adaptive_throttle: bool,
+
+    /// Write spans around archive operations to this file, in the Chrome trace format.
+    #[cfg(feature = "trace")]
+    #[structopt(long, global = true)]
+    trace_chrome: Option<PathBuf>,
+
+    /// Write spans around archive operations to this file as folded stacks, for drawing
+    /// a flamegraph.
+    #[cfg(feature = "trace")]
+    #[structopt(long, global = true)]
+    trace_folded: Option<PathBuf>,
+}
+
+impl Args {
+    fn run(&self) -> Result<ExitCode> {
+        #[cfg(feature = "trace")]
+        let _trace_guard = if self.trace_chrome.is_some() || self.trace_folded.is_some() {
+            Some(conserve::trace::start(
+                self.trace_chrome.as_deref(),
+                self.trace_folded.as_deref(),
+            )?)
+        } else {
+            None
+        };
+        conserve::throttle::set_limits(conserve::throttle::ThrottleOptions {
+            bytes_per_second: self.limit_mb_per_sec.map(|mb| mb << 20),
+            ops_per_second: self.limit_ops_per_sec,
+            adaptive: self.adaptive_throttle,
+        });
+        let mut result = self.command.run();
+        if let Some(metrics_path) = &self.metrics_json {
+            if let Err(err) = Metrics::snapshot().write_json(metrics_path) {
+                if result.is_ok() {
+                    result = Err(err);
+                } else {
+                    ui::show_error(&err);
+                }
+            }
+        }
+        // Trace files are finished when the guard is dropped here, before exiting.
+        result
+    }
+}
+
+#[derive(Debug, StructOpt)]
 enum Command {
     /// Copy source directory into an archive.
     Backup {
@@ -45,6 +110,45 @@ enum Command {
         exclude_from: Vec<String>,
         #[structopt(long)]
         no_stats: bool,
+        /// Number of threads to hash, compress and write file content, or 0 for one per CPU.
+        #[structopt(long, short = "j", default_value = "1")]
+        jobs: usize,
+        /// Cut large files into blocks at content-defined boundaries, so that insertions
+        /// don't prevent deduplication of the rest of the file.
+        #[structopt(long)]
+        content_chunking: bool,
+        /// List all blocks in the archive before starting, to avoid checking whether each
+        /// new block exists. Faster on remote or network archives.
+        #[structopt(long)]
+        preload_block_names: bool,
+        /// Encoding for index hunks: "json", readable by all versions, or the smaller and
+        /// faster "binary", which needs Conserve 0.6.15 or later to read.
+        #[structopt(long, default_value = "json")]
+        index_format: IndexFormat,
+        /// Compression for new data blocks: "snappy", readable by all versions, or
+        /// "zstd" or "zstd:LEVEL", which is smaller and needs Conserve 0.6.15 or later.
+        #[structopt(long, default_value = "snappy")]
+        compression: Compression,
+        /// Write new blocks into large pack files rather than one file per block.
+        /// Fewer files are faster on object stores; needs Conserve 0.6.15 or later.
+        #[structopt(long)]
+        pack_blocks: bool,
+        /// Compare small files whose mtime changed to their previous content, and don't
+        /// store them again if it's the same. This reads some blocks from the archive.
+        #[structopt(long)]
+        dedup_small_files_from_basis: bool,
+        /// Keep the inode and ctime of each file in this local file, outside the source,
+        /// and read files again if they changed even though their mtime and size didn't.
+        #[structopt(long)]
+        stat_cache: Option<PathBuf>,
+        /// If the last backup was interrupted, continue writing it from where it stopped,
+        /// rather than starting a new backup.
+        #[structopt(long)]
+        resume: bool,
+        /// Drop source files from the OS page cache after reading them, so that the backup
+        /// doesn't push other programs' data out of memory.
+        #[structopt(long)]
+        drop_source_cache: bool,
     },
 
     Debug(Debug),
@@ -66,12 +170,17 @@ enum Command {
         no_stats: bool,
     },
 
-    /// Compare a stored tree to a source directory.
+    /// Compare a stored tree to a source directory, or to another stored tree.
     Diff {
         archive: PathBuf,
-        source: PathBuf,
+        /// Source directory to compare to the backup.
+        #[structopt(required_unless = "to")]
+        source: Option<PathBuf>,
         #[structopt(long, short)]
         backup: Option<BandId>,
+        /// Compare to this other backup, rather than to a source directory.
+        #[structopt(long, conflicts_with = "source")]
+        to: Option<BandId>,
         #[structopt(long, short, number_of_values = 1)]
         exclude: Vec<String>,
         #[structopt(long, short = "E", number_of_values = 1)]
@@ -84,6 +193,10 @@ enum Command {
     Init {
         /// Path for new archive.
         archive: PathBuf,
+        /// Hash for data blocks: "blake2b", readable by all versions, or the faster
+        /// "blake3", which needs Conserve 0.6.15 or later to read.
+        #[structopt(long, default_value = "blake2b")]
+        block_hash: HashAlgorithm,
     },
 
     /// Delete blocks unreferenced by any index.
@@ -131,6 +244,19 @@ enum Command {
         only_subtree: Option<Apath>,
         #[structopt(long)]
         no_stats: bool,
+        /// Megabytes of each file's content to fetch and decompress ahead of writing
+        /// it, or 0 to read blocks only as they're needed.
+        #[structopt(long, default_value = "32")]
+        read_ahead_mb: u64,
+        /// Number of threads to write out files, or 0 for one per CPU.
+        #[structopt(long, short = "j", default_value = "1")]
+        jobs: usize,
+        /// Allocate space for each file before writing it, to reduce fragmentation.
+        #[structopt(long, conflicts_with = "sparse")]
+        preallocate: bool,
+        /// Leave runs of zeros in restored files as holes.
+        #[structopt(long)]
+        sparse: bool,
     },
 
     /// Show the total size of files in a stored tree or source directory, with exclusions.
@@ -156,6 +282,22 @@ enum Command {
         /// Skip reading and checking the content of data blocks.
         #[structopt(long, short = "q")]
         quick: bool,
+
+        /// Skip blocks checked by an earlier incremental validation, and remember
+        /// the blocks checked by this one.
+        #[structopt(long)]
+        incremental: bool,
+
+        /// With --incremental, also re-check this percentage of previously checked
+        /// blocks, chosen at random.
+        #[structopt(long, default_value = "0")]
+        reverify_percent: f64,
+
+        /// With --incremental, also re-check blocks last checked more than this many
+        /// days ago.
+        #[structopt(long)]
+        reverify_days: Option<u64>,
+
         #[structopt(long)]
         no_stats: bool,
     },
@@ -231,22 +373,46 @@ impl Command {
                 exclude,
                 exclude_from,
                 no_stats,
+                jobs,
+                content_chunking,
+                preload_block_names,
+                index_format,
+                compression,
+                pack_blocks,
+                dedup_small_files_from_basis,
+                stat_cache,
+                resume,
+                drop_source_cache,
             } => {
                 let excludes = ExcludeBuilder::from_args(exclude, exclude_from)?.build()?;
                 let source = &LiveTree::open(source)?;
                 let options = BackupOptions {
                     print_filenames: *verbose,
                     excludes,
+                    jobs: *jobs,
+                    content_chunking: if *content_chunking {
+                        Some(ContentChunking::default())
+                    } else {
+                        None
+                    },
+                    preload_block_names: *preload_block_names,
+                    index_format: *index_format,
+                    compression: *compression,
+                    pack_blocks: *pack_blocks,
+                    dedup_small_files_from_basis: *dedup_small_files_from_basis,
+                    stat_cache: stat_cache.clone(),
+                    resume: *resume,
+                    drop_source_cache: *drop_source_cache,
                     ..Default::default()
                 };
-                let stats = backup(&Archive::open_path(archive)?, &source, &options)?;
+                let stats = backup(&open_archive(archive)?, &source, &options)?;
                 if !no_stats {
                     ui::println(&format!("Backup complete.\n{}", stats));
                 }
             }
             Command::Debug(Debug::Blocks { archive }) => {
                 let mut bw = BufWriter::new(stdout);
-                for hash in Archive::open_path(archive)?.block_dir().block_names()? {
+                for hash in open_archive(archive)?.block_dir().block_names()? {
                     writeln!(bw, "{}", hash)?;
                 }
             }
@@ -256,14 +422,14 @@ impl Command {
             }
             Command::Debug(Debug::Referenced { archive }) => {
                 let mut bw = BufWriter::new(stdout);
-                let archive = Archive::open_path(archive)?;
+                let archive = open_archive(archive)?;
                 for hash in archive.referenced_blocks(&archive.list_band_ids()?)? {
                     writeln!(bw, "{}", hash)?;
                 }
             }
             Command::Debug(Debug::Unreferenced { archive }) => {
                 let mut bw = BufWriter::new(stdout);
-                for hash in Archive::open_path(archive)?.unreferenced_blocks()? {
+                for hash in open_archive(archive)?.unreferenced_blocks()? {
                     writeln!(bw, "{}", hash)?;
                 }
             }
@@ -274,7 +440,7 @@ impl Command {
                 break_lock,
                 no_stats,
             } => {
-                let stats = Archive::open_path(archive)?.delete_bands(
+                let stats = open_archive(archive)?.delete_bands(
                     &backup,
                     &DeleteOptions {
                         dry_run: *dry_run,
@@ -289,18 +455,24 @@ impl Command {
                 archive,
                 source,
                 backup,
+                to,
                 exclude,
                 exclude_from,
                 include_unchanged,
             } => {
                 let excludes = ExcludeBuilder::from_args(exclude, exclude_from)?.build()?;
                 let st = stored_tree_from_opt(archive, backup)?;
-                let lt = LiveTree::open(source)?;
                 let options = DiffOptions {
                     excludes,
                     include_unchanged: *include_unchanged,
                 };
-                show_diff(diff(&st, &lt, &options)?, &mut stdout)?;
+                if to.is_some() {
+                    let st2 = stored_tree_from_opt(archive, to)?;
+                    show_diff(diff_stored(&st, &st2, &options)?, &mut stdout)?;
+                } else {
+                    let lt = LiveTree::open(source.as_ref().expect("source is required"))?;
+                    show_diff(diff(&st, &lt, &options)?, &mut stdout)?;
+                }
             }
             Command::Gc {
                 archive,
@@ -308,7 +480,7 @@ impl Command {
                 break_lock,
                 no_stats,
             } => {
-                let archive = Archive::open_path(archive)?;
+                let archive = open_archive(archive)?;
                 let stats = archive.delete_bands(
                     &[],
                     &DeleteOptions {
@@ -320,8 +492,16 @@ impl Command {
                     ui::println(&format!("{}", stats));
                 }
             }
-            Command::Init { archive } => {
-                Archive::create_path(&archive)?;
+            Command::Init {
+                archive,
+                block_hash,
+            } => {
+                Archive::create_with_options(
+                    open_transport(&archive.to_string_lossy())?,
+                    &ArchiveOptions {
+                        block_hash: *block_hash,
+                    },
+                )?;
                 ui::println(&format!("Created new archive in {:?}", &archive));
             }
             Command::Ls {
@@ -354,9 +534,13 @@ impl Command {
                 exclude_from,
                 only_subtree,
                 no_stats,
+                read_ahead_mb,
+                jobs,
+                preallocate,
+                sparse,
             } => {
                 let band_selection = band_selection_policy_from_opt(backup);
-                let archive = Archive::open_path(archive)?;
+                let archive = open_archive(archive)?;
                 let excludes = ExcludeBuilder::from_args(exclude, exclude_from)?.build()?;
 
                 let options = RestoreOptions {
@@ -365,6 +549,11 @@ impl Command {
                     only_subtree: only_subtree.clone(),
                     band_selection,
                     overwrite: *force_overwrite,
+                    read_ahead_bytes: *read_ahead_mb << 20,
+                    jobs: *jobs,
+                    preallocate: *preallocate,
+                    sparse: *sparse,
+                    ..Default::default()
                 };
 
                 let stats = restore(&archive, &destination, &options)?;
@@ -397,12 +586,19 @@ impl Command {
             Command::Validate {
                 archive,
                 quick,
+                incremental,
+                reverify_percent,
+                reverify_days,
                 no_stats,
             } => {
                 let options = ValidateOptions {
                     skip_block_hashes: *quick,
+                    incremental: *incremental,
+                    reverify_fraction: reverify_percent / 100.0,
+                    reverify_older_than: reverify_days
+                        .map(|days| std::time::Duration::from_secs(days * 24 * 3600)),
                 };
-                let stats = Archive::open_path(archive)?.validate(&options)?;
+                let stats = open_archive(archive)?.validate(&options)?;
                 if !no_stats {
                     println!("{}", stats);
                 }
@@ -421,7 +617,7 @@ impl Command {
                 utc,
             } => {
                 ui::enable_progress(false);
-                let archive = Archive::open_path(archive)?;
+                let archive = open_archive(archive)?;
                 let options = ShowVersionsOptions {
                     newest_first: *newest,
                     tree_size: *sizes,
@@ -436,8 +632,13 @@ impl Command {
     }
 }
 
+/// Open an archive from a local path or a URL.
+fn open_archive(archive: &Path) -> Result<Archive> {
+    Archive::open(open_transport(&archive.to_string_lossy())?)
+}
+
 fn stored_tree_from_opt(archive: &Path, backup: &Option<BandId>) -> Result<StoredTree> {
-    let archive = Archive::open_path(archive)?;
+    let archive = open_archive(archive)?;
     let policy = band_selection_policy_from_opt(backup);
     archive.open_stored_tree(policy)
 }
@@ -452,7 +653,7 @@ fn band_selection_policy_from_opt(backup: &Option<BandId>) -> BandSelectionPolic
 
 fn main() {
     ui::enable_progress(true);
-    let result = Command::from_args().run();
+    let result = Args::from_args().run();
     match result {
         Err(ref e) => {
             ui::show_error(e);
@@ -21,26 +21,43 @@
 //!
 //! The structure is: archive > blockdir > subdir > file.
 
-use std::collections::{HashMap, HashSet};
+use std::collections::HashSet;
 use std::convert::TryInto;
 use std::io;
 use std::path::Path;
-use std::sync::Mutex;
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::SystemTime;
 
-use blake2_rfc::blake2b;
-use blake2_rfc::blake2b::Blake2b;
+use itertools::Itertools;
 use rayon::prelude::*;
 use serde::{Deserialize, Serialize};
-use thousands::Separable;
 
-use crate::blockhash::BlockHash;
-use crate::compress::snappy::{Compressor, Decompressor};
+use crate::blockhash::{BlockHash, HashAlgorithm};
+use crate::compress::Compression;
+use crate::gc_lock::GarbageCollectionLock;
 use crate::kind::Kind;
-use crate::stats::{BackupStats, Sizes, ValidateStats};
+use crate::metrics::{Phase, Timer};
+use crate::prefetch;
+use crate::referenced::ReferencedBlocks;
+use crate::stats::{BackupStats, DeleteStats, Sizes, ValidateStats};
 use crate::transport::local::LocalTransport;
 use crate::transport::{DirEntry, ListDirNames, Transport};
+use crate::validate::{BlockLenSorter, SortedBlockLens};
 use crate::*;
 
+mod buffers;
+mod cache;
+mod pack;
+
+pub use buffers::BlockSlice;
+use buffers::{check_hash, BlockReader, BlockWriter};
+use cache::BlockCache;
+pub use cache::DEFAULT_BLOCK_CACHE_BYTES;
+use pack::{PackIndex, PackWriter, PACK_DIR, PACK_TARGET_BYTES};
+
+/// Check blocks in parallel batches of this many.
+const VALIDATE_BATCH_BLOCKS: usize = 10_000;
+
 const BLOCKDIR_FILE_NAME_LEN: usize = crate::BLAKE_HASH_SIZE_BYTES * 2;
 
 /// Take this many characters from the block hash to form the subdirectory name.
@@ -68,6 +85,90 @@ pub struct Address {
 #[derive(Clone, Debug)]
 pub struct BlockDir {
     transport: Box<dyn Transport>,
+
+    /// Blocks known to be present, if they've been loaded; shared between clones.
+    presence: Option<Arc<BlockPresence>>,
+
+    /// Recently read blocks, shared between clones.
+    cache: Arc<Mutex<BlockCache>>,
+
+    /// Compression for newly written blocks.
+    compression: Compression,
+
+    /// Hash of block content, which names the blocks.
+    hash_algorithm: HashAlgorithm,
+
+    /// Blocks stored in packs, loaded when first needed; shared between clones.
+    packs: Arc<RwLock<Option<PackIndex>>>,
+
+    /// The pack being filled, if new blocks are written into packs; shared between clones.
+    pack_writer: Option<Arc<Mutex<PackWriter>>>,
+}
+
+/// Where to read the compressed content of a block.
+#[derive(Debug)]
+enum BlockLocation {
+    /// A file holding only this block.
+    File(String),
+    /// A range within a pack file.
+    Packed {
+        relpath: String,
+        offset: u64,
+        len: u64,
+    },
+}
+
+impl BlockLocation {
+    fn relpath(&self) -> &str {
+        match self {
+            BlockLocation::File(relpath) => relpath,
+            BlockLocation::Packed { relpath, .. } => relpath,
+        }
+    }
+}
+
+/// A compact in-memory record of which blocks are present, to avoid a transport `exists`
+/// call for each new block.
+///
+/// Only a 64-bit prefix of each hash is held. If the prefix is absent the block is certainly
+/// absent, but if it's present the block still needs to be checked in the transport, since
+/// distinct hashes might share a prefix.
+#[derive(Debug)]
+struct BlockPresence {
+    /// Sorted prefixes of blocks present when the cache was loaded.
+    loaded: Vec<u64>,
+    /// Prefixes of blocks written since then.
+    added: Mutex<HashSet<u64>>,
+}
+
+impl BlockPresence {
+    fn may_contain(&self, hash: &BlockHash) -> bool {
+        let prefix = hash.prefix_u64();
+        self.loaded.binary_search(&prefix).is_ok() || self.added.lock().unwrap().contains(&prefix)
+    }
+
+    fn insert(&self, hash: &BlockHash) {
+        self.added.lock().unwrap().insert(hash.prefix_u64());
+    }
+}
+
+/// Interpret the result of writing a block file.
+fn check_block_write(hash: &BlockHash, result: io::Result<()>) -> Result<()> {
+    result.or_else(|io_err| {
+        if io_err.kind() == io::ErrorKind::AlreadyExists {
+            // Perhaps it was simultaneously created by another thread or process.
+            ui::problem(&format!(
+                "Unexpected late detection of existing block {:?}",
+                hash.to_string()
+            ));
+            Ok(())
+        } else {
+            Err(Error::WriteBlock {
+                hash: hash.to_string(),
+                source: io_err,
+            })
+        }
+    })
 }
 
 /// Returns the transport-relative subdirectory name.
@@ -87,7 +188,123 @@ impl BlockDir {
     }
 
     pub fn open(transport: Box<dyn Transport>) -> BlockDir {
-        BlockDir { transport }
+        BlockDir {
+            transport,
+            presence: None,
+            cache: Arc::new(Mutex::new(BlockCache::new(DEFAULT_BLOCK_CACHE_BYTES))),
+            compression: Compression::Snappy,
+            hash_algorithm: HashAlgorithm::Blake2b,
+            packs: Arc::new(RwLock::new(None)),
+            pack_writer: None,
+        }
+    }
+
+    /// Set the compression for blocks written by this BlockDir and clones made after
+    /// this is called.
+    ///
+    /// Blocks in every format can always be read.
+    pub(crate) fn set_compression(&mut self, compression: Compression) {
+        self.compression = compression;
+    }
+
+    /// Set the hash algorithm used to name and check blocks in this BlockDir, and
+    /// clones made after this is called.
+    ///
+    /// This is a property of the archive, and must match how its blocks were written.
+    pub(crate) fn set_hash_algorithm(&mut self, hash_algorithm: HashAlgorithm) {
+        self.hash_algorithm = hash_algorithm;
+    }
+
+    pub fn hash_algorithm(&self) -> HashAlgorithm {
+        self.hash_algorithm
+    }
+
+    /// Write new blocks into pack files, rather than each into its own file, from this
+    /// BlockDir and clones made after this is called.
+    ///
+    /// Blocks are only visible in the archive once their pack is written by `flush_pack`,
+    /// or when it fills up.
+    pub(crate) fn set_packing(&mut self, packing: bool) {
+        self.pack_writer = if packing {
+            Some(Arc::new(Mutex::new(PackWriter::default())))
+        } else {
+            None
+        };
+    }
+
+    /// Write out the blocks waiting to be packed, if any.
+    pub(crate) fn flush_pack(&self) -> Result<()> {
+        if let Some(pack_writer) = &self.pack_writer {
+            let writer = std::mem::take(&mut *pack_writer.lock().unwrap());
+            if !writer.is_empty() {
+                self.write_pack(writer)?;
+            }
+        }
+        Ok(())
+    }
+
+    fn write_pack(&self, writer: PackWriter) -> Result<()> {
+        let pack = writer.write(self.transport.as_ref())?;
+        self.with_packs_mut(|packs| packs.add(pack))
+    }
+
+    /// Add a compressed block to the pack being filled, and write the pack if it's full.
+    fn add_to_pack(
+        &self,
+        pack_writer: &Mutex<PackWriter>,
+        hash: &BlockHash,
+        compressed: &[u8],
+    ) -> Result<()> {
+        let full = {
+            let mut writer = pack_writer.lock().unwrap();
+            writer.add(hash, compressed);
+            if writer.content_len() >= PACK_TARGET_BYTES {
+                Some(std::mem::take(&mut *writer))
+            } else {
+                None
+            }
+        };
+        match full {
+            Some(writer) => self.write_pack(writer),
+            None => Ok(()),
+        }
+    }
+
+    /// Run `f` on the index of packed blocks, first loading it if necessary.
+    fn with_packs<R, F: FnOnce(&PackIndex) -> R>(&self, f: F) -> Result<R> {
+        if let Some(packs) = &*self.packs.read().unwrap() {
+            return Ok(f(packs));
+        }
+        self.with_packs_mut(|packs| f(packs))
+    }
+
+    fn with_packs_mut<R, F: FnOnce(&mut PackIndex) -> R>(&self, f: F) -> Result<R> {
+        let mut packs = self.packs.write().unwrap();
+        if packs.is_none() {
+            *packs = Some(PackIndex::load(self.transport.as_ref())?);
+        }
+        Ok(f(packs.as_mut().unwrap()))
+    }
+
+    /// True if the block is in a pack, or waiting to be written into one.
+    fn is_packed(&self, hash: &BlockHash) -> Result<bool> {
+        if let Some(pack_writer) = &self.pack_writer {
+            if pack_writer.lock().unwrap().contains(hash) {
+                return Ok(true);
+            }
+        }
+        self.with_packs(|packs| packs.contains(hash))
+    }
+
+    fn locate(&self, hash: &BlockHash) -> Result<BlockLocation> {
+        self.with_packs(|packs| match packs.get(hash) {
+            Some(packed) => BlockLocation::Packed {
+                relpath: packs.pack_relpath(packed.pack),
+                offset: packed.offset,
+                len: packed.len,
+            },
+            None => BlockLocation::File(block_relpath(hash)),
+        })
     }
 
     /// Create a BlockDir directory and return an object accessing it.
@@ -99,58 +316,213 @@ impl BlockDir {
         transport
             .create_dir("")
             .map_err(|source| Error::CreateBlockDir { source })?;
-        Ok(BlockDir { transport })
+        Ok(BlockDir::open(transport))
+    }
+
+    /// List all the blocks present, and remember them in memory so that storing
+    /// new blocks doesn't need to check whether each one already exists.
+    ///
+    /// The cache is shared with clones made after this is called.
+    pub(crate) fn preload_block_names(&mut self) -> Result<()> {
+        let mut loaded: Vec<u64> = self.block_names()?.map(|h| h.prefix_u64()).collect();
+        loaded.par_sort_unstable();
+        loaded.dedup();
+        self.presence = Some(Arc::new(BlockPresence {
+            loaded,
+            added: Mutex::new(HashSet::new()),
+        }));
+        Ok(())
     }
 
     /// Returns the number of compressed bytes.
-    pub(crate) fn compress_and_store(&mut self, in_buf: &[u8], hash: &BlockHash) -> Result<u64> {
-        // TODO: Move this to a BlockWriter, which can hold a reusable buffer.
-        let mut compressor = Compressor::new();
-        let compressed = compressor.compress(&in_buf)?;
-        let comp_len: u64 = compressed.len().try_into().unwrap();
+    pub(crate) fn compress_and_store(&self, in_buf: &[u8], hash: &BlockHash) -> Result<u64> {
+        if let Some(pack_writer) = &self.pack_writer {
+            // Adding to the pack may write it out and reload the pack index, which can
+            // wait on rayon, so the writer is released first.
+            let compressed = BlockWriter::with(|writer| {
+                writer
+                    .compress(self.compression, in_buf)
+                    .map(|compressed| compressed.to_vec())
+            })?;
+            self.add_to_pack(pack_writer, hash, &compressed)?;
+            return Ok(compressed.len() as u64);
+        }
         let hex_hash = hash.to_string();
         let relpath = block_relpath(hash);
         self.transport.create_dir(subdir_relpath(&hex_hash))?;
-        self.transport
-            .write_file(&relpath, compressed)
-            .or_else(|io_err| {
-                if io_err.kind() == io::ErrorKind::AlreadyExists {
-                    // Perhaps it was simultaneously created by another thread or process.
-                    ui::problem(&format!(
-                        "Unexpected late detection of existing block {:?}",
-                        hex_hash
-                    ));
-                    Ok(())
+        BlockWriter::with(|writer| {
+            let compressed = writer.compress(self.compression, in_buf)?;
+            let comp_len: u64 = compressed.len().try_into().unwrap();
+            check_block_write(hash, self.transport.write_file(&relpath, compressed))?;
+            Ok(comp_len)
+        })
+    }
+
+    /// Store each of a batch of blocks whose hashes are known, unless it's already present.
+    ///
+    /// The hashes should be distinct. Presence checks and writes are each issued as one
+    /// batch to the transport, so that remote transports can have many in flight.
+    pub(crate) fn store_batch(
+        &self,
+        blocks: &[(&[u8], &BlockHash)],
+        stats: &mut BackupStats,
+    ) -> Result<()> {
+        trace_span!("store_blocks", count = blocks.len());
+        let mut timer = Timer::start(Phase::StoreBlocks);
+        timer.set_ops(blocks.len() as u64);
+        timer.add_bytes(blocks.iter().map(|(data, _)| data.len() as u64).sum());
+        let mut present = vec![false; blocks.len()];
+        let mut to_check: Vec<usize> = Vec::new();
+        for (i, (_, hash)) in blocks.iter().enumerate() {
+            if let Some(presence) = &self.presence {
+                if presence.may_contain(hash) {
+                    stats.block_presence_hits += 1;
                 } else {
-                    Err(Error::WriteBlock {
-                        hash: hex_hash,
-                        source: io_err,
-                    })
+                    stats.block_presence_misses += 1;
+                    continue;
                 }
-            })?;
-        Ok(comp_len)
+            }
+            if self.is_packed(hash)? {
+                present[i] = true;
+            } else {
+                to_check.push(i);
+            }
+        }
+        let check_paths: Vec<String> = to_check
+            .iter()
+            .map(|&i| block_relpath(blocks[i].1))
+            .collect();
+        for (&i, exists) in to_check
+            .iter()
+            .zip(self.transport.exists_many(&check_paths))
+        {
+            present[i] = exists?;
+        }
+
+        let mut absent = Vec::new();
+        for (i, (block_data, hash)) in blocks.iter().enumerate() {
+            if present[i] {
+                stats.deduplicated_blocks += 1;
+                stats.deduplicated_bytes += block_data.len() as u64;
+            } else {
+                absent.push((*block_data, *hash));
+            }
+        }
+        if absent.is_empty() {
+            return Ok(());
+        }
+
+        let compression = self.compression;
+        let files: Vec<(String, Vec<u8>)> = absent
+            .par_iter()
+            .map(|(block_data, hash)| {
+                BlockWriter::with(|writer| {
+                    writer
+                        .compress(compression, block_data)
+                        .map(|compressed| (block_relpath(hash), compressed.to_vec()))
+                })
+            })
+            .collect::<Result<Vec<(String, Vec<u8>)>>>()?;
+        let results: Vec<Result<()>> = match &self.pack_writer {
+            Some(pack_writer) => absent
+                .iter()
+                .zip(files.iter())
+                .map(|((_, hash), (_, compressed))| self.add_to_pack(pack_writer, hash, compressed))
+                .collect(),
+            None => {
+                self.create_subdirs(&absent)?;
+                self.transport
+                    .write_many(&files)
+                    .into_iter()
+                    .zip(absent.iter())
+                    .map(|(result, (_, hash))| check_block_write(hash, result))
+                    .collect()
+            }
+        };
+        for (((block_data, hash), (_, compressed)), result) in
+            absent.iter().zip(files.iter()).zip(results)
+        {
+            result?;
+            if let Some(presence) = &self.presence {
+                presence.insert(hash);
+            }
+            stats.written_blocks += 1;
+            stats.uncompressed_bytes += block_data.len() as u64;
+            stats.compressed_bytes += compressed.len() as u64;
+        }
+        Ok(())
     }
 
+    /// Create the subdirectories for some new block files.
+    fn create_subdirs(&self, blocks: &[(&[u8], &BlockHash)]) -> Result<()> {
+        let mut subdirs: Vec<String> = blocks
+            .iter()
+            .map(|(_, hash)| subdir_relpath(&hash.to_string()).to_owned())
+            .collect();
+        subdirs.sort_unstable();
+        subdirs.dedup();
+        for result in prefetch::map_concurrent(&subdirs, self.transport.concurrency(), |subdir| {
+            self.transport.create_dir(subdir)
+        }) {
+            result?;
+        }
+        Ok(())
+    }
+
+    /// Store a block unless it's already present, and return its hash.
+    ///
+    /// This takes `&self` so that many blocks can be stored concurrently from multiple threads.
     pub(crate) fn store_or_deduplicate(
-        &mut self,
+        &self,
         block_data: &[u8],
         stats: &mut BackupStats,
     ) -> Result<BlockHash> {
         let hash = self.hash_bytes(block_data);
-        if self.contains(&hash)? {
+        self.store_if_absent(block_data, &hash, stats)?;
+        Ok(hash)
+    }
+
+    /// Store a block whose hash is already known, unless it's already present.
+    pub(crate) fn store_if_absent(
+        &self,
+        block_data: &[u8],
+        hash: &BlockHash,
+        stats: &mut BackupStats,
+    ) -> Result<()> {
+        trace_span!("store_block", hash = %hash);
+        let mut timer = Timer::start(Phase::StoreBlocks);
+        timer.add_bytes(block_data.len() as u64);
+        let present = match &self.presence {
+            Some(presence) if presence.may_contain(hash) => {
+                stats.block_presence_hits += 1;
+                self.contains(hash)?
+            }
+            Some(_) => {
+                stats.block_presence_misses += 1;
+                false
+            }
+            None => self.contains(hash)?,
+        };
+        if present {
             stats.deduplicated_blocks += 1;
             stats.deduplicated_bytes += block_data.len() as u64;
         } else {
-            let comp_len = self.compress_and_store(block_data, &hash)?;
+            let comp_len = self.compress_and_store(block_data, hash)?;
+            if let Some(presence) = &self.presence {
+                presence.insert(hash);
+            }
             stats.written_blocks += 1;
             stats.uncompressed_bytes += block_data.len() as u64;
             stats.compressed_bytes += comp_len;
         }
-        Ok(hash)
+        Ok(())
     }
 
     /// True if the named block is present in this directory.
     pub fn contains(&self, hash: &BlockHash) -> Result<bool> {
+        if self.is_packed(hash)? {
+            return Ok(true);
+        }
         self.transport
             .exists(&block_relpath(hash))
             .map_err(Error::from)
@@ -158,6 +530,9 @@ impl BlockDir {
 
     /// Returns the compressed on-disk size of a block.
     pub fn compressed_size(&self, hash: &BlockHash) -> Result<u64> {
+        if let Some(packed) = self.with_packs(|packs| packs.get(hash))? {
+            return Ok(packed.len);
+        }
         Ok(self.transport.metadata(&block_relpath(hash))?.len)
     }
 
@@ -165,23 +540,67 @@ impl BlockDir {
     ///
     /// To read a whole file, use StoredFile instead.
     pub fn get(&self, address: &Address) -> Result<(Vec<u8>, Sizes)> {
-        let (mut decompressed, sizes) = self.get_block_content(&address.hash)?;
+        self.get_slice(address)
+            .map(|(slice, sizes)| (slice.into_vec(), sizes))
+    }
+
+    /// Read back the contents of a block, as a slice that may share the block's buffer
+    /// with the cache and with other slices.
+    ///
+    /// Blocks that are only partly used by this address, such as combined blocks holding
+    /// several small files, are kept in a cache shared by all clones of this BlockDir,
+    /// since the other parts are likely to be read soon. Only reads of such blocks are
+    /// counted as cache misses, since whole blocks are never cached.
+    pub fn get_slice(&self, address: &Address) -> Result<(BlockSlice, Sizes)> {
+        let cached = self.cache.lock().unwrap().get(&address.hash);
+        let (content, sizes) = match cached {
+            Some(cached) => cached,
+            None => {
+                trace_span!("read_block", hash = %address.hash);
+                let location = self.locate(&address.hash)?;
+                let (content, sizes) = BlockReader::with(|reader| {
+                    reader
+                        .read(self.transport.as_ref(), &address.hash, &location)
+                        .map(|(bytes, sizes)| (Arc::new(bytes), sizes))
+                })?;
+                check_hash(self.hash_algorithm, &address.hash, &location, &content)?;
+                if address.start != 0 || address.len != content.len() as u64 {
+                    let mut cache = self.cache.lock().unwrap();
+                    cache.misses += 1;
+                    cache.insert(&address.hash, Arc::clone(&content), sizes);
+                }
+                (content, sizes)
+            }
+        };
         let len = address.len as usize;
         let start = address.start as usize;
-        let actual_len = decompressed.len();
+        let actual_len = content.len();
         if (start + len) > actual_len {
             return Err(Error::AddressTooLong {
                 address: address.to_owned(),
                 actual_len,
             });
         }
-        if start != 0 {
-            let trimmed = decompressed[start..(start + len)].to_owned();
-            Ok((trimmed, sizes))
-        } else {
-            decompressed.truncate(len);
-            Ok((decompressed, sizes))
-        }
+        Ok((BlockSlice::new(content, start, len), sizes))
+    }
+
+    /// Set the maximum total size of decompressed blocks held in the cache shared by this
+    /// BlockDir and its clones.
+    ///
+    /// 0 turns off caching.
+    pub fn set_block_cache_limit(&self, limit_bytes: u64) {
+        self.cache.lock().unwrap().set_limit(limit_bytes);
+    }
+
+    /// Return the maximum total size of decompressed blocks held in the cache.
+    pub fn block_cache_limit(&self) -> u64 {
+        self.cache.lock().unwrap().limit_bytes()
+    }
+
+    /// Return the total number of (hits, misses) in the block cache.
+    pub(crate) fn block_cache_counts(&self) -> (u64, u64) {
+        let cache = self.cache.lock().unwrap();
+        (cache.hits, cache.misses)
     }
 
     pub fn delete_block(&self, hash: &BlockHash) -> Result<()> {
@@ -190,13 +609,35 @@ impl BlockDir {
             .map_err(Error::from)
     }
 
+    /// Delete a batch of blocks stored in their own files, returning the result for each.
+    pub(crate) fn delete_blocks(&self, hashes: &[BlockHash]) -> Vec<Result<()>> {
+        let paths: Vec<String> = hashes.iter().map(block_relpath).collect();
+        self.transport
+            .remove_many(&paths)
+            .into_iter()
+            .map(|result| result.map_err(Error::from))
+            .collect()
+    }
+
+    /// Return the compressed sizes of a batch of blocks stored in their own files.
+    pub(crate) fn compressed_sizes(&self, hashes: &[BlockHash]) -> Vec<Result<u64>> {
+        let paths: Vec<String> = hashes.iter().map(block_relpath).collect();
+        self.transport
+            .metadata_many(&paths)
+            .into_iter()
+            .map(|result| result.map(|metadata| metadata.len).map_err(Error::from))
+            .collect()
+    }
+
     /// Return an iterator of block subdirectories, in arbitrary order.
     ///
     /// Errors, other than failure to open the directory at all, are logged and discarded.
     fn subdirs(&self) -> Result<Vec<String>> {
         let ListDirNames { mut dirs, .. } = self.transport.list_dir_names("")?;
         dirs.retain(|dirname| {
-            if dirname.len() == SUBDIR_NAME_CHARS {
+            if dirname == PACK_DIR {
+                false
+            } else if dirname.len() == SUBDIR_NAME_CHARS {
                 true
             } else {
                 ui::problem(&format!(
@@ -238,6 +679,13 @@ impl BlockDir {
     /// Return all the blocknames in the blockdir,
     /// in arbitrary order.
     pub fn block_names(&self) -> Result<impl Iterator<Item = BlockHash>> {
+        let packed = self.packed_block_names()?;
+        Ok(self.loose_block_names()?.chain(packed))
+    }
+
+    /// Return the names of blocks stored in their own files, rather than in packs,
+    /// in arbitrary order.
+    pub(crate) fn loose_block_names(&self) -> Result<impl Iterator<Item = BlockHash>> {
         let mut progress_bar = ProgressBar::new();
         progress_bar.set_phase("List blocks");
         Ok(self
@@ -245,6 +693,10 @@ impl BlockDir {
             .filter_map(|de| de.name.parse().ok()))
     }
 
+    fn packed_block_names(&self) -> Result<Vec<BlockHash>> {
+        self.with_packs(|packs| packs.hashes().cloned().collect())
+    }
+
     /// Return all the blocknames in the blockdir.
     pub fn block_names_set(&self) -> Result<HashSet<BlockHash>> {
         let mut progress_bar = ProgressBar::new();
@@ -259,97 +711,250 @@ impl BlockDir {
                 }
             })
             .map(|(_i, hash)| hash)
+            .chain(self.packed_block_names()?)
             .collect())
     }
 
+    /// Delete packs holding unreferenced blocks, and packs that have no index.
+    ///
+    /// Packs where some blocks are still referenced are first rewritten into a new pack
+    /// holding only those blocks.
+    ///
+    /// A pack with no index may be one that a concurrent backup is still writing, so it's
+    /// only deleted if it was last modified before `gc_start`. The guard is checked again
+    /// before anything is deleted.
+    pub(crate) fn compact_packs(
+        &self,
+        referenced: &ReferencedBlocks,
+        delete_guard: &GarbageCollectionLock,
+        gc_start: SystemTime,
+        dry_run: bool,
+        stats: &mut DeleteStats,
+    ) -> Result<()> {
+        type Blocks = Vec<(BlockHash, u64, u64)>;
+        let (to_compact, orphans): (Vec<(usize, String, Blocks, Blocks)>, Vec<String>) = self
+            .with_packs(|packs| {
+                let to_compact = packs
+                    .packs()
+                    .filter_map(|(pack_number, pack)| {
+                        let (keep, unreferenced): (Blocks, Blocks) = pack
+                            .blocks
+                            .iter()
+                            .cloned()
+                            .partition(|(hash, _, _)| referenced.contains(hash));
+                        if unreferenced.is_empty() {
+                            None
+                        } else {
+                            Some((pack_number, pack.name.clone(), keep, unreferenced))
+                        }
+                    })
+                    .collect();
+                (to_compact, packs.orphans.clone())
+            })?;
+        if !dry_run && !to_compact.is_empty() {
+            delete_guard.check()?;
+        }
+        for (pack_number, name, keep, unreferenced) in to_compact {
+            stats.unreferenced_block_count += unreferenced.len();
+            stats.unreferenced_block_bytes +=
+                unreferenced.iter().map(|(_, _, len)| len).sum::<u64>();
+            if dry_run {
+                continue;
+            }
+            match self.rewrite_pack(pack_number, &name, &keep) {
+                Ok(()) => {
+                    stats.deleted_block_count += unreferenced.len();
+                    if !keep.is_empty() {
+                        stats.rewritten_pack_count += 1;
+                    }
+                }
+                Err(err) => {
+                    ui::problem(&format!("Failed to compact pack {:?}: {}", name, err));
+                    stats.deletion_errors += unreferenced.len();
+                }
+            }
+        }
+        if dry_run {
+            return Ok(());
+        }
+        let deleted = self.delete_stale_orphans(orphans, delete_guard, gc_start, stats);
+        // Rewritten packs were removed from the index, so its block map must be rebuilt
+        // even if deleting the orphans failed.
+        self.with_packs_mut(|packs| {
+            if let Ok(deleted) = &deleted {
+                packs.orphans.retain(|name| !deleted.contains(name));
+            }
+            packs.rebuild();
+        })?;
+        deleted.map(|_| ())
+    }
+
+    /// Delete packs with no index that were last modified before `gc_start`, and return
+    /// the names of those deleted.
+    fn delete_stale_orphans(
+        &self,
+        orphans: Vec<String>,
+        delete_guard: &GarbageCollectionLock,
+        gc_start: SystemTime,
+        stats: &mut DeleteStats,
+    ) -> Result<HashSet<String>> {
+        let mut deleted = HashSet::new();
+        let orphan_paths: Vec<String> = orphans
+            .iter()
+            .map(|name| pack::pack_relpath(name))
+            .collect();
+        let stale_orphans: Vec<String> = orphans
+            .into_iter()
+            .zip(self.transport.metadata_many(&orphan_paths))
+            .filter_map(|(name, metadata)| match metadata {
+                Ok(metadata) if metadata.mtime.map_or(false, |mtime| mtime < gc_start) => {
+                    Some(name)
+                }
+                Ok(_) => None,
+                Err(err) if err.kind() == io::ErrorKind::NotFound => None,
+                Err(err) => {
+                    ui::problem(&format!(
+                        "Failed to stat unindexed pack {:?}: {}",
+                        name, err
+                    ));
+                    None
+                }
+            })
+            .collect();
+        if stale_orphans.is_empty() {
+            return Ok(deleted);
+        }
+        delete_guard.check()?;
+        for name in stale_orphans {
+            match pack::delete_orphan(self.transport.as_ref(), &name) {
+                Ok(()) => {
+                    deleted.insert(name);
+                }
+                Err(err) => {
+                    ui::problem(&format!(
+                        "Failed to delete unindexed pack {:?}: {}",
+                        name, err
+                    ));
+                    stats.deletion_errors += 1;
+                }
+            }
+        }
+        Ok(deleted)
+    }
+
+    /// Copy the given blocks from a pack into a new pack, and then delete the old pack.
+    fn rewrite_pack(
+        &self,
+        pack_number: usize,
+        name: &str,
+        keep: &[(BlockHash, u64, u64)],
+    ) -> Result<()> {
+        if !keep.is_empty() {
+            let read_error = |source| Error::ReadBlock {
+                hash: name.to_owned(),
+                source,
+            };
+            let mut content = Vec::new();
+            self.transport
+                .read_file(&pack::pack_relpath(name), &mut content)
+                .map_err(read_error)?;
+            let mut writer = PackWriter::default();
+            for (hash, offset, len) in keep {
+                let block = content
+                    .get((*offset as usize)..((offset + len) as usize))
+                    .ok_or_else(|| {
+                        read_error(io::Error::new(
+                            io::ErrorKind::UnexpectedEof,
+                            format!("Block {} extends past the end of the pack", hash),
+                        ))
+                    })?;
+                writer.add(hash, block);
+            }
+            self.write_pack(writer)?;
+        }
+        pack::delete_pack(self.transport.as_ref(), name)?;
+        self.with_packs_mut(|packs| packs.remove(pack_number))
+    }
+
     /// Check format invariants of the BlockDir.
     ///
-    /// Return a dict describing which blocks are present, and the length of their uncompressed
-    /// data.
-    pub fn validate(&self, stats: &mut ValidateStats) -> Result<HashMap<BlockHash, usize>> {
+    /// Return the present blocks whose content is correct, with the length of their
+    /// uncompressed data, in hash order.
+    ///
+    /// Blocks are listed and checked in batches, so memory use doesn't grow with the
+    /// number of blocks.
+    pub(crate) fn validate(&self, stats: &mut ValidateStats) -> Result<SortedBlockLens> {
         // TODO: In the top-level directory, no files or directories other than prefix
         // directories of the right length.
         // TODO: Test having a block with the right compression but the wrong contents.
-        ui::println("Count blocks...");
-        let blocks = self.block_names_set()?;
-        crate::ui::println(&format!(
-            "Check {} blocks...",
-            blocks.len().separate_with_commas()
-        ));
-
-        stats.block_read_count = blocks.len().try_into().unwrap();
+        ui::println("Check blocks...");
         let mut progress_bar = ProgressBar::new();
         progress_bar.set_phase("Check block hashes");
-        progress_bar.set_total_work(blocks.len());
-        progress_bar.set_work_done(0);
         let pb_mutex = Mutex::new(progress_bar);
-        // Make a vec of Some(usize) if the block could be read, or None if it
-        // failed, where the usize gives the uncompressed data size.
-        let results: Vec<Option<(BlockHash, usize)>> = blocks
+        let mut lens = BlockLenSorter::new();
+        for chunk in &self.block_names()?.chunks(VALIDATE_BATCH_BLOCKS) {
+            for (hash, sizes) in self.check_blocks(chunk.collect(), stats, &pb_mutex) {
+                lens.push(hash, sizes.uncompressed)?;
+            }
+        }
+        lens.finish()
+    }
+
+    /// Read and check the hash of each of the given blocks.
+    ///
+    /// Return the sizes of those that could be read and have the right content.
+    pub(crate) fn check_blocks(
+        &self,
+        blocks: Vec<BlockHash>,
+        stats: &mut ValidateStats,
+        pb_mutex: &Mutex<ProgressBar>,
+    ) -> Vec<(BlockHash, Sizes)> {
+        stats.block_read_count += blocks.len() as u64;
+        // Make a vec of Some if the block could be read, or None if it failed.
+        let results: Vec<Option<(BlockHash, Sizes)>> = blocks
             .into_par_iter()
-            // .into_iter()
             .map(|hash| {
                 let r = self
-                    .get_block_content(&hash)
-                    .map(|(bytes, _sizes)| (hash, bytes.len()))
+                    .locate(&hash)
+                    .and_then(|location| {
+                        let (content, sizes) = BlockReader::with(|reader| {
+                            reader.read(self.transport.as_ref(), &hash, &location)
+                        })?;
+                        let checked = check_hash(self.hash_algorithm, &hash, &location, &content);
+                        BlockReader::with(|reader| reader.recycle(content));
+                        checked.map(|()| sizes)
+                    })
+                    .map(|sizes| (hash, sizes))
                     .ok();
                 let mut pbl = pb_mutex.lock().unwrap();
                 pbl.increment_work_done(1);
                 if let Some(ref t) = r {
-                    pbl.increment_bytes_done(t.1 as u64);
+                    pbl.increment_bytes_done(t.1.uncompressed);
                 }
                 r
             })
             .collect();
         stats.block_error_count += results.iter().filter(|o| o.is_none()).count();
-        let len_map: HashMap<BlockHash, usize> = results
+        results
             .into_iter()
             .flatten() // keep only Some values
-            .collect();
-        Ok(len_map)
+            .collect()
     }
 
     /// Return the entire contents of the block.
     ///
     /// Checks that the hash is correct with the contents.
     pub fn get_block_content(&self, hash: &BlockHash) -> Result<(Vec<u8>, Sizes)> {
-        // TODO: Reuse decompressor buffer.
-        // TODO: Reuse read buffer.
-        let mut decompressor = Decompressor::new();
-        let mut compressed_bytes = Vec::new();
-        let block_relpath = block_relpath(hash);
-        self.transport
-            .read_file(&block_relpath, &mut compressed_bytes)
-            .map_err(|source| Error::ReadBlock {
-                source,
-                hash: hash.to_string(),
-            })?;
-        let decompressed_bytes = decompressor.decompress(&compressed_bytes)?;
-        let actual_hash = BlockHash::from(blake2b::blake2b(
-            BLAKE_HASH_SIZE_BYTES,
-            &[],
-            &decompressed_bytes,
-        ));
-        if actual_hash != *hash {
-            ui::problem(&format!(
-                "Block file {:?} has actual decompressed hash {}",
-                &block_relpath, actual_hash
-            ));
-            return Err(Error::BlockCorrupt {
-                hash: hash.to_string(),
-                actual_hash: actual_hash.to_string(),
-            });
-        }
-        let sizes = Sizes {
-            uncompressed: decompressed_bytes.len() as u64,
-            compressed: compressed_bytes.len() as u64,
-        };
-        Ok((decompressor.take_buffer(), sizes))
+        let location = self.locate(hash)?;
+        let (content, sizes) =
+            BlockReader::with(|reader| reader.read(self.transport.as_ref(), hash, &location))?;
+        check_hash(self.hash_algorithm, hash, &location, &content)?;
+        Ok((content, sizes))
     }
 
-    fn hash_bytes(&self, in_buf: &[u8]) -> BlockHash {
-        let mut hasher = Blake2b::new(BLAKE_HASH_SIZE_BYTES);
-        hasher.update(in_buf);
-        BlockHash::from(hasher.finalize())
+    pub(crate) fn hash_bytes(&self, in_buf: &[u8]) -> BlockHash {
+        let mut timer = Timer::start(Phase::HashBlock);
+        timer.add_bytes(in_buf.len() as u64);
+        self.hash_algorithm.hash(in_buf)
     }
 }
@@ -0,0 +1,218 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Reusable buffers for reading and writing blocks, and shared slices of block content.
+//!
+//! BlockDir methods take `&self` so that many threads can read and write blocks at
+//! once, so each thread keeps one reader and one writer, reused for every block it
+//! handles. Each holds at most about two blocks' worth of memory.
+
+use std::cell::RefCell;
+use std::ops::Deref;
+use std::sync::Arc;
+
+use super::BlockLocation;
+use crate::blockhash::HashAlgorithm;
+use crate::compress::{Compression, Compressor, Decompressor};
+use crate::metrics::{Phase, Timer};
+use crate::stats::Sizes;
+use crate::transport::Transport;
+use crate::*;
+
+thread_local! {
+    static READER: RefCell<BlockReader> = RefCell::new(BlockReader::new());
+    static WRITER: RefCell<BlockWriter> = RefCell::new(BlockWriter::new());
+}
+
+/// Holds buffers for the compressed and decompressed content of blocks being read.
+pub(super) struct BlockReader {
+    compressed: Vec<u8>,
+    decompressor: Decompressor,
+}
+
+impl BlockReader {
+    fn new() -> BlockReader {
+        BlockReader {
+            compressed: Vec::new(),
+            decompressor: Decompressor::new(),
+        }
+    }
+
+    /// Run `f` with this thread's reader.
+    ///
+    /// `f` must not hash the content, or do anything else that can wait on rayon: a
+    /// thread waiting in rayon runs other queued jobs, which may read blocks too and so
+    /// borrow the reader again.
+    pub fn with<R, F: FnOnce(&mut BlockReader) -> R>(f: F) -> R {
+        READER.with(|reader| f(&mut reader.borrow_mut()))
+    }
+
+    /// Read and decompress a block.
+    ///
+    /// The decompressed buffer is moved out of the reader, rather than copied. The caller
+    /// should check it with `check_hash` once the reader is released, and can give it
+    /// back with `recycle` if it's not kept.
+    pub fn read(
+        &mut self,
+        transport: &dyn Transport,
+        hash: &BlockHash,
+        location: &BlockLocation,
+    ) -> Result<(Vec<u8>, Sizes)> {
+        let read_result = match location {
+            BlockLocation::File(relpath) => transport.read_file(relpath, &mut self.compressed),
+            BlockLocation::Packed {
+                relpath,
+                offset,
+                len,
+            } => transport.read_range(relpath, *offset, *len, &mut self.compressed),
+        };
+        read_result.map_err(|source| Error::ReadBlock {
+            source,
+            hash: hash.to_string(),
+        })?;
+        let mut timer = Timer::start(Phase::DecompressBlock);
+        self.decompressor.decompress(&self.compressed)?;
+        let decompressed_bytes = self.decompressor.take_output();
+        timer.add_bytes(decompressed_bytes.len() as u64);
+        drop(timer);
+        let sizes = Sizes {
+            uncompressed: decompressed_bytes.len() as u64,
+            compressed: self.compressed.len() as u64,
+        };
+        Ok((decompressed_bytes, sizes))
+    }
+
+    /// Reuse a buffer returned by `read` for a later read.
+    pub fn recycle(&mut self, buf: Vec<u8>) {
+        self.decompressor.recycle(buf)
+    }
+}
+
+/// Check that the decompressed content of a block read from `location` has the
+/// expected hash.
+pub(super) fn check_hash(
+    hash_algorithm: HashAlgorithm,
+    hash: &BlockHash,
+    location: &BlockLocation,
+    content: &[u8],
+) -> Result<()> {
+    let mut timer = Timer::start(Phase::HashBlock);
+    timer.add_bytes(content.len() as u64);
+    let actual_hash = hash_algorithm.hash(content);
+    drop(timer);
+    if actual_hash != *hash {
+        ui::problem(&format!(
+            "Block {} in {:?} has actual decompressed hash {}",
+            hash,
+            location.relpath(),
+            actual_hash
+        ));
+        return Err(Error::BlockCorrupt {
+            hash: hash.to_string(),
+            actual_hash: actual_hash.to_string(),
+        });
+    }
+    Ok(())
+}
+
+/// Holds a compressor, and its output buffer, for blocks being written.
+pub(super) struct BlockWriter {
+    compressor: Compressor,
+}
+
+impl BlockWriter {
+    fn new() -> BlockWriter {
+        BlockWriter {
+            compressor: Compressor::new(),
+        }
+    }
+
+    /// Run `f` with this thread's writer.
+    pub fn with<R, F: FnOnce(&mut BlockWriter) -> R>(f: F) -> R {
+        WRITER.with(|writer| f(&mut writer.borrow_mut()))
+    }
+
+    /// Compress a block, returning a slice valid until the next call.
+    pub fn compress(&mut self, compression: Compression, input: &[u8]) -> Result<&[u8]> {
+        let mut timer = Timer::start(Phase::CompressBlock);
+        timer.add_bytes(input.len() as u64);
+        self.compressor.set_compression(compression);
+        self.compressor.compress(input)
+    }
+}
+
+/// A range of the content of a decompressed block, shared rather than copied.
+///
+/// Several slices, such as the files in a combined block, can share one cached block.
+#[derive(Clone, Debug, Default)]
+pub struct BlockSlice {
+    content: Arc<Vec<u8>>,
+    start: usize,
+    len: usize,
+}
+
+impl BlockSlice {
+    /// Make a slice, which must be within the content.
+    pub(super) fn new(content: Arc<Vec<u8>>, start: usize, len: usize) -> BlockSlice {
+        assert!(start + len <= content.len());
+        BlockSlice {
+            content,
+            start,
+            len,
+        }
+    }
+
+    /// Return the content as a vec, without copying if it's a prefix of a block
+    /// that's not shared.
+    pub fn into_vec(self) -> Vec<u8> {
+        let BlockSlice {
+            content,
+            start,
+            len,
+        } = self;
+        match Arc::try_unwrap(content) {
+            Ok(mut content) if start == 0 => {
+                content.truncate(len);
+                content
+            }
+            Ok(content) => content[start..(start + len)].to_vec(),
+            Err(shared) => shared[start..(start + len)].to_vec(),
+        }
+    }
+}
+
+impl Deref for BlockSlice {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.content[self.start..(self.start + self.len)]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn block_slice_ranges() {
+        let content = Arc::new(b"hello world".to_vec());
+        let world = BlockSlice::new(Arc::clone(&content), 6, 5);
+        assert_eq!(&*world, b"world");
+        assert_eq!(world.clone().into_vec(), b"world");
+        let hello = BlockSlice::new(content, 0, 5);
+        drop(world);
+        // Now unshared, so the buffer is reused.
+        assert_eq!(hello.into_vec(), b"hello");
+        assert!(BlockSlice::default().is_empty());
+    }
+}
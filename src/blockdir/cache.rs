@@ -0,0 +1,196 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! A bounded least-recently-used cache of decompressed, hash-checked blocks.
+//!
+//! Many small files are packed into each combined block, so restoring or diffing them
+//! would otherwise read, decompress and hash the same block once per file.
+
+use std::collections::{BTreeMap, HashMap};
+use std::fmt;
+use std::sync::Arc;
+
+use crate::stats::Sizes;
+use crate::BlockHash;
+
+/// By default, hold up to this many bytes of decompressed blocks.
+pub const DEFAULT_BLOCK_CACHE_BYTES: u64 = 64 << 20;
+
+struct CachedBlock {
+    content: Arc<Vec<u8>>,
+    sizes: Sizes,
+    /// Value of `BlockCache::clock` when this was last used.
+    last_used: u64,
+}
+
+pub(super) struct BlockCache {
+    blocks: HashMap<BlockHash, CachedBlock>,
+    /// Hashes of cached blocks, by when they were last used.
+    by_last_used: BTreeMap<u64, BlockHash>,
+    /// Incremented on every use.
+    clock: u64,
+    /// Total uncompressed size of cached blocks.
+    total_bytes: u64,
+    limit_bytes: u64,
+    pub hits: u64,
+    /// Reads of blocks that could have been cached, counted by the caller, since many
+    /// lookups are for blocks that are never cached.
+    pub misses: u64,
+}
+
+impl fmt::Debug for BlockCache {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("BlockCache")
+            .field("blocks", &self.blocks.len())
+            .field("total_bytes", &self.total_bytes)
+            .field("limit_bytes", &self.limit_bytes)
+            .finish()
+    }
+}
+
+impl BlockCache {
+    pub fn new(limit_bytes: u64) -> BlockCache {
+        BlockCache {
+            blocks: HashMap::new(),
+            by_last_used: BTreeMap::new(),
+            clock: 0,
+            total_bytes: 0,
+            limit_bytes,
+            hits: 0,
+            misses: 0,
+        }
+    }
+
+    /// Return a block if it's cached, marking it as recently used, and count a hit.
+    pub fn get(&mut self, hash: &BlockHash) -> Option<(Arc<Vec<u8>>, Sizes)> {
+        self.clock += 1;
+        let clock = self.clock;
+        if let Some(cached) = self.blocks.get_mut(hash) {
+            self.hits += 1;
+            self.by_last_used.remove(&cached.last_used);
+            self.by_last_used.insert(clock, hash.clone());
+            cached.last_used = clock;
+            Some((Arc::clone(&cached.content), cached.sizes))
+        } else {
+            None
+        }
+    }
+
+    /// Add a block, evicting the least recently used blocks if that's over the limit.
+    ///
+    /// Blocks bigger than the whole limit are not cached.
+    pub fn insert(&mut self, hash: &BlockHash, content: Arc<Vec<u8>>, sizes: Sizes) {
+        let len = content.len() as u64;
+        if len > self.limit_bytes || self.blocks.contains_key(hash) {
+            return;
+        }
+        self.clock += 1;
+        self.total_bytes += len;
+        self.by_last_used.insert(self.clock, hash.clone());
+        self.blocks.insert(
+            hash.clone(),
+            CachedBlock {
+                content,
+                sizes,
+                last_used: self.clock,
+            },
+        );
+        self.evict();
+    }
+
+    pub fn limit_bytes(&self) -> u64 {
+        self.limit_bytes
+    }
+
+    pub fn set_limit(&mut self, limit_bytes: u64) {
+        self.limit_bytes = limit_bytes;
+        self.evict();
+    }
+
+    fn evict(&mut self) {
+        while self.total_bytes > self.limit_bytes {
+            let oldest = *self
+                .by_last_used
+                .keys()
+                .next()
+                .expect("cache is over its limit but empty");
+            let hash = self.by_last_used.remove(&oldest).unwrap();
+            let evicted = self.blocks.remove(&hash).unwrap();
+            self.total_bytes -= evicted.content.len() as u64;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::BLAKE_HASH_SIZE_BYTES;
+
+    fn block(i: u8, len: usize) -> (BlockHash, Arc<Vec<u8>>, Sizes) {
+        let sizes = Sizes {
+            compressed: len as u64 / 2,
+            uncompressed: len as u64,
+        };
+        (
+            BlockHash::from_bytes(&[i; BLAKE_HASH_SIZE_BYTES]),
+            Arc::new(vec![i; len]),
+            sizes,
+        )
+    }
+
+    #[test]
+    fn evicts_least_recently_used() {
+        let mut cache = BlockCache::new(300);
+        let (h1, c1, s1) = block(1, 100);
+        let (h2, c2, s2) = block(2, 100);
+        let (h3, c3, s3) = block(3, 100);
+        let (h4, c4, s4) = block(4, 100);
+        cache.insert(&h1, c1, s1);
+        cache.insert(&h2, c2, s2);
+        cache.insert(&h3, c3, s3);
+        assert_eq!(cache.get(&h1).unwrap().1, s1);
+        cache.insert(&h4, c4, s4);
+        // 2 was used least recently.
+        assert!(cache.get(&h2).is_none());
+        assert!(cache.get(&h1).is_some());
+        assert!(cache.get(&h3).is_some());
+        assert_eq!(cache.get(&h4).unwrap().0[0], 4);
+        assert_eq!(cache.hits, 4);
+        // Misses are only counted by the caller.
+        assert_eq!(cache.misses, 0);
+        assert_eq!(cache.total_bytes, 300);
+    }
+
+    #[test]
+    fn oversized_blocks_are_not_cached() {
+        let mut cache = BlockCache::new(50);
+        let (h1, c1, s1) = block(1, 100);
+        cache.insert(&h1, c1, s1);
+        assert!(cache.get(&h1).is_none());
+        assert_eq!(cache.total_bytes, 0);
+    }
+
+    #[test]
+    fn lowering_limit_evicts() {
+        let mut cache = BlockCache::new(300);
+        let (h1, c1, s1) = block(1, 100);
+        let (h2, c2, s2) = block(2, 100);
+        cache.insert(&h1, c1, s1);
+        cache.insert(&h2, c2, s2);
+        cache.set_limit(100);
+        assert!(cache.get(&h1).is_none());
+        assert!(cache.get(&h2).is_some());
+        cache.set_limit(0);
+        assert!(cache.get(&h2).is_none());
+    }
+}
@@ -0,0 +1,357 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Pack files, which hold many compressed blocks in one transport file.
+//!
+//! Each pack `pack/NAME.pack` is the concatenation of some blocks, each exactly as it
+//! would be stored in its own block file. Its index `pack/NAME.idx` lists the hash,
+//! offset and length of each block. The pack is written before its index, so a pack
+//! is only used once its index exists.
+//!
+//! The name is the hex BLAKE2b hash of the index, so packs never collide.
+
+use std::collections::{HashMap, HashSet};
+use std::convert::TryInto;
+use std::io;
+
+use blake2_rfc::blake2b;
+
+use crate::transport::Transport;
+use crate::*;
+
+/// Subdirectory of the block dir holding packs.
+pub(super) const PACK_DIR: &str = "pack";
+
+const PACK_SUFFIX: &str = ".pack";
+const INDEX_SUFFIX: &str = ".idx";
+
+/// Finish a pack once it holds this many compressed bytes.
+pub(super) const PACK_TARGET_BYTES: usize = 32 << 20;
+
+const INDEX_MAGIC: &[u8] = b"CPAK";
+const INDEX_FORMAT_VERSION: u8 = 1;
+/// Each index record is the binary hash followed by the offset and length of the
+/// compressed block as little-endian u64s.
+const INDEX_RECORD_LEN: usize = BLAKE_HASH_SIZE_BYTES + 2 * 8;
+
+/// Where a block is within a pack.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub(super) struct PackedBlock {
+    /// Position of the pack in `PackIndex::packs`.
+    pub pack: usize,
+    pub offset: u64,
+    pub len: u64,
+}
+
+/// The blocks in one pack, as (hash, offset, len).
+#[derive(Debug)]
+pub(super) struct Pack {
+    pub name: String,
+    pub blocks: Vec<(BlockHash, u64, u64)>,
+}
+
+/// The contents of all the packs in a block dir.
+#[derive(Debug, Default)]
+pub(super) struct PackIndex {
+    /// Packs by number; None for those that have been deleted.
+    packs: Vec<Option<Pack>>,
+    blocks: HashMap<BlockHash, PackedBlock>,
+    /// Names of packs that have no index, perhaps because writing them was interrupted.
+    pub orphans: Vec<String>,
+}
+
+impl PackIndex {
+    /// Read the indexes of all packs.
+    ///
+    /// Packs with undecodable indexes are reported as problems and otherwise ignored.
+    pub fn load(transport: &dyn Transport) -> Result<PackIndex> {
+        let mut index = PackIndex::default();
+        let files = match transport.list_dir_names(PACK_DIR) {
+            Ok(names) => names.files,
+            Err(err) if err.kind() == io::ErrorKind::NotFound => return Ok(index),
+            Err(source) => return Err(Error::ListBlocks { source }),
+        };
+        let names: Vec<&str> = files
+            .iter()
+            .filter_map(|file| file.strip_suffix(INDEX_SUFFIX))
+            .collect();
+        let index_paths: Vec<String> = names.iter().map(|name| index_relpath(name)).collect();
+        for (name, content) in names.iter().zip(transport.read_many(&index_paths)) {
+            let content = content.map_err(|source| Error::ListBlocks { source })?;
+            match decode_index(&content) {
+                Some(blocks) => index.add(Pack {
+                    name: (*name).to_owned(),
+                    blocks,
+                }),
+                None => ui::problem(&format!(
+                    "Can't decode pack index {:?}",
+                    index_relpath(name)
+                )),
+            }
+        }
+        let indexed: HashSet<&str> = names.into_iter().collect();
+        index.orphans = files
+            .iter()
+            .filter_map(|file| file.strip_suffix(PACK_SUFFIX))
+            .filter(|name| !indexed.contains(name))
+            .map(str::to_owned)
+            .collect();
+        Ok(index)
+    }
+
+    pub fn get(&self, hash: &BlockHash) -> Option<PackedBlock> {
+        self.blocks.get(hash).copied()
+    }
+
+    pub fn contains(&self, hash: &BlockHash) -> bool {
+        self.blocks.contains_key(hash)
+    }
+
+    pub fn len(&self) -> usize {
+        self.blocks.len()
+    }
+
+    pub fn hashes(&self) -> impl Iterator<Item = &BlockHash> {
+        self.blocks.keys()
+    }
+
+    pub fn pack_relpath(&self, pack: usize) -> String {
+        pack_relpath(&self.packs[pack].as_ref().expect("pack was deleted").name)
+    }
+
+    /// Return the numbers and contents of all packs.
+    pub fn packs(&self) -> impl Iterator<Item = (usize, &Pack)> {
+        self.packs
+            .iter()
+            .enumerate()
+            .filter_map(|(i, pack)| pack.as_ref().map(|pack| (i, pack)))
+    }
+
+    pub fn add(&mut self, pack: Pack) {
+        let pack_number = self.packs.len();
+        for (hash, offset, len) in &pack.blocks {
+            self.blocks.insert(
+                hash.clone(),
+                PackedBlock {
+                    pack: pack_number,
+                    offset: *offset,
+                    len: *len,
+                },
+            );
+        }
+        self.packs.push(Some(pack));
+    }
+
+    /// Forget a pack, and the blocks found in it.
+    ///
+    /// If some of those blocks are also in other packs, they're found
+    /// again by `rebuild`.
+    pub fn remove(&mut self, pack_number: usize) {
+        if let Some(pack) = self.packs[pack_number].take() {
+            for (hash, _, _) in &pack.blocks {
+                if self.blocks.get(hash).map(|packed| packed.pack) == Some(pack_number) {
+                    self.blocks.remove(hash);
+                }
+            }
+        }
+    }
+
+    /// Rebuild the map of blocks from the remaining packs.
+    pub fn rebuild(&mut self) {
+        let packs = std::mem::take(&mut self.packs);
+        self.blocks.clear();
+        for pack in packs {
+            match pack {
+                Some(pack) => self.add(pack),
+                None => self.packs.push(None),
+            }
+        }
+    }
+}
+
+/// Blocks waiting to be written into a new pack.
+#[derive(Debug, Default)]
+pub(super) struct PackWriter {
+    content: Vec<u8>,
+    blocks: Vec<(BlockHash, u64, u64)>,
+    hashes: HashSet<BlockHash>,
+}
+
+impl PackWriter {
+    /// Add a compressed block, unless it's already in this pack.
+    pub fn add(&mut self, hash: &BlockHash, compressed: &[u8]) {
+        if self.hashes.insert(hash.clone()) {
+            self.blocks.push((
+                hash.clone(),
+                self.content.len() as u64,
+                compressed.len() as u64,
+            ));
+            self.content.extend_from_slice(compressed);
+        }
+    }
+
+    pub fn contains(&self, hash: &BlockHash) -> bool {
+        self.hashes.contains(hash)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.blocks.is_empty()
+    }
+
+    /// Total compressed size of blocks in the pack so far.
+    pub fn content_len(&self) -> usize {
+        self.content.len()
+    }
+
+    /// Write the pack and then its index, and return what it contains.
+    pub fn write(self, transport: &dyn Transport) -> Result<Pack> {
+        let index_bytes = encode_index(&self.blocks);
+        let name =
+            hex::encode(blake2b::blake2b(BLAKE_HASH_SIZE_BYTES / 2, &[], &index_bytes).as_bytes());
+        let write_error = |source| Error::WritePack {
+            name: name.clone(),
+            source,
+        };
+        transport.create_dir(PACK_DIR).map_err(write_error)?;
+        transport
+            .write_file(&pack_relpath(&name), &self.content)
+            .map_err(write_error)?;
+        transport
+            .write_file(&index_relpath(&name), &index_bytes)
+            .map_err(write_error)?;
+        Ok(Pack {
+            name,
+            blocks: self.blocks,
+        })
+    }
+}
+
+/// Delete a pack's index, and then the pack.
+pub(super) fn delete_pack(transport: &dyn Transport, name: &str) -> io::Result<()> {
+    transport.remove_file(&index_relpath(name))?;
+    transport.remove_file(&pack_relpath(name))
+}
+
+/// Delete a pack that has no index.
+pub(super) fn delete_orphan(transport: &dyn Transport, name: &str) -> io::Result<()> {
+    transport.remove_file(&pack_relpath(name))
+}
+
+pub(super) fn pack_relpath(name: &str) -> String {
+    format!("{}/{}{}", PACK_DIR, name, PACK_SUFFIX)
+}
+
+fn index_relpath(name: &str) -> String {
+    format!("{}/{}{}", PACK_DIR, name, INDEX_SUFFIX)
+}
+
+fn encode_index(blocks: &[(BlockHash, u64, u64)]) -> Vec<u8> {
+    let mut buf = Vec::with_capacity(INDEX_MAGIC.len() + 1 + blocks.len() * INDEX_RECORD_LEN);
+    buf.extend_from_slice(INDEX_MAGIC);
+    buf.push(INDEX_FORMAT_VERSION);
+    for (hash, offset, len) in blocks {
+        buf.extend_from_slice(hash.as_bytes());
+        buf.extend_from_slice(&offset.to_le_bytes());
+        buf.extend_from_slice(&len.to_le_bytes());
+    }
+    buf
+}
+
+fn decode_index(buf: &[u8]) -> Option<Vec<(BlockHash, u64, u64)>> {
+    let header_len = INDEX_MAGIC.len() + 1;
+    if buf.len() < header_len
+        || &buf[..INDEX_MAGIC.len()] != INDEX_MAGIC
+        || buf[INDEX_MAGIC.len()] != INDEX_FORMAT_VERSION
+        || (buf.len() - header_len) % INDEX_RECORD_LEN != 0
+    {
+        return None;
+    }
+    let u64_at = |r: &[u8], i: usize| {
+        let start = BLAKE_HASH_SIZE_BYTES + i * 8;
+        u64::from_le_bytes(r[start..(start + 8)].try_into().unwrap())
+    };
+    Some(
+        buf[header_len..]
+            .chunks_exact(INDEX_RECORD_LEN)
+            .map(|r| {
+                (
+                    BlockHash::from_bytes(&r[..BLAKE_HASH_SIZE_BYTES]),
+                    u64_at(r, 0),
+                    u64_at(r, 1),
+                )
+            })
+            .collect(),
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::transport::local::LocalTransport;
+
+    fn hash(i: u8) -> BlockHash {
+        BlockHash::from_bytes(&[i; BLAKE_HASH_SIZE_BYTES])
+    }
+
+    #[test]
+    fn write_and_load_packs() {
+        let temp = tempfile::tempdir().unwrap();
+        let transport = LocalTransport::new(temp.path());
+        assert_eq!(PackIndex::load(&transport).unwrap().len(), 0);
+
+        let mut writer = PackWriter::default();
+        writer.add(&hash(1), b"one");
+        writer.add(&hash(2), b"two!");
+        writer.add(&hash(1), b"one");
+        assert!(writer.contains(&hash(2)));
+        assert_eq!(writer.content_len(), 7);
+        let pack = writer.write(&transport).unwrap();
+        assert_eq!(pack.blocks.len(), 2);
+
+        let mut index = PackIndex::load(&transport).unwrap();
+        assert_eq!(index.len(), 2);
+        assert!(index.orphans.is_empty());
+        let packed = index.get(&hash(2)).unwrap();
+        assert_eq!((packed.offset, packed.len), (3, 4));
+        let mut content = Vec::new();
+        transport
+            .read_file(&index.pack_relpath(packed.pack), &mut content)
+            .unwrap();
+        assert_eq!(content, b"onetwo!");
+
+        index.remove(packed.pack);
+        assert!(!index.contains(&hash(1)));
+        delete_pack(&transport, &pack.name).unwrap();
+        assert_eq!(PackIndex::load(&transport).unwrap().len(), 0);
+    }
+
+    #[test]
+    fn pack_without_index_is_orphan() {
+        let temp = tempfile::tempdir().unwrap();
+        let transport = LocalTransport::new(temp.path());
+        transport.create_dir(PACK_DIR).unwrap();
+        transport
+            .write_file(&pack_relpath("abcd"), b"interrupted")
+            .unwrap();
+        let index = PackIndex::load(&transport).unwrap();
+        assert_eq!(index.len(), 0);
+        assert_eq!(index.orphans, ["abcd"]);
+    }
+
+    #[test]
+    fn undecodable_index() {
+        assert!(decode_index(b"CPAK").is_none());
+        assert!(decode_index(b"CPAK\x01short").is_none());
+        assert!(decode_index(b"CPAK\x01").unwrap().is_empty());
+    }
+}
@@ -20,11 +20,85 @@ use std::fmt::{Debug, Display};
 use std::hash::{Hash, Hasher};
 use std::str::FromStr;
 
-use blake2_rfc::blake2b::Blake2bResult;
+use blake2_rfc::blake2b::{Blake2b, Blake2bResult};
 use serde::{Deserialize, Serialize};
 
 use crate::*;
 
+/// Hash very large blocks of BLAKE3 input on several threads; under this, one thread
+/// is faster.
+const BLAKE3_PARALLEL_BYTES: usize = 128 << 10;
+
+/// The algorithm used to hash the content of blocks, recorded in the archive header.
+///
+/// Both give hashes of `BLAKE_HASH_SIZE_BYTES`, so blocks are named and indexed the
+/// same way whichever is used.
+#[derive(Debug, Clone, Copy, Eq, PartialEq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum HashAlgorithm {
+    /// BLAKE2b-512, readable by all versions of Conserve.
+    Blake2b,
+    /// BLAKE3 with 512 bits of extended output, which is faster and uses SIMD and
+    /// multiple threads for large blocks: readable by Conserve 0.6.15 and later.
+    Blake3,
+}
+
+impl HashAlgorithm {
+    /// Hash some content.
+    pub fn hash(self, content: &[u8]) -> BlockHash {
+        match self {
+            HashAlgorithm::Blake2b => {
+                let mut hasher = Blake2b::new(BLAKE_HASH_SIZE_BYTES);
+                hasher.update(content);
+                BlockHash::from(hasher.finalize())
+            }
+            HashAlgorithm::Blake3 => {
+                let mut hasher = blake3::Hasher::new();
+                if content.len() >= BLAKE3_PARALLEL_BYTES {
+                    hasher.update_rayon(content);
+                } else {
+                    hasher.update(content);
+                }
+                let mut bin = [0; BLAKE_HASH_SIZE_BYTES];
+                hasher.finalize_xof().fill(&mut bin);
+                BlockHash { bin }
+            }
+        }
+    }
+
+    pub(crate) fn is_default(&self) -> bool {
+        *self == HashAlgorithm::default()
+    }
+}
+
+impl Default for HashAlgorithm {
+    fn default() -> HashAlgorithm {
+        HashAlgorithm::Blake2b
+    }
+}
+
+impl FromStr for HashAlgorithm {
+    type Err = String;
+
+    /// Parse `blake2b` or `blake3`.
+    fn from_str(s: &str) -> std::result::Result<HashAlgorithm, String> {
+        match s {
+            "blake2b" => Ok(HashAlgorithm::Blake2b),
+            "blake3" => Ok(HashAlgorithm::Blake3),
+            _ => Err(format!("Unknown hash algorithm {:?}", s)),
+        }
+    }
+}
+
+impl Display for HashAlgorithm {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            HashAlgorithm::Blake2b => write!(f, "blake2b"),
+            HashAlgorithm::Blake3 => write!(f, "blake3"),
+        }
+    }
+}
+
 /// The hash of a block of body data.
 ///
 /// Stored in memory as compact bytes, but translatable to and from
@@ -48,6 +122,30 @@ impl Display for BlockHashParseError {
     }
 }
 
+impl BlockHash {
+    /// The first 64 bits of the hash, as a compact key that is very probably, but not
+    /// certainly, unique.
+    pub(crate) fn prefix_u64(&self) -> u64 {
+        let mut prefix = [0u8; 8];
+        prefix.copy_from_slice(&self.bin[..8]);
+        u64::from_be_bytes(prefix)
+    }
+
+    /// The binary form of the hash.
+    pub(crate) fn as_bytes(&self) -> &[u8] {
+        &self.bin
+    }
+
+    /// Construct from the binary form of a hash.
+    ///
+    /// Panics if `bytes` is not exactly `BLAKE_HASH_SIZE_BYTES` long.
+    pub(crate) fn from_bytes(bytes: &[u8]) -> BlockHash {
+        let mut bin = [0; BLAKE_HASH_SIZE_BYTES];
+        bin.copy_from_slice(bytes);
+        BlockHash { bin }
+    }
+}
+
 impl FromStr for BlockHash {
     type Err = BlockHashParseError;
 
@@ -125,3 +223,41 @@ impl Hash for BlockHash {
         self.bin.hash(state);
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn blake3_hash_extends_standard_output() {
+        // The first 32 bytes of the extended output are the standard BLAKE3 hash.
+        let hash = HashAlgorithm::Blake3.hash(b"");
+        assert_eq!(
+            hex::encode(&hash.as_bytes()[..32]),
+            "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"
+        );
+        assert_ne!(hash, HashAlgorithm::Blake2b.hash(b""));
+    }
+
+    #[test]
+    fn blake3_parallel_hash_matches() {
+        let content: Vec<u8> = (0..(1 << 20)).map(|i: u32| (i % 251) as u8).collect();
+        let hash = HashAlgorithm::Blake3.hash(&content);
+        assert_eq!(
+            &hash.as_bytes()[..32],
+            blake3::hash(&content).as_bytes().as_ref()
+        );
+    }
+
+    #[test]
+    fn parse_and_display_hash_algorithm() {
+        for algorithm in &[HashAlgorithm::Blake2b, HashAlgorithm::Blake3] {
+            assert_eq!(
+                algorithm.to_string().parse::<HashAlgorithm>().unwrap(),
+                *algorithm
+            );
+        }
+        assert!("md5".parse::<HashAlgorithm>().is_err());
+        assert_eq!(HashAlgorithm::default(), HashAlgorithm::Blake2b);
+    }
+}
@@ -0,0 +1,259 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Split the content of large files into blocks.
+//!
+//! By default files are cut at fixed multiples of `MAX_BLOCK_SIZE`. That's cheap, but
+//! inserting or deleting a single byte shifts all the following block boundaries, so none
+//! of the later blocks match those already stored.
+//!
+//! Content-defined chunking instead chooses cut points from a rolling hash of the last few
+//! dozen bytes, in the style of FastCDC. An edit only changes the blocks around it and the
+//! boundaries then resynchronize, so the rest of the file is deduplicated.
+
+use std::io;
+use std::io::prelude::*;
+
+use lazy_static::lazy_static;
+use serde::{Deserialize, Serialize};
+
+use crate::io::read_with_retries;
+use crate::MAX_BLOCK_SIZE;
+
+/// Sizes used for content-defined chunking, in bytes.
+///
+/// These are recorded in the head of bands that were written with them.
+#[derive(Debug, Clone, Copy, Eq, PartialEq, Serialize, Deserialize)]
+pub struct ContentChunking {
+    /// No cut is made less than this far into a chunk, except at the end of the file.
+    pub min_size: usize,
+    /// The target average chunk size.
+    pub avg_size: usize,
+    /// Chunks are always cut at this size. Must be no more than `MAX_BLOCK_SIZE`.
+    pub max_size: usize,
+}
+
+impl Default for ContentChunking {
+    fn default() -> ContentChunking {
+        ContentChunking {
+            min_size: 128 << 10,
+            avg_size: 512 << 10,
+            max_size: MAX_BLOCK_SIZE,
+        }
+    }
+}
+
+lazy_static! {
+    /// Random values for each byte, mixed into the rolling "gear" hash.
+    ///
+    /// These are generated deterministically, and must never change, or chunk boundaries
+    /// would move and new backups would no longer deduplicate against old ones.
+    static ref GEAR: [u64; 256] = {
+        let mut table = [0u64; 256];
+        // splitmix64
+        let mut state: u64 = 0x2545_f491_4f6c_dd1d;
+        for t in table.iter_mut() {
+            state = state.wrapping_add(0x9e37_79b9_7f4a_7c15);
+            let mut z = state;
+            z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+            z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+            *t = z ^ (z >> 31);
+        }
+        table
+    };
+}
+
+/// A mask selecting the top `bits` bits of a u64, which depend on the most bytes in the
+/// gear hash.
+fn top_bits_mask(bits: u32) -> u64 {
+    if bits == 0 {
+        0
+    } else {
+        !0u64 << (64 - bits)
+    }
+}
+
+impl ContentChunking {
+    /// Return the length of the first chunk in `data`.
+    ///
+    /// `data` should be at least `max_size` bytes long, unless it's the end of the file.
+    ///
+    /// Following FastCDC's "normalized chunking", a harder condition is used before the
+    /// average size and an easier one after it, which narrows the distribution of sizes.
+    fn cut_point(&self, data: &[u8]) -> usize {
+        if data.len() <= self.min_size {
+            return data.len();
+        }
+        let max = data.len().min(self.max_size);
+        let normal = max.min(self.avg_size);
+        let bits = 63 - (self.avg_size as u64).leading_zeros();
+        let hard_mask = top_bits_mask(bits + 1);
+        let easy_mask = top_bits_mask(bits.saturating_sub(1));
+        let gear: &[u64; 256] = &GEAR;
+        let mut hash: u64 = 0;
+        let mut i = self.min_size;
+        while i < normal {
+            hash = (hash << 1).wrapping_add(gear[data[i] as usize]);
+            if hash & hard_mask == 0 {
+                return i + 1;
+            }
+            i += 1;
+        }
+        while i < max {
+            hash = (hash << 1).wrapping_add(gear[data[i] as usize]);
+            if hash & easy_mask == 0 {
+                return i + 1;
+            }
+            i += 1;
+        }
+        max
+    }
+}
+
+/// Reads a file and cuts it into blocks, either at fixed sizes or at content-defined
+/// boundaries.
+pub(crate) struct Chunker {
+    content_chunking: Option<ContentChunking>,
+    /// Data read from the file but not yet returned.
+    pending: Vec<u8>,
+    /// True once the end of the file has been seen.
+    eof: bool,
+}
+
+impl Chunker {
+    pub fn new(content_chunking: Option<ContentChunking>) -> Chunker {
+        if let Some(cc) = content_chunking {
+            assert!(
+                cc.min_size <= cc.avg_size
+                    && cc.avg_size <= cc.max_size
+                    && cc.max_size <= MAX_BLOCK_SIZE
+                    && cc.avg_size > 0,
+                "Invalid content chunking sizes {:?}",
+                cc
+            );
+        }
+        Chunker {
+            content_chunking,
+            pending: Vec::new(),
+            eof: false,
+        }
+    }
+
+    /// Return the next block of the file, or an empty vec at the end of the file.
+    pub fn next_chunk(&mut self, from_file: &mut dyn Read) -> io::Result<Vec<u8>> {
+        let cc = match self.content_chunking {
+            None => {
+                let mut buffer = Vec::new();
+                read_with_retries(&mut buffer, MAX_BLOCK_SIZE, from_file)?;
+                return Ok(buffer);
+            }
+            Some(cc) => cc,
+        };
+        if !self.eof && self.pending.len() < cc.max_size {
+            let want = cc.max_size - self.pending.len();
+            let mut more = Vec::new();
+            read_with_retries(&mut more, want, from_file)?;
+            if more.len() < want {
+                self.eof = true;
+            }
+            self.pending.extend_from_slice(&more);
+        }
+        let cut = cc.cut_point(&self.pending);
+        let rest = self.pending.split_off(cut);
+        Ok(std::mem::replace(&mut self.pending, rest))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashSet;
+
+    use super::*;
+
+    const SMALL: ContentChunking = ContentChunking {
+        min_size: 1 << 10,
+        avg_size: 4 << 10,
+        max_size: 16 << 10,
+    };
+
+    /// Deterministic pseudo-random bytes.
+    fn noise(len: usize) -> Vec<u8> {
+        let mut x: u32 = 12345;
+        (0..len)
+            .map(|_| {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                (x >> 24) as u8
+            })
+            .collect()
+    }
+
+    fn chunks(content_chunking: Option<ContentChunking>, data: &[u8]) -> Vec<Vec<u8>> {
+        let mut chunker = Chunker::new(content_chunking);
+        let mut from = data;
+        let mut chunks = Vec::new();
+        loop {
+            let chunk = chunker.next_chunk(&mut from).unwrap();
+            if chunk.is_empty() {
+                break;
+            }
+            chunks.push(chunk);
+        }
+        chunks
+    }
+
+    #[test]
+    fn fixed_chunks() {
+        let data = noise(MAX_BLOCK_SIZE * 2 + 10);
+        let chunks = chunks(None, &data);
+        assert_eq!(
+            chunks.iter().map(|c| c.len()).collect::<Vec<_>>(),
+            [MAX_BLOCK_SIZE, MAX_BLOCK_SIZE, 10]
+        );
+    }
+
+    #[test]
+    fn content_chunks_are_within_bounds() {
+        let data = noise(1 << 20);
+        let chunks = chunks(Some(SMALL), &data);
+        assert_eq!(chunks.concat(), data);
+        let (last, body) = chunks.split_last().unwrap();
+        assert!(last.len() <= SMALL.max_size);
+        for c in body {
+            assert!(c.len() >= SMALL.min_size && c.len() <= SMALL.max_size);
+        }
+        let avg = data.len() / chunks.len();
+        assert!(
+            avg > SMALL.min_size * 2 && avg < SMALL.max_size,
+            "avg={}",
+            avg
+        );
+    }
+
+    #[test]
+    fn insertion_only_changes_nearby_chunks() {
+        let data = noise(1 << 20);
+        let mut edited = data.clone();
+        edited.insert(100_000, b'x');
+        let before: HashSet<Vec<u8>> = chunks(Some(SMALL), &data).into_iter().collect();
+        let after = chunks(Some(SMALL), &edited);
+        let changed = after.iter().filter(|c| !before.contains(*c)).count();
+        assert!(
+            changed <= 3,
+            "{} of {} chunks changed",
+            changed,
+            after.len()
+        );
+    }
+}
@@ -1,4 +1,4 @@
-// Copyright 2017, 2019, 2020 Martin Pool.
+// Copyright 2017, 2019, 2020, 2021 Martin Pool.
 
 // This program is free software; you can redistribute it and/or modify
 // it under the terms of the GNU General Public License as published by
@@ -11,4 +11,330 @@
 // GNU General Public License for more details.
 
 //! Data compression algorithms.
+//!
+//! Snappy data is written without any header, as by all earlier versions. Data in
+//! other codecs starts with a header that can never begin valid Snappy data: a
+//! length varint too large for Snappy, then a codec byte, then the uncompressed
+//! length as a little-endian u32.
+
+use std::convert::{TryFrom, TryInto};
+use std::fmt;
+use std::str::FromStr;
+
+use serde::{Deserialize, Serialize};
+
+use crate::errors::Error;
+use crate::Result;
+
 pub mod snappy;
+
+/// Starts every block that's not in Snappy format.
+const TAG: [u8; 5] = [0xff, 0xff, 0xff, 0xff, 0x7f];
+const HEADER_LEN: usize = TAG.len() + 1 + 4;
+
+const CODEC_RAW: u8 = 1;
+const CODEC_ZSTD: u8 = 2;
+
+/// Zstd level used if none is given.
+pub const DEFAULT_ZSTD_LEVEL: i32 = 3;
+
+/// Inputs longer than this are first checked for being incompressible, by compressing
+/// a sample of this size from the middle.
+const SAMPLE_LEN: usize = 64 << 10;
+
+/// Store the input uncompressed if a sample doesn't compress to less than this
+/// percentage of its size.
+const INCOMPRESSIBLE_PERCENT: usize = 97;
+
+/// Compression for newly written blocks.
+#[derive(Debug, Clone, Copy, Eq, PartialEq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum Compression {
+    /// Fast Snappy compression, readable by all versions of Conserve.
+    Snappy,
+    /// Zstandard at the given level, or stored raw if the data is incompressible:
+    /// readable by Conserve 0.6.15 and later.
+    Zstd { level: i32 },
+}
+
+impl Default for Compression {
+    fn default() -> Compression {
+        Compression::Snappy
+    }
+}
+
+impl FromStr for Compression {
+    type Err = String;
+
+    /// Parse `snappy`, `zstd`, or `zstd:LEVEL`.
+    fn from_str(s: &str) -> std::result::Result<Compression, String> {
+        let mut parts = s.splitn(2, ':');
+        match (parts.next(), parts.next()) {
+            (Some("snappy"), None) => Ok(Compression::Snappy),
+            (Some("zstd"), None) => Ok(Compression::Zstd {
+                level: DEFAULT_ZSTD_LEVEL,
+            }),
+            (Some("zstd"), Some(level)) => level
+                .parse()
+                .map(|level| Compression::Zstd { level })
+                .map_err(|_| format!("Invalid zstd level {:?}", level)),
+            _ => Err(format!("Unknown compression {:?}", s)),
+        }
+    }
+}
+
+impl fmt::Display for Compression {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Compression::Snappy => write!(f, "snappy"),
+            Compression::Zstd { level } => write!(f, "zstd:{}", level),
+        }
+    }
+}
+
+/// Compresses data with one codec, holding reusable buffers.
+pub(crate) struct Compressor {
+    compression: Compression,
+    snappy: snappy::Compressor,
+    out_buf: Vec<u8>,
+}
+
+impl Compressor {
+    /// Make a Compressor for the default compression, Snappy.
+    pub fn new() -> Compressor {
+        Compressor::with_compression(Compression::Snappy)
+    }
+
+    pub fn with_compression(compression: Compression) -> Compressor {
+        Compressor {
+            compression,
+            snappy: snappy::Compressor::new(),
+            out_buf: Vec::new(),
+        }
+    }
+
+    /// Change the compression used for later calls, keeping the buffers.
+    pub fn set_compression(&mut self, compression: Compression) {
+        self.compression = compression;
+    }
+
+    /// Compress bytes.
+    ///
+    /// Returns a slice referencing a buffer in this object, valid only
+    /// until the next call.
+    pub fn compress(&mut self, input: &[u8]) -> Result<&[u8]> {
+        let level = match self.compression {
+            Compression::Snappy => return self.snappy.compress(input),
+            Compression::Zstd { level } => level,
+        };
+        if !self.looks_incompressible(input)? {
+            let compressed = zstd::bulk::compress(input, level)?;
+            if compressed.len() + HEADER_LEN < input.len() {
+                self.start_tagged(CODEC_ZSTD, input.len());
+                self.out_buf.extend_from_slice(&compressed);
+                return Ok(&self.out_buf);
+            }
+        }
+        self.start_tagged(CODEC_RAW, input.len());
+        self.out_buf.extend_from_slice(input);
+        Ok(&self.out_buf)
+    }
+
+    /// Guess cheaply whether compressing all of a large input would be a waste of time,
+    /// as it typically is for media or already-compressed files.
+    fn looks_incompressible(&mut self, input: &[u8]) -> Result<bool> {
+        if input.len() < 2 * SAMPLE_LEN {
+            return Ok(false);
+        }
+        let sample_start = (input.len() - SAMPLE_LEN) / 2;
+        let sample = &input[sample_start..(sample_start + SAMPLE_LEN)];
+        let compressed_len = self.snappy.compress(sample)?.len();
+        Ok(compressed_len * 100 >= SAMPLE_LEN * INCOMPRESSIBLE_PERCENT)
+    }
+
+    fn start_tagged(&mut self, codec: u8, uncompressed_len: usize) {
+        self.out_buf.clear();
+        self.out_buf.extend_from_slice(&TAG);
+        self.out_buf.push(codec);
+        let len = u32::try_from(uncompressed_len).expect("uncompressed length fits in u32");
+        self.out_buf.extend_from_slice(&len.to_le_bytes());
+    }
+}
+
+/// Decompresses data in any codec, holding reusable buffers.
+#[derive(Default)]
+pub(crate) struct Decompressor {
+    snappy: snappy::Decompressor,
+    out_buf: Vec<u8>,
+    /// True if the last output is in `snappy`'s buffer rather than `out_buf`.
+    last_was_snappy: bool,
+}
+
+impl Decompressor {
+    pub fn new() -> Decompressor {
+        Decompressor::default()
+    }
+
+    /// Decompress data in any codec.
+    ///
+    /// Returns a slice pointing into a reusable object inside the Decompressor.
+    pub fn decompress(&mut self, input: &[u8]) -> Result<&[u8]> {
+        if input.len() < HEADER_LEN || input[..TAG.len()] != TAG {
+            self.last_was_snappy = true;
+            return self.snappy.decompress(input);
+        }
+        self.last_was_snappy = false;
+        let codec = input[TAG.len()];
+        let len = u32::from_le_bytes(input[(TAG.len() + 1)..HEADER_LEN].try_into().unwrap());
+        let len = len as usize;
+        let payload = &input[HEADER_LEN..];
+        match codec {
+            CODEC_RAW => {
+                self.out_buf.clear();
+                self.out_buf.extend_from_slice(payload);
+            }
+            CODEC_ZSTD => self.out_buf = zstd::bulk::decompress(payload, len)?,
+            _ => {
+                return Err(Error::CorruptCompression {
+                    reason: format!("unknown codec {}", codec),
+                })
+            }
+        }
+        if self.out_buf.len() != len {
+            return Err(Error::CorruptCompression {
+                reason: format!(
+                    "decompressed to {} bytes rather than {}",
+                    self.out_buf.len(),
+                    len
+                ),
+            });
+        }
+        Ok(&self.out_buf)
+    }
+
+    /// Take the buffer holding the latest output, without copying it, leaving another
+    /// buffer for the next call.
+    pub fn take_output(&mut self) -> Vec<u8> {
+        if self.last_was_snappy {
+            self.snappy.take_output()
+        } else {
+            std::mem::take(&mut self.out_buf)
+        }
+    }
+
+    /// Reuse a buffer, such as one from `take_output`, for later output.
+    pub fn recycle(&mut self, buf: Vec<u8>) {
+        self.snappy.recycle(buf)
+    }
+
+    /// Deconstruct this Decompressor and return its buffer with the latest contents.
+    pub fn take_buffer(self) -> Vec<u8> {
+        if self.last_was_snappy {
+            self.snappy.take_buffer()
+        } else {
+            self.out_buf
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Deterministic bytes that don't compress.
+    fn noise(len: usize) -> Vec<u8> {
+        let mut x: u32 = 0x1234_5678;
+        (0..len)
+            .map(|_| {
+                // xorshift32
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                x as u8
+            })
+            .collect()
+    }
+
+    #[test]
+    fn take_output_and_recycle() {
+        let input = noise(10_000);
+        let mut compressor = Compressor::new();
+        let compressed = compressor.compress(&input).unwrap().to_vec();
+        let mut decompressor = Decompressor::new();
+        decompressor.decompress(&compressed).unwrap();
+        let output = decompressor.take_output();
+        assert_eq!(output, input);
+        decompressor.recycle(output);
+        assert_eq!(decompressor.decompress(&compressed).unwrap(), &input[..]);
+        assert_eq!(decompressor.take_output(), input);
+    }
+
+    #[test]
+    fn parse_compression() {
+        assert_eq!("snappy".parse(), Ok(Compression::Snappy));
+        assert_eq!(
+            "zstd".parse(),
+            Ok(Compression::Zstd {
+                level: DEFAULT_ZSTD_LEVEL
+            })
+        );
+        assert_eq!("zstd:19".parse(), Ok(Compression::Zstd { level: 19 }));
+        assert!("zstd:high".parse::<Compression>().is_err());
+        assert!("lzma".parse::<Compression>().is_err());
+        assert_eq!(Compression::Zstd { level: 7 }.to_string(), "zstd:7");
+    }
+
+    #[test]
+    fn snappy_is_untagged() {
+        let mut compressor = Compressor::new();
+        let comp = compressor.compress(b"hello world").unwrap().to_vec();
+        assert_eq!(comp, b"\x0b(hello world");
+        let mut decompressor = Decompressor::new();
+        assert_eq!(decompressor.decompress(&comp).unwrap(), b"hello world");
+        assert_eq!(decompressor.take_buffer(), b"hello world");
+    }
+
+    #[test]
+    fn zstd_round_trip() {
+        let input = b"hello world, ".repeat(1000);
+        let mut compressor = Compressor::with_compression(Compression::Zstd { level: 9 });
+        let comp = compressor.compress(&input).unwrap().to_vec();
+        assert_eq!(&comp[..TAG.len()], TAG);
+        assert_eq!(comp[TAG.len()], CODEC_ZSTD);
+        assert!(comp.len() < input.len() / 10);
+        let mut decompressor = Decompressor::new();
+        assert_eq!(decompressor.decompress(&comp).unwrap(), &input[..]);
+        assert_eq!(decompressor.take_buffer(), input);
+    }
+
+    #[test]
+    fn incompressible_data_is_stored_raw() {
+        for len in &[10, 1000, 3 * SAMPLE_LEN] {
+            let input = noise(*len);
+            let mut compressor = Compressor::with_compression(Compression::Zstd {
+                level: DEFAULT_ZSTD_LEVEL,
+            });
+            let comp = compressor.compress(&input).unwrap().to_vec();
+            assert_eq!(comp[TAG.len()], CODEC_RAW);
+            assert_eq!(comp.len(), input.len() + HEADER_LEN);
+            assert_eq!(Decompressor::new().decompress(&comp).unwrap(), &input[..]);
+        }
+    }
+
+    #[test]
+    fn unknown_codec_is_an_error() {
+        let mut comp = TAG.to_vec();
+        comp.push(99);
+        comp.extend_from_slice(&0u32.to_le_bytes());
+        assert!(Decompressor::new().decompress(&comp).is_err());
+    }
+
+    #[test]
+    fn wrong_raw_length_is_an_error() {
+        let mut comp = TAG.to_vec();
+        comp.push(CODEC_RAW);
+        comp.extend_from_slice(&10u32.to_le_bytes());
+        comp.extend_from_slice(b"short");
+        assert!(Decompressor::new().decompress(&comp).is_err());
+    }
+}
@@ -75,6 +75,20 @@ impl Decompressor {
         Ok(&self.out_buf[..actual_len])
     }
 
+    /// Take the buffer holding the latest output, leaving an empty one for the next call.
+    pub fn take_output(&mut self) -> Vec<u8> {
+        let mut out_buf = std::mem::take(&mut self.out_buf);
+        out_buf.truncate(self.last_len);
+        out_buf
+    }
+
+    /// Reuse a buffer, such as one from `take_output`, for later output.
+    pub fn recycle(&mut self, buf: Vec<u8>) {
+        if buf.capacity() > self.out_buf.capacity() {
+            self.out_buf = buf;
+        }
+    }
+
     /// Deconstruct this Decompressor and return its buffer with the latest contents.
     pub fn take_buffer(self) -> Vec<u8> {
         let Decompressor { mut out_buf, .. } = self;
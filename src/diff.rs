@@ -15,10 +15,12 @@
 //!
 //! See also [conserve::show_diff] to format the diff as text.
 
+use std::collections::{HashSet, VecDeque};
 use std::fmt;
 
 use readahead_iterator::IntoReadahead;
 
+use crate::index::{HunkSummary, IndexSummary};
 use crate::*;
 
 use DiffKind::*;
@@ -88,18 +90,149 @@ pub fn diff(
         .filter(|le| le.kind() != Unknown)
         .readahead(readahead);
     Ok(MergeTrees::new(ait, bit)
-        .map(diff_merged_entry)
+        .map(|me| diff_merged_entry(me, diff_common_entry))
         .filter(move |de: &DiffEntry| include_unchanged || de.kind != DiffKind::Unchanged))
 }
 
-fn diff_merged_entry<AE, BE>(me: merge::MergedEntry<AE, BE>) -> DiffEntry
+/// Read this many changed index hunks at once from each tree, when diffing stored trees.
+const DIFF_HUNK_BATCH: usize = 16;
+
+type StoredEntries = Box<dyn Iterator<Item = IndexEntry> + Send>;
+
+/// Generate an iter of per-entry diffs between two stored trees, such as last night's
+/// and tonight's backups.
+///
+/// File content is never read: files are unchanged if they have the same mtime and block
+/// addresses. When both bands are complete and their index summaries have hunk hashes,
+/// hunks that are identical in both bands are skipped without being read, so the cost
+/// is roughly proportional to what changed. (Unless unchanged entries are wanted, in
+/// which case every hunk is read.)
+pub fn diff_stored(
+    a: &StoredTree,
+    b: &StoredTree,
+    options: &DiffOptions,
+) -> Result<impl Iterator<Item = DiffEntry>> {
+    let readahead = 1000;
+    let include_unchanged: bool = options.include_unchanged;
+    let (ait, bit): (StoredEntries, StoredEntries) = match changed_hunks(a, b, options)? {
+        Some((a_hunks, b_hunks)) => (
+            selected_entries(a, a_hunks, options.excludes.clone()),
+            selected_entries(b, b_hunks, options.excludes.clone()),
+        ),
+        None => (
+            Box::new(a.iter_entries(None, options.excludes.clone())?),
+            Box::new(b.iter_entries(None, options.excludes.clone())?),
+        ),
+    };
+    Ok(
+        MergeTrees::new(ait.readahead(readahead), bit.readahead(readahead))
+            .map(|me| diff_merged_entry(me, diff_stored_common_entry))
+            .filter(move |de: &DiffEntry| include_unchanged || de.kind != DiffKind::Unchanged),
+    )
+}
+
+/// Find the numbers of the hunks in each tree that aren't identical to a hunk in the
+/// other, or None if all entries must be read.
+///
+/// Identical hunks cover the same apath range in both trees, with the same entries, and
+/// since hunks don't overlap no other hunk on either side has entries in that range: so
+/// leaving them out of both sides of the merge drops only unchanged entries.
+fn changed_hunks(
+    a: &StoredTree,
+    b: &StoredTree,
+    options: &DiffOptions,
+) -> Result<Option<(Vec<u32>, Vec<u32>)>> {
+    if options.include_unchanged || !a.is_closed()? || !b.is_closed()? {
+        return Ok(None);
+    }
+    let (a_summary, b_summary) = match (
+        a.band().index().read_summary()?,
+        b.band().index().read_summary()?,
+    ) {
+        (Some(a_summary), Some(b_summary)) => (a_summary, b_summary),
+        _ => return Ok(None),
+    };
+    let identical: HashSet<&HunkSummary> = {
+        let a_hashed: HashSet<&HunkSummary> = hashed_hunks(&a_summary).collect();
+        hashed_hunks(&b_summary)
+            .filter(|hunk| a_hashed.contains(hunk))
+            .collect()
+    };
+    let changed = |summary: &IndexSummary| -> Vec<u32> {
+        (0..summary.hunks.len() as u32)
+            .filter(|&i| !identical.contains(&summary.hunks[i as usize]))
+            .collect()
+    };
+    Ok(Some((changed(&a_summary), changed(&b_summary))))
+}
+
+fn hashed_hunks(summary: &IndexSummary) -> impl Iterator<Item = &HunkSummary> {
+    summary.hunks.iter().filter(|hunk| hunk.hash.is_some())
+}
+
+/// Entries from only some hunks of a stored tree.
+fn selected_entries(st: &StoredTree, hunk_numbers: Vec<u32>, excludes: GlobSet) -> StoredEntries {
+    Box::new(
+        SelectedHunks {
+            index: st.band().index(),
+            hunk_numbers,
+            next: 0,
+            buffered: VecDeque::new(),
+        }
+        .flatten()
+        .filter(move |entry| !excludes.is_match(&entry.apath)),
+    )
+}
+
+/// Reads some hunks of an index, in order, several at a time.
+struct SelectedHunks {
+    index: IndexRead,
+    hunk_numbers: Vec<u32>,
+    /// Position in `hunk_numbers` of the next hunk to read.
+    next: usize,
+    buffered: VecDeque<Vec<IndexEntry>>,
+}
+
+impl Iterator for SelectedHunks {
+    type Item = Vec<IndexEntry>;
+
+    fn next(&mut self) -> Option<Vec<IndexEntry>> {
+        loop {
+            if let Some(entries) = self.buffered.pop_front() {
+                return Some(entries);
+            }
+            if self.next >= self.hunk_numbers.len() {
+                return None;
+            }
+            let end = (self.next + DIFF_HUNK_BATCH).min(self.hunk_numbers.len());
+            let batch = &self.hunk_numbers[self.next..end];
+            self.next = end;
+            match self.index.read_hunks(batch.iter().cloned()) {
+                Ok(hunks) => {
+                    for (hunk_number, entries) in batch.iter().zip(hunks) {
+                        match entries {
+                            Some(entries) => self.buffered.push_back(entries),
+                            None => ui::problem(&format!("Index hunk {} is missing", hunk_number)),
+                        }
+                    }
+                }
+                Err(err) => ui::problem(&format!("Error reading index hunks: {}", err)),
+            }
+        }
+    }
+}
+
+fn diff_merged_entry<AE, BE>(
+    me: merge::MergedEntry<AE, BE>,
+    diff_common: fn(AE, BE, Apath) -> DiffEntry,
+) -> DiffEntry
 where
     AE: Entry,
     BE: Entry,
 {
     let apath = me.apath;
     match me.kind {
-        Both(ae, be) => diff_common_entry(ae, be, apath),
+        Both(ae, be) => diff_common(ae, be, apath),
         LeftOnly(_) => DiffEntry {
             kind: Deleted,
             apath,
@@ -131,3 +264,17 @@ where
         }
     }
 }
+
+/// Compare two stored entries, using their block addresses rather than their content.
+fn diff_stored_common_entry(ae: IndexEntry, be: IndexEntry, apath: Apath) -> DiffEntry {
+    let ak = ae.kind();
+    let kind = if ak != be.kind()
+        || (ak == File && (ae.mtime() != be.mtime() || ae.addrs != be.addrs))
+        || (ak == Symlink && (ae.target != be.target))
+    {
+        Changed
+    } else {
+        Unchanged
+    };
+    DiffEntry { kind, apath }
+}
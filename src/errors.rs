@@ -37,12 +37,18 @@ pub enum Error {
     #[error("Failed to read block {hash:?}")]
     ReadBlock { hash: String, source: IOError },
 
+    #[error("Failed to write pack {name:?}")]
+    WritePack { name: String, source: IOError },
+
     #[error("Failed to list block files")]
     ListBlocks { source: IOError },
 
     #[error("Not a Conserve archive")]
     NotAnArchive {},
 
+    #[error("Failed to read or write stat cache {path:?}")]
+    StatCache { path: PathBuf, source: IOError },
+
     #[error("Failed to read archive header")]
     ReadArchiveHeader { source: std::io::Error },
 
@@ -116,6 +122,9 @@ pub enum Error {
         source: serde_json::Error,
     },
 
+    #[error("Failed to decode binary index hunk {:?}: {}", path, reason)]
+    DecodeIndex { path: String, reason: String },
+
     #[error("Failed to write metadata file {:?}", path)]
     WriteMetadata {
         path: String,
@@ -165,6 +174,15 @@ pub enum Error {
         source: IOError,
     },
 
+    #[error("Can't open {:?}: {}", location, reason)]
+    InvalidLocation { location: String, reason: String },
+
+    #[error("Can't start tracing: {}", reason)]
+    StartTrace { reason: String },
+
+    #[error("Corrupt compressed data: {}", reason)]
+    CorruptCompression { reason: String },
+
     #[error(transparent)]
     SnapCompressionError {
         #[from]
@@ -14,15 +14,25 @@
 //! Index lists the files in a band in the archive.
 
 use std::cmp::Ordering;
+use std::collections::HashMap;
+use std::convert::TryFrom;
 use std::io;
 use std::iter::Peekable;
-use std::path::Path;
+use std::ops::Bound;
+use std::str::FromStr;
+use std::sync::Arc;
 use std::vec;
 
-use crate::compress::snappy::{Compressor, Decompressor};
+use blake2_rfc::blake2b;
+use rayon::prelude::*;
+use serde::{Deserialize, Serialize};
+
+use crate::compress::{Compressor, Decompressor};
+use crate::jsonio::write_json;
 use crate::kind::Kind;
-use crate::stats::{IndexReadStats, IndexWriterStats};
-use crate::transport::local::LocalTransport;
+use crate::metrics::{Phase, Timer};
+use crate::prefetch::OrderedPrefetch;
+use crate::stats::{IndexReadStats, IndexWriterStats, TreeStats};
 use crate::transport::Transport;
 use crate::unix_time::UnixTime;
 use crate::*;
@@ -31,6 +41,39 @@ pub const MAX_ENTRIES_PER_HUNK: usize = 1000;
 
 pub const HUNKS_PER_SUBDIR: u32 = 10_000;
 
+/// File within the index directory listing the apath range of each hunk.
+const SUMMARY_FILENAME: &str = "SUMMARY";
+
+mod binary;
+
+/// Encoding of the entries within each (compressed) index hunk.
+#[derive(Debug, Clone, Copy, Eq, PartialEq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum IndexFormat {
+    /// A JSON list of entries, as written by all versions of Conserve.
+    Json,
+    /// A compact binary encoding, readable by Conserve 0.6.15 and later.
+    Binary,
+}
+
+impl Default for IndexFormat {
+    fn default() -> IndexFormat {
+        IndexFormat::Json
+    }
+}
+
+impl FromStr for IndexFormat {
+    type Err = String;
+
+    fn from_str(s: &str) -> std::result::Result<IndexFormat, String> {
+        match s {
+            "json" => Ok(IndexFormat::Json),
+            "binary" => Ok(IndexFormat::Binary),
+            _ => Err(format!("Unknown index format {:?}", s)),
+        }
+    }
+}
+
 /// Description of one archived file.
 ///
 /// This struct is directly encoded/decoded to the json index file, and also can be constructed by
@@ -123,6 +166,31 @@ impl IndexEntry {
     }
 }
 
+/// Apath ranges of all the hunks in an index, so that readers can seek directly to
+/// the hunk holding a given apath.
+///
+/// This is written when the index is finished.
+#[derive(Debug, Clone, Default, Eq, PartialEq, Serialize, Deserialize)]
+pub(crate) struct IndexSummary {
+    pub hunks: Vec<HunkSummary>,
+}
+
+/// The first and last apath in one index hunk, and a hash of its content.
+#[derive(Debug, Clone, Eq, Hash, PartialEq, Serialize, Deserialize)]
+pub(crate) struct HunkSummary {
+    pub first: Apath,
+    pub last: Apath,
+
+    /// Hex BLAKE2b hash of the uncompressed hunk, so that identical hunks in different
+    /// bands can be recognized without reading them. Absent in summaries written by
+    /// 0.6.15 pre-releases.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub hash: Option<String>,
+}
+
+/// Bytes of BLAKE2b hash of each hunk recorded in the summary.
+const HUNK_HASH_BYTES: usize = 32;
+
 /// Write out index hunks.
 ///
 /// This class is responsible for: remembering the hunk number, and checking that the
@@ -146,12 +214,32 @@ pub struct IndexWriter {
     pub stats: IndexWriterStats,
 
     compressor: Compressor,
+
+    /// Encoding for new hunks.
+    format: IndexFormat,
+
+    /// Reused buffer for the uncompressed hunk.
+    hunk_buf: Vec<u8>,
+
+    /// Apath ranges of the hunks written so far.
+    summary: IndexSummary,
+
+    /// Finished hunks not yet written, as (relpath, compressed content).
+    pending: Vec<(String, Vec<u8>)>,
+
+    /// Counts of all the entries in the hunks so far.
+    tree_counter: TreeCounter,
 }
 
 /// Accumulate and write out index entries into files in an index directory.
 impl IndexWriter {
     /// Make a new builder that will write files into the given directory.
     pub fn new(transport: Box<dyn Transport>) -> IndexWriter {
+        IndexWriter::with_format(transport, IndexFormat::Json)
+    }
+
+    /// Make a new builder that will write hunks in the given format.
+    pub fn with_format(transport: Box<dyn Transport>, format: IndexFormat) -> IndexWriter {
         IndexWriter {
             transport,
             entries: Vec::<IndexEntry>::with_capacity(MAX_ENTRIES_PER_HUNK),
@@ -159,12 +247,115 @@ impl IndexWriter {
             check_order: apath::DebugCheckOrder::new(),
             stats: IndexWriterStats::default(),
             compressor: Compressor::new(),
+            format,
+            hunk_buf: Vec::new(),
+            summary: IndexSummary::default(),
+            pending: Vec::new(),
+            tree_counter: TreeCounter::default(),
         }
     }
 
-    /// Finish the last hunk of this index, and return the stats.
+    /// Reopen an index left incomplete by an interrupted backup, to write more hunks
+    /// after those already present.
+    ///
+    /// The summary of the existing hunks is rebuilt by reading them. Hunks past the
+    /// first missing or empty one, which can be left behind when a batch of writes was
+    /// interrupted, are removed so that they will be rewritten.
+    pub(crate) fn resume(
+        transport: Box<dyn Transport>,
+        format: IndexFormat,
+    ) -> Result<IndexWriter> {
+        trace_span!("resume_index");
+        let mut writer = IndexWriter::with_format(transport, format);
+        let mut decompressor = Decompressor::new();
+        let mut compressed_buf = Vec::new();
+        loop {
+            let relpath = hunk_relpath(writer.sequence);
+            match writer.transport.read_file(&relpath, &mut compressed_buf) {
+                Ok(()) => {}
+                Err(err) if err.kind() == io::ErrorKind::NotFound => break,
+                Err(source) => {
+                    return Err(Error::ReadIndex {
+                        path: relpath,
+                        source,
+                    })
+                }
+            }
+            let index_bytes = decompressor.decompress(&compressed_buf)?;
+            let entries = decode_hunk(&relpath, index_bytes, Bound::Unbounded)?;
+            let (first, last) = match (entries.first(), entries.last()) {
+                (Some(first), Some(last)) => (first.apath.clone(), last.apath.clone()),
+                _ => break,
+            };
+            writer.check_order.check(&first);
+            if entries.len() > 1 {
+                writer.check_order.check(&last);
+            }
+            for entry in &entries {
+                writer.tree_counter.count(entry);
+            }
+            writer.summary.hunks.push(HunkSummary {
+                first,
+                last,
+                hash: Some(hunk_hash(index_bytes)),
+            });
+            writer.sequence += 1;
+        }
+        writer.remove_hunks_from(writer.sequence)?;
+        Ok(writer)
+    }
+
+    /// Remove any hunks numbered `first` or later.
+    fn remove_hunks_from(&self, first: u32) -> Result<()> {
+        let subdirs = self
+            .transport
+            .list_dir_names("")
+            .map_err(|source| Error::ReadIndex {
+                path: String::new(),
+                source,
+            })?
+            .dirs;
+        for subdir in subdirs {
+            match subdir.parse::<u32>() {
+                Ok(n) if (n + 1) * HUNKS_PER_SUBDIR > first => {}
+                _ => continue,
+            }
+            let files = self
+                .transport
+                .list_dir_names(&subdir)
+                .map_err(|source| Error::ReadIndex {
+                    path: subdir.clone(),
+                    source,
+                })?
+                .files;
+            for name in files {
+                if matches!(name.parse::<u32>(), Ok(hunk_number) if hunk_number >= first) {
+                    let path = format!("{}/{}", subdir, name);
+                    self.transport
+                        .remove_file(&path)
+                        .map_err(|source| Error::WriteIndex { path, source })?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// The number of hunks written so far, including any there before it was resumed.
+    pub(crate) fn hunk_count(&self) -> u32 {
+        self.sequence
+    }
+
+    /// The last apath in the hunks written so far.
+    pub(crate) fn last_apath(&self) -> Option<&Apath> {
+        self.summary.hunks.last().map(|hunk| &hunk.last)
+    }
+
+    /// Finish the last hunk of this index, write the summary, and return the stats.
     pub fn finish(mut self) -> Result<IndexWriterStats> {
         self.finish_hunk()?;
+        self.flush()?;
+        write_json(&self.transport, SUMMARY_FILENAME, &self.summary)?;
+        self.stats.tree = std::mem::take(&mut self.tree_counter).finish();
         Ok(self.stats)
     }
 
@@ -184,9 +375,11 @@ impl IndexWriter {
 
     /// Finish this hunk of the index.
     ///
-    /// This writes all the currently queued entries into a new index file
-    /// in the band directory, and then clears the buffer to start receiving
-    /// entries for the next hunk.
+    /// This encodes all the currently queued entries into a new index hunk, and then clears
+    /// the buffer to start receiving entries for the next hunk.
+    ///
+    /// Finished hunks are written to the transport in batches, so that they can be in flight
+    /// together: a hunk is only certainly written after `flush` or `finish`.
     pub fn finish_hunk(&mut self) -> Result<()> {
         if self.entries.is_empty() {
             return Ok(());
@@ -199,32 +392,105 @@ impl IndexWriter {
         if self.entries.len() > 1 {
             self.check_order.check(&self.entries.last().unwrap().apath);
         }
+        for entry in &self.entries {
+            self.tree_counter.count(entry);
+        }
+        trace_span!("write_index_hunk", hunk = self.sequence);
+        let mut timer = Timer::start(Phase::EncodeIndexHunk);
         let relpath = hunk_relpath(self.sequence);
         let write_error = |source| Error::WriteIndex {
             path: relpath.clone(),
             source,
         };
-        let json =
-            serde_json::to_vec(&self.entries).map_err(|source| Error::SerializeIndex { source })?;
+        match self.format {
+            IndexFormat::Json => {
+                self.hunk_buf = serde_json::to_vec(&self.entries)
+                    .map_err(|source| Error::SerializeIndex { source })?
+            }
+            IndexFormat::Binary => binary::encode_hunk(&self.entries, &mut self.hunk_buf),
+        }
         if (self.sequence % HUNKS_PER_SUBDIR) == 0 {
             self.transport
                 .create_dir(&subdir_relpath(self.sequence))
                 .map_err(write_error)?;
         }
-        let compressed_bytes = self.compressor.compress(&json)?;
-        self.transport
-            .write_file(&relpath, compressed_bytes)
-            .map_err(write_error)?;
-
+        let compressed_bytes = self.compressor.compress(&self.hunk_buf)?;
         self.stats.index_hunks += 1;
         self.stats.compressed_index_bytes += compressed_bytes.len() as u64;
-        self.stats.uncompressed_index_bytes += json.len() as u64;
+        self.stats.uncompressed_index_bytes += self.hunk_buf.len() as u64;
+        self.summary.hunks.push(HunkSummary {
+            first: self.entries[0].apath.clone(),
+            last: self.entries.last().unwrap().apath.clone(),
+            hash: Some(hunk_hash(&self.hunk_buf)),
+        });
+        timer.add_bytes(self.hunk_buf.len() as u64);
+        self.pending.push((relpath, compressed_bytes.to_vec()));
         self.entries.clear(); // Ready for the next hunk.
         self.sequence += 1;
+        drop(timer);
+        if self.pending.len() >= self.transport.concurrency() {
+            self.flush()?;
+        }
+        Ok(())
+    }
+
+    /// Write out all finished hunks.
+    pub fn flush(&mut self) -> Result<()> {
+        trace_span!("flush_index", hunks = self.pending.len());
+        let mut timer = Timer::start(Phase::FlushIndex);
+        timer.set_ops(self.pending.len() as u64);
+        timer.add_bytes(self.pending.iter().map(|(_, hunk)| hunk.len() as u64).sum());
+        let results = self.transport.write_many(&self.pending);
+        for ((path, _), result) in self.pending.iter().zip(results) {
+            result.map_err(|source| Error::WriteIndex {
+                path: path.clone(),
+                source,
+            })?;
+        }
+        self.pending.clear();
         Ok(())
     }
 }
 
+/// Counts the entries written to an index, for its band's tail.
+#[derive(Debug, Default)]
+struct TreeCounter {
+    stats: TreeStats,
+    /// The end of the furthest part referenced of each block, keyed by a prefix of its
+    /// hash to save memory: a collision would only make the count slightly low.
+    block_ends: HashMap<u64, u64>,
+}
+
+impl TreeCounter {
+    fn count(&mut self, entry: &IndexEntry) {
+        match entry.kind {
+            Kind::File => {
+                self.stats.files += 1;
+                for addr in &entry.addrs {
+                    self.stats.file_bytes += addr.len;
+                    let end = self.block_ends.entry(addr.hash.prefix_u64()).or_insert(0);
+                    *end = (*end).max(addr.start + addr.len);
+                }
+            }
+            Kind::Dir => self.stats.directories += 1,
+            Kind::Symlink => self.stats.symlinks += 1,
+            Kind::Unknown => {}
+        }
+    }
+
+    fn finish(self) -> TreeStats {
+        TreeStats {
+            referenced_block_bytes: self.block_ends.values().sum(),
+            ..self.stats
+        }
+    }
+}
+
+/// Return the hash of an uncompressed hunk recorded in the summary.
+fn hunk_hash(hunk: &[u8]) -> String {
+    hex::encode(blake2b::blake2b(HUNK_HASH_BYTES, &[], hunk).as_bytes())
+}
+
 /// Return the transport-relative path for a subdirectory.
 fn subdir_relpath(hunk_number: u32) -> String {
     format!("{:05}", hunk_number / HUNKS_PER_SUBDIR)
@@ -242,11 +508,6 @@ pub struct IndexRead {
 }
 
 impl IndexRead {
-    #[allow(unused)]
-    pub(crate) fn open_path(path: &Path) -> IndexRead {
-        IndexRead::open(Box::new(LocalTransport::new(path)))
-    }
-
     pub(crate) fn open(transport: Box<dyn Transport>) -> IndexRead {
         IndexRead { transport }
     }
@@ -280,30 +541,140 @@ impl IndexRead {
     }
 
     /// Make an iterator that returns hunks of entries from this index.
+    ///
+    /// Hunks are read and decoded in the background, up to the transport's
+    /// concurrency ahead of the one being returned.
     pub fn iter_hunks(&self) -> IndexHunkIter {
         IndexHunkIter {
             next_hunk_number: 0,
-            transport: self.transport.box_clone(),
-            decompressor: Decompressor::new(),
-            compressed_buf: Vec::new(),
+            next_prefetch_number: 0,
+            read_ahead_hunks: self.transport.concurrency(),
+            read_ahead_window: 1,
+            prefetch: OrderedPrefetch::new(),
+            transport: Arc::from(self.transport.box_clone()),
             stats: IndexReadStats::default(),
-            after: None,
+            from: Bound::Unbounded,
+            summary: None,
         }
     }
+
+    /// Read and decode some hunks, by number, with the reads in flight together,
+    /// returning None for any that don't exist.
+    ///
+    /// Unlike `iter_hunks`, hunks can be read in any order, and from several threads
+    /// at once.
+    pub(crate) fn read_hunks<I: IntoIterator<Item = u32>>(
+        &self,
+        hunk_numbers: I,
+    ) -> Result<Vec<Option<Vec<IndexEntry>>>> {
+        let paths: Vec<String> = hunk_numbers.into_iter().map(hunk_relpath).collect();
+        trace_span!("read_index_hunks", count = paths.len());
+        let contents = self.transport.read_many(&paths);
+        paths
+            .into_par_iter()
+            .zip(contents)
+            .map(|(path, read_result)| decode_hunk_file(path, read_result))
+            .collect()
+    }
+
+    /// Read the summary of hunk apath ranges, if this index has one.
+    ///
+    /// Indexes written before 0.6.15, and those that were interrupted, have no summary.
+    pub(crate) fn read_summary(&self) -> Result<Option<IndexSummary>> {
+        read_summary(self.transport.as_ref())
+    }
+}
+
+fn read_summary(transport: &dyn Transport) -> Result<Option<IndexSummary>> {
+    let mut buf = Vec::new();
+    match transport.read_file(SUMMARY_FILENAME, &mut buf) {
+        Ok(()) => {}
+        Err(err) if err.kind() == io::ErrorKind::NotFound => return Ok(None),
+        Err(source) => {
+            return Err(Error::ReadIndex {
+                path: SUMMARY_FILENAME.to_owned(),
+                source,
+            })
+        }
+    }
+    serde_json::from_slice(&buf)
+        .map(Some)
+        .map_err(|source| Error::DeserializeJson {
+            path: SUMMARY_FILENAME.into(),
+            source,
+        })
+}
+
+/// True if `apath` is within the range starting at `from`.
+fn bound_admits(from: Bound<&Apath>, apath: &Apath) -> bool {
+    match from {
+        Bound::Unbounded => true,
+        Bound::Included(b) => apath >= b,
+        Bound::Excluded(b) => apath > b,
+    }
+}
+
+/// Return whichever of two lower bounds admits fewer apaths.
+pub(crate) fn tighter_bound(a: Bound<Apath>, b: Bound<&Apath>) -> Bound<Apath> {
+    let b_is_tighter = match (&a, b) {
+        (_, Bound::Unbounded) => false,
+        (Bound::Unbounded, _) => true,
+        (Bound::Excluded(ak), Bound::Included(bk)) => bk > ak,
+        (Bound::Included(ak), Bound::Included(bk))
+        | (Bound::Included(ak), Bound::Excluded(bk))
+        | (Bound::Excluded(ak), Bound::Excluded(bk)) => bk >= ak,
+    };
+    if !b_is_tighter {
+        return a;
+    }
+    match b {
+        Bound::Unbounded => Bound::Unbounded,
+        Bound::Included(bk) => Bound::Included(bk.clone()),
+        Bound::Excluded(bk) => Bound::Excluded(bk.clone()),
+    }
+}
+
+pub(crate) fn bound_ref(b: &Bound<Apath>) -> Bound<&Apath> {
+    match b {
+        Bound::Unbounded => Bound::Unbounded,
+        Bound::Included(k) => Bound::Included(k),
+        Bound::Excluded(k) => Bound::Excluded(k),
+    }
+}
+
+/// Hunk iterators that can skip forward, ideally without reading the hunks in between.
+pub trait SeekHunks: Iterator<Item = Vec<IndexEntry>> {
+    /// Skip forward so that only entries within the range starting at `from` are
+    /// returned from now on.
+    ///
+    /// This never moves backwards: entries excluded by an earlier seek stay excluded.
+    fn seek(&mut self, from: Bound<&Apath>);
 }
 
 /// Read hunks of entries from a stored index, in apath order.
 ///
 /// Each returned item is a vec of (typically up to a thousand) index entries.
 pub struct IndexHunkIter {
+    /// The number of the next hunk to return.
     next_hunk_number: u32,
+    /// The number of the next hunk to start reading in the background: hunks from
+    /// `next_hunk_number` up to this are in `prefetch`.
+    next_prefetch_number: u32,
+    /// The most hunks to read ahead, or 0 to read each hunk only when it's needed.
+    read_ahead_hunks: usize,
+    /// The number of hunks to read ahead now: this starts at 1 and grows up to
+    /// `read_ahead_hunks` as hunks are found, so that reading a small index doesn't
+    /// make many requests for hunks past its end.
+    read_ahead_window: usize,
+    /// Hunks being read and decoded in the background, in order.
+    prefetch: OrderedPrefetch<HunkRead>,
     /// The `i` directory within the band where all files for this index are written.
-    transport: Box<dyn Transport>,
-    decompressor: Decompressor,
-    compressed_buf: Vec<u8>,
+    transport: Arc<dyn Transport>,
     pub stats: IndexReadStats,
-    /// If set, yield only entries ordered after this apath.
-    after: Option<Apath>,
+    /// Yield only entries in the range starting here.
+    from: Bound<Apath>,
+    /// The index summary, once it's been loaded to seek; the inner None if it's absent.
+    summary: Option<Option<IndexSummary>>,
 }
 
 impl Iterator for IndexHunkIter {
@@ -324,102 +695,293 @@ impl Iterator for IndexHunkIter {
                     continue;
                 }
             };
-            if let Some(ref after) = self.after {
-                if let Some(last) = entries.last() {
-                    if last.apath <= *after {
-                        continue;
-                    }
-                }
-                if let Some(first) = entries.first() {
-                    if first.apath > *after {
-                        self.after = None; // don't need to look again
-                        return Some(entries);
-                    }
+            if let Bound::Unbounded = self.from {
+                if entries.is_empty() {
+                    continue;
                 }
-                let idx = match entries.binary_search_by_key(&after, |entry| &entry.apath) {
-                    Ok(idx) => idx + 1, // after the point it was found
-                    Err(idx) => idx,    // from the point it would have been
-                };
-                return Some(Vec::from(&entries[idx..]));
+                return Some(entries);
             }
-            if !entries.is_empty() {
+            let from = bound_ref(&self.from);
+            match entries.last() {
+                None => continue,
+                Some(last) if !bound_admits(from, &last.apath) => continue,
+                Some(_) => {}
+            }
+            if bound_admits(from, &entries[0].apath) {
+                self.from = Bound::Unbounded; // don't need to look again
                 return Some(entries);
             }
+            let idx = entries
+                .binary_search_by(|entry| {
+                    if bound_admits(from, &entry.apath) {
+                        Ordering::Greater
+                    } else {
+                        Ordering::Less
+                    }
+                })
+                .unwrap_err();
+            return Some(Vec::from(&entries[idx..]));
+        }
+    }
+}
+
+impl SeekHunks for IndexHunkIter {
+    /// Skip forward, using the summary if there is one to jump directly to the first
+    /// hunk that can contain entries in range.
+    fn seek(&mut self, from: Bound<&Apath>) {
+        if let Bound::Unbounded = from {
+            return;
+        }
+        self.from = tighter_bound(std::mem::replace(&mut self.from, Bound::Unbounded), from);
+        if self.summary.is_none() {
+            self.summary = Some(read_summary(self.transport.as_ref()).unwrap_or_else(|err| {
+                ui::problem(&format!("Error reading index summary: {:?}", err));
+                None
+            }));
+        }
+        if let Some(Some(summary)) = &self.summary {
+            let from = bound_ref(&self.from);
+            let first_needed = summary
+                .hunks
+                .binary_search_by(|hunk| {
+                    if bound_admits(from, &hunk.last) {
+                        Ordering::Greater
+                    } else {
+                        Ordering::Less
+                    }
+                })
+                .unwrap_err();
+            // Hunks beyond the end of the summary, if there are any, are still read in order.
+            let first_needed = u32::try_from(first_needed).expect("hunk count fits in u32");
+            if first_needed > self.next_hunk_number {
+                self.next_hunk_number = first_needed;
+                self.restart_prefetch();
+            }
         }
     }
 }
 
 impl IndexHunkIter {
     /// Advance self so that it returns only entries with apaths ordered after `apath`.
-    pub fn advance_to_after(self, apath: &Apath) -> Self {
-        IndexHunkIter {
-            after: Some(apath.clone()),
-            ..self
-        }
+    pub fn advance_to_after(mut self, apath: &Apath) -> Self {
+        self.seek(Bound::Excluded(apath));
+        self
+    }
+
+    /// Set the most hunks to read and decode ahead in the background, or 0 to read
+    /// them only when they're needed.
+    pub fn read_ahead(mut self, hunks: usize) -> Self {
+        self.read_ahead_hunks = hunks;
+        self
     }
 
     fn read_next_hunk(&mut self) -> Result<Option<Vec<IndexEntry>>> {
-        let path = &hunk_relpath(self.next_hunk_number);
+        let hunk_number = self.next_hunk_number;
+        let hunk = if self.read_ahead_hunks == 0 {
+            read_hunk(self.transport.as_ref(), hunk_number, bound_ref(&self.from))
+        } else {
+            self.start_prefetch();
+            self.prefetch.pop().expect("Next hunk is prefetched")
+        };
+        debug_assert_eq!(hunk.hunk_number, hunk_number);
         // Whether we succeed or fail, don't try to read this hunk again.
         self.next_hunk_number += 1;
-        if let Err(err) = self.transport.read_file(&path, &mut self.compressed_buf) {
-            if err.kind() == io::ErrorKind::NotFound {
-                // TODO: Cope with one hunk being missing, while there are still
-                // later-numbered hunks. This would require reading the whole
-                // list of hunks first.
-                return Ok(None);
-            } else {
-                return Err(Error::ReadIndex {
-                    path: path.clone(),
-                    source: err,
-                });
-            }
+        if let Some(compressed_len) = hunk.compressed_len {
+            self.stats.index_hunks += 1;
+            self.stats.compressed_index_bytes += compressed_len;
         }
-        self.stats.index_hunks += 1;
-        self.stats.compressed_index_bytes += self.compressed_buf.len() as u64;
-        let index_bytes = self.decompressor.decompress(&self.compressed_buf)?;
-        self.stats.uncompressed_index_bytes += index_bytes.len() as u64;
-        let entries: Vec<IndexEntry> =
-            serde_json::from_slice(&index_bytes).map_err(|source| Error::DeserializeIndex {
-                path: path.clone(),
-                source,
-            })?;
-        if entries.is_empty() {
-            // It's legal, it's just weird - and it can be produced by some old Conserve versions.
+        self.stats.uncompressed_index_bytes += hunk.uncompressed_len.unwrap_or(0);
+        if !hunk.missing {
+            self.read_ahead_window = (self.read_ahead_window * 2).min(self.read_ahead_hunks.max(1));
+            // Start the next reads now, so they proceed while the caller works on this one.
+            self.start_prefetch();
+        } else {
+            // TODO: Cope with one hunk being missing, while there are still
+            // later-numbered hunks. This would require reading the whole
+            // list of hunks first.
+            self.restart_prefetch();
+        }
+        hunk.entries
+    }
+
+    /// Start reading hunks in the background, up to the read-ahead window.
+    fn start_prefetch(&mut self) {
+        while self.prefetch.len() < self.read_ahead_window.min(self.read_ahead_hunks) {
+            let hunk_number = self.next_prefetch_number;
+            self.next_prefetch_number += 1;
+            let transport = Arc::clone(&self.transport);
+            let from = self.from.clone();
+            self.prefetch
+                .push(move || read_hunk(transport.as_ref(), hunk_number, bound_ref(&from)));
+        }
+    }
+
+    /// Forget hunks being read in the background, so that the next one read is
+    /// `next_hunk_number`.
+    fn restart_prefetch(&mut self) {
+        // Dropping the queue lets any reads still running finish, and discards their
+        // results.
+        self.prefetch = OrderedPrefetch::new();
+        self.next_prefetch_number = self.next_hunk_number;
+    }
+}
+
+/// The result of reading and decoding one index hunk.
+struct HunkRead {
+    hunk_number: u32,
+    /// True if the hunk doesn't exist, which is the end of the index.
+    missing: bool,
+    /// The length of the hunk file, if it was read.
+    compressed_len: Option<u64>,
+    /// The length of the hunk content, if it was decompressed.
+    uncompressed_len: Option<u64>,
+    /// The decoded entries, or None if the hunk doesn't exist.
+    entries: Result<Option<Vec<IndexEntry>>>,
+}
+
+/// Read, decompress, and decode one hunk, skipping entries before `from` if possible.
+///
+/// This runs on a prefetch thread when hunks are read ahead.
+fn read_hunk(transport: &dyn Transport, hunk_number: u32, from: Bound<&Apath>) -> HunkRead {
+    trace_span!("read_index_hunk", hunk = hunk_number);
+    let path = hunk_relpath(hunk_number);
+    let mut hunk = HunkRead {
+        hunk_number,
+        missing: false,
+        compressed_len: None,
+        uncompressed_len: None,
+        entries: Ok(None),
+    };
+    let mut compressed_buf = Vec::new();
+    match transport.read_file(&path, &mut compressed_buf) {
+        Ok(()) => {}
+        Err(err) if err.kind() == io::ErrorKind::NotFound => {
+            hunk.missing = true;
+            return hunk;
+        }
+        Err(source) => {
+            // Later hunks might still be readable.
+            hunk.entries = Err(Error::ReadIndex { path, source });
+            return hunk;
+        }
+    }
+    hunk.compressed_len = Some(compressed_buf.len() as u64);
+    let mut decompressor = Decompressor::new();
+    hunk.entries = match decompressor.decompress(&compressed_buf) {
+        Ok(index_bytes) => {
+            hunk.uncompressed_len = Some(index_bytes.len() as u64);
+            decode_hunk(&path, index_bytes, from).map(Some)
+        }
+        Err(err) => Err(err),
+    };
+    hunk
+}
+
+/// Decompress and decode the result of reading a whole hunk file, or return None if
+/// it doesn't exist.
+fn decode_hunk_file(
+    path: String,
+    read_result: io::Result<Vec<u8>>,
+) -> Result<Option<Vec<IndexEntry>>> {
+    match read_result {
+        Ok(compressed_buf) => {
+            let mut decompressor = Decompressor::new();
+            let index_bytes = decompressor.decompress(&compressed_buf)?;
+            decode_hunk(&path, index_bytes, Bound::Unbounded).map(Some)
         }
-        Ok(Some(entries))
+        Err(err) if err.kind() == io::ErrorKind::NotFound => Ok(None),
+        Err(source) => Err(Error::ReadIndex { path, source }),
+    }
+}
+
+/// Decode the uncompressed content of a hunk in either format.
+///
+/// Binary hunks can skip decoding entries before `from`; JSON hunks return all entries.
+fn decode_hunk(path: &str, index_bytes: &[u8], from: Bound<&Apath>) -> Result<Vec<IndexEntry>> {
+    if binary::is_binary_hunk(index_bytes) {
+        binary::decode_hunk(index_bytes, from).map_err(|reason| Error::DecodeIndex {
+            path: path.to_owned(),
+            reason: reason.to_owned(),
+        })
+    } else {
+        // An empty hunk is legal, it's just weird - and it can be produced by some old
+        // Conserve versions.
+        serde_json::from_slice(&index_bytes).map_err(|source| Error::DeserializeIndex {
+            path: path.to_owned(),
+            source,
+        })
     }
 }
 
+/// Discard buffered entries before `from`, and if that empties the buffer, skip the
+/// hunk iterator forward.
+fn seek_buffered<HI: SeekHunks>(
+    buffered_entries: &mut Peekable<vec::IntoIter<IndexEntry>>,
+    hunk_iter: &mut HI,
+    from: Bound<&Apath>,
+) {
+    while let Some(entry) = buffered_entries.peek() {
+        if bound_admits(from, &entry.apath) {
+            return;
+        }
+        buffered_entries.next();
+    }
+    hunk_iter.seek(from);
+}
+
 /// Read out all the entries from a stored index, in apath order.
-pub struct IndexEntryIter<HI: Iterator<Item = Vec<IndexEntry>>> {
+pub struct IndexEntryIter<HI: SeekHunks> {
     /// Temporarily buffered entries, read from the index files but not yet
     /// returned to the client.
     buffered_entries: Peekable<vec::IntoIter<IndexEntry>>,
     hunk_iter: HI,
     subtree: Option<Apath>,
+    /// If there's a subtree, the key just before its descendants.
+    descendants_start: Option<Apath>,
     excludes: GlobSet,
+    /// True once all entries in the subtree have been returned.
+    done: bool,
 }
 
-impl<HI: Iterator<Item = Vec<IndexEntry>>> IndexEntryIter<HI> {
-    pub(crate) fn new(hunk_iter: HI, subtree: Option<Apath>, excludes: GlobSet) -> Self {
+impl<HI: SeekHunks> IndexEntryIter<HI> {
+    pub(crate) fn new(mut hunk_iter: HI, subtree: Option<Apath>, excludes: GlobSet) -> Self {
+        if let Some(subtree) = &subtree {
+            hunk_iter.seek(Bound::Included(subtree));
+        }
         IndexEntryIter {
             buffered_entries: Vec::<IndexEntry>::new().into_iter().peekable(),
             hunk_iter,
+            descendants_start: subtree.as_ref().map(Apath::descendants_start),
             subtree,
             excludes,
+            done: false,
         }
     }
 }
 
-impl<HI: Iterator<Item = Vec<IndexEntry>>> Iterator for IndexEntryIter<HI> {
+impl<HI: SeekHunks> Iterator for IndexEntryIter<HI> {
     type Item = IndexEntry;
 
     fn next(&mut self) -> Option<IndexEntry> {
-        loop {
+        while !self.done {
             if let Some(entry) = self.buffered_entries.next() {
-                if let Some(subtree) = &self.subtree {
+                if let (Some(subtree), Some(descendants_start)) =
+                    (&self.subtree, &self.descendants_start)
+                {
                     if !subtree.is_prefix_of(&entry.apath) {
+                        // The subtree's descendants are contiguous, but they're separated from
+                        // the subtree directory itself by its later siblings and the
+                        // descendants of its earlier siblings. Skip over those, and stop at
+                        // the first entry after the descendants.
+                        if entry.apath > *descendants_start {
+                            self.done = true;
+                        } else if entry.apath > *subtree {
+                            seek_buffered(
+                                &mut self.buffered_entries,
+                                &mut self.hunk_iter,
+                                Bound::Excluded(descendants_start),
+                            );
+                        }
                         continue;
                     }
                 }
@@ -432,10 +994,11 @@ impl<HI: Iterator<Item = Vec<IndexEntry>>> Iterator for IndexEntryIter<HI> {
                 return None;
             }
         }
+        None
     }
 }
 
-impl<HI: Iterator<Item = Vec<IndexEntry>>> IndexEntryIter<HI> {
+impl<HI: SeekHunks> IndexEntryIter<HI> {
     /// Return the entry for given apath, if it is present, otherwise None.
     /// It follows this will also return None at the end of the index.
     ///
@@ -443,6 +1006,7 @@ impl<HI: Iterator<Item = Vec<IndexEntry>>> IndexEntryIter<HI> {
     /// discarding entries for any earlier files. However, even if the apath
     /// is not present, other entries coming after it can still be read.
     pub fn advance_to(&mut self, apath: &Apath) -> Option<IndexEntry> {
+        self.seek(Bound::Included(apath));
         // This takes some care because we don't want to consume the entry
         // that tells us we went too far.
         loop {
@@ -466,6 +1030,10 @@ impl<HI: Iterator<Item = Vec<IndexEntry>>> IndexEntryIter<HI> {
         }
     }
 
+    fn seek(&mut self, from: Bound<&Apath>) {
+        seek_buffered(&mut self.buffered_entries, &mut self.hunk_iter, from)
+    }
+
     /// Read another hunk file and put it into buffered_entries.
     ///
     /// Returns true if another hunk could be found, otherwise false.
@@ -485,11 +1053,19 @@ impl<HI: Iterator<Item = Vec<IndexEntry>>> IndexEntryIter<HI> {
 
 #[cfg(test)]
 mod tests {
+    use std::path::Path;
+
     use tempfile::TempDir;
 
     use super::transport::local::LocalTransport;
     use super::*;
 
+    impl IndexRead {
+        fn open_path(path: &Path) -> IndexRead {
+            IndexRead::open(Box::new(LocalTransport::new(path)))
+        }
+    }
+
     fn setup() -> (TempDir, IndexWriter) {
         let testdir = TempDir::new().unwrap();
         let ib = IndexWriter::new(Box::new(LocalTransport::new(testdir.path())));
@@ -564,6 +1140,49 @@ mod tests {
         ib.finish_hunk().unwrap();
     }
 
+    #[test]
+    fn hunks_are_written_by_flush() {
+        let (testdir, mut ib) = setup();
+        ib.push_entry(sample_entry("/1"));
+        ib.finish_hunk().unwrap();
+        ib.push_entry(sample_entry("/2"));
+        ib.finish_hunk().unwrap();
+        assert_eq!(ib.stats.index_hunks, 2);
+        let index_read = IndexRead::open_path(testdir.path());
+        assert_eq!(index_read.count_hunks().unwrap(), 0);
+
+        ib.flush().unwrap();
+        assert_eq!(index_read.count_hunks().unwrap(), 2);
+        let hunks = index_read.read_hunks(0..3).unwrap();
+        assert_eq!(hunks[1].as_ref().unwrap()[0].apath, "/2");
+        assert!(hunks[2].is_none());
+    }
+
+    #[test]
+    fn resume_after_one_entry_hunks() {
+        let (testdir, mut ib) = setup();
+        for apath in &["/1", "/2", "/3"] {
+            ib.push_entry(sample_entry(apath));
+            ib.finish_hunk().unwrap();
+        }
+        ib.flush().unwrap();
+        drop(ib);
+
+        let mut ib = IndexWriter::resume(
+            Box::new(LocalTransport::new(testdir.path())),
+            IndexFormat::Json,
+        )
+        .unwrap();
+        assert_eq!(ib.hunk_count(), 3);
+        assert_eq!(ib.last_apath().unwrap(), "/3");
+        ib.push_entry(sample_entry("/4"));
+        ib.finish().unwrap();
+        assert_eq!(
+            IndexRead::open_path(testdir.path()).count_hunks().unwrap(),
+            4
+        );
+    }
+
     #[test]
     fn path_for_hunk() {
         assert_eq!(super::hunk_relpath(0), "00000/000000000");
@@ -607,6 +1226,7 @@ mod tests {
         ib.finish_hunk().unwrap();
         ib.append_entries(&mut vec![sample_entry("/2.1"), sample_entry("/2.2")]);
         ib.finish_hunk().unwrap();
+        ib.flush().unwrap();
 
         let index_read = IndexRead::open_path(&testdir.path());
         let it = index_read.iter_entries();
@@ -633,6 +1253,37 @@ mod tests {
         );
     }
 
+    #[test]
+    fn binary_hunks() {
+        let testdir = TempDir::new().unwrap();
+        let mut ib = IndexWriter::with_format(
+            Box::new(LocalTransport::new(testdir.path())),
+            IndexFormat::Binary,
+        );
+        ib.append_entries(&mut vec![sample_entry("/1.1"), sample_entry("/1.2")]);
+        ib.finish_hunk().unwrap();
+        ib.append_entries(&mut vec![sample_entry("/2.1"), sample_entry("/2.2")]);
+        ib.finish_hunk().unwrap();
+        ib.flush().unwrap();
+
+        let index_read = IndexRead::open_path(&testdir.path());
+        let names: Vec<String> = index_read
+            .clone()
+            .iter_entries()
+            .map(|x| x.apath.into())
+            .collect();
+        assert_eq!(names, &["/1.1", "/1.2", "/2.1", "/2.2"]);
+        assert_eq!(index_read.iter_hunks().count(), 2);
+
+        let names: Vec<String> = index_read
+            .iter_hunks()
+            .advance_to_after(&"/1.1".into())
+            .flatten()
+            .map(|entry| entry.apath.into())
+            .collect();
+        assert_eq!(names, ["/1.2", "/2.1", "/2.2"]);
+    }
+
     #[test]
     fn iter_hunks_advance_to_after() {
         let (testdir, mut ib) = setup();
@@ -640,6 +1291,7 @@ mod tests {
         ib.finish_hunk().unwrap();
         ib.append_entries(&mut vec![sample_entry("/2.1"), sample_entry("/2.2")]);
         ib.finish_hunk().unwrap();
+        ib.flush().unwrap();
 
         let index_read = IndexRead::open_path(&testdir.path());
         let names: Vec<String> = index_read
@@ -728,6 +1380,7 @@ mod tests {
         ib.push_entry(sample_entry("/g02"));
         ib.push_entry(sample_entry("/g03"));
         ib.finish_hunk().unwrap();
+        ib.flush().unwrap();
 
         // Advance to /foo and read on from there.
         let mut it = IndexRead::open_path(&testdir.path()).iter_entries();
@@ -765,8 +1418,179 @@ mod tests {
         ib.finish_hunk()?;
         // Think about, but don't actually add some files
         ib.finish_hunk()?;
+        ib.flush()?;
         let read_index = IndexRead::open_path(&testdir.path());
         assert_eq!(read_index.count_hunks()?, 1);
         Ok(())
     }
+
+    /// Write one hunk for each directory, holding its direct children.
+    fn write_tree_index(ib: &mut IndexWriter) {
+        ib.push_entry(sample_entry("/"));
+        for d in &["a", "b", "c"] {
+            ib.push_entry(sample_entry(&format!("/{}", d)));
+        }
+        ib.finish_hunk().unwrap();
+        for d in &["a", "b", "c"] {
+            for f in 0..3 {
+                ib.push_entry(sample_entry(&format!("/{}/{}", d, f)));
+            }
+            ib.finish_hunk().unwrap();
+        }
+    }
+
+    #[test]
+    fn summary_records_hunk_ranges() {
+        let (testdir, mut ib) = setup();
+        write_tree_index(&mut ib);
+        ib.finish().unwrap();
+        let summary = IndexRead::open_path(testdir.path())
+            .read_summary()
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.hunks.len(), 4);
+        assert_eq!(summary.hunks[0].first, "/");
+        assert_eq!(summary.hunks[0].last, "/c");
+        assert_eq!(summary.hunks[2].first, "/b/0");
+        assert_eq!(summary.hunks[2].last, "/b/2");
+
+        // Each hunk's hash is of its content, so it's the same in another index with
+        // the same entries, and differs between hunks.
+        let (testdir2, mut ib2) = setup();
+        write_tree_index(&mut ib2);
+        ib2.finish().unwrap();
+        let summary2 = IndexRead::open_path(testdir2.path())
+            .read_summary()
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary, summary2);
+        assert!(summary.hunks[0].hash.is_some());
+        assert_ne!(summary.hunks[0].hash, summary.hunks[1].hash);
+    }
+
+    #[test]
+    fn seek_uses_summary_to_skip_hunks() {
+        let (testdir, mut ib) = setup();
+        write_tree_index(&mut ib);
+        ib.finish().unwrap();
+        let index_read = IndexRead::open_path(testdir.path());
+
+        let mut hunks = index_read.iter_hunks();
+        hunks.seek(Bound::Included(&"/b/1".into()));
+        let names: Vec<String> = (&mut hunks)
+            .flatten()
+            .map(|entry| entry.apath.into())
+            .collect();
+        assert_eq!(names, ["/b/1", "/b/2", "/c/0", "/c/1", "/c/2"]);
+        assert_eq!(hunks.stats.index_hunks, 2);
+
+        let mut hunks = index_read.iter_hunks().advance_to_after(&"/b/2".into());
+        assert_eq!(hunks.next().unwrap()[0].apath, "/c/0");
+        assert_eq!(hunks.stats.index_hunks, 1);
+    }
+
+    #[test]
+    fn seek_without_summary_reads_all_hunks() {
+        let (testdir, mut ib) = setup();
+        write_tree_index(&mut ib);
+        ib.finish_hunk().unwrap();
+        ib.flush().unwrap();
+        // Not finished, so there's no summary.
+        let mut hunks = IndexRead::open_path(testdir.path()).iter_hunks();
+        hunks.seek(Bound::Excluded(&"/b/2".into()));
+        assert_eq!(hunks.next().unwrap()[0].apath, "/c/0");
+        assert_eq!(hunks.stats.index_hunks, 4);
+    }
+
+    #[test]
+    fn read_ahead_returns_hunks_in_order() {
+        let (testdir, mut ib) = setup();
+        for i in 0..50 {
+            ib.push_entry(sample_entry(&format!("/{:03}", i)));
+            ib.finish_hunk().unwrap();
+        }
+        ib.finish().unwrap();
+        let index_read = IndexRead::open_path(testdir.path());
+        let expected: Vec<String> = (0..50).map(|i| format!("/{:03}", i)).collect();
+        for &read_ahead in &[0, 1, 4, 64] {
+            let mut hunks = index_read.iter_hunks().read_ahead(read_ahead);
+            let names: Vec<String> = (&mut hunks)
+                .map(|hunk| {
+                    assert_eq!(hunk.len(), 1);
+                    hunk[0].apath.to_string()
+                })
+                .collect();
+            assert_eq!(names, expected, "read_ahead={}", read_ahead);
+            assert_eq!(hunks.stats.index_hunks, 50);
+            assert_eq!(hunks.stats.errors, 0);
+        }
+    }
+
+    #[test]
+    fn read_ahead_seek_skips_prefetched_hunks() {
+        let (testdir, mut ib) = setup();
+        write_tree_index(&mut ib);
+        ib.finish().unwrap();
+        let mut hunks = IndexRead::open_path(testdir.path())
+            .iter_hunks()
+            .read_ahead(8);
+        assert_eq!(hunks.next().unwrap()[0].apath, "/");
+        hunks.seek(Bound::Included(&"/c/1".into()));
+        let names: Vec<String> = (&mut hunks)
+            .flatten()
+            .map(|entry| entry.apath.into())
+            .collect();
+        assert_eq!(names, ["/c/1", "/c/2"]);
+        assert_eq!(hunks.stats.index_hunks, 2);
+    }
+
+    #[test]
+    fn subtree_iteration_stops_after_subtree() {
+        let (testdir, mut ib) = setup();
+        write_tree_index(&mut ib);
+        ib.finish().unwrap();
+        let index_read = IndexRead::open_path(testdir.path());
+
+        let mut it = IndexEntryIter::new(
+            index_read.iter_hunks(),
+            Some("/b".into()),
+            excludes_nothing(),
+        );
+        let names: Vec<String> = (&mut it).map(|entry| entry.apath.into()).collect();
+        assert_eq!(names, ["/b", "/b/0", "/b/1", "/b/2"]);
+        // Read the top hunk, then jumped over /a's hunk, and stopped at /c's.
+        assert_eq!(it.hunk_iter.stats.index_hunks, 3);
+
+        let names: Vec<String> = IndexEntryIter::new(
+            index_read.iter_hunks(),
+            Some("/".into()),
+            excludes_nothing(),
+        )
+        .map(|entry| entry.apath.into())
+        .collect();
+        assert_eq!(names.len(), 13);
+
+        let names: Vec<String> = IndexEntryIter::new(
+            index_read.iter_hunks(),
+            Some("/c/1".into()),
+            excludes_nothing(),
+        )
+        .map(|entry| entry.apath.into())
+        .collect();
+        assert_eq!(names, ["/c/1"]);
+    }
+
+    #[test]
+    fn descendants_start_orders_before_descendants() {
+        let b: Apath = "/b".into();
+        let start = b.descendants_start();
+        for before in &["/", "/a", "/b", "/c", "/a/0", "/a/z/z"] {
+            assert!(start > (*before).into(), "{}", before);
+        }
+        for after in &["/b/0", "/b/0/0", "/c/0"] {
+            assert!(start < (*after).into(), "{}", after);
+        }
+        let root: Apath = "/".into();
+        assert_eq!(root.descendants_start(), root);
+    }
 }
@@ -0,0 +1,488 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Compact binary encoding of index hunks.
+//!
+//! Compared to JSON this is much cheaper to parse, and smaller: apaths are stored
+//! as a suffix after the prefix they share with the previous entry, and each block
+//! hash is stored once per hunk and then referred to by its position.
+//!
+//! Every `RESTART_INTERVAL` entries the full apath is stored, and a fixed-width
+//! table at the end of the hunk gives the offset of each such restart point, so
+//! that a reader can binary search to the first entries it needs.
+//!
+//! The layout is described in `doc/format.md`. All integers are unsigned LEB128
+//! varints, except for the fixed-width trailer.
+
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use std::ops::Bound;
+
+use super::bound_admits;
+use crate::blockdir::Address;
+use crate::*;
+
+/// Binary hunks start with these bytes, which can never begin a JSON hunk.
+const MAGIC: &[u8] = b"CIDX";
+
+/// Version of the binary hunk encoding.
+const FORMAT_VERSION: u8 = 1;
+
+/// Store a full apath, and a restart offset, every this many entries.
+const RESTART_INTERVAL: usize = 16;
+
+/// Every encoded entry takes at least this many bytes: one each for the shared prefix
+/// length, suffix length, kind, mtime, mtime nanos, address count, and target.
+const MIN_ENTRY_LEN: usize = 7;
+
+type DecodeResult<T> = std::result::Result<T, &'static str>;
+
+/// True if these (uncompressed) hunk bytes use the binary encoding.
+pub(super) fn is_binary_hunk(bytes: &[u8]) -> bool {
+    bytes.starts_with(MAGIC)
+}
+
+/// Encode a hunk of sorted entries into `out`, replacing its previous contents.
+pub(super) fn encode_hunk(entries: &[IndexEntry], out: &mut Vec<u8>) {
+    out.clear();
+    out.extend_from_slice(MAGIC);
+    out.push(FORMAT_VERSION);
+    put_varint(out, RESTART_INTERVAL as u64);
+    put_varint(out, entries.len() as u64);
+
+    let mut hash_positions: HashMap<&BlockHash, u64> = HashMap::new();
+    let mut hashes: Vec<&BlockHash> = Vec::new();
+    for addr in entries.iter().flat_map(|entry| entry.addrs.iter()) {
+        if !hash_positions.contains_key(&addr.hash) {
+            hash_positions.insert(&addr.hash, hashes.len() as u64);
+            hashes.push(&addr.hash);
+        }
+    }
+    put_varint(out, hashes.len() as u64);
+    for hash in &hashes {
+        out.extend_from_slice(hash.as_bytes());
+    }
+
+    let mut restarts: Vec<u32> = Vec::with_capacity(entries.len() / RESTART_INTERVAL + 1);
+    let mut prev: &[u8] = &[];
+    for (i, entry) in entries.iter().enumerate() {
+        let apath = entry.apath.as_bytes();
+        let shared = if i % RESTART_INTERVAL == 0 {
+            restarts.push(u32::try_from(out.len()).expect("index hunk too large"));
+            0
+        } else {
+            prev.iter()
+                .zip(apath.iter())
+                .take_while(|(a, b)| a == b)
+                .count()
+        };
+        put_varint(out, shared as u64);
+        put_bytes(out, &apath[shared..]);
+        out.push(kind_code(entry.kind));
+        put_varint(out, zigzag(entry.mtime));
+        put_varint(out, entry.mtime_nanos.into());
+        put_varint(out, entry.addrs.len() as u64);
+        for addr in &entry.addrs {
+            put_varint(out, hash_positions[&addr.hash]);
+            put_varint(out, addr.start);
+            put_varint(out, addr.len);
+        }
+        match &entry.target {
+            None => put_varint(out, 0),
+            Some(target) => {
+                put_varint(out, target.len() as u64 + 1);
+                out.extend_from_slice(target.as_bytes());
+            }
+        }
+        prev = apath;
+    }
+
+    for offset in &restarts {
+        out.extend_from_slice(&offset.to_le_bytes());
+    }
+    out.extend_from_slice(&(restarts.len() as u32).to_le_bytes());
+}
+
+/// Decode a binary hunk.
+///
+/// Only entries within the range starting at `from` are returned, and entries before the
+/// last restart point preceding it are not decoded at all.
+pub(super) fn decode_hunk(bytes: &[u8], from: Bound<&Apath>) -> DecodeResult<Vec<IndexEntry>> {
+    if !is_binary_hunk(bytes) || bytes.len() < MAGIC.len() + 1 + 4 {
+        return Err("not a binary index hunk");
+    }
+    if bytes[MAGIC.len()] != FORMAT_VERSION {
+        return Err("unsupported binary index version");
+    }
+    let restart_count = read_u32_le(&bytes[bytes.len() - 4..]) as usize;
+    let table_len = restart_count
+        .checked_mul(4)
+        .and_then(|l| l.checked_add(4))
+        .ok_or("restart table too long")?;
+    if table_len > bytes.len() - MAGIC.len() - 1 {
+        return Err("restart table too long");
+    }
+    let body_end = bytes.len() - table_len;
+    let restarts: Vec<usize> = bytes[body_end..bytes.len() - 4]
+        .chunks(4)
+        .map(|b| read_u32_le(b) as usize)
+        .collect();
+
+    let mut r = Reader {
+        buf: &bytes[..body_end],
+        pos: MAGIC.len() + 1,
+    };
+    let restart_interval = r.usize()?;
+    let entry_count = r.usize()?;
+    let hash_count = r.usize()?;
+    if restart_interval == 0
+        || restarts.len()
+            != entry_count
+                .checked_add(restart_interval - 1)
+                .ok_or("inconsistent restart table")?
+                / restart_interval
+    {
+        return Err("inconsistent restart table");
+    }
+    if hash_count > r.remaining() / BLAKE_HASH_SIZE_BYTES {
+        return Err("hash table too long");
+    }
+    let hashes: Vec<BlockHash> = (0..hash_count)
+        .map(|_| r.bytes(BLAKE_HASH_SIZE_BYTES).map(BlockHash::from_bytes))
+        .collect::<DecodeResult<_>>()?;
+    let entries_start = r.pos;
+    if entry_count > r.remaining() / MIN_ENTRY_LEN {
+        return Err("entry count too large for hunk");
+    }
+    if restarts
+        .iter()
+        .any(|&offset| offset < entries_start || offset >= body_end)
+    {
+        return Err("restart offset out of range");
+    }
+
+    // Find the last restart point whose apath is before `from`; everything before it
+    // can be skipped.
+    let mut first_restart = 0;
+    if from != Bound::Unbounded {
+        let (mut lo, mut hi) = (0, restarts.len());
+        while hi - lo > 1 {
+            let mid = (lo + hi) / 2;
+            r.pos = restarts[mid];
+            if !bound_admits(from, &r.restart_apath()?) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        first_restart = lo;
+    }
+
+    let first_entry = first_restart * restart_interval;
+    r.pos = restarts
+        .get(first_restart)
+        .copied()
+        .unwrap_or(entries_start);
+    let mut entries =
+        Vec::with_capacity(entry_count.saturating_sub(first_entry).min(r.remaining()));
+    let mut apath_buf: Vec<u8> = Vec::new();
+    for _ in first_entry..entry_count {
+        let shared = r.usize()?;
+        if shared > apath_buf.len() {
+            return Err("shared apath prefix too long");
+        }
+        let suffix_len = r.usize()?;
+        apath_buf.truncate(shared);
+        apath_buf.extend_from_slice(r.bytes(suffix_len)?);
+        let kind = kind_from_code(r.byte()?)?;
+        let mtime = unzigzag(r.varint()?);
+        let mtime_nanos = u32::try_from(r.varint()?).map_err(|_| "mtime_nanos out of range")?;
+        let addr_count = r.usize()?;
+        let mut addrs = Vec::with_capacity(addr_count.min(r.remaining()));
+        for _ in 0..addr_count {
+            let hash = hashes
+                .get(r.usize()?)
+                .ok_or("block hash index out of range")?
+                .clone();
+            let start = r.varint()?;
+            let len = r.varint()?;
+            addrs.push(Address { hash, start, len });
+        }
+        let target = match r.usize()? {
+            0 => None,
+            n => Some(
+                String::from_utf8(r.bytes(n - 1)?.to_vec())
+                    .map_err(|_| "symlink target is not UTF-8")?,
+            ),
+        };
+        let apath: Apath = std::str::from_utf8(&apath_buf)
+            .map_err(|_| "apath is not UTF-8")?
+            .parse()
+            .map_err(|_| "invalid apath")?;
+        if !bound_admits(from, &apath) {
+            continue;
+        }
+        entries.push(IndexEntry {
+            apath,
+            kind,
+            mtime,
+            mtime_nanos,
+            addrs,
+            target,
+        });
+    }
+    if r.remaining() != 0 {
+        return Err("unexpected data after index entries");
+    }
+    Ok(entries)
+}
+
+struct Reader<'a> {
+    buf: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn remaining(&self) -> usize {
+        self.buf.len() - self.pos
+    }
+
+    fn byte(&mut self) -> DecodeResult<u8> {
+        let b = *self.buf.get(self.pos).ok_or("truncated index hunk")?;
+        self.pos += 1;
+        Ok(b)
+    }
+
+    fn bytes(&mut self, len: usize) -> DecodeResult<&'a [u8]> {
+        if len > self.remaining() {
+            return Err("truncated index hunk");
+        }
+        let b = &self.buf[self.pos..self.pos + len];
+        self.pos += len;
+        Ok(b)
+    }
+
+    fn varint(&mut self) -> DecodeResult<u64> {
+        let mut value: u64 = 0;
+        let mut shift = 0;
+        loop {
+            let b = self.byte()?;
+            if shift > 63 {
+                return Err("varint too long");
+            }
+            value |= u64::from(b & 0x7f) << shift;
+            if b & 0x80 == 0 {
+                return Ok(value);
+            }
+            shift += 7;
+        }
+    }
+
+    fn usize(&mut self) -> DecodeResult<usize> {
+        usize::try_from(self.varint()?).map_err(|_| "length out of range")
+    }
+
+    /// Read the apath of an entry at a restart point, which is stored whole.
+    fn restart_apath(&mut self) -> DecodeResult<Apath> {
+        if self.usize()? != 0 {
+            return Err("restart entry has a shared prefix");
+        }
+        let len = self.usize()?;
+        std::str::from_utf8(self.bytes(len)?)
+            .map_err(|_| "apath is not UTF-8")?
+            .parse()
+            .map_err(|_| "invalid apath")
+    }
+}
+
+fn put_varint(out: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        out.push((value as u8) | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+fn put_bytes(out: &mut Vec<u8>, bytes: &[u8]) {
+    put_varint(out, bytes.len() as u64);
+    out.extend_from_slice(bytes);
+}
+
+fn read_u32_le(b: &[u8]) -> u32 {
+    let mut a = [0u8; 4];
+    a.copy_from_slice(b);
+    u32::from_le_bytes(a)
+}
+
+fn zigzag(v: i64) -> u64 {
+    ((v << 1) ^ (v >> 63)) as u64
+}
+
+fn unzigzag(v: u64) -> i64 {
+    ((v >> 1) as i64) ^ -((v & 1) as i64)
+}
+
+fn kind_code(kind: Kind) -> u8 {
+    match kind {
+        Kind::File => 0,
+        Kind::Dir => 1,
+        Kind::Symlink => 2,
+        Kind::Unknown => 3,
+    }
+}
+
+fn kind_from_code(code: u8) -> DecodeResult<Kind> {
+    match code {
+        0 => Ok(Kind::File),
+        1 => Ok(Kind::Dir),
+        2 => Ok(Kind::Symlink),
+        3 => Ok(Kind::Unknown),
+        _ => Err("unknown entry kind"),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn hash(b: u8) -> BlockHash {
+        BlockHash::from_bytes(&[b; BLAKE_HASH_SIZE_BYTES])
+    }
+
+    fn sample_entries(n: usize) -> Vec<IndexEntry> {
+        let mut entries = vec![IndexEntry {
+            apath: "/".into(),
+            kind: Kind::Dir,
+            mtime: -12345,
+            mtime_nanos: 0,
+            addrs: Vec::new(),
+            target: None,
+        }];
+        for i in 0..n {
+            entries.push(IndexEntry {
+                apath: format!("/file{:05}", i).into(),
+                kind: Kind::File,
+                mtime: 1_600_000_000 + i as i64,
+                mtime_nanos: 999_999_999,
+                addrs: vec![
+                    Address {
+                        hash: hash((i % 3) as u8),
+                        start: i as u64 * 100,
+                        len: 100,
+                    },
+                    Address {
+                        hash: hash(7),
+                        start: 0,
+                        len: 1 << 20,
+                    },
+                ],
+                target: None,
+            });
+        }
+        entries.push(IndexEntry {
+            apath: "/link".into(),
+            kind: Kind::Symlink,
+            mtime: 0,
+            mtime_nanos: 0,
+            addrs: Vec::new(),
+            target: Some("../target/ü".to_owned()),
+        });
+        entries.sort_by(|a, b| a.apath.cmp(&b.apath));
+        entries
+    }
+
+    #[test]
+    fn round_trip() {
+        let entries = sample_entries(100);
+        let mut buf = Vec::new();
+        encode_hunk(&entries, &mut buf);
+        assert!(is_binary_hunk(&buf));
+        assert!(buf.len() < serde_json::to_vec(&entries).unwrap().len() / 3);
+        assert_eq!(decode_hunk(&buf, Bound::Unbounded).unwrap(), entries);
+    }
+
+    #[test]
+    fn round_trip_empty() {
+        let mut buf = Vec::new();
+        encode_hunk(&[], &mut buf);
+        assert_eq!(decode_hunk(&buf, Bound::Unbounded).unwrap(), []);
+        assert_eq!(
+            decode_hunk(&buf, Bound::Excluded(&"/a".into())).unwrap(),
+            []
+        );
+    }
+
+    #[test]
+    fn decode_after() {
+        let entries = sample_entries(100);
+        let mut buf = Vec::new();
+        encode_hunk(&entries, &mut buf);
+        for i in 0..entries.len() {
+            let apath = &entries[i].apath;
+            assert_eq!(
+                decode_hunk(&buf, Bound::Excluded(apath)).unwrap(),
+                &entries[i + 1..],
+                "after {}",
+                apath
+            );
+            assert_eq!(
+                decode_hunk(&buf, Bound::Included(apath)).unwrap(),
+                &entries[i..],
+                "from {}",
+                apath
+            );
+        }
+        assert_eq!(
+            decode_hunk(&buf, Bound::Excluded(&"/".into())).unwrap(),
+            &entries[1..]
+        );
+        assert_eq!(
+            decode_hunk(&buf, Bound::Excluded(&"/zzz/zzz".into())).unwrap(),
+            []
+        );
+    }
+
+    #[test]
+    fn truncated_hunks_are_errors() {
+        let entries = sample_entries(20);
+        let mut buf = Vec::new();
+        encode_hunk(&entries, &mut buf);
+        for len in 0..buf.len() {
+            assert!(decode_hunk(&buf[..len], Bound::Unbounded).is_err());
+        }
+    }
+
+    #[test]
+    fn huge_entry_count_is_an_error() {
+        let mut buf = MAGIC.to_vec();
+        buf.push(FORMAT_VERSION);
+        put_varint(&mut buf, 1 << 40); // restart interval
+        put_varint(&mut buf, 1 << 40); // entry count
+        put_varint(&mut buf, 0); // hash count
+        let entries_start = buf.len() as u32;
+        buf.extend_from_slice(&[0; 20]);
+        buf.extend_from_slice(&entries_start.to_le_bytes());
+        buf.extend_from_slice(&1u32.to_le_bytes());
+        assert_eq!(
+            decode_hunk(&buf, Bound::Unbounded),
+            Err("entry count too large for hunk")
+        );
+    }
+
+    #[test]
+    fn json_is_not_binary() {
+        let json = serde_json::to_vec(&sample_entries(1)).unwrap();
+        assert!(!is_binary_hunk(&json));
+        assert!(decode_hunk(&json, Bound::Unbounded).is_err());
+    }
+}
@@ -13,10 +13,21 @@
 
 //! IO utilities.
 
-use std::fs;
+use std::fs::{self, File};
 use std::io;
 use std::io::prelude::*;
+use std::io::SeekFrom;
 use std::path::Path;
+use std::time::Instant;
+
+use crate::throttle;
+
+/// When dropping a source file's pages from the cache, do it after each of this many
+/// bytes are read, rather than holding the whole file in the cache until the end.
+const DROP_CACHE_INTERVAL: u64 = 8 << 20;
+
+/// Leave holes in sparse restored files only for runs of zeros at least this long.
+const SPARSE_PIECE: usize = 4096;
 
 pub(crate) fn ensure_dir_exists(path: &Path) -> std::io::Result<()> {
     fs::create_dir(path).or_else(|e| {
@@ -52,3 +63,201 @@ pub(crate) fn read_with_retries(
     buf.truncate(bytes_read);
     Ok(())
 }
+
+/// A source file being read for a backup, optionally advising the kernel that it's read
+/// sequentially and that its pages needn't stay in the cache once they've been read.
+///
+/// Dropping pages from the cache keeps a backup from evicting the working set of other
+/// programs. Only clean pages are dropped, and the advice is ignored on platforms
+/// that don't support it.
+pub(crate) struct SourceFile {
+    file: File,
+    drop_cache: bool,
+    /// Bytes read so far.
+    pos: u64,
+    /// Pages before this offset have already been dropped.
+    dropped: u64,
+}
+
+impl SourceFile {
+    pub fn new(file: File, drop_cache: bool) -> SourceFile {
+        if drop_cache {
+            fadvise(&file, 0, 0, Advice::Sequential);
+        }
+        SourceFile {
+            file,
+            drop_cache,
+            pos: 0,
+            dropped: 0,
+        }
+    }
+}
+
+impl Read for SourceFile {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let start = Instant::now();
+        let len = self.file.read(buf)?;
+        throttle::source_read(len as u64, start.elapsed());
+        self.pos += len as u64;
+        if self.drop_cache && self.pos - self.dropped >= DROP_CACHE_INTERVAL {
+            fadvise(
+                &self.file,
+                self.dropped,
+                self.pos - self.dropped,
+                Advice::DontNeed,
+            );
+            self.dropped = self.pos;
+        }
+        Ok(len)
+    }
+}
+
+impl Drop for SourceFile {
+    fn drop(&mut self) {
+        if self.drop_cache && self.pos > self.dropped {
+            // A length of 0 means through to the end of the file.
+            fadvise(&self.file, self.dropped, 0, Advice::DontNeed);
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+enum Advice {
+    Sequential,
+    DontNeed,
+}
+
+/// Advise the kernel how a range of a file will be used; this is only a hint, so
+/// failures are ignored.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn fadvise(file: &File, offset: u64, len: u64, advice: Advice) {
+    use std::os::unix::io::AsRawFd;
+    let advice = match advice {
+        Advice::Sequential => libc::POSIX_FADV_SEQUENTIAL,
+        Advice::DontNeed => libc::POSIX_FADV_DONTNEED,
+    };
+    unsafe {
+        libc::posix_fadvise(
+            file.as_raw_fd(),
+            offset as libc::off_t,
+            len as libc::off_t,
+            advice,
+        );
+    }
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+fn fadvise(_file: &File, _offset: u64, _len: u64, _advice: Advice) {}
+
+/// Allocate space for the whole length of a new file before writing it, so that it's
+/// less fragmented.
+///
+/// This is only a hint: if the filesystem or platform doesn't support it, the file is
+/// just written as usual.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub(crate) fn preallocate(file: &File, len: u64) {
+    use std::os::unix::io::AsRawFd;
+    if len > 0 {
+        unsafe {
+            libc::fallocate(file.as_raw_fd(), 0, 0, len as libc::off_t);
+        }
+    }
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub(crate) fn preallocate(_file: &File, _len: u64) {}
+
+/// Copy everything from a reader into a new file, seeking over runs of zeros rather
+/// than writing them, so that they become holes on filesystems that support sparse
+/// files.
+///
+/// Returns the number of bytes copied, including zeros.
+pub(crate) fn copy_sparse(from: &mut dyn Read, to: &mut File) -> io::Result<u64> {
+    let mut buf = vec![0u8; 1 << 20];
+    let mut total: u64 = 0;
+    // Zeros read but not yet seeked over.
+    let mut hole: u64 = 0;
+    loop {
+        let len = match from.read(&mut buf) {
+            Ok(0) => break,
+            Ok(len) => len,
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+            Err(err) => return Err(err),
+        };
+        let data = &buf[..len];
+        // Start of the data read but not yet written.
+        let mut run_start = 0;
+        for (i, piece) in data.chunks(SPARSE_PIECE).enumerate() {
+            if piece.iter().all(|&b| b == 0) {
+                let piece_start = i * SPARSE_PIECE;
+                write_after_hole(to, &mut hole, &data[run_start..piece_start])?;
+                hole += piece.len() as u64;
+                run_start = piece_start + piece.len();
+            }
+        }
+        write_after_hole(to, &mut hole, &data[run_start..])?;
+        total += len as u64;
+    }
+    if hole > 0 {
+        // Extend the file over the trailing hole.
+        to.set_len(total)?;
+    }
+    Ok(total)
+}
+
+/// Seek over any pending hole, and then write some data, unless it's empty.
+fn write_after_hole(to: &mut File, hole: &mut u64, data: &[u8]) -> io::Result<()> {
+    if data.is_empty() {
+        return Ok(());
+    }
+    if *hole > 0 {
+        to.seek(SeekFrom::Current(*hole as i64))?;
+        *hole = 0;
+    }
+    to.write_all(data)
+}
+
+#[cfg(test)]
+mod tests {
+    use tempfile::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn copy_sparse_preserves_content() {
+        let temp = TempDir::new().unwrap();
+        let mut content = vec![0u8; 3 << 20];
+        content[..10].copy_from_slice(b"0123456789");
+        content[SPARSE_PIECE * 100 + 7] = 1;
+        let cases: Vec<Vec<u8>> = vec![
+            Vec::new(),
+            vec![0; 10],
+            vec![1; 10],
+            vec![0; SPARSE_PIECE * 3],
+            content,
+        ];
+        for (i, case) in cases.iter().enumerate() {
+            let path = temp.path().join(format!("f{}", i));
+            let mut file = File::create(&path).unwrap();
+            let copied = copy_sparse(&mut case.as_slice(), &mut file).unwrap();
+            drop(file);
+            assert_eq!(copied, case.len() as u64);
+            assert_eq!(&fs::read(&path).unwrap(), case, "case {}", i);
+        }
+    }
+
+    #[test]
+    fn source_file_reads_all_content() {
+        let temp = TempDir::new().unwrap();
+        let path = temp.path().join("f");
+        let content = vec![b'x'; (DROP_CACHE_INTERVAL as usize) * 2 + 123];
+        fs::write(&path, &content).unwrap();
+        for &drop_cache in &[false, true] {
+            let mut read = Vec::new();
+            SourceFile::new(File::open(&path).unwrap(), drop_cache)
+                .read_to_end(&mut read)
+                .unwrap();
+            assert_eq!(read, content);
+        }
+    }
+}
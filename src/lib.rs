@@ -13,6 +13,9 @@
 //! Conserve backup system.
 
 // Conserve implementation modules.
+// trace is first so that its macro is visible in the others.
+#[macro_use]
+pub mod trace;
 pub mod apath;
 pub mod archive;
 pub mod backup;
@@ -20,6 +23,7 @@ mod band;
 pub mod bandid;
 mod blockdir;
 pub mod blockhash;
+pub mod chunker;
 pub mod compress;
 mod diff;
 mod entry;
@@ -32,36 +36,44 @@ mod jsonio;
 pub mod kind;
 pub mod live_tree;
 mod merge;
+pub mod metrics;
 pub(crate) mod misc;
+mod prefetch;
 mod progress;
+mod referenced;
 pub mod restore;
 pub mod show;
+mod stat_cache;
 pub mod stats;
 mod stitch;
 mod stored_file;
 mod stored_tree;
 pub mod test_fixtures;
+pub mod throttle;
 pub mod transport;
 mod tree;
 pub mod ui;
 pub mod unix_time;
 mod validate;
+mod verified;
 
 pub use crate::apath::Apath;
 pub use crate::archive::Archive;
-pub use crate::archive::DeleteOptions;
+pub use crate::archive::{ArchiveOptions, DeleteOptions};
 pub use crate::backup::{backup, BackupOptions};
-pub use crate::band::Band;
 pub use crate::band::BandSelectionPolicy;
+pub use crate::band::{Band, BandOptions};
 pub use crate::bandid::BandId;
-pub use crate::blockdir::BlockDir;
-pub use crate::blockhash::BlockHash;
-pub use crate::diff::{diff, DiffEntry, DiffKind, DiffOptions};
+pub use crate::blockdir::{BlockDir, BlockSlice};
+pub use crate::blockhash::{BlockHash, HashAlgorithm};
+pub use crate::chunker::ContentChunking;
+pub use crate::compress::Compression;
+pub use crate::diff::{diff, diff_stored, DiffEntry, DiffKind, DiffOptions};
 pub use crate::entry::Entry;
 pub use crate::errors::Error;
 pub use crate::excludes::{excludes_nothing, ExcludeBuilder};
 pub use crate::gc_lock::GarbageCollectionLock;
-pub use crate::index::{IndexEntry, IndexRead, IndexWriter};
+pub use crate::index::{IndexEntry, IndexFormat, IndexRead, IndexWriter};
 pub use crate::kind::Kind;
 pub use crate::live_tree::{LiveEntry, LiveTree};
 pub use crate::merge::{MergeTrees, MergedEntryKind};
@@ -69,7 +81,7 @@ pub use crate::misc::bytes_to_human_mb;
 pub use crate::progress::ProgressBar;
 pub use crate::restore::{restore, RestoreOptions, RestoreTree};
 pub use crate::show::{show_diff, show_versions, ShowVersionsOptions};
-pub use crate::stats::{BackupStats, DeleteStats, RestoreStats, ValidateStats};
+pub use crate::stats::{BackupStats, DeleteStats, RestoreStats, TreeStats, ValidateStats};
 pub use crate::stored_tree::StoredTree;
 pub use crate::transport::{open_transport, Transport};
 pub use crate::tree::{ReadBlocks, ReadTree, TreeSize};
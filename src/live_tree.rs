@@ -14,12 +14,17 @@
 //! Find source files within a source directory, in apath order.
 
 use std::collections::vec_deque::VecDeque;
+use std::collections::HashMap;
 use std::fs;
 use std::io::ErrorKind;
 use std::path::{Path, PathBuf};
+use std::sync::{mpsc, Arc};
 
 use globset::GlobSet;
 
+use crate::metrics::{Phase, Timer};
+use crate::prefetch;
+use crate::stat_cache::FileIdentity;
 use crate::stats::LiveTreeIterStats;
 use crate::unix_time::UnixTime;
 use crate::Result;
@@ -53,6 +58,8 @@ pub struct LiveEntry {
     mtime: UnixTime,
     size: Option<u64>,
     symlink_target: Option<String>,
+    /// Device, inode and ctime, where the platform has them.
+    identity: Option<FileIdentity>,
 }
 
 fn relative_path(root: &Path, apath: &Apath) -> PathBuf {
@@ -134,10 +141,18 @@ impl LiveEntry {
             mtime,
             symlink_target,
             size,
+            identity: FileIdentity::from_metadata(metadata),
         }
     }
+
+    pub(crate) fn identity(&self) -> Option<&FileIdentity> {
+        self.identity.as_ref()
+    }
 }
 
+/// Read and stat up to this many directories ahead of the one being returned.
+const DIRECTORY_READ_AHEAD: usize = 32;
+
 /// Recursive iterator of the contents of a live tree.
 #[derive(Debug)]
 pub struct Iter {
@@ -151,11 +166,21 @@ pub struct Iter {
     /// should be returned.
     entry_deque: VecDeque<LiveEntry>,
 
+    /// Directories being read in the background, ahead of being visited.
+    ///
+    /// These are always among the first directories in `dir_deque`, although new
+    /// subdirectories can be pushed in front of them.
+    dir_reads: HashMap<Apath, mpsc::Receiver<(Vec<LiveEntry>, LiveTreeIterStats)>>,
+
     /// Check that emitted paths are in the right order.
     check_order: apath::DebugCheckOrder,
 
     /// glob pattern to skip in iterator
-    excludes: GlobSet,
+    excludes: Arc<GlobSet>,
+
+    /// Skip entries up to and including this apath, without reading directories whose
+    /// contents all sort before it.
+    skip_through: Option<Apath>,
 
     stats: LiveTreeIterStats,
 }
@@ -182,143 +207,204 @@ impl Iter {
             root_path: root_path.to_path_buf(),
             entry_deque,
             dir_deque,
+            dir_reads: HashMap::new(),
             check_order: apath::DebugCheckOrder::new(),
-            excludes,
+            excludes: Arc::new(excludes),
+            skip_through: None,
             stats: LiveTreeIterStats::default(),
         })
     }
 
-    /// Visit the next directory.
+    /// Return only entries ordered after `apath`.
     ///
-    /// Any errors occurring are logged but not returned; we'll continue to
-    /// visit whatever can be read.
+    /// Directories whose descendants all sort before `apath` aren't read at all, so this
+    /// is much cheaper than walking the tree up to that point.
+    pub fn advance_to_after(mut self, apath: &Apath) -> Self {
+        self.skip_through = Some(apath.clone());
+        self
+    }
+
+    /// True if nothing inside this directory needs to be returned.
+    fn is_skipped_dir(&self, dir: &Apath) -> bool {
+        match &self.skip_through {
+            // Descendants of a directory are contiguous in apath order, so if the skip
+            // point is past their start and isn't among them, it's after all of them.
+            Some(skip) => *skip > dir.descendants_start() && !dir.is_prefix_of(skip),
+            None => false,
+        }
+    }
+
+    /// Visit the next directory, using the results of reading it in the background if
+    /// that was started.
     fn visit_next_directory(&mut self, parent_apath: &Apath) {
-        // TODO: Rather than mutating self, return new vectors to append, so that
-        // this function isn't too big?
-        //
-        // TODO: Perhaps reuse the child buffer in the Iter, which we know will
-        // now be empty? We have to be able to sort it, but perhaps a Vec in
-        // reverse order from which we pop would work well.
-        self.stats.directories_visited += 1;
-        let mut children = Vec::<(String, LiveEntry)>::new();
-        let dir_path = relative_path(&self.root_path, parent_apath);
-        let dir_iter = match fs::read_dir(&dir_path) {
-            Ok(i) => i,
+        let (children, stats) = match self.dir_reads.remove(parent_apath) {
+            Some(rx) => rx.recv().expect("Directory read task panicked"),
+            None => read_directory(&self.root_path, parent_apath, &self.excludes),
+        };
+        self.stats += stats;
+        // To get the right overall tree ordering, any new subdirectories
+        // discovered here should be visited together in apath order, but before
+        // any previously pending directories. In other words, in reverse order
+        // push them onto the front of the dir deque.
+        for idir in children.iter().filter(|x| x.kind == Kind::Dir).rev() {
+            self.dir_deque.push_front(idir.apath().clone())
+        }
+        self.entry_deque.reserve(children.len());
+        self.entry_deque.extend(children);
+        self.start_directory_reads();
+    }
+
+    /// Start reading the next few directories that will be visited.
+    fn start_directory_reads(&mut self) {
+        for apath in self.dir_deque.iter().take(DIRECTORY_READ_AHEAD) {
+            if self.dir_reads.len() >= DIRECTORY_READ_AHEAD {
+                break;
+            }
+            if self.dir_reads.contains_key(apath) || self.is_skipped_dir(apath) {
+                continue;
+            }
+            let root_path = self.root_path.clone();
+            let excludes = Arc::clone(&self.excludes);
+            let dir_apath = apath.clone();
+            let rx = prefetch::spawn(move || read_directory(&root_path, &dir_apath, &excludes));
+            self.dir_reads.insert(apath.clone(), rx);
+        }
+    }
+}
+
+/// List and stat the children of a directory, returning them in apath order.
+///
+/// Any errors occurring are logged but not returned; we'll continue to
+/// visit whatever can be read.
+fn read_directory(
+    root_path: &Path,
+    parent_apath: &Apath,
+    excludes: &GlobSet,
+) -> (Vec<LiveEntry>, LiveTreeIterStats) {
+    // TODO: Perhaps reuse the child buffer in the Iter, which we know will
+    // now be empty? We have to be able to sort it, but perhaps a Vec in
+    // reverse order from which we pop would work well.
+    let _timer = Timer::start(Phase::WalkSourceDir);
+    let mut stats = LiveTreeIterStats {
+        directories_visited: 1,
+        ..LiveTreeIterStats::default()
+    };
+    let mut children = Vec::<LiveEntry>::new();
+    // Reused to build the apath of each child, which is then copied once into its Apath.
+    let mut child_apath_str = String::new();
+    let dir_path = relative_path(root_path, parent_apath);
+    let dir_iter = match fs::read_dir(&dir_path) {
+        Ok(i) => i,
+        Err(e) => {
+            ui::problem(&format!("Error reading directory {:?}: {}", &dir_path, e));
+            return (Vec::new(), stats);
+        }
+    };
+    for dir_entry in dir_iter {
+        let dir_entry = match dir_entry {
+            Ok(dir_entry) => dir_entry,
             Err(e) => {
-                ui::problem(&format!("Error reading directory {:?}: {}", &dir_path, e));
-                return;
+                ui::problem(&format!(
+                    "Error reading next entry from directory {:?}: {}",
+                    &dir_path, e
+                ));
+                continue;
             }
         };
-        for dir_entry in dir_iter {
-            let dir_entry = match dir_entry {
-                Ok(dir_entry) => dir_entry,
-                Err(e) => {
-                    ui::problem(&format!(
-                        "Error reading next entry from directory {:?}: {}",
-                        &dir_path, e
-                    ));
-                    continue;
-                }
-            };
-            let mut child_apath_str = parent_apath.to_string();
-            // TODO: Specific Apath join method?
-            if child_apath_str != "/" {
-                child_apath_str.push('/');
+        child_apath_str.clear();
+        child_apath_str.push_str(parent_apath);
+        // TODO: Specific Apath join method?
+        if child_apath_str != "/" {
+            child_apath_str.push('/');
+        }
+        let child_osstr = &dir_entry.file_name();
+        let child_name = match child_osstr.to_str() {
+            Some(c) => c,
+            None => {
+                ui::problem(&format!(
+                    "Can't decode filename {:?} in {:?}",
+                    child_osstr, dir_path,
+                ));
+                continue;
             }
-            let child_osstr = &dir_entry.file_name();
-            let child_name = match child_osstr.to_str() {
-                Some(c) => c,
-                None => {
-                    ui::problem(&format!(
-                        "Can't decode filename {:?} in {:?}",
-                        child_osstr, dir_path,
-                    ));
-                    continue;
-                }
-            };
-            child_apath_str.push_str(child_name);
-            let ft = match dir_entry.file_type() {
-                Ok(ft) => ft,
-                Err(e) => {
-                    ui::problem(&format!(
-                        "Error getting type of {:?} during iteration: {}",
-                        child_apath_str, e
-                    ));
-                    continue;
-                }
-            };
-
-            if self.excludes.is_match(&child_apath_str) {
-                self.stats.exclusions += 1;
+        };
+        child_apath_str.push_str(child_name);
+        let ft = match dir_entry.file_type() {
+            Ok(ft) => ft,
+            Err(e) => {
+                ui::problem(&format!(
+                    "Error getting type of {:?} during iteration: {}",
+                    child_apath_str, e
+                ));
                 continue;
             }
+        };
 
-            let metadata = match dir_entry.metadata() {
-                Ok(metadata) => metadata,
-                Err(e) => {
-                    match e.kind() {
-                        ErrorKind::NotFound => {
-                            // Fairly harmless, and maybe not even worth logging. Just a race
-                            // between listing the directory and looking at the contents.
-                            ui::problem(&format!(
-                                "File disappeared during iteration: {:?}: {}",
-                                child_apath_str, e
-                            ));
-                        }
-                        _ => {
-                            ui::problem(&format!(
-                                "Failed to read source metadata from {:?}: {}",
-                                child_apath_str, e
-                            ));
-                            self.stats.metadata_error += 1;
-                        }
-                    };
-                    continue;
-                }
-            };
+        if excludes.is_match(&child_apath_str) {
+            stats.exclusions += 1;
+            continue;
+        }
 
-            // TODO: Move this into LiveEntry::from_fs_metadata, once there's a
-            // global way for it to complain about errors.
-            let target: Option<String> = if ft.is_symlink() {
-                let t = match dir_path.join(dir_entry.file_name()).read_link() {
-                    Ok(t) => t,
-                    Err(e) => {
+        let metadata = match dir_entry.metadata() {
+            Ok(metadata) => metadata,
+            Err(e) => {
+                match e.kind() {
+                    ErrorKind::NotFound => {
+                        // Fairly harmless, and maybe not even worth logging. Just a race
+                        // between listing the directory and looking at the contents.
                         ui::problem(&format!(
-                            "Failed to read target of symlink {:?}: {}",
+                            "File disappeared during iteration: {:?}: {}",
                             child_apath_str, e
                         ));
-                        continue;
                     }
-                };
-                match t.into_os_string().into_string() {
-                    Ok(t) => Some(t),
-                    Err(e) => {
+                    _ => {
                         ui::problem(&format!(
-                            "Failed to decode target of symlink {:?}: {:?}",
+                            "Failed to read source metadata from {:?}: {}",
                             child_apath_str, e
                         ));
-                        continue;
+                        stats.metadata_error += 1;
                     }
+                };
+                continue;
+            }
+        };
+
+        // TODO: Move this into LiveEntry::from_fs_metadata, once there's a
+        // global way for it to complain about errors.
+        let target: Option<String> = if ft.is_symlink() {
+            let t = match dir_path.join(dir_entry.file_name()).read_link() {
+                Ok(t) => t,
+                Err(e) => {
+                    ui::problem(&format!(
+                        "Failed to read target of symlink {:?}: {}",
+                        child_apath_str, e
+                    ));
+                    continue;
                 }
-            } else {
-                None
             };
-            children.push((
-                child_name.to_string(),
-                LiveEntry::from_fs_metadata(child_apath_str.into(), &metadata, target),
-            ));
-        }
-        children.sort_unstable_by(|a, b| a.0.cmp(&b.0));
-        // To get the right overall tree ordering, any new subdirectories
-        // discovered here should be visited together in apath order, but before
-        // any previously pending directories. In other words, in reverse order
-        // push them onto the front of the dir deque.
-        for idir in children.iter().filter(|x| x.1.kind == Kind::Dir).rev() {
-            self.dir_deque.push_front(idir.1.apath().clone())
-        }
-        self.entry_deque.reserve(children.len());
-        self.entry_deque.extend(children.into_iter().map(|x| x.1));
+            match t.into_os_string().into_string() {
+                Ok(t) => Some(t),
+                Err(e) => {
+                    ui::problem(&format!(
+                        "Failed to decode target of symlink {:?}: {:?}",
+                        child_apath_str, e
+                    ));
+                    continue;
+                }
+            }
+        } else {
+            None
+        };
+        children.push(LiveEntry::from_fs_metadata(
+            Apath::from(child_apath_str.as_str()),
+            &metadata,
+            target,
+        ));
     }
+    // The children all have the same parent, so sorting their apaths as strings sorts
+    // them by name.
+    children.sort_unstable_by(|a, b| (*a.apath).cmp(&*b.apath));
+    (children, stats)
 }
 
 // The source iterator yields one path at a time as it walks through the source directories.
@@ -335,12 +421,22 @@ impl Iterator for Iter {
     fn next(&mut self) -> Option<LiveEntry> {
         loop {
             if let Some(entry) = self.entry_deque.pop_front() {
+                if let Some(skip) = &self.skip_through {
+                    if entry.apath <= *skip {
+                        continue;
+                    }
+                    // Everything from here on is later.
+                    self.skip_through = None;
+                }
                 // Have already found some entries, so just return the first.
                 self.stats.entries_returned += 1;
                 // Sanity check that all the returned paths are in correct order.
                 self.check_order.check(&entry.apath);
                 return Some(entry);
             } else if let Some(entry) = self.dir_deque.pop_front() {
+                if self.is_skipped_dir(&entry) {
+                    continue;
+                }
                 // No entries already queued, visit a new directory to try to refill the queue.
                 self.visit_next_directory(&entry)
             } else {
@@ -388,7 +484,7 @@ mod tests {
         assert_eq!(result.len(), 7);
 
         let repr = format!("{:?}", &result[6]);
-        let re = Regex::new(r#"LiveEntry \{ apath: Apath\("/jam/apricot"\), kind: File, mtime: UnixTime \{ [^)]* \}, size: Some\(8\), symlink_target: None \}"#).unwrap();
+        let re = Regex::new(r#"LiveEntry \{ apath: Apath\("/jam/apricot"\), kind: File, mtime: UnixTime \{ [^)]* \}, size: Some\(8\), symlink_target: None, identity: (None|Some\(FileIdentity \{ .* \}\)) \}"#).unwrap();
         assert!(re.is_match(&repr));
 
         // TODO: Somehow get the stats out of the iterator.
@@ -460,4 +556,81 @@ mod tests {
 
         assert_eq!(names.as_slice(), ["/subdir", "/subdir/a", "/subdir/b"]);
     }
+
+    #[test]
+    fn many_directories_read_ahead_in_order() {
+        // More directories than are read ahead at once, nested so that subdirectories are
+        // discovered while their siblings are still being read.
+        let tf = TreeFixture::new();
+        for i in 0..40 {
+            let dir = format!("d{:02}", i);
+            tf.create_dir(&dir);
+            tf.create_file(&format!("{}/f", dir));
+            for j in 0..3 {
+                tf.create_dir(&format!("{}/s{}", dir, j));
+                tf.create_file(&format!("{}/s{}/g", dir, j));
+            }
+        }
+        let lt = LiveTree::open(tf.path()).unwrap();
+        let apaths: Vec<Apath> = lt
+            .iter_entries(None, excludes_nothing())
+            .unwrap()
+            .map(|entry| entry.apath)
+            .collect();
+        assert_eq!(apaths.len(), 1 + 40 * (2 + 3 * 2));
+        let mut sorted = apaths.clone();
+        sorted.sort();
+        assert_eq!(apaths, sorted);
+        assert_eq!(apaths[1], "/d00");
+        assert_eq!(apaths[41], "/d00/f");
+    }
+
+    #[test]
+    fn advance_to_after_matches_filtered_walk() {
+        let tf = TreeFixture::new();
+        for d in &["a", "b", "c"] {
+            tf.create_dir(d);
+            tf.create_file(&format!("{}/f", d));
+            tf.create_dir(&format!("{}/sub", d));
+            tf.create_file(&format!("{}/sub/g", d));
+        }
+        tf.create_file("z");
+        let lt = LiveTree::open(tf.path()).unwrap();
+        let all: Vec<Apath> = lt
+            .iter_entries(None, excludes_nothing())
+            .unwrap()
+            .map(|entry| entry.apath)
+            .collect();
+        for skip in &all {
+            let after: Vec<Apath> = lt
+                .iter_entries(None, excludes_nothing())
+                .unwrap()
+                .advance_to_after(skip)
+                .map(|entry| entry.apath)
+                .collect();
+            let expected: Vec<Apath> = all.iter().filter(|a| *a > skip).cloned().collect();
+            assert_eq!(after, expected, "after {}", skip);
+        }
+    }
+
+    #[test]
+    fn advance_to_after_skips_reading_earlier_directories() {
+        let tf = TreeFixture::new();
+        tf.create_dir("a");
+        tf.create_file("a/f");
+        tf.create_dir("b");
+        tf.create_file("b/f");
+        tf.create_file("b/g");
+        let lt = LiveTree::open(tf.path()).unwrap();
+        let iter = lt
+            .iter_entries(None, excludes_nothing())
+            .unwrap()
+            .advance_to_after(&"/b/f".into());
+        // Everything in /a sorts before /b/f, but /b must still be read.
+        assert!(iter.is_skipped_dir(&"/a".into()));
+        assert!(!iter.is_skipped_dir(&"/b".into()));
+        assert!(!iter.is_skipped_dir(&"/".into()));
+        let apaths: Vec<Apath> = iter.map(|entry| entry.apath).collect();
+        assert_eq!(apaths, [Apath::from("/b/g")]);
+    }
 }
@@ -0,0 +1,238 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Process-wide counters of the time, operations and bytes spent in each phase of work,
+//! to show where time goes.
+//!
+//! Times are summed across all threads, so phases running in parallel can add up to
+//! more than the elapsed time. Some phases contain others: for example storing a block
+//! includes compressing it and the transport write.
+
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering::Relaxed};
+use std::time::Instant;
+
+use lazy_static::lazy_static;
+use serde::Serialize;
+
+use crate::*;
+
+/// A kind of work that's timed and counted.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum Phase {
+    /// Listing and statting one source directory.
+    WalkSourceDir,
+    /// Reading source file content.
+    ReadSource,
+    /// Hashing a block.
+    HashBlock,
+    /// Compressing a block.
+    CompressBlock,
+    /// Decompressing a block.
+    DecompressBlock,
+    /// Storing new blocks, including checking whether they're present, compressing and
+    /// writing them.
+    StoreBlocks,
+    /// Serializing and compressing an index hunk.
+    EncodeIndexHunk,
+    /// Writing out pending index hunks.
+    FlushIndex,
+    /// Reading a file from the transport.
+    TransportRead,
+    /// Writing a file to the transport.
+    TransportWrite,
+    /// Checking whether a file exists or reading its metadata.
+    TransportStat,
+    /// Listing a directory.
+    TransportList,
+    /// Removing a file.
+    TransportRemove,
+    /// Waiting to stay within IO rate limits.
+    Throttle,
+}
+
+impl Phase {
+    pub const ALL: &'static [Phase] = &[
+        Phase::WalkSourceDir,
+        Phase::ReadSource,
+        Phase::HashBlock,
+        Phase::CompressBlock,
+        Phase::DecompressBlock,
+        Phase::StoreBlocks,
+        Phase::EncodeIndexHunk,
+        Phase::FlushIndex,
+        Phase::TransportRead,
+        Phase::TransportWrite,
+        Phase::TransportStat,
+        Phase::TransportList,
+        Phase::TransportRemove,
+        Phase::Throttle,
+    ];
+
+    /// The name used for this phase in JSON output.
+    pub fn name(self) -> &'static str {
+        match self {
+            Phase::WalkSourceDir => "walk_source_dir",
+            Phase::ReadSource => "read_source",
+            Phase::HashBlock => "hash_block",
+            Phase::CompressBlock => "compress_block",
+            Phase::DecompressBlock => "decompress_block",
+            Phase::StoreBlocks => "store_blocks",
+            Phase::EncodeIndexHunk => "encode_index_hunk",
+            Phase::FlushIndex => "flush_index",
+            Phase::TransportRead => "transport_read",
+            Phase::TransportWrite => "transport_write",
+            Phase::TransportStat => "transport_stat",
+            Phase::TransportList => "transport_list",
+            Phase::TransportRemove => "transport_remove",
+            Phase::Throttle => "throttle",
+        }
+    }
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    nanos: AtomicU64,
+    ops: AtomicU64,
+    bytes: AtomicU64,
+}
+
+lazy_static! {
+    /// Counters for each phase, in the same order as `Phase::ALL`.
+    static ref COUNTERS: Vec<Counters> = Phase::ALL.iter().map(|_| Counters::default()).collect();
+}
+
+fn counters(phase: Phase) -> &'static Counters {
+    &COUNTERS[phase as usize]
+}
+
+/// Times one operation in a phase, from when it's started until it's dropped.
+#[derive(Debug)]
+pub(crate) struct Timer {
+    phase: Phase,
+    start: Instant,
+    ops: u64,
+    bytes: u64,
+}
+
+impl Timer {
+    pub fn start(phase: Phase) -> Timer {
+        Timer {
+            phase,
+            start: Instant::now(),
+            ops: 1,
+            bytes: 0,
+        }
+    }
+
+    /// Count some bytes processed by this operation.
+    pub fn add_bytes(&mut self, bytes: u64) {
+        self.bytes += bytes;
+    }
+
+    /// Count this as `ops` operations rather than one, for batched work.
+    pub fn set_ops(&mut self, ops: u64) {
+        self.ops = ops;
+    }
+}
+
+impl Drop for Timer {
+    fn drop(&mut self) {
+        let c = counters(self.phase);
+        c.nanos
+            .fetch_add(self.start.elapsed().as_nanos() as u64, Relaxed);
+        c.ops.fetch_add(self.ops, Relaxed);
+        c.bytes.fetch_add(self.bytes, Relaxed);
+    }
+}
+
+/// Totals for one phase.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Serialize)]
+pub struct PhaseMetrics {
+    pub seconds: f64,
+    pub ops: u64,
+    pub bytes: u64,
+}
+
+/// Totals for all phases so far in this process.
+#[derive(Clone, Debug, Default, PartialEq, Serialize)]
+pub struct Metrics {
+    /// Phases that had any operations, by name.
+    pub phases: BTreeMap<&'static str, PhaseMetrics>,
+}
+
+impl Metrics {
+    /// Return the totals so far for this process.
+    pub fn snapshot() -> Metrics {
+        let phases = Phase::ALL
+            .iter()
+            .map(|&phase| {
+                let c = counters(phase);
+                (
+                    phase.name(),
+                    PhaseMetrics {
+                        seconds: c.nanos.load(Relaxed) as f64 / 1e9,
+                        ops: c.ops.load(Relaxed),
+                        bytes: c.bytes.load(Relaxed),
+                    },
+                )
+            })
+            .filter(|(_, m)| m.ops > 0)
+            .collect();
+        Metrics { phases }
+    }
+
+    pub fn get(&self, phase: Phase) -> PhaseMetrics {
+        self.phases.get(phase.name()).cloned().unwrap_or_default()
+    }
+
+    /// Write these metrics as a JSON object to a file.
+    pub fn write_json(&self, path: &Path) -> Result<()> {
+        let mut writer = BufWriter::new(File::create(path)?);
+        serde_json::to_writer_pretty(&mut writer, self).map_err(|source| Error::SerializeJson {
+            path: path.to_string_lossy().into_owned(),
+            source,
+        })?;
+        writer.flush()?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn phase_order_matches_all() {
+        for (i, phase) in Phase::ALL.iter().enumerate() {
+            assert_eq!(*phase as usize, i);
+        }
+    }
+
+    #[test]
+    fn timers_are_counted() {
+        let before = Metrics::snapshot().get(Phase::HashBlock);
+        {
+            let mut timer = Timer::start(Phase::HashBlock);
+            timer.add_bytes(100);
+        }
+        let after = Metrics::snapshot().get(Phase::HashBlock);
+        // Other tests may run concurrently, so there could be more.
+        assert!(after.ops >= before.ops + 1);
+        assert!(after.bytes >= before.bytes + 100);
+        assert!(after.seconds >= before.seconds);
+    }
+}
@@ -0,0 +1,160 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Start reads from the archive or source tree ahead of time, and take the results in order.
+//!
+//! Reading is often bound by storage latency rather than CPU, so the
+//! work runs on a dedicated pool rather than rayon's global pool. That also means code
+//! already running on the global pool can wait on prefetches without deadlocking.
+
+use std::collections::VecDeque;
+use std::sync::mpsc;
+
+use lazy_static::lazy_static;
+use rayon::prelude::*;
+use rayon::{ThreadPool, ThreadPoolBuilder};
+
+/// Minimum number of threads for prefetching, even on machines with few CPUs: they
+/// mostly wait on IO.
+const MIN_PREFETCH_THREADS: usize = 8;
+
+lazy_static! {
+    static ref PREFETCH_POOL: ThreadPool = ThreadPoolBuilder::new()
+        .num_threads(rayon::current_num_threads().max(MIN_PREFETCH_THREADS))
+        .thread_name(|i| format!("conserve-prefetch-{}", i))
+        .build()
+        .expect("Failed to create prefetch thread pool");
+}
+
+/// Start running `f` on the prefetch pool, and return a channel that will receive its
+/// result.
+pub(crate) fn spawn<T, F>(f: F) -> mpsc::Receiver<T>
+where
+    T: Send + 'static,
+    F: FnOnce() -> T + Send + 'static,
+{
+    let (tx, rx) = mpsc::sync_channel(1);
+    PREFETCH_POOL.spawn_fifo(move || {
+        // If the receiver was dropped, nobody wants the result; that's fine.
+        let _ = tx.send(f());
+    });
+    rx
+}
+
+/// Apply `f` to every item on the prefetch pool, with at most `concurrency` calls
+/// running at once, and return the results in the same order as the items.
+///
+/// This is meant for IO requests whose latency is worth overlapping, rather than for
+/// CPU-bound work.
+pub(crate) fn map_concurrent<T, R, F>(items: &[T], concurrency: usize, f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&T) -> R + Sync,
+{
+    if concurrency <= 1 || items.len() <= 1 {
+        return items.iter().map(f).collect();
+    }
+    // Each chunk runs sequentially, so the number of chunks bounds the requests in flight.
+    let chunk_len = (items.len() + concurrency - 1) / concurrency;
+    PREFETCH_POOL
+        .install(|| {
+            items
+                .par_chunks(chunk_len)
+                .map(|chunk| chunk.iter().map(&f).collect::<Vec<R>>())
+                .collect::<Vec<Vec<R>>>()
+        })
+        .into_iter()
+        .flatten()
+        .collect()
+}
+
+/// A queue of tasks running in the background, whose results are returned in the
+/// order they were pushed.
+pub(crate) struct OrderedPrefetch<T> {
+    pending: VecDeque<mpsc::Receiver<T>>,
+}
+
+impl<T: Send + 'static> OrderedPrefetch<T> {
+    pub fn new() -> OrderedPrefetch<T> {
+        OrderedPrefetch {
+            pending: VecDeque::new(),
+        }
+    }
+
+    /// Start running `f` in the background.
+    pub fn push<F>(&mut self, f: F)
+    where
+        F: FnOnce() -> T + Send + 'static,
+    {
+        self.pending.push_back(spawn(f));
+    }
+
+    /// Wait for and return the result of the oldest task, or None if there are none
+    /// pending.
+    pub fn pop(&mut self) -> Option<T> {
+        self.pending
+            .pop_front()
+            .map(|rx| rx.recv().expect("Prefetch task panicked"))
+    }
+
+    pub fn len(&self) -> usize {
+        self.pending.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.pending.is_empty()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread::sleep;
+    use std::time::Duration;
+
+    use super::*;
+
+    #[test]
+    fn results_are_in_order() {
+        let mut prefetch = OrderedPrefetch::new();
+        for i in 0..20u64 {
+            // Make earlier tasks slower, so they finish out of order.
+            prefetch.push(move || {
+                sleep(Duration::from_millis(20 - i));
+                i
+            });
+        }
+        assert_eq!(prefetch.len(), 20);
+        let results: Vec<u64> = std::iter::from_fn(|| prefetch.pop()).collect();
+        assert_eq!(results, (0..20).collect::<Vec<u64>>());
+        assert!(prefetch.is_empty());
+    }
+
+    #[test]
+    fn map_concurrent_keeps_order_and_limit() {
+        use std::sync::atomic::{AtomicUsize, Ordering};
+
+        let running = AtomicUsize::new(0);
+        let max_running = AtomicUsize::new(0);
+        let items: Vec<u64> = (0..40).collect();
+        let results = map_concurrent(&items, 4, |&i| {
+            let now = running.fetch_add(1, Ordering::SeqCst) + 1;
+            max_running.fetch_max(now, Ordering::SeqCst);
+            sleep(Duration::from_millis(2));
+            running.fetch_sub(1, Ordering::SeqCst);
+            i * 2
+        });
+        assert_eq!(results, (0..40).map(|i| i * 2).collect::<Vec<u64>>());
+        assert!(max_running.load(Ordering::SeqCst) <= 4);
+    }
+}
@@ -0,0 +1,148 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! A compact set of the blocks referenced by some bands, for garbage collection.
+//!
+//! Only the first 64 bits of each hash are kept, in a sorted vec, so that archives
+//! with tens of millions of blocks can be collected in modest memory. Two blocks
+//! sharing a prefix means an unreferenced block might be kept, which is harmless
+//! and vanishingly rare; a referenced block is never treated as garbage.
+
+use rayon::prelude::*;
+
+use crate::*;
+
+/// Read this many index hunks at once within each band.
+const HUNK_BATCH: u32 = 64;
+
+#[derive(Debug, Default)]
+pub(crate) struct ReferencedBlocks {
+    /// Sorted, deduplicated hash prefixes.
+    prefixes: Vec<u64>,
+}
+
+impl ReferencedBlocks {
+    /// Find all blocks referenced by the given bands.
+    ///
+    /// Bands are read one at a time, with many hunks of each band read and decoded
+    /// in parallel, so memory is bounded by the set so far plus one band's references.
+    ///
+    /// Unlike reading for restore, any error reading an index is returned: if some
+    /// references are unknown it's not safe to delete anything.
+    pub fn collect(archive: &Archive, band_ids: &[BandId]) -> Result<ReferencedBlocks> {
+        let mut progress_bar = ProgressBar::new();
+        progress_bar.set_phase("Find referenced blocks...");
+        let mut referenced = ReferencedBlocks::default();
+        for (i, band_id) in band_ids.iter().enumerate() {
+            progress_bar.set_fraction(i, band_ids.len());
+            let index = Band::open(archive, band_id)?.index();
+            referenced.add_band(&index)?;
+        }
+        Ok(referenced)
+    }
+
+    fn add_band(&mut self, index: &IndexRead) -> Result<()> {
+        let mut band_prefixes = Vec::new();
+        let mut start = 0;
+        loop {
+            let hunks = index.read_hunks(start..(start + HUNK_BATCH))?;
+            let mut reached_end = false;
+            // Stop at the first missing hunk, as iteration does.
+            for entries in hunks {
+                if let Some(entries) = entries {
+                    band_prefixes.extend(
+                        entries
+                            .iter()
+                            .flat_map(|entry| entry.addrs.iter())
+                            .map(|addr| addr.hash.prefix_u64()),
+                    );
+                } else {
+                    reached_end = true;
+                    break;
+                }
+            }
+            if reached_end {
+                break;
+            }
+            start += HUNK_BATCH;
+        }
+        band_prefixes.par_sort_unstable();
+        band_prefixes.dedup();
+        self.prefixes = merge_sorted(&self.prefixes, &band_prefixes);
+        Ok(())
+    }
+
+    /// True if the block is referenced, or possibly if another block with the same
+    /// prefix is.
+    pub fn contains(&self, hash: &BlockHash) -> bool {
+        self.prefixes.binary_search(&hash.prefix_u64()).is_ok()
+    }
+}
+
+/// Merge two sorted, deduplicated vecs into one.
+fn merge_sorted(a: &[u64], b: &[u64]) -> Vec<u64> {
+    let mut merged = Vec::with_capacity(a.len() + b.len());
+    let (mut i, mut j) = (0, 0);
+    while i < a.len() && j < b.len() {
+        if a[i] < b[j] {
+            merged.push(a[i]);
+            i += 1;
+        } else if a[i] > b[j] {
+            merged.push(b[j]);
+            j += 1;
+        } else {
+            merged.push(a[i]);
+            i += 1;
+            j += 1;
+        }
+    }
+    merged.extend_from_slice(&a[i..]);
+    merged.extend_from_slice(&b[j..]);
+    merged.shrink_to_fit();
+    merged
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_fixtures::{ScratchArchive, TreeFixture};
+
+    #[test]
+    fn merge_sorted_dedups() {
+        assert_eq!(
+            merge_sorted(&[1, 3, 5, 7], &[2, 3, 7, 9]),
+            [1, 2, 3, 5, 7, 9]
+        );
+        assert_eq!(merge_sorted(&[], &[4]), [4]);
+        assert_eq!(merge_sorted(&[4], &[]), [4]);
+    }
+
+    #[test]
+    fn collect_blocks_from_several_bands() {
+        let archive = ScratchArchive::new();
+        let tf = TreeFixture::new();
+        tf.create_file_with_contents("a", b"first file");
+        backup(&archive, &tf.live_tree(), &BackupOptions::default()).unwrap();
+        tf.create_file_with_contents("b", b"second file");
+        backup(&archive, &tf.live_tree(), &BackupOptions::default()).unwrap();
+
+        let band_ids = archive.list_band_ids().unwrap();
+        let referenced = ReferencedBlocks::collect(&archive, &band_ids).unwrap();
+        let all_hashes = archive.referenced_blocks(&band_ids).unwrap();
+        assert_eq!(referenced.prefixes.len(), all_hashes.len());
+        assert!(all_hashes.iter().all(|hash| referenced.contains(hash)));
+
+        let first_band_only = ReferencedBlocks::collect(&archive, &band_ids[..1]).unwrap();
+        assert!(first_band_only.prefixes.len() < referenced.prefixes.len());
+    }
+}
@@ -16,18 +16,25 @@ use std::fs::File;
 use std::io;
 use std::io::Write;
 use std::path::{Path, PathBuf};
+use std::sync::Mutex;
 use std::{fs, time::Instant};
 
 use filetime::{set_file_handle_times, set_symlink_file_times};
 use globset::GlobSet;
+use itertools::Itertools;
+use rayon::prelude::*;
 
 use crate::band::BandSelectionPolicy;
 use crate::entry::Entry;
-use crate::io::{directory_is_empty, ensure_dir_exists};
+use crate::io::{copy_sparse, directory_is_empty, ensure_dir_exists, preallocate};
 use crate::stats::RestoreStats;
 use crate::unix_time::UnixTime;
 use crate::*;
 
+/// Number of entries whose directories are created before their files are written in
+/// parallel.
+const RESTORE_BATCH_ENTRIES: usize = 1000;
+
 /// Description of how to restore a tree.
 #[derive(Debug)]
 pub struct RestoreOptions {
@@ -38,6 +45,20 @@ pub struct RestoreOptions {
     pub overwrite: bool,
     // The band to select, or by default the last complete one.
     pub band_selection: BandSelectionPolicy,
+    /// Fetch and decompress up to this many bytes of each file's content in the
+    /// background, ahead of writing it out. 0 to read blocks only as they're needed.
+    pub read_ahead_bytes: u64,
+    /// Number of threads writing out files, or 0 for one per CPU.
+    pub jobs: usize,
+    /// Keep up to this many bytes of recently-read decompressed blocks in memory, so that
+    /// small files packed into the same block don't each decompress it again.
+    pub block_cache_bytes: u64,
+    /// Allocate space for each whole file before writing its content, so that large
+    /// files are less fragmented. Ignored on platforms without `fallocate`.
+    pub preallocate: bool,
+    /// Leave runs of zeros in restored files as holes, on filesystems that support sparse
+    /// files, rather than writing them out.
+    pub sparse: bool,
 }
 
 impl Default for RestoreOptions {
@@ -48,6 +69,11 @@ impl Default for RestoreOptions {
             band_selection: BandSelectionPolicy::LatestClosed,
             excludes: excludes_nothing(),
             only_subtree: None,
+            read_ahead_bytes: crate::stored_file::DEFAULT_READ_AHEAD_BYTES,
+            jobs: 1,
+            block_cache_bytes: crate::blockdir::DEFAULT_BLOCK_CACHE_BYTES,
+            preallocate: false,
+            sparse: false,
         }
     }
 }
@@ -58,12 +84,33 @@ pub fn restore(
     destination_path: &Path,
     options: &RestoreOptions,
 ) -> Result<RestoreStats> {
-    let st = archive.open_stored_tree(options.band_selection.clone())?;
+    trace_span!("restore");
+    // The cache is shared by everything using this archive, so only change its limit
+    // while restoring.
+    let block_dir = archive.block_dir();
+    let previous_cache_limit = block_dir.block_cache_limit();
+    block_dir.set_block_cache_limit(options.block_cache_bytes);
+    let result = restore_tree(archive, destination_path, options);
+    block_dir.set_block_cache_limit(previous_cache_limit);
+    result
+}
+
+fn restore_tree(
+    archive: &Archive,
+    destination_path: &Path,
+    options: &RestoreOptions,
+) -> Result<RestoreStats> {
+    let mut st = archive.open_stored_tree(options.band_selection.clone())?;
+    st.set_read_ahead_bytes(options.read_ahead_bytes);
+    let block_dir = archive.block_dir();
+    let (start_cache_hits, start_cache_misses) = block_dir.block_cache_counts();
     let mut rt = if options.overwrite {
         RestoreTree::create_overwrite(destination_path)
     } else {
         RestoreTree::create(destination_path)
     }?;
+    rt.set_preallocate(options.preallocate);
+    rt.set_sparse(options.sparse);
     let mut stats = RestoreStats::default();
     let mut progress_bar = ProgressBar::new();
     let start = Instant::now();
@@ -80,43 +127,82 @@ pub fn restore(
     // }
 
     progress_bar.set_phase("Copying");
+    let progress_bar = Mutex::new(progress_bar);
+    let pool = rayon::ThreadPoolBuilder::new()
+        .num_threads(options.jobs)
+        .thread_name(|i| format!("conserve-restore-{}", i))
+        .build()
+        .expect("Failed to create restore thread pool");
     let entry_iter = st.iter_entries(options.only_subtree.clone(), options.excludes.clone())?;
-    for entry in entry_iter {
-        if options.print_filenames {
-            crate::ui::println(entry.apath());
-        }
-        progress_bar.set_filename(entry.apath().to_string());
-        if let Err(e) = match entry.kind() {
-            Kind::Dir => {
-                stats.directories += 1;
-                rt.copy_dir(&entry)
+    for batch in &entry_iter.chunks(RESTORE_BATCH_ENTRIES) {
+        // Directories and symlinks are made in order on this thread, so that each file's
+        // parent directory exists before any worker writes into it. (A directory's entry
+        // always comes before its children.)
+        let mut files = Vec::new();
+        for entry in batch {
+            if options.print_filenames {
+                crate::ui::println(entry.apath());
             }
-            Kind::File => {
-                stats.files += 1;
-                let result = rt.copy_file(&entry, &st).map(|s| stats += s);
-                if let Some(bytes) = entry.size() {
-                    progress_bar.increment_bytes_done(bytes);
+            if let Err(e) = match entry.kind() {
+                Kind::Dir => {
+                    stats.directories += 1;
+                    rt.copy_dir(&entry)
                 }
-                result
-            }
-            Kind::Symlink => {
-                stats.symlinks += 1;
-                rt.copy_symlink(&entry)
-            }
-            Kind::Unknown => {
-                stats.unknown_kind += 1;
-                // TODO: Perhaps eventually we could backup and restore pipes,
-                // sockets, etc. Or at least count them. For now, silently skip.
-                // https://github.com/sourcefrog/conserve/issues/82
+                Kind::File => {
+                    stats.files += 1;
+                    files.push(entry);
+                    continue;
+                }
+                Kind::Symlink => {
+                    stats.symlinks += 1;
+                    rt.copy_symlink(&entry)
+                }
+                Kind::Unknown => {
+                    stats.unknown_kind += 1;
+                    // TODO: Perhaps eventually we could backup and restore pipes,
+                    // sockets, etc. Or at least count them. For now, silently skip.
+                    // https://github.com/sourcefrog/conserve/issues/82
+                    continue;
+                }
+            } {
+                ui::show_error(&e);
+                stats.errors += 1;
                 continue;
             }
-        } {
-            ui::show_error(&e);
-            stats.errors += 1;
-            continue;
+        }
+        let rt = &rt;
+        let st = &st;
+        let progress_bar = &progress_bar;
+        let file_stats: Vec<RestoreStats> = pool.install(|| {
+            files
+                .par_iter()
+                .map(|entry| {
+                    progress_bar
+                        .lock()
+                        .unwrap()
+                        .set_filename(entry.apath().to_string());
+                    let result = rt.copy_file(entry, st);
+                    if let Some(bytes) = entry.size() {
+                        progress_bar.lock().unwrap().increment_bytes_done(bytes);
+                    }
+                    result.unwrap_or_else(|e| {
+                        ui::show_error(&e);
+                        RestoreStats {
+                            errors: 1,
+                            ..RestoreStats::default()
+                        }
+                    })
+                })
+                .collect()
+        });
+        for s in file_stats {
+            stats += s;
         }
     }
     stats += rt.finish()?;
+    let (cache_hits, cache_misses) = block_dir.block_cache_counts();
+    stats.block_cache_hits = (cache_hits - start_cache_hits) as usize;
+    stats.block_cache_misses = (cache_misses - start_cache_misses) as usize;
     stats.elapsed = start.elapsed();
     // TODO: Merge in stats from the tree iter and maybe the source tree?
     Ok(stats)
@@ -128,6 +214,12 @@ pub struct RestoreTree {
     path: PathBuf,
 
     dir_mtimes: Vec<(PathBuf, UnixTime)>,
+
+    /// Allocate the length of each file before writing it.
+    preallocate: bool,
+
+    /// Seek over runs of zeros rather than writing them.
+    sparse: bool,
 }
 
 impl RestoreTree {
@@ -135,6 +227,8 @@ impl RestoreTree {
         RestoreTree {
             path,
             dir_mtimes: Vec::new(),
+            preallocate: false,
+            sparse: false,
         }
     }
 
@@ -155,6 +249,18 @@ impl RestoreTree {
         Ok(RestoreTree::new(path.to_path_buf()))
     }
 
+    /// Allocate space for each whole file before writing it.
+    ///
+    /// This has no effect on sparse restores.
+    pub fn set_preallocate(&mut self, preallocate: bool) {
+        self.preallocate = preallocate;
+    }
+
+    /// Leave runs of zeros in restored files as holes.
+    pub fn set_sparse(&mut self, sparse: bool) {
+        self.sparse = sparse;
+    }
+
     fn rooted_path(&self, apath: &Apath) -> PathBuf {
         // Remove initial slash so that the apath is relative to the destination.
         self.path.join(&apath[1..])
@@ -182,10 +288,11 @@ impl RestoreTree {
 
     /// Copy in the contents of a file from another tree.
     fn copy_file<R: ReadTree>(
-        &mut self,
+        &self,
         source_entry: &R::Entry,
         from_tree: &R,
     ) -> Result<RestoreStats> {
+        trace_span!("restore_file", apath = %source_entry.apath());
         // TODO: Restore permissions.
         let path = self.rooted_path(source_entry.apath());
         let restore_err = |source| Error::Restore {
@@ -195,7 +302,24 @@ impl RestoreTree {
         let mut restore_file = File::create(&path).map_err(restore_err)?;
         // TODO: Read one block at a time: don't pull all the contents into memory.
         let content = &mut from_tree.file_contents(&source_entry)?;
-        let bytes_copied = std::io::copy(content, &mut restore_file).map_err(restore_err)?;
+        let preallocated = match source_entry.size() {
+            Some(size) if self.preallocate && !self.sparse => {
+                preallocate(&restore_file, size);
+                Some(size)
+            }
+            _ => None,
+        };
+        let bytes_copied = if self.sparse {
+            copy_sparse(content, &mut restore_file)
+        } else {
+            std::io::copy(content, &mut restore_file)
+        }
+        .map_err(restore_err)?;
+        if preallocated.map_or(false, |size| size > bytes_copied) {
+            // The content was shorter than the index said: don't leave allocated zeros
+            // at the end.
+            restore_file.set_len(bytes_copied).map_err(restore_err)?;
+        }
         restore_file.flush().map_err(restore_err)?;
 
         let mtime = Some(source_entry.mtime().into());
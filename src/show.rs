@@ -26,8 +26,8 @@ use crate::*;
 pub struct ShowVersionsOptions {
     /// Show versions in LIFO order by band_id.
     pub newest_first: bool,
-    /// Show the total size of files in the tree.  This is
-    /// slower because it requires walking the whole index.
+    /// Show the total size of files in the tree.  For bands written before 0.6.15, and
+    /// incomplete bands, this is slower because it requires walking the whole index.
     pub tree_size: bool,
     /// Show the date and time that each backup started.
     pub start_time: bool,
@@ -95,12 +95,16 @@ pub fn show_versions(
         }
 
         if options.tree_size {
-            let tree_mb_str = crate::misc::bytes_to_human_mb(
-                archive
-                    .open_stored_tree(BandSelectionPolicy::Specified(band_id.clone()))?
-                    .size(excludes_nothing())?
-                    .file_bytes,
-            );
+            let file_bytes = match &info.tree_stats {
+                Some(tree_stats) => tree_stats.file_bytes,
+                None => {
+                    archive
+                        .open_stored_tree(BandSelectionPolicy::Specified(band_id.clone()))?
+                        .size(excludes_nothing())?
+                        .file_bytes
+                }
+            };
+            let tree_mb_str = crate::misc::bytes_to_human_mb(file_bytes);
             l.push(format!("{:>14}", tree_mb_str,));
         }
 
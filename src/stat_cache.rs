@@ -0,0 +1,318 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! A local cache of the inode, device and ctime of files at the last backup, so that
+//! files rewritten without changing their mtime or size are noticed.
+//!
+//! The cache is a file outside the source tree, holding one json record per line in
+//! apath order, so that it can be read alongside the walk of the source tree without
+//! holding it all in memory.
+//!
+//! A file is only assumed to be unchanged if its record matches: this is stricter than
+//! comparing mtime and size alone, since the ctime changes whenever the file is written
+//! or its mtime is set, and can't be set back.
+
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, BufWriter, ErrorKind, Write};
+use std::path::{Path, PathBuf};
+use std::time::SystemTime;
+
+use serde::{Deserialize, Serialize};
+
+use crate::unix_time::UnixTime;
+use crate::*;
+
+/// Identifies a version of a file on disk, beyond its mtime and size.
+#[derive(Debug, Clone, Copy, Eq, PartialEq)]
+pub struct FileIdentity {
+    pub dev: u64,
+    pub ino: u64,
+    /// Time of the last change to the inode, including writes and setting the mtime.
+    pub ctime: UnixTime,
+}
+
+impl FileIdentity {
+    #[cfg(unix)]
+    pub(crate) fn from_metadata(metadata: &fs::Metadata) -> Option<FileIdentity> {
+        use std::os::unix::fs::MetadataExt;
+        Some(FileIdentity {
+            dev: metadata.dev(),
+            ino: metadata.ino(),
+            ctime: UnixTime {
+                secs: metadata.ctime(),
+                nanosecs: metadata.ctime_nsec() as u32,
+            },
+        })
+    }
+
+    #[cfg(not(unix))]
+    pub(crate) fn from_metadata(_metadata: &fs::Metadata) -> Option<FileIdentity> {
+        None
+    }
+}
+
+/// One line of the stat cache.
+#[derive(Debug, Clone, Eq, PartialEq, Serialize, Deserialize)]
+struct StatRecord {
+    apath: Apath,
+    dev: u64,
+    ino: u64,
+    ctime: i64,
+    ctime_nanos: u32,
+    mtime: i64,
+    mtime_nanos: u32,
+    size: u64,
+}
+
+impl StatRecord {
+    fn from_entry(entry: &LiveEntry) -> Option<StatRecord> {
+        let identity = entry.identity()?;
+        let mtime = entry.mtime();
+        Some(StatRecord {
+            apath: entry.apath().clone(),
+            dev: identity.dev,
+            ino: identity.ino,
+            ctime: identity.ctime.secs,
+            ctime_nanos: identity.ctime.nanosecs,
+            mtime: mtime.secs,
+            mtime_nanos: mtime.nanosecs,
+            size: entry.size()?,
+        })
+    }
+}
+
+/// Reads a stat cache written by a previous backup.
+pub(crate) struct StatCache {
+    path: PathBuf,
+    /// Lines still to be read, or None after the end or an error.
+    lines: Option<io::Lines<BufReader<File>>>,
+    /// A record read past the last apath looked up.
+    next: Option<StatRecord>,
+}
+
+impl StatCache {
+    /// Open a stat cache, or return None if it doesn't exist yet.
+    pub fn open(path: &Path) -> Result<Option<StatCache>> {
+        match File::open(path) {
+            Ok(file) => Ok(Some(StatCache {
+                path: path.to_owned(),
+                lines: Some(BufReader::new(file).lines()),
+                next: None,
+            })),
+            Err(err) if err.kind() == ErrorKind::NotFound => Ok(None),
+            Err(source) => Err(Error::StatCache {
+                path: path.to_owned(),
+                source,
+            }),
+        }
+    }
+
+    /// True if the cache shows that this entry is the same file, unchanged since it was
+    /// recorded.
+    ///
+    /// Entries must be looked up in apath order.
+    pub fn is_unchanged(&mut self, entry: &LiveEntry) -> bool {
+        match (
+            self.advance_to(entry.apath()),
+            StatRecord::from_entry(entry),
+        ) {
+            (Some(cached), Some(current)) => cached == current,
+            _ => false,
+        }
+    }
+
+    fn advance_to(&mut self, apath: &Apath) -> Option<StatRecord> {
+        loop {
+            let record = match self.next.take() {
+                Some(record) => record,
+                None => self.read_record()?,
+            };
+            if record.apath == *apath {
+                return Some(record);
+            } else if record.apath > *apath {
+                self.next = Some(record);
+                return None;
+            }
+        }
+    }
+
+    fn read_record(&mut self) -> Option<StatRecord> {
+        let result = match self.lines.as_mut()?.next() {
+            Some(Ok(line)) => serde_json::from_str(&line).map_err(|err| err.to_string()),
+            Some(Err(err)) => Err(err.to_string()),
+            None => {
+                self.lines = None;
+                return None;
+            }
+        };
+        match result {
+            Ok(record) => Some(record),
+            Err(err) => {
+                // Stop reading, so that all later files are read again.
+                ui::problem(&format!(
+                    "Failed to read stat cache {:?}: {}",
+                    self.path, err
+                ));
+                self.lines = None;
+                None
+            }
+        }
+    }
+}
+
+/// Writes a new stat cache during a backup, replacing the old one when it's finished.
+pub(crate) struct StatCacheWriter {
+    path: PathBuf,
+    tmp_path: PathBuf,
+    writer: BufWriter<File>,
+    /// Files changed at or after this many seconds since the epoch aren't recorded,
+    /// since they might change again within the timestamp resolution.
+    racy_secs: i64,
+}
+
+impl StatCacheWriter {
+    pub fn create(path: &Path) -> Result<StatCacheWriter> {
+        let mut tmp_name = path.file_name().unwrap_or_default().to_owned();
+        tmp_name.push(".tmp");
+        let tmp_path = path.with_file_name(tmp_name);
+        let file = File::create(&tmp_path).map_err(|source| Error::StatCache {
+            path: tmp_path.clone(),
+            source,
+        })?;
+        Ok(StatCacheWriter {
+            path: path.to_owned(),
+            tmp_path,
+            writer: BufWriter::new(file),
+            racy_secs: UnixTime::from(SystemTime::now()).secs - 1,
+        })
+    }
+
+    /// Record a file that was just backed up.
+    ///
+    /// Files whose ctime is too recent are skipped, so that they're read again by the
+    /// next backup: they may have been changed again after they were read without any
+    /// visible change to their ctime.
+    pub fn record(&mut self, entry: &LiveEntry) -> Result<()> {
+        let record = match StatRecord::from_entry(entry) {
+            Some(record) if record.ctime < self.racy_secs => record,
+            _ => return Ok(()),
+        };
+        let mut line = serde_json::to_string(&record).map_err(|source| Error::SerializeJson {
+            path: self.tmp_path.to_string_lossy().into_owned(),
+            source,
+        })?;
+        line.push('\n');
+        self.writer
+            .write_all(line.as_bytes())
+            .map_err(|source| Error::StatCache {
+                path: self.tmp_path.clone(),
+                source,
+            })
+    }
+
+    /// Finish writing, and replace the previous cache.
+    pub fn finish(self) -> Result<()> {
+        let StatCacheWriter {
+            path,
+            tmp_path,
+            writer,
+            ..
+        } = self;
+        close_and_rename(writer, &tmp_path, &path).map_err(|source| Error::StatCache {
+            path: tmp_path,
+            source,
+        })
+    }
+}
+
+fn close_and_rename(mut writer: BufWriter<File>, tmp_path: &Path, path: &Path) -> io::Result<()> {
+    writer.flush()?;
+    writer.get_ref().sync_all()?;
+    drop(writer);
+    fs::rename(tmp_path, path)
+}
+
+#[cfg(test)]
+mod tests {
+    use tempfile::TempDir;
+
+    use super::*;
+    use crate::test_fixtures::TreeFixture;
+
+    fn live_entries(tf: &TreeFixture) -> Vec<LiveEntry> {
+        tf.live_tree()
+            .iter_entries(None, excludes_nothing())
+            .unwrap()
+            .filter(|entry| entry.kind() == Kind::File)
+            .collect()
+    }
+
+    #[test]
+    fn missing_cache_is_none() {
+        let temp = TempDir::new().unwrap();
+        assert!(StatCache::open(&temp.path().join("cache"))
+            .unwrap()
+            .is_none());
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn old_files_are_recorded_and_matched() {
+        let temp = TempDir::new().unwrap();
+        let cache_path = temp.path().join("cache");
+        let tf = TreeFixture::new();
+        tf.create_file("a");
+        tf.create_file("b");
+        tf.create_file("c");
+        let old = filetime::FileTime::from_unix_time(1_000_000_000, 0);
+        for name in &["a", "b", "c"] {
+            filetime::set_file_mtime(tf.path().join(name), old).unwrap();
+        }
+        let mut writer = StatCacheWriter::create(&cache_path).unwrap();
+        // Pretend the backup happened well after the files were last changed.
+        writer.racy_secs = i64::MAX;
+        for entry in live_entries(&tf) {
+            writer.record(&entry).unwrap();
+        }
+        writer.finish().unwrap();
+        assert!(!temp.path().join("cache.tmp").exists());
+
+        // Replace b with a file of the same size and mtime. (Rewriting it in place
+        // changes only the ctime, which might not tick over during the test.)
+        tf.create_file_with_contents("b.new", b"CONTENTS");
+        filetime::set_file_mtime(tf.path().join("b.new"), old).unwrap();
+        fs::rename(tf.path().join("b.new"), tf.path().join("b")).unwrap();
+
+        let mut cache = StatCache::open(&cache_path).unwrap().unwrap();
+        let unchanged: Vec<bool> = live_entries(&tf)
+            .iter()
+            .map(|entry| cache.is_unchanged(entry))
+            .collect();
+        assert_eq!(unchanged, [true, false, true]);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn recently_changed_files_are_not_recorded() {
+        let temp = TempDir::new().unwrap();
+        let cache_path = temp.path().join("cache");
+        let tf = TreeFixture::new();
+        tf.create_file("a");
+        let mut writer = StatCacheWriter::create(&cache_path).unwrap();
+        for entry in live_entries(&tf) {
+            writer.record(&entry).unwrap();
+        }
+        writer.finish().unwrap();
+        assert_eq!(fs::read_to_string(&cache_path).unwrap(), "");
+    }
+}
@@ -15,6 +15,7 @@ use std::fmt;
 use std::time::Duration;
 
 use derive_more::{Add, AddAssign, Sum};
+use serde::{Deserialize, Serialize};
 use thousands::Separable;
 
 use crate::ui::duration_to_hms;
@@ -87,6 +88,9 @@ pub struct ValidateStats {
 
     /// Number of blocks read.
     pub block_read_count: u64,
+    /// Number of blocks not read because an earlier incremental validation found them
+    /// to be correct.
+    pub block_previously_verified_count: u64,
     /// Number of blocks that failed to read back.
     pub block_error_count: usize,
     pub block_missing_count: usize,
@@ -118,6 +122,20 @@ impl fmt::Display for ValidateStats {
         writeln!(w).unwrap();
 
         write_count(w, "blocks read", self.block_read_count as usize);
+        if self.block_previously_verified_count > 0 {
+            write_count(
+                w,
+                "blocks previously verified",
+                self.block_previously_verified_count as usize,
+            );
+            let total = self.block_read_count + self.block_previously_verified_count;
+            writeln!(
+                w,
+                "{:>11.1}%      of blocks read this time",
+                self.block_read_count as f64 * 100.0 / total as f64
+            )
+            .unwrap();
+        }
         write_duration(w, "elapsed", self.elapsed)?;
 
         Ok(())
@@ -143,9 +161,28 @@ pub struct IndexWriterStats {
     pub index_hunks: usize,
     pub uncompressed_index_bytes: u64,
     pub compressed_index_bytes: u64,
+    /// Counts of all the entries in the index, including any hunks there before it was
+    /// resumed: set when the index is finished.
+    pub tree: TreeStats,
+}
+
+/// Counts and sizes of the entries in a complete band's index, recorded in its tail so
+/// that they can be shown without reading the index.
+#[derive(Add, AddAssign, Clone, Debug, Default, Eq, PartialEq, Serialize, Deserialize)]
+pub struct TreeStats {
+    pub files: u64,
+    pub directories: u64,
+    pub symlinks: u64,
+    /// Total length of the content of all files.
+    pub file_bytes: u64,
+    /// Uncompressed length of the distinct blocks referenced by files, counting each
+    /// block up to the end of the last part of it that's referenced.
+    ///
+    /// This is less than `file_bytes` when files share blocks.
+    pub referenced_block_bytes: u64,
 }
 
-#[derive(Debug, Default, Clone, Eq, PartialEq)]
+#[derive(Add, AddAssign, Debug, Default, Clone, Eq, PartialEq)]
 pub struct LiveTreeIterStats {
     pub directories_visited: usize,
     pub exclusions: usize,
@@ -164,6 +201,11 @@ pub struct RestoreStats {
 
     pub uncompressed_file_bytes: u64,
 
+    /// Reads of blocks found in the decompressed block cache.
+    pub block_cache_hits: usize,
+    /// Reads of blocks not in the cache, which were read and decompressed.
+    pub block_cache_misses: usize,
+
     pub elapsed: Duration,
 }
 
@@ -177,6 +219,12 @@ impl fmt::Display for RestoreStats {
         write_count(w, "unsupported file kind", self.unknown_kind);
         writeln!(w).unwrap();
 
+        if self.block_cache_hits + self.block_cache_misses > 0 {
+            write_count(w, "block cache hits", self.block_cache_hits);
+            write_count(w, "block cache misses", self.block_cache_misses);
+            writeln!(w).unwrap();
+        }
+
         write_count(w, "errors", self.errors);
         write_duration(w, "elapsed", self.elapsed)?;
 
@@ -196,9 +244,12 @@ pub struct BackupStats {
 
     pub unmodified_files: usize,
     pub modified_files: usize,
+    /// Modified files whose mtime and size were the same, but whose stat cache record
+    /// didn't match.
+    pub stat_cache_changed_files: usize,
     pub new_files: usize,
 
-    /// Bytes that matched an existing block.
+    /// Bytes that matched an existing block, or an identical small file.
     pub deduplicated_bytes: u64,
     /// Bytes that were stored as new blocks, before compression.
     pub uncompressed_bytes: u64,
@@ -209,14 +260,25 @@ pub struct BackupStats {
     /// Blocks containing combined small files.
     pub combined_blocks: usize,
 
+    /// Blocks found in the preloaded block presence cache, which were then confirmed in
+    /// the archive.
+    pub block_presence_hits: usize,
+    /// Blocks not in the block presence cache, which were written without checking the
+    /// archive.
+    pub block_presence_misses: usize,
+
     pub empty_files: usize,
     pub small_combined_files: usize,
+    /// Small files identical to one already stored, which weren't stored again.
+    pub deduplicated_small_files: usize,
     pub single_block_files: usize,
     pub multi_block_files: usize,
 
     pub errors: usize,
 
     pub index_builder_stats: IndexWriterStats,
+    /// Index hunks already in an incomplete band when the backup resumed it.
+    pub resumed_index_hunks: usize,
     pub elapsed: Duration,
 }
 
@@ -225,6 +287,9 @@ impl fmt::Display for BackupStats {
         write_count(w, "files:", self.files);
         write_count(w, "  unmodified files", self.unmodified_files);
         write_count(w, "  modified files", self.modified_files);
+        if self.stat_cache_changed_files > 0 {
+            write_count(w, "    with unchanged mtime", self.stat_cache_changed_files);
+        }
         write_count(w, "  new files", self.new_files);
         write_count(w, "symlinks", self.symlinks);
         write_count(w, "directories", self.directories);
@@ -239,6 +304,13 @@ impl fmt::Display for BackupStats {
         writeln!(w).unwrap();
 
         write_count(w, "data blocks deduplicated:", self.deduplicated_blocks);
+        if self.deduplicated_small_files > 0 {
+            write_count(
+                w,
+                "  small files deduplicated",
+                self.deduplicated_small_files,
+            );
+        }
         write_size(w, "  saved", self.deduplicated_bytes);
         writeln!(w).unwrap();
 
@@ -247,8 +319,17 @@ impl fmt::Display for BackupStats {
         write_compressed_size(w, self.compressed_bytes, self.uncompressed_bytes);
         writeln!(w).unwrap();
 
+        if self.block_presence_hits + self.block_presence_misses > 0 {
+            write_count(w, "block presence cache hits", self.block_presence_hits);
+            write_count(w, "block presence cache misses", self.block_presence_misses);
+            writeln!(w).unwrap();
+        }
+
         let idx = &self.index_builder_stats;
         write_count(w, "new index hunks", idx.index_hunks);
+        if self.resumed_index_hunks > 0 {
+            write_count(w, "  after resumed hunks", self.resumed_index_hunks);
+        }
         write_compressed_size(w, idx.compressed_index_bytes, idx.uncompressed_index_bytes);
         writeln!(w).unwrap();
 
@@ -266,6 +347,8 @@ pub struct DeleteStats {
     pub unreferenced_block_bytes: u64,
     pub deletion_errors: usize,
     pub deleted_block_count: usize,
+    /// Packs rewritten to drop unreferenced blocks while keeping referenced ones.
+    pub rewritten_pack_count: usize,
     pub elapsed: Duration,
 }
 
@@ -279,6 +362,9 @@ impl fmt::Display for DeleteStats {
         write_count(w, "unreferenced blocks", self.unreferenced_block_count);
         write_size(w, "  unreferenced", self.unreferenced_block_bytes);
         write_count(w, "  deleted", self.deleted_block_count);
+        if self.rewritten_pack_count > 0 {
+            write_count(w, "  packs rewritten", self.rewritten_pack_count);
+        }
         writeln!(w)?;
 
         write_count(w, "deletion errors", self.deletion_errors);
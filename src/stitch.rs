@@ -28,7 +28,9 @@
 //!   seen.
 //! * Bands might be deleted, so their numbers are not contiguous.
 
-use crate::index::IndexEntryIter;
+use std::ops::Bound;
+
+use crate::index::{bound_ref, tighter_bound, IndexEntryIter, SeekHunks};
 use crate::*;
 
 pub struct IterStitchedIndexHunks {
@@ -38,6 +40,9 @@ pub struct IterStitchedIndexHunks {
     /// The latest (and highest-ordered) apath we have already yielded.
     last_apath: Option<Apath>,
 
+    /// Yield only entries in the range starting here, from any band.
+    from: Bound<Apath>,
+
     /// Currently pending index hunks.
     index_hunks: Option<crate::index::IndexHunkIter>,
 
@@ -50,6 +55,7 @@ impl IterStitchedIndexHunks {
             archive: archive.clone(),
             band_id: band_id.clone(),
             last_apath: None,
+            from: Bound::Unbounded,
             index_hunks: None,
         }
     }
@@ -94,11 +100,22 @@ impl Iterator for IterStitchedIndexHunks {
             if let Some(last) = &self.last_apath {
                 iter_hunks = iter_hunks.advance_to_after(last)
             }
+            iter_hunks.seek(bound_ref(&self.from));
             self.index_hunks = Some(iter_hunks);
         }
     }
 }
 
+impl SeekHunks for IterStitchedIndexHunks {
+    fn seek(&mut self, from: Bound<&Apath>) {
+        if let Some(index_hunks) = &mut self.index_hunks {
+            index_hunks.seek(from);
+        }
+        // Remember it for older bands that are opened later.
+        self.from = tighter_bound(std::mem::replace(&mut self.from, Bound::Unbounded), from);
+    }
+}
+
 fn previous_existing_band(archive: &Archive, band_id: &BandId) -> Option<BandId> {
     let mut band_id = band_id.clone();
     loop {
@@ -11,9 +11,18 @@
 // GNU General Public License for more details.
 
 ///! Access a file stored in the archive.
+use std::io;
+use std::iter::Peekable;
+use std::sync::Arc;
+
+use crate::blockdir::Address;
+use crate::prefetch::OrderedPrefetch;
 use crate::stats::Sizes;
 use crate::*;
 
+/// By default, read ahead up to this many bytes of file content.
+pub const DEFAULT_READ_AHEAD_BYTES: u64 = 32 << 20;
+
 /// Returns the contents of a file stored in the archive, as an iter of byte blocks.
 ///
 /// These can be constructed through `StoredTree::open_stored_file()` or more
@@ -31,13 +40,20 @@ impl StoredFile {
         StoredFile { block_dir, addrs }
     }
 
-    /// Open a cursor on this file that implements `std::io::Read`.
-    pub(crate) fn into_read(self) -> ReadStoredFile {
+    /// Open a cursor on this file that implements `std::io::Read`, and that fetches and
+    /// decompresses blocks in the background, holding up to about `read_ahead_bytes`
+    /// of file content that has not yet been read.
+    ///
+    /// If `read_ahead_bytes` is 0, blocks are read only when they're needed.
+    pub(crate) fn into_read_ahead(self, read_ahead_bytes: u64) -> ReadStoredFile {
         ReadStoredFile {
-            remaining_addrs: self.addrs.into_iter(),
-            buf: Vec::<u8>::new(),
+            remaining_addrs: self.addrs.into_iter().peekable(),
+            buf: BlockSlice::default(),
             buf_cursor: 0,
-            block_dir: self.block_dir,
+            block_dir: Arc::new(self.block_dir),
+            prefetch: OrderedPrefetch::new(),
+            prefetch_bytes: 0,
+            read_ahead_bytes,
         }
     }
 }
@@ -54,23 +70,63 @@ impl ReadBlocks for StoredFile {
 
 /// Adapt a StoredFile to `std::io::Read`, which requires keeping a cursor position.
 pub struct ReadStoredFile {
-    /// Block addresses remaining to be read.
-    remaining_addrs: std::vec::IntoIter<blockdir::Address>,
+    /// Block addresses remaining to be read, and not yet prefetched.
+    remaining_addrs: Peekable<std::vec::IntoIter<blockdir::Address>>,
 
-    // TODO: buf, buf_cursor, remaining_addrs all really belong in some kind of `Read` adapter, not
-    // the StoredFile itself.
     /// Already-read but not yet returned data.
-    buf: Vec<u8>,
+    buf: BlockSlice,
 
     /// How far through buf has been returned?
     buf_cursor: usize,
 
-    block_dir: BlockDir,
+    block_dir: Arc<BlockDir>,
+
+    /// Blocks being read in the background, with their lengths.
+    prefetch: OrderedPrefetch<(u64, Result<BlockSlice>)>,
+
+    /// Total length of content in `prefetch`.
+    prefetch_bytes: u64,
+
+    /// Limit on `prefetch_bytes`, except that at least one block is always prefetched.
+    read_ahead_bytes: u64,
+}
+
+impl ReadStoredFile {
+    /// Start reading more blocks, up to the read-ahead limit.
+    fn start_prefetch(&mut self) {
+        while let Some(addr) = self.remaining_addrs.peek() {
+            if !self.prefetch.is_empty() && self.prefetch_bytes + addr.len > self.read_ahead_bytes {
+                break;
+            }
+            let addr: Address = self.remaining_addrs.next().unwrap();
+            let len = addr.len;
+            let block_dir = Arc::clone(&self.block_dir);
+            self.prefetch_bytes += len;
+            self.prefetch
+                .push(move || (len, block_dir.get_slice(&addr).map(|(slice, _sizes)| slice)));
+        }
+    }
+
+    /// Return the content of the next block, or None at the end of the file.
+    fn next_block(&mut self) -> Option<Result<BlockSlice>> {
+        if self.read_ahead_bytes == 0 {
+            return self
+                .remaining_addrs
+                .next()
+                .map(|addr| self.block_dir.get_slice(&addr).map(|(slice, _sizes)| slice));
+        }
+        self.start_prefetch();
+        let (len, result) = self.prefetch.pop()?;
+        self.prefetch_bytes -= len;
+        // Refill the queue now, so that it keeps working while the caller writes out
+        // this block.
+        self.start_prefetch();
+        Some(result)
+    }
 }
 
 impl std::io::Read for ReadStoredFile {
     fn read(&mut self, out: &mut [u8]) -> std::io::Result<usize> {
-        // TODO: Readahead n_cpus blocks into memory, using futures-cpupool or similar.
         loop {
             // If there's already buffered data, return as much of that as will fit.
             let avail = self.buf.len() - self.buf_cursor;
@@ -80,11 +136,10 @@ impl std::io::Read for ReadStoredFile {
                 out[..s].copy_from_slice(r);
                 self.buf_cursor += s;
                 return Ok(s);
-            } else if let Some(addr) = self.remaining_addrs.next() {
-                // TODO: Handle errors nicely, but they need to convert to std::io::Error.
+            } else if let Some(result) = self.next_block() {
                 // TODO: Remember the sizes somewhere, maybe by changing this not to be
                 // std::io::Read.
-                self.buf = self.block_dir.get(&addr).unwrap().0;
+                self.buf = result.map_err(|err| io::Error::new(io::ErrorKind::Other, err))?;
                 self.buf_cursor = 0;
             // TODO: Read directly into the caller's buffer, if it will fit. Requires changing
             // BlockDir::get to take a caller-provided buffer.
@@ -95,3 +150,57 @@ impl std::io::Read for ReadStoredFile {
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::io::Read;
+
+    use tempfile::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn read_ahead_returns_blocks_in_order() {
+        let tempdir = TempDir::new().unwrap();
+        let block_dir = BlockDir::create_path(tempdir.path()).unwrap();
+        let mut stats = BackupStats::default();
+        let mut content = Vec::new();
+        let mut addrs = Vec::new();
+        for i in 0..20u8 {
+            let block: Vec<u8> = (0..(1000 + i as usize * 100))
+                .map(|j| (j as u8).wrapping_mul(i))
+                .collect();
+            let hash = block_dir.store_or_deduplicate(&block, &mut stats).unwrap();
+            // Take part of each block, as if it were combined with other files.
+            addrs.push(Address {
+                hash,
+                start: 10,
+                len: block.len() as u64 - 20,
+            });
+            content.extend_from_slice(&block[10..block.len() - 10]);
+        }
+        for &read_ahead_bytes in &[0, 1, 5000, DEFAULT_READ_AHEAD_BYTES] {
+            let mut read = StoredFile::open(block_dir.clone(), addrs.clone())
+                .into_read_ahead(read_ahead_bytes);
+            let mut buf = Vec::new();
+            read.read_to_end(&mut buf).unwrap();
+            assert_eq!(buf, content, "read_ahead_bytes={}", read_ahead_bytes);
+        }
+    }
+
+    #[test]
+    fn missing_block_is_an_error() {
+        let tempdir = TempDir::new().unwrap();
+        let block_dir = BlockDir::create_path(tempdir.path()).unwrap();
+        let addrs = vec![Address {
+            hash: BlockHash::from_bytes(&[0; BLAKE_HASH_SIZE_BYTES]),
+            start: 0,
+            len: 10,
+        }];
+        let mut buf = Vec::new();
+        assert!(StoredFile::open(block_dir, addrs)
+            .into_read_ahead(DEFAULT_READ_AHEAD_BYTES)
+            .read_to_end(&mut buf)
+            .is_err());
+    }
+}
@@ -19,7 +19,7 @@
 //! multiple index files, bands, and blocks.
 
 use crate::blockdir::BlockDir;
-use crate::stored_file::{ReadStoredFile, StoredFile};
+use crate::stored_file::{ReadStoredFile, StoredFile, DEFAULT_READ_AHEAD_BYTES};
 use crate::*;
 
 /// Read index and file contents for a version stored in the archive.
@@ -27,6 +27,8 @@ pub struct StoredTree {
     band: Band,
     archive: Archive,
     block_dir: BlockDir,
+    /// Bytes of file content to read ahead of the caller.
+    read_ahead_bytes: u64,
 }
 
 impl StoredTree {
@@ -35,9 +37,16 @@ impl StoredTree {
             band: Band::open(archive, band_id)?,
             block_dir: archive.block_dir().clone(),
             archive: archive.clone(),
+            read_ahead_bytes: DEFAULT_READ_AHEAD_BYTES,
         })
     }
 
+    /// Set how many bytes of each file's content are fetched and decompressed in the
+    /// background, ahead of being read. 0 turns off read-ahead.
+    pub fn set_read_ahead_bytes(&mut self, read_ahead_bytes: u64) {
+        self.read_ahead_bytes = read_ahead_bytes;
+    }
+
     pub fn band(&self) -> &Band {
         &self.band
     }
@@ -66,12 +75,27 @@ impl ReadTree for StoredTree {
     }
 
     fn file_contents(&self, entry: &Self::Entry) -> Result<Self::R> {
-        Ok(self.open_stored_file(entry).into_read())
+        Ok(self
+            .open_stored_file(entry)
+            .into_read_ahead(self.read_ahead_bytes))
     }
 
     fn estimate_count(&self) -> Result<u64> {
         self.band.index().estimate_entry_count()
     }
+
+    /// Measure the tree size, from the counts in the band tail if the band is complete
+    /// and nothing is excluded, or otherwise by walking the index.
+    fn size(&self, excludes: GlobSet) -> Result<TreeSize> {
+        if excludes.is_empty() {
+            if let Some(tree_stats) = self.band.get_info()?.tree_stats {
+                return Ok(TreeSize {
+                    file_bytes: tree_stats.file_bytes,
+                });
+            }
+        }
+        tree::measure_size(self, excludes)
+    }
 }
 
 #[cfg(test)]
@@ -0,0 +1,288 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Process-wide limits on the rate of local file IO, so that backups, deletions, and
+//! validation can run alongside latency-sensitive services.
+//!
+//! One throttle is shared by all threads: it's charged for each operation on a local
+//! archive and each read of a source file. Limits are token buckets that allow bursts of
+//! up to one second's worth of IO after an idle period.
+//!
+//! The adaptive mode also watches the latency of source file reads, and when it rises
+//! well above its recent average, which suggests the disk is busy, pauses between reads
+//! until it falls again.
+
+use std::cmp::max;
+use std::sync::{Arc, Mutex, RwLock};
+use std::thread::sleep;
+use std::time::{Duration, Instant};
+
+use lazy_static::lazy_static;
+
+use crate::metrics::{Phase, Timer};
+
+/// IO can run ahead of the limits by up to this long, after it's been idle.
+const BURST: Duration = Duration::from_secs(1);
+
+/// Weight of each new read in the short-term average latency.
+const RECENT_WEIGHT: f64 = 0.2;
+
+/// Weight of each new read in the long-term average latency.
+const BASELINE_WEIGHT: f64 = 0.01;
+
+/// Back off when the recent latency is more than this multiple of the baseline.
+const LATENCY_RISE: f64 = 2.0;
+
+/// At most, reads are slowed to take this many times as long as the reads themselves.
+const MAX_SLOWDOWN: f64 = 10.0;
+
+/// Never pause longer than this after one read.
+const MAX_PAUSE: Duration = Duration::from_secs(1);
+
+lazy_static! {
+    /// The throttle for this process, if any limits are set.
+    static ref THROTTLE: RwLock<Option<Arc<Throttle>>> = RwLock::new(None);
+}
+
+/// Limits on the rate of IO.
+#[derive(Clone, Debug, Default, Eq, PartialEq)]
+pub struct ThrottleOptions {
+    /// Maximum bytes per second read from source files and read or written in a local
+    /// archive, or None for no limit.
+    pub bytes_per_second: Option<u64>,
+
+    /// Maximum number of source reads and local archive operations per second, or None
+    /// for no limit.
+    pub ops_per_second: Option<u64>,
+
+    /// Pause between source file reads when their latency rises.
+    pub adaptive: bool,
+}
+
+impl ThrottleOptions {
+    fn is_unlimited(&self) -> bool {
+        self.bytes_per_second.is_none() && self.ops_per_second.is_none() && !self.adaptive
+    }
+}
+
+/// Limit IO for the rest of this process, replacing any previous limits.
+pub fn set_limits(options: ThrottleOptions) {
+    let throttle = if options.is_unlimited() {
+        None
+    } else {
+        Some(Arc::new(Throttle::new(options)))
+    };
+    *THROTTLE.write().unwrap() = throttle;
+}
+
+fn current() -> Option<Arc<Throttle>> {
+    THROTTLE.read().unwrap().clone()
+}
+
+/// Wait, if necessary, before doing some archive IO.
+pub(crate) fn io(ops: u64, bytes: u64) {
+    if let Some(throttle) = current() {
+        throttle.wait(ops, bytes);
+    }
+}
+
+/// Wait, if necessary, after one read of a source file that took `latency`.
+pub(crate) fn source_read(bytes: u64, latency: Duration) {
+    if let Some(throttle) = current() {
+        throttle.wait(1, bytes);
+        throttle.pause_after_read(latency);
+    }
+}
+
+/// A token-bucket limit on IO, shared across threads.
+#[derive(Debug)]
+pub struct Throttle {
+    options: ThrottleOptions,
+    state: Mutex<State>,
+}
+
+#[derive(Debug)]
+struct State {
+    /// Bytes charged so far are paid for at this time.
+    bytes_paid_until: Instant,
+    /// Operations charged so far are paid for at this time.
+    ops_paid_until: Instant,
+    /// Short-term average source read latency, in seconds.
+    recent_latency: Option<f64>,
+    /// Long-term average source read latency, in seconds.
+    baseline_latency: Option<f64>,
+    /// Reads are followed by a pause of this much less one times as long as the read.
+    slowdown: f64,
+}
+
+impl Throttle {
+    pub fn new(options: ThrottleOptions) -> Throttle {
+        let now = Instant::now();
+        Throttle {
+            options,
+            state: Mutex::new(State {
+                bytes_paid_until: now,
+                ops_paid_until: now,
+                recent_latency: None,
+                baseline_latency: None,
+                slowdown: 1.0,
+            }),
+        }
+    }
+
+    /// Charge for some IO, and sleep until it's within the limits.
+    ///
+    /// Callers on different threads each wait their turn, without holding the lock
+    /// while they sleep.
+    pub fn wait(&self, ops: u64, bytes: u64) {
+        let delay = self.reserve(ops, bytes, Instant::now());
+        if delay > Duration::from_secs(0) {
+            let _timer = Timer::start(Phase::Throttle);
+            sleep(delay);
+        }
+    }
+
+    /// Charge for some IO at `now`, and return how long to wait before doing it.
+    fn reserve(&self, ops: u64, bytes: u64, now: Instant) -> Duration {
+        let mut state = self.state.lock().unwrap();
+        let mut delay = Duration::from_secs(0);
+        if let Some(rate) = self.options.bytes_per_second {
+            delay = max(delay, charge(&mut state.bytes_paid_until, now, bytes, rate));
+        }
+        if let Some(rate) = self.options.ops_per_second {
+            delay = max(delay, charge(&mut state.ops_paid_until, now, ops, rate));
+        }
+        delay
+    }
+
+    /// In adaptive mode, record the latency of a source read, and sleep if reads are
+    /// slower than usual.
+    pub fn pause_after_read(&self, latency: Duration) {
+        if !self.options.adaptive {
+            return;
+        }
+        let pause = self.state.lock().unwrap().observe_latency(latency);
+        if pause > Duration::from_secs(0) {
+            let _timer = Timer::start(Phase::Throttle);
+            sleep(pause);
+        }
+    }
+}
+
+/// Add the cost of `count` units at `rate` per second to a bucket, and return how long
+/// the caller must wait before it's within the burst allowance.
+fn charge(paid_until: &mut Instant, now: Instant, count: u64, rate: u64) -> Duration {
+    let cost = Duration::from_secs_f64(count as f64 / rate.max(1) as f64);
+    // Time that was idle more than a burst ago can't be used.
+    let earliest = now.checked_sub(BURST).unwrap_or(now);
+    *paid_until = max(*paid_until, earliest) + cost;
+    paid_until
+        .saturating_duration_since(now)
+        .checked_sub(BURST)
+        .unwrap_or_default()
+}
+
+impl State {
+    /// Update the latency averages, and return how long to pause after this read.
+    fn observe_latency(&mut self, latency: Duration) -> Duration {
+        let latency = latency.as_secs_f64();
+        let recent = match self.recent_latency {
+            None => latency,
+            Some(recent) => recent + (latency - recent) * RECENT_WEIGHT,
+        };
+        let baseline = match self.baseline_latency {
+            None => latency,
+            Some(baseline) => baseline + (latency - baseline) * BASELINE_WEIGHT,
+        };
+        self.recent_latency = Some(recent);
+        self.baseline_latency = Some(baseline);
+        if recent > baseline * LATENCY_RISE {
+            self.slowdown = (self.slowdown * 1.25).min(MAX_SLOWDOWN);
+        } else {
+            self.slowdown = (self.slowdown * 0.9).max(1.0);
+        }
+        Duration::from_secs_f64((self.slowdown - 1.0) * latency).min(MAX_PAUSE)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn unlimited_never_waits() {
+        let throttle = Throttle::new(ThrottleOptions::default());
+        let now = Instant::now();
+        for _ in 0..1000 {
+            assert_eq!(throttle.reserve(1, 1 << 30, now), Duration::from_secs(0));
+        }
+    }
+
+    #[test]
+    fn bytes_beyond_the_burst_wait() {
+        let throttle = Throttle::new(ThrottleOptions {
+            bytes_per_second: Some(1000),
+            ..ThrottleOptions::default()
+        });
+        let now = Instant::now();
+        // The first second's worth goes through at once.
+        assert_eq!(throttle.reserve(1, 1000, now), Duration::from_secs(0));
+        let delay = throttle.reserve(1, 2000, now);
+        assert!(
+            delay > Duration::from_millis(1900) && delay <= Duration::from_millis(2000),
+            "delay={:?}",
+            delay
+        );
+        // After waiting, the next caller queues behind the previous one.
+        let delay = throttle.reserve(1, 500, now + Duration::from_secs(2));
+        assert!(
+            delay > Duration::from_millis(400) && delay <= Duration::from_millis(500),
+            "delay={:?}",
+            delay
+        );
+    }
+
+    #[test]
+    fn ops_are_limited_separately() {
+        let throttle = Throttle::new(ThrottleOptions {
+            ops_per_second: Some(10),
+            ..ThrottleOptions::default()
+        });
+        let now = Instant::now();
+        for _ in 0..10 {
+            assert_eq!(throttle.reserve(1, 1 << 20, now), Duration::from_secs(0));
+        }
+        assert!(throttle.reserve(1, 0, now) > Duration::from_millis(50));
+    }
+
+    #[test]
+    fn adaptive_pauses_when_latency_rises() {
+        let mut state = Throttle::new(ThrottleOptions::default())
+            .state
+            .into_inner()
+            .unwrap();
+        let fast = Duration::from_millis(1);
+        for _ in 0..100 {
+            assert_eq!(state.observe_latency(fast), Duration::from_secs(0));
+        }
+        let slow = Duration::from_millis(20);
+        let pauses: Vec<Duration> = (0..20).map(|_| state.observe_latency(slow)).collect();
+        assert!(pauses.last().unwrap() > &Duration::from_millis(20));
+        assert!(pauses.iter().all(|&pause| pause <= MAX_PAUSE));
+        // Once reads are back to their usual speed, the slowdown wears off.
+        for _ in 0..200 {
+            state.observe_latency(fast);
+        }
+        assert_eq!(state.observe_latency(fast), Duration::from_secs(0));
+    }
+}
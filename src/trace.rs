@@ -0,0 +1,91 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Optional tracing spans around archive operations, for profiling real runs.
+//!
+//! When built with the `trace` feature, `trace_span!` enters a `tracing` span until the
+//! end of the enclosing block, and `start` records spans to a Chrome trace file, a
+//! folded-stack file for flamegraphs, or both. Without the feature, spans compile to
+//! nothing.
+
+/// Enter a span, named and with fields as for `tracing::info_span!`, until the end of
+/// the enclosing block.
+macro_rules! trace_span {
+    ($($args:tt)*) => {
+        #[cfg(feature = "trace")]
+        let _span = tracing::info_span!($($args)*).entered();
+    };
+}
+
+#[cfg(feature = "trace")]
+pub use enabled::*;
+
+#[cfg(feature = "trace")]
+mod enabled {
+    use std::fs::File;
+    use std::io::BufWriter;
+    use std::path::Path;
+
+    use tracing_chrome::ChromeLayerBuilder;
+    use tracing_flame::FlameLayer;
+    use tracing_subscriber::prelude::*;
+
+    use crate::*;
+
+    /// Keeps recording spans until it's dropped, and then finishes writing the trace files.
+    #[must_use]
+    pub struct TraceGuard {
+        _chrome: Option<tracing_chrome::FlushGuard>,
+        _folded: Option<tracing_flame::FlushGuard<BufWriter<File>>>,
+    }
+
+    /// Start recording spans for the rest of the process.
+    ///
+    /// `chrome_path` is written in the Chrome trace event format, which can be loaded into
+    /// `chrome://tracing` or Perfetto. `folded_path` is written as folded stacks, which
+    /// can be drawn by `inferno-flamegraph` or `flamegraph.pl`.
+    pub fn start(chrome_path: Option<&Path>, folded_path: Option<&Path>) -> Result<TraceGuard> {
+        let (chrome_layer, chrome_guard) = match chrome_path {
+            Some(path) => {
+                let (layer, guard) = ChromeLayerBuilder::new()
+                    .file(path.to_owned())
+                    .include_args(true)
+                    .build();
+                (Some(layer), Some(guard))
+            }
+            None => (None, None),
+        };
+        let (folded_layer, folded_guard) = match folded_path {
+            Some(path) => {
+                let (layer, guard) =
+                    FlameLayer::with_file(path).map_err(|err| Error::StartTrace {
+                        reason: err.to_string(),
+                    })?;
+                (Some(layer), Some(guard))
+            }
+            None => (None, None),
+        };
+        tracing::subscriber::set_global_default(
+            tracing_subscriber::registry()
+                .with(chrome_layer)
+                .with(folded_layer),
+        )
+        .map_err(|err| Error::StartTrace {
+            reason: err.to_string(),
+        })?;
+        Ok(TraceGuard {
+            _chrome: chrome_guard,
+            _folded: folded_guard,
+        })
+    }
+}
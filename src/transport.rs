@@ -15,19 +15,25 @@
 //! Transport operations return std::io::Result to reflect their narrower focus.
 
 use std::io;
-use std::path::{Path, PathBuf};
+use std::path::PathBuf;
 use std::str::FromStr;
+use std::time::SystemTime;
 
 use crate::errors::Error;
 use crate::kind::Kind;
+use crate::prefetch;
 use crate::Result;
 
 pub mod local;
+#[cfg(feature = "s3")]
+pub mod s3;
 
-/// Open a `Transport` to access a local directory.
+/// By default, keep up to this many requests in flight in batched operations.
+pub const DEFAULT_CONCURRENCY: usize = 16;
+
+/// Open a `Transport` to access a local directory or a URL.
 pub fn open_transport(s: &str) -> Result<Box<dyn Transport>> {
-    // TODO: Recognize URL-style strings.
-    Ok(Box::new(local::LocalTransport::new(&Path::new(s))))
+    Location::from_str(s)?.open()
 }
 
 /// Abstracted filesystem IO to access an archive.
@@ -42,6 +48,11 @@ pub fn open_transport(s: &str) -> Result<Box<dyn Transport>> {
 ///
 /// Files in Conserve archives have bounded size and fit in memory so this does not need to
 /// support streaming or partial reads and writes.
+///
+/// The `_many` methods do the same as the single-file methods for a batch of files, so
+/// that high-latency transports can keep many requests in flight. Their results are in
+/// the same order as the arguments. By default they make up to `concurrency()` single-file
+/// calls at once; transports with native batch or asynchronous requests can override them.
 pub trait Transport: Send + Sync + std::fmt::Debug {
     /// Read the contents of a directory under this transport, without recursing down.
     ///
@@ -78,9 +89,43 @@ pub trait Transport: Send + Sync + std::fmt::Debug {
     /// memory, and this is simple to support on all implementations.
     fn read_file(&self, path: &str, out_buf: &mut Vec<u8>) -> io::Result<()>;
 
-    /// Check if an entry exists.
+    /// Read `len` bytes starting at `offset` in a file into a caller-provided buffer.
+    ///
+    /// By default this reads the whole file and keeps the requested part; transports
+    /// that can read part of a file should override it.
+    fn read_range(
+        &self,
+        path: &str,
+        offset: u64,
+        len: u64,
+        out_buf: &mut Vec<u8>,
+    ) -> io::Result<()> {
+        self.read_file(path, out_buf)?;
+        let start = offset as usize;
+        let end = start + len as usize;
+        if end > out_buf.len() {
+            return Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                format!("{:?} is shorter than the range read from it", path),
+            ));
+        }
+        out_buf.truncate(end);
+        out_buf.drain(..start);
+        Ok(())
+    }
+
+    /// Check if a file exists.
+    ///
+    /// Use `dir_exists` for directories: some transports can't find them this way.
     fn exists(&self, path: &str) -> io::Result<bool>;
 
+    /// Check if a directory exists.
+    ///
+    /// On transports without real directories, it exists if anything is below it.
+    fn dir_exists(&self, relpath: &str) -> io::Result<bool> {
+        self.exists(relpath)
+    }
+
     /// Create a directory, if it does not exist.
     ///
     /// If the directory already exists, it's not an error.
@@ -114,6 +159,43 @@ pub trait Transport: Send + Sync + std::fmt::Debug {
 
     /// Clone this object into a new box.
     fn box_clone(&self) -> Box<dyn Transport>;
+
+    /// The number of requests worth having in flight at once in batched operations.
+    fn concurrency(&self) -> usize {
+        DEFAULT_CONCURRENCY
+    }
+
+    /// Check whether each of several entries exists.
+    fn exists_many(&self, paths: &[String]) -> Vec<io::Result<bool>> {
+        prefetch::map_concurrent(paths, self.concurrency(), |path| self.exists(path))
+    }
+
+    /// Read several complete files.
+    fn read_many(&self, paths: &[String]) -> Vec<io::Result<Vec<u8>>> {
+        prefetch::map_concurrent(paths, self.concurrency(), |path| {
+            let mut buf = Vec::new();
+            self.read_file(path, &mut buf).map(|()| buf)
+        })
+    }
+
+    /// Write several complete files, each as by `write_file`.
+    ///
+    /// The files may become visible in any order.
+    fn write_many(&self, files: &[(String, Vec<u8>)]) -> Vec<io::Result<()>> {
+        prefetch::map_concurrent(files, self.concurrency(), |(path, content)| {
+            self.write_file(path, content)
+        })
+    }
+
+    /// Get metadata about several files.
+    fn metadata_many(&self, paths: &[String]) -> Vec<io::Result<Metadata>> {
+        prefetch::map_concurrent(paths, self.concurrency(), |path| self.metadata(path))
+    }
+
+    /// Delete several files.
+    fn remove_many(&self, paths: &[String]) -> Vec<io::Result<()>> {
+        prefetch::map_concurrent(paths, self.concurrency(), |path| self.remove_file(path))
+    }
 }
 
 impl Clone for Box<dyn Transport> {
@@ -136,6 +218,9 @@ pub struct DirEntry {
 pub struct Metadata {
     /// File length.
     pub len: u64,
+
+    /// Time the file was last modified, if the transport knows it.
+    pub mtime: Option<SystemTime>,
 }
 
 /// A list of all the files and directories in a directory.
@@ -147,12 +232,15 @@ pub struct ListDirNames {
 
 /// A path or other URL-like specification of a directory that can be opened as a transport.
 ///
-/// Locations can be parsed from strings. At present the only supported form is an absolute
-/// or relative filename.
+/// Locations can be parsed from strings: `s3://BUCKET/PREFIX` addresses objects in S3
+/// (when built with the `s3` feature), and anything without a `://` is a local filename.
 #[derive(Debug, Eq, PartialEq)]
 pub enum Location {
     /// A local directory.
     Local(PathBuf),
+    /// A key prefix within an S3 bucket, without a leading or trailing slash.
+    #[cfg(feature = "s3")]
+    S3 { bucket: String, prefix: String },
 }
 
 impl Location {
@@ -162,6 +250,8 @@ impl Location {
     pub fn open(&self) -> Result<Box<dyn Transport>> {
         match self {
             Location::Local(pathbuf) => Ok(Box::new(local::LocalTransport::new(&pathbuf))),
+            #[cfg(feature = "s3")]
+            Location::S3 { bucket, prefix } => Ok(Box::new(s3::S3Transport::new(bucket, prefix)?)),
         }
     }
 }
@@ -170,7 +260,41 @@ impl FromStr for Location {
     type Err = Error;
 
     fn from_str(s: &str) -> std::result::Result<Self, Self::Err> {
-        // Eventually can specifically recognize url or sftp style forms here.
-        Ok(Location::Local(s.into()))
+        let invalid = |reason: &str| Error::InvalidLocation {
+            location: s.to_owned(),
+            reason: reason.to_owned(),
+        };
+        match s.find("://") {
+            None => Ok(Location::Local(s.into())),
+            Some(scheme_len) => match &s[..scheme_len] {
+                "s3" => {
+                    let rest = &s[(scheme_len + 3)..];
+                    let (bucket, prefix) = match rest.find('/') {
+                        Some(slash) => (&rest[..slash], &rest[(slash + 1)..]),
+                        None => (rest, ""),
+                    };
+                    if bucket.is_empty() {
+                        return Err(invalid("no bucket name"));
+                    }
+                    s3_location(bucket, prefix.trim_matches('/')).ok_or_else(|| {
+                        invalid("this build of Conserve does not have the `s3` feature")
+                    })
+                }
+                _ => Err(invalid("unsupported URL scheme")),
+            },
+        }
     }
 }
+
+#[cfg(feature = "s3")]
+fn s3_location(bucket: &str, prefix: &str) -> Option<Location> {
+    Some(Location::S3 {
+        bucket: bucket.to_owned(),
+        prefix: prefix.to_owned(),
+    })
+}
+
+#[cfg(not(feature = "s3"))]
+fn s3_location(_bucket: &str, _prefix: &str) -> Option<Location> {
+    None
+}
@@ -18,6 +18,8 @@ use std::io;
 use std::io::prelude::*;
 use std::path::{Path, PathBuf};
 
+use crate::metrics::{Phase, Timer};
+use crate::throttle;
 use crate::transport::{DirEntry, Metadata, Transport};
 
 #[derive(Clone, Debug)]
@@ -47,6 +49,8 @@ impl Transport for LocalTransport {
         // Archives should never normally contain non-UTF-8 (or even non-ASCII) filenames, but
         // let's pass them back as lossy UTF-8 so they can be reported at a higher level, for
         // example during validation.
+        throttle::io(1, 0);
+        let _timer = Timer::start(Phase::TransportList);
         let relpath = relpath.to_owned();
         Ok(Box::new(self.full_path(&relpath).read_dir()?.map(
             move |i| {
@@ -65,14 +69,37 @@ impl Transport for LocalTransport {
         // read_to_end reads in gradually increasing parts, but here we can probably read one large
         // buffer.
         let mut file = File::open(&self.full_path(relpath))?;
-        let prefetch_len: usize = file.metadata()?.len().try_into().unwrap();
+        let file_len = file.metadata()?.len();
+        // Charged for the expected length before reading, like the other operations.
+        throttle::io(1, file_len);
+        let mut timer = Timer::start(Phase::TransportRead);
+        let prefetch_len: usize = file_len.try_into().unwrap();
         out_buf.resize(prefetch_len, 0);
         let actual_len = file.read(out_buf)?;
         out_buf.truncate(actual_len);
+        timer.add_bytes(actual_len as u64);
         Ok(())
     }
 
+    fn read_range(
+        &self,
+        relpath: &str,
+        offset: u64,
+        len: u64,
+        out_buf: &mut Vec<u8>,
+    ) -> io::Result<()> {
+        throttle::io(1, len);
+        let mut timer = Timer::start(Phase::TransportRead);
+        timer.add_bytes(len);
+        let mut file = File::open(&self.full_path(relpath))?;
+        file.seek(io::SeekFrom::Start(offset))?;
+        out_buf.resize(len.try_into().unwrap(), 0);
+        file.read_exact(out_buf)
+    }
+
     fn exists(&self, relpath: &str) -> io::Result<bool> {
+        throttle::io(1, 0);
+        let _timer = Timer::start(Phase::TransportStat);
         Ok(self.full_path(relpath).exists())
     }
 
@@ -91,6 +118,9 @@ impl Transport for LocalTransport {
     }
 
     fn write_file(&self, relpath: &str, content: &[u8]) -> io::Result<()> {
+        throttle::io(1, content.len() as u64);
+        let mut timer = Timer::start(Phase::TransportWrite);
+        timer.add_bytes(content.len() as u64);
         let full_path = self.full_path(relpath);
         let dir = full_path.parent().unwrap();
         let mut temp = tempfile::Builder::new()
@@ -109,14 +139,18 @@ impl Transport for LocalTransport {
     }
 
     fn remove_file(&self, relpath: &str) -> io::Result<()> {
+        throttle::io(1, 0);
+        let _timer = Timer::start(Phase::TransportRemove);
         std::fs::remove_file(self.full_path(relpath))
     }
 
     fn remove_dir(&self, relpath: &str) -> io::Result<()> {
+        throttle::io(1, 0);
         std::fs::remove_dir(self.full_path(relpath))
     }
 
     fn remove_dir_all(&self, relpath: &str) -> io::Result<()> {
+        throttle::io(1, 0);
         std::fs::remove_dir_all(self.full_path(relpath))
     }
 
@@ -127,8 +161,13 @@ impl Transport for LocalTransport {
     }
 
     fn metadata(&self, relpath: &str) -> io::Result<Metadata> {
+        throttle::io(1, 0);
+        let _timer = Timer::start(Phase::TransportStat);
         let fsmeta = self.root.join(relpath).metadata()?;
-        Ok(Metadata { len: fsmeta.len() })
+        Ok(Metadata {
+            len: fsmeta.len(),
+            mtime: fsmeta.modified().ok(),
+        })
     }
 }
 
@@ -143,6 +182,8 @@ mod test {
     use assert_fs::prelude::*;
     use predicates::prelude::*;
 
+    use std::time::SystemTime;
+
     use super::*;
     use crate::kind::Kind;
 
@@ -162,6 +203,19 @@ mod test {
         temp.close().unwrap();
     }
 
+    #[test]
+    fn read_range() {
+        let temp = assert_fs::TempDir::new().unwrap();
+        temp.child("poem.txt")
+            .write_str("the ribs of the disaster")
+            .unwrap();
+        let transport = LocalTransport::new(temp.path());
+        let mut buf = b"old content".to_vec();
+        transport.read_range("poem.txt", 4, 4, &mut buf).unwrap();
+        assert_eq!(buf, b"ribs");
+        assert!(transport.read_range("poem.txt", 20, 10, &mut buf).is_err());
+    }
+
     #[test]
     fn read_metadata() {
         let temp = assert_fs::TempDir::new().unwrap();
@@ -171,7 +225,9 @@ mod test {
 
         let transport = LocalTransport::new(temp.path());
 
-        assert_eq!(transport.metadata(&filename).unwrap(), Metadata { len: 24 });
+        let metadata = transport.metadata(&filename).unwrap();
+        assert_eq!(metadata.len, 24);
+        assert!(metadata.mtime.unwrap() <= SystemTime::now());
         assert!(transport.metadata("nopoem").is_err());
     }
 
@@ -224,6 +280,8 @@ mod test {
 
         assert_eq!(transport.exists("root file").unwrap(), true);
         assert_eq!(transport.exists("nuh-uh").unwrap(), false);
+        assert_eq!(transport.dir_exists("subdir").unwrap(), true);
+        assert_eq!(transport.dir_exists("nuh-uh").unwrap(), false);
 
         let subdir_list: Vec<_> = transport
             .iter_dir_entries("subdir")
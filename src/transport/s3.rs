@@ -0,0 +1,554 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Access to an archive in Amazon S3, or another store with an S3-compatible API.
+//!
+//! Files are objects whose keys are the transport's prefix joined with the relative path.
+//! Object stores have no real directories: creating a directory does nothing, listing a
+//! directory lists the keys under its prefix, and a directory exists if any key is below it.
+//! So `exists` checks for one object, and `dir_exists` lists the prefix.
+//!
+//! Credentials and the region come from the usual AWS environment variables and
+//! configuration files. `AWS_ENDPOINT_URL` selects a different S3-compatible service.
+//!
+//! Requests are made through one pooled HTTP client on a private Tokio runtime. Single-file
+//! calls block on one request; the batched calls keep up to `concurrency()` requests in
+//! flight at once on that client, so throughput holds up despite per-request latency.
+
+use std::collections::HashMap;
+use std::fmt;
+use std::io;
+use std::sync::Arc;
+use std::time::SystemTime;
+
+use chrono::DateTime;
+use futures::stream::{self, StreamExt, TryStreamExt};
+use rusoto_core::{ByteStream, Region, RusotoError};
+use rusoto_s3::{
+    Delete, DeleteObjectRequest, DeleteObjectsRequest, GetObjectError, GetObjectRequest,
+    HeadObjectError, HeadObjectRequest, ListObjectsV2Request, ObjectIdentifier, PutObjectRequest,
+    S3Client, S3,
+};
+use tokio::runtime::Runtime;
+
+use crate::metrics::{Phase, Timer};
+
+use crate::kind::Kind;
+use crate::transport::{DirEntry, Metadata, Transport};
+
+/// Keep up to this many requests in flight in batched operations.
+const S3_CONCURRENCY: usize = 64;
+
+/// S3 deletes at most this many keys in one request.
+const MAX_DELETE_KEYS: usize = 1000;
+
+#[derive(Clone)]
+pub struct S3Transport {
+    /// Runtime for the client's requests, shared by all clones and sub-transports.
+    runtime: Arc<Runtime>,
+    client: S3Client,
+    bucket: String,
+    /// Key prefix for the root of this transport, without a leading or trailing slash.
+    base: String,
+}
+
+impl fmt::Debug for S3Transport {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("S3Transport")
+            .field("bucket", &self.bucket)
+            .field("base", &self.base)
+            .finish()
+    }
+}
+
+impl S3Transport {
+    pub fn new(bucket: &str, prefix: &str) -> io::Result<S3Transport> {
+        let runtime = tokio::runtime::Builder::new_multi_thread()
+            .enable_all()
+            .build()?;
+        Ok(S3Transport {
+            runtime: Arc::new(runtime),
+            client: S3Client::new(region()),
+            bucket: bucket.to_owned(),
+            base: prefix.trim_matches('/').to_owned(),
+        })
+    }
+
+    fn key(&self, relpath: &str) -> String {
+        join_key(&self.base, relpath)
+    }
+
+    /// The prefix of all keys inside a directory, including the trailing slash, or empty
+    /// for the bucket root.
+    fn dir_prefix(&self, relpath: &str) -> String {
+        let mut prefix = self.key(relpath);
+        if !prefix.is_empty() {
+            prefix.push('/');
+        }
+        prefix
+    }
+
+    async fn get(&self, relpath: &str) -> io::Result<Vec<u8>> {
+        let mut timer = Timer::start(Phase::TransportRead);
+        let key = self.key(relpath);
+        let request = GetObjectRequest {
+            bucket: self.bucket.clone(),
+            key: key.clone(),
+            ..Default::default()
+        };
+        let output = match self.client.get_object(request).await {
+            Ok(output) => output,
+            Err(RusotoError::Service(GetObjectError::NoSuchKey(_))) => return Err(not_found(&key)),
+            Err(err) if is_not_found(&err) => return Err(not_found(&key)),
+            Err(err) => return Err(io_error(err)),
+        };
+        let mut buf = Vec::with_capacity(output.content_length.unwrap_or_default() as usize);
+        if let Some(mut body) = output.body {
+            while let Some(chunk) = body.try_next().await? {
+                buf.extend_from_slice(&chunk);
+            }
+        }
+        timer.add_bytes(buf.len() as u64);
+        Ok(buf)
+    }
+
+    /// Read part of an object, with an HTTP range request.
+    async fn get_range(&self, relpath: &str, offset: u64, len: u64) -> io::Result<Vec<u8>> {
+        let key = self.key(relpath);
+        if len == 0 {
+            return Ok(Vec::new());
+        }
+        let mut timer = Timer::start(Phase::TransportRead);
+        timer.add_bytes(len);
+        let request = GetObjectRequest {
+            bucket: self.bucket.clone(),
+            key: key.clone(),
+            range: Some(format!("bytes={}-{}", offset, offset + len - 1)),
+            ..Default::default()
+        };
+        let output = match self.client.get_object(request).await {
+            Ok(output) => output,
+            Err(RusotoError::Service(GetObjectError::NoSuchKey(_))) => return Err(not_found(&key)),
+            Err(err) if is_not_found(&err) => return Err(not_found(&key)),
+            Err(err) => return Err(io_error(err)),
+        };
+        let mut buf = Vec::with_capacity(len as usize);
+        if let Some(mut body) = output.body {
+            while let Some(chunk) = body.try_next().await? {
+                buf.extend_from_slice(&chunk);
+            }
+        }
+        if buf.len() as u64 != len {
+            return Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                format!("S3 object {:?} is shorter than the range read from it", key),
+            ));
+        }
+        Ok(buf)
+    }
+
+    /// Return the length and modification time of an object, or None if it doesn't exist.
+    async fn head(&self, relpath: &str) -> io::Result<Option<Metadata>> {
+        let _timer = Timer::start(Phase::TransportStat);
+        let request = HeadObjectRequest {
+            bucket: self.bucket.clone(),
+            key: self.key(relpath),
+            ..Default::default()
+        };
+        match self.client.head_object(request).await {
+            Ok(output) => Ok(Some(Metadata {
+                len: output.content_length.unwrap_or_default() as u64,
+                mtime: output
+                    .last_modified
+                    .and_then(|date| DateTime::parse_from_rfc2822(&date).ok())
+                    .map(SystemTime::from),
+            })),
+            Err(RusotoError::Service(HeadObjectError::NoSuchKey(_))) => Ok(None),
+            Err(err) if is_not_found(&err) => Ok(None),
+            Err(err) => Err(io_error(err)),
+        }
+    }
+
+    /// True if there's an object with this name.
+    async fn exists_async(&self, relpath: &str) -> io::Result<bool> {
+        Ok(self.head(relpath).await?.is_some())
+    }
+
+    /// True if there's any object below this name, as a directory.
+    async fn dir_exists_async(&self, relpath: &str) -> io::Result<bool> {
+        let _timer = Timer::start(Phase::TransportList);
+        let request = ListObjectsV2Request {
+            bucket: self.bucket.clone(),
+            prefix: Some(self.dir_prefix(relpath)),
+            max_keys: Some(1),
+            ..Default::default()
+        };
+        let output = self
+            .client
+            .list_objects_v2(request)
+            .await
+            .map_err(io_error)?;
+        Ok(output
+            .contents
+            .map_or(false, |contents| !contents.is_empty()))
+    }
+
+    async fn metadata_async(&self, relpath: &str) -> io::Result<Metadata> {
+        self.head(relpath)
+            .await?
+            .ok_or_else(|| not_found(&self.key(relpath)))
+    }
+
+    async fn put(&self, relpath: &str, content: Vec<u8>) -> io::Result<()> {
+        let mut timer = Timer::start(Phase::TransportWrite);
+        timer.add_bytes(content.len() as u64);
+        let request = PutObjectRequest {
+            bucket: self.bucket.clone(),
+            key: self.key(relpath),
+            content_length: Some(content.len() as i64),
+            body: Some(ByteStream::from(content)),
+            ..Default::default()
+        };
+        self.client
+            .put_object(request)
+            .await
+            .map(|_| ())
+            .map_err(io_error)
+    }
+
+    /// List the objects in a directory, returning their names and lengths relative to
+    /// the directory, and the names of subdirectories.
+    ///
+    /// If `recursive` is true, all objects below the directory are returned, with their
+    /// relative paths, and no subdirectories.
+    async fn list(
+        &self,
+        relpath: &str,
+        recursive: bool,
+    ) -> io::Result<(Vec<(String, u64)>, Vec<String>)> {
+        let _timer = Timer::start(Phase::TransportList);
+        let prefix = self.dir_prefix(relpath);
+        let mut objects = Vec::new();
+        let mut subdirs = Vec::new();
+        let mut continuation_token = None;
+        loop {
+            let request = ListObjectsV2Request {
+                bucket: self.bucket.clone(),
+                prefix: Some(prefix.clone()),
+                delimiter: if recursive {
+                    None
+                } else {
+                    Some("/".to_owned())
+                },
+                continuation_token: continuation_token.take(),
+                ..Default::default()
+            };
+            let output = self
+                .client
+                .list_objects_v2(request)
+                .await
+                .map_err(io_error)?;
+            for object in output.contents.unwrap_or_default() {
+                if let Some(name) = object.key.as_deref().and_then(|k| k.strip_prefix(&*prefix)) {
+                    if !name.is_empty() {
+                        objects.push((name.to_owned(), object.size.unwrap_or_default() as u64));
+                    }
+                }
+            }
+            for common_prefix in output.common_prefixes.unwrap_or_default() {
+                if let Some(name) = common_prefix
+                    .prefix
+                    .as_deref()
+                    .and_then(|p| p.strip_prefix(&*prefix))
+                {
+                    subdirs.push(name.trim_end_matches('/').to_owned());
+                }
+            }
+            match output.next_continuation_token {
+                Some(token) if output.is_truncated == Some(true) => {
+                    continuation_token = Some(token)
+                }
+                _ => break,
+            }
+        }
+        Ok((objects, subdirs))
+    }
+
+    /// Delete objects by key, with many keys in each request and several requests in
+    /// flight, returning the result for each key.
+    async fn delete_keys(&self, keys: Vec<String>) -> Vec<io::Result<()>> {
+        let batches: Vec<Vec<String>> = keys
+            .chunks(MAX_DELETE_KEYS)
+            .map(|batch| batch.to_vec())
+            .collect();
+        stream::iter(batches)
+            .map(|batch| self.delete_batch(batch))
+            .buffered(self.concurrency())
+            .collect::<Vec<Vec<io::Result<()>>>>()
+            .await
+            .into_iter()
+            .flatten()
+            .collect()
+    }
+
+    async fn delete_batch(&self, keys: Vec<String>) -> Vec<io::Result<()>> {
+        let mut timer = Timer::start(Phase::TransportRemove);
+        timer.set_ops(keys.len() as u64);
+        let request = DeleteObjectsRequest {
+            bucket: self.bucket.clone(),
+            delete: Delete {
+                objects: keys
+                    .iter()
+                    .map(|key| ObjectIdentifier {
+                        key: key.clone(),
+                        version_id: None,
+                    })
+                    .collect(),
+                quiet: Some(true),
+            },
+            ..Default::default()
+        };
+        match self.client.delete_objects(request).await {
+            Ok(output) => {
+                // In quiet mode, only failures are reported.
+                let failed: HashMap<String, String> = output
+                    .errors
+                    .unwrap_or_default()
+                    .into_iter()
+                    .filter_map(|err| Some((err.key?, err.message.unwrap_or_default())))
+                    .collect();
+                keys.iter()
+                    .map(|key| match failed.get(key) {
+                        Some(message) => Err(io::Error::new(
+                            io::ErrorKind::Other,
+                            format!("Failed to delete {:?}: {}", key, message),
+                        )),
+                        None => Ok(()),
+                    })
+                    .collect()
+            }
+            Err(err) => {
+                let message = err.to_string();
+                keys.iter()
+                    .map(|_| Err(io::Error::new(io::ErrorKind::Other, message.clone())))
+                    .collect()
+            }
+        }
+    }
+}
+
+impl Transport for S3Transport {
+    fn iter_dir_entries(
+        &self,
+        relpath: &str,
+    ) -> io::Result<Box<dyn Iterator<Item = io::Result<DirEntry>>>> {
+        let (objects, subdirs) = self.runtime.block_on(self.list(relpath, false))?;
+        let files = objects.into_iter().map(|(name, _len)| DirEntry {
+            name,
+            kind: Kind::File,
+        });
+        let dirs = subdirs.into_iter().map(|name| DirEntry {
+            name,
+            kind: Kind::Dir,
+        });
+        Ok(Box::new(files.chain(dirs).map(Ok)))
+    }
+
+    fn read_file(&self, relpath: &str, out_buf: &mut Vec<u8>) -> io::Result<()> {
+        *out_buf = self.runtime.block_on(self.get(relpath))?;
+        Ok(())
+    }
+
+    fn read_range(
+        &self,
+        relpath: &str,
+        offset: u64,
+        len: u64,
+        out_buf: &mut Vec<u8>,
+    ) -> io::Result<()> {
+        *out_buf = self
+            .runtime
+            .block_on(self.get_range(relpath, offset, len))?;
+        Ok(())
+    }
+
+    fn exists(&self, relpath: &str) -> io::Result<bool> {
+        self.runtime.block_on(self.exists_async(relpath))
+    }
+
+    fn dir_exists(&self, relpath: &str) -> io::Result<bool> {
+        self.runtime.block_on(self.dir_exists_async(relpath))
+    }
+
+    /// Does nothing, since directories are implied by the keys below them.
+    fn create_dir(&self, _relpath: &str) -> io::Result<()> {
+        Ok(())
+    }
+
+    /// Write a file with a single PUT, which S3 makes visible atomically.
+    fn write_file(&self, relpath: &str, content: &[u8]) -> io::Result<()> {
+        self.runtime.block_on(self.put(relpath, content.to_vec()))
+    }
+
+    fn metadata(&self, relpath: &str) -> io::Result<Metadata> {
+        self.runtime.block_on(self.metadata_async(relpath))
+    }
+
+    /// Delete an object. Unlike local files, deleting an object that doesn't exist succeeds.
+    fn remove_file(&self, relpath: &str) -> io::Result<()> {
+        let _timer = Timer::start(Phase::TransportRemove);
+        let request = DeleteObjectRequest {
+            bucket: self.bucket.clone(),
+            key: self.key(relpath),
+            ..Default::default()
+        };
+        self.runtime
+            .block_on(self.client.delete_object(request))
+            .map(|_| ())
+            .map_err(io_error)
+    }
+
+    /// Does nothing, since an empty directory doesn't exist.
+    fn remove_dir(&self, _relpath: &str) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn remove_dir_all(&self, relpath: &str) -> io::Result<()> {
+        let dir_key = self.key(relpath);
+        self.runtime.block_on(async {
+            let (objects, _) = self.list(relpath, true).await?;
+            let keys = objects
+                .into_iter()
+                .map(|(name, _len)| join_key(&dir_key, &name))
+                .collect();
+            self.delete_keys(keys)
+                .await
+                .into_iter()
+                .collect::<io::Result<()>>()
+        })
+    }
+
+    fn sub_transport(&self, relpath: &str) -> Box<dyn Transport> {
+        Box::new(S3Transport {
+            base: self.key(relpath),
+            ..self.clone()
+        })
+    }
+
+    fn box_clone(&self) -> Box<dyn Transport> {
+        Box::new(self.clone())
+    }
+
+    fn concurrency(&self) -> usize {
+        S3_CONCURRENCY
+    }
+
+    fn exists_many(&self, paths: &[String]) -> Vec<io::Result<bool>> {
+        self.runtime.block_on(
+            stream::iter(paths)
+                .map(|path| self.exists_async(path))
+                .buffered(self.concurrency())
+                .collect(),
+        )
+    }
+
+    fn read_many(&self, paths: &[String]) -> Vec<io::Result<Vec<u8>>> {
+        self.runtime.block_on(
+            stream::iter(paths)
+                .map(|path| self.get(path))
+                .buffered(self.concurrency())
+                .collect(),
+        )
+    }
+
+    fn write_many(&self, files: &[(String, Vec<u8>)]) -> Vec<io::Result<()>> {
+        self.runtime.block_on(
+            stream::iter(files)
+                .map(|(path, content)| self.put(path, content.clone()))
+                .buffered(self.concurrency())
+                .collect(),
+        )
+    }
+
+    fn metadata_many(&self, paths: &[String]) -> Vec<io::Result<Metadata>> {
+        self.runtime.block_on(
+            stream::iter(paths)
+                .map(|path| self.metadata_async(path))
+                .buffered(self.concurrency())
+                .collect(),
+        )
+    }
+
+    fn remove_many(&self, paths: &[String]) -> Vec<io::Result<()>> {
+        let keys = paths.iter().map(|path| self.key(path)).collect();
+        self.runtime.block_on(self.delete_keys(keys))
+    }
+}
+
+/// The region from the environment, or a custom endpoint from `AWS_ENDPOINT_URL`.
+fn region() -> Region {
+    let region = Region::default();
+    match std::env::var("AWS_ENDPOINT_URL") {
+        Ok(endpoint) => Region::Custom {
+            name: region.name().to_owned(),
+            endpoint,
+        },
+        Err(_) => region,
+    }
+}
+
+/// Join a key prefix and a relative path.
+fn join_key(base: &str, relpath: &str) -> String {
+    let relpath = relpath.trim_matches('/');
+    if base.is_empty() {
+        relpath.to_owned()
+    } else if relpath.is_empty() {
+        base.to_owned()
+    } else {
+        format!("{}/{}", base, relpath)
+    }
+}
+
+/// True if the error is an HTTP 404, which is how S3 reports a missing object
+/// in response to requests such as HEAD that have no error body.
+fn is_not_found<E>(err: &RusotoError<E>) -> bool {
+    matches!(err, RusotoError::Unknown(response) if response.status.as_u16() == 404)
+}
+
+fn not_found(key: &str) -> io::Error {
+    io::Error::new(
+        io::ErrorKind::NotFound,
+        format!("S3 object {:?} not found", key),
+    )
+}
+
+fn io_error<E: std::error::Error + Send + Sync + 'static>(err: RusotoError<E>) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, err)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn join_keys() {
+        assert_eq!(join_key("", ""), "");
+        assert_eq!(join_key("", "d/123"), "d/123");
+        assert_eq!(join_key("backups/home", ""), "backups/home");
+        assert_eq!(
+            join_key("backups/home", "b0000/BANDHEAD"),
+            "backups/home/b0000/BANDHEAD"
+        );
+        assert_eq!(join_key("backups", "/d/"), "backups/d");
+    }
+}
@@ -43,18 +43,23 @@ pub trait ReadTree {
     ///
     /// This typically requires walking all entries, which may take a while.
     fn size(&self, excludes: GlobSet) -> Result<TreeSize> {
-        let mut progress_bar = ProgressBar::new();
-        progress_bar.set_phase("Measuring");
-        let mut tot = 0u64;
-        for e in self.iter_entries(None, excludes)? {
-            // While just measuring size, ignore directories/files we can't stat.
-            if let Some(bytes) = e.size() {
-                tot += bytes;
-                progress_bar.increment_bytes_done(bytes);
-            }
+        measure_size(self, excludes)
+    }
+}
+
+/// Measure the tree size by walking all its entries.
+pub(crate) fn measure_size<T: ReadTree + ?Sized>(tree: &T, excludes: GlobSet) -> Result<TreeSize> {
+    let mut progress_bar = ProgressBar::new();
+    progress_bar.set_phase("Measuring");
+    let mut tot = 0u64;
+    for e in tree.iter_entries(None, excludes)? {
+        // While just measuring size, ignore directories/files we can't stat.
+        if let Some(bytes) = e.size() {
+            tot += bytes;
+            progress_bar.increment_bytes_done(bytes);
         }
-        Ok(TreeSize { file_bytes: tot })
     }
+    Ok(TreeSize { file_bytes: tot })
 }
 
 /// Read a file as a series of blocks of bytes.
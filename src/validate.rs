@@ -10,49 +10,38 @@
 // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 // GNU General Public License for more details.
 
-use std::collections::HashMap;
-use std::{cmp::max, sync::Mutex};
+use std::sync::Mutex;
+use std::time::Duration;
 
-use crate::blockdir::Address;
 use crate::*;
 
-pub(crate) struct BlockLengths(pub(crate) HashMap<BlockHash, u64>);
+mod sorted_lens;
+
+pub(crate) use sorted_lens::{BlockLenSorter, SortedBlockLens};
 
 #[derive(Debug, Default)]
 pub struct ValidateOptions {
     /// Assume blocks that are present have the right content: don't read and hash them.
     pub skip_block_hashes: bool,
-}
 
-impl BlockLengths {
-    fn new() -> BlockLengths {
-        BlockLengths(HashMap::new())
-    }
+    /// Skip blocks that were checked by an earlier incremental validation, and record
+    /// which blocks were checked by this one.
+    pub incremental: bool,
 
-    fn add(&mut self, addr: Address) {
-        let end = addr.start + addr.len;
-        if let Some(al) = self.0.get_mut(&addr.hash) {
-            *al = max(*al, end)
-        } else {
-            self.0.insert(addr.hash, end);
-        }
-    }
+    /// In incremental mode, check again this fraction of the previously checked blocks,
+    /// chosen at random.
+    pub reverify_fraction: f64,
 
-    fn update(&mut self, b: BlockLengths) {
-        for (bh, bl) in b.0 {
-            self.0
-                .entry(bh)
-                .and_modify(|al| *al = max(*al, bl))
-                .or_insert(bl);
-        }
-    }
+    /// In incremental mode, check again blocks last checked longer ago than this.
+    pub reverify_older_than: Option<Duration>,
 }
+
 pub(crate) fn validate_bands(
     archive: &Archive,
     band_ids: &[BandId],
-) -> (BlockLengths, ValidateStats) {
+) -> Result<(SortedBlockLens, ValidateStats)> {
     let mut stats = ValidateStats::default();
-    let mut block_lens = BlockLengths::new();
+    let mut block_lens = BlockLenSorter::new();
 
     let mut progress_bar = ProgressBar::new();
     progress_bar.set_phase("Check index");
@@ -70,12 +59,7 @@ pub(crate) fn validate_bands(
         }
 
         if let Ok(st) = archive.open_stored_tree(BandSelectionPolicy::Specified(band_id.clone())) {
-            if let Ok((st_block_lens, st_stats)) = validate_stored_tree(&st) {
-                stats += st_stats;
-                block_lens.update(st_block_lens);
-            } else {
-                stats.tree_validate_errors += 1
-            }
+            stats += validate_stored_tree(&st, &mut block_lens)?;
         } else {
             stats.tree_open_errors += 1;
             continue;
@@ -85,19 +69,58 @@ pub(crate) fn validate_bands(
             pb_lock.increment_work_done(1);
         }
     }
-    (block_lens, stats)
+    Ok((block_lens.finish()?, stats))
 }
 
-pub(crate) fn validate_stored_tree(st: &StoredTree) -> Result<(BlockLengths, ValidateStats)> {
-    let mut block_lens = BlockLengths::new();
-    let stats = ValidateStats::default();
-    for entry in st
-        .iter_entries(None, excludes_nothing())?
-        .filter(|entry| entry.kind() == Kind::File)
-    {
+/// Check that every referenced block is present and at least as long as the
+/// references to it, by walking both in hash order.
+pub(crate) fn check_block_lengths(
+    referenced: &mut SortedBlockLens,
+    present: &mut SortedBlockLens,
+    stats: &mut ValidateStats,
+) -> Result<()> {
+    let mut next_present = present.next_block()?;
+    while let Some((block_hash, referenced_len)) = referenced.next_block()? {
+        while matches!(&next_present, Some((present_hash, _)) if *present_hash < block_hash) {
+            next_present = present.next_block()?;
+        }
+        match &next_present {
+            Some((present_hash, actual_len)) if *present_hash == block_hash => {
+                if referenced_len > *actual_len {
+                    ui::problem(&format!("Block {:?} is too short", block_hash,));
+                    // TODO: A separate counter; this is worse than just being missing
+                    stats.block_missing_count += 1;
+                }
+            }
+            _ => {
+                ui::problem(&format!("Block {:?} is missing", block_hash));
+                stats.block_missing_count += 1;
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Add the extent of every block referenced by a stored tree to `block_lens`.
+///
+/// Addresses go straight into the sorter, which keeps the largest length for each
+/// block as it sorts, so memory doesn't grow with the number of distinct blocks.
+pub(crate) fn validate_stored_tree(
+    st: &StoredTree,
+    block_lens: &mut BlockLenSorter,
+) -> Result<ValidateStats> {
+    let mut stats = ValidateStats::default();
+    let entries = match st.iter_entries(None, excludes_nothing()) {
+        Ok(entries) => entries,
+        Err(_) => {
+            stats.tree_validate_errors += 1;
+            return Ok(stats);
+        }
+    };
+    for entry in entries.filter(|entry| entry.kind() == Kind::File) {
         for addr in entry.addrs {
-            block_lens.add(addr)
+            block_lens.push(addr.hash, addr.start + addr.len)?;
         }
     }
-    Ok((block_lens, stats))
+    Ok(stats)
 }
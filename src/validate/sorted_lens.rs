@@ -0,0 +1,209 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Sort (block hash, length) pairs in bounded memory.
+//!
+//! Pairs are buffered and sorted in memory, and each full buffer is written to a
+//! temporary file as a sorted run. The runs are then merged, combining pairs for the
+//! same hash by keeping the largest length, so that the referenced and present
+//! blocks of a whole archive can be compared by walking both in hash order.
+
+use std::cmp::{max, Reverse};
+use std::collections::BinaryHeap;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{self, BufReader, BufWriter, Read, Seek, SeekFrom, Write};
+
+use rayon::prelude::*;
+
+use crate::*;
+
+/// Write a sorted run after buffering this many pairs: about 72MB.
+const RUN_RECORDS: usize = 1 << 20;
+
+/// Each record in a run file is the binary hash then a little-endian u64 length.
+const RECORD_LEN: usize = BLAKE_HASH_SIZE_BYTES + 8;
+
+pub(crate) struct BlockLenSorter {
+    buf: Vec<(BlockHash, u64)>,
+    /// Sorted runs that have been written out, each positioned at the start.
+    runs: Vec<File>,
+    run_records: usize,
+}
+
+impl BlockLenSorter {
+    pub fn new() -> BlockLenSorter {
+        BlockLenSorter::with_run_records(RUN_RECORDS)
+    }
+
+    fn with_run_records(run_records: usize) -> BlockLenSorter {
+        BlockLenSorter {
+            buf: Vec::new(),
+            runs: Vec::new(),
+            run_records,
+        }
+    }
+
+    pub fn push(&mut self, hash: BlockHash, len: u64) -> Result<()> {
+        self.buf.push((hash, len));
+        if self.buf.len() >= self.run_records {
+            self.write_run()?;
+        }
+        Ok(())
+    }
+
+    fn write_run(&mut self) -> Result<()> {
+        sort_and_combine(&mut self.buf);
+        let mut file = tempfile::tempfile()?;
+        let mut writer = BufWriter::new(&mut file);
+        for (hash, len) in self.buf.drain(..) {
+            writer.write_all(hash.as_bytes())?;
+            writer.write_all(&len.to_le_bytes())?;
+        }
+        writer.flush()?;
+        drop(writer);
+        file.seek(SeekFrom::Start(0))?;
+        self.runs.push(file);
+        Ok(())
+    }
+
+    /// Stop adding pairs, and start merging them in order.
+    pub fn finish(mut self) -> Result<SortedBlockLens> {
+        sort_and_combine(&mut self.buf);
+        let mut runs: Vec<Run> = self
+            .runs
+            .into_iter()
+            .map(|file| Run::File(BufReader::new(file)))
+            .collect();
+        runs.push(Run::Memory(self.buf.into_iter()));
+        let mut sorted = SortedBlockLens {
+            runs,
+            heap: BinaryHeap::new(),
+        };
+        for i in 0..sorted.runs.len() {
+            sorted.refill(i)?;
+        }
+        Ok(sorted)
+    }
+}
+
+/// Sort by hash, and keep only the largest length for each hash.
+fn sort_and_combine(buf: &mut Vec<(BlockHash, u64)>) {
+    buf.par_sort_unstable_by(|a, b| a.0.cmp(&b.0));
+    buf.dedup_by(|later, earlier| {
+        if later.0 == earlier.0 {
+            earlier.1 = max(earlier.1, later.1);
+            true
+        } else {
+            false
+        }
+    });
+}
+
+enum Run {
+    Memory(std::vec::IntoIter<(BlockHash, u64)>),
+    File(BufReader<File>),
+}
+
+impl Run {
+    fn read(&mut self) -> Result<Option<(BlockHash, u64)>> {
+        match self {
+            Run::Memory(iter) => Ok(iter.next()),
+            Run::File(reader) => {
+                let mut record = [0u8; RECORD_LEN];
+                match reader.read_exact(&mut record) {
+                    Ok(()) => Ok(Some((
+                        BlockHash::from_bytes(&record[..BLAKE_HASH_SIZE_BYTES]),
+                        u64::from_le_bytes(record[BLAKE_HASH_SIZE_BYTES..].try_into().unwrap()),
+                    ))),
+                    Err(err) if err.kind() == io::ErrorKind::UnexpectedEof => Ok(None),
+                    Err(err) => Err(err.into()),
+                }
+            }
+        }
+    }
+}
+
+/// Distinct block hashes in increasing order, each with the largest length pushed for it.
+pub(crate) struct SortedBlockLens {
+    runs: Vec<Run>,
+    /// The next pair from each run that isn't exhausted, and the index of that run.
+    heap: BinaryHeap<Reverse<(BlockHash, u64, usize)>>,
+}
+
+impl SortedBlockLens {
+    pub fn next_block(&mut self) -> Result<Option<(BlockHash, u64)>> {
+        let (hash, mut len, i) = match self.heap.pop() {
+            None => return Ok(None),
+            Some(Reverse(next)) => next,
+        };
+        self.refill(i)?;
+        while let Some(Reverse((next_hash, _, _))) = self.heap.peek() {
+            if *next_hash != hash {
+                break;
+            }
+            let Reverse((_, next_len, j)) = self.heap.pop().unwrap();
+            len = max(len, next_len);
+            self.refill(j)?;
+        }
+        Ok(Some((hash, len)))
+    }
+
+    fn refill(&mut self, i: usize) -> Result<()> {
+        if let Some((hash, len)) = self.runs[i].read()? {
+            self.heap.push(Reverse((hash, len, i)));
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn hash(i: u8) -> BlockHash {
+        BlockHash::from_bytes(&[i; BLAKE_HASH_SIZE_BYTES])
+    }
+
+    fn collect(mut sorted: SortedBlockLens) -> Vec<(BlockHash, u64)> {
+        std::iter::from_fn(|| sorted.next_block().unwrap()).collect()
+    }
+
+    #[test]
+    fn merges_runs_keeping_largest_length() {
+        // Small runs, so that most pairs go through temporary files.
+        let mut sorter = BlockLenSorter::with_run_records(3);
+        for (i, len) in &[
+            (5, 10),
+            (1, 7),
+            (3, 2),
+            (1, 9),
+            (5, 4),
+            (2, 1),
+            (3, 8),
+            (1, 3),
+        ] {
+            sorter.push(hash(*i), *len).unwrap();
+        }
+        assert_eq!(sorter.runs.len(), 2);
+        assert_eq!(
+            collect(sorter.finish().unwrap()),
+            [(hash(1), 9), (hash(2), 1), (hash(3), 8), (hash(5), 10)]
+        );
+    }
+
+    #[test]
+    fn empty() {
+        assert!(collect(BlockLenSorter::new().finish().unwrap()).is_empty());
+    }
+}
@@ -0,0 +1,220 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! A ledger of blocks whose content was checked by an earlier validation, so that
+//! incremental validation can skip them.
+//!
+//! The ledger is only a cache: if it's missing or unreadable, every block is checked.
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::io;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use crate::transport::Transport;
+use crate::*;
+
+/// Name of the ledger file in the archive directory.
+pub(crate) const VERIFIED_FILENAME: &str = "VERIFIED";
+
+const MAGIC: &[u8] = b"CVER";
+const FORMAT_VERSION: u8 = 1;
+/// Each record is the binary hash followed by the verify time, compressed length, and
+/// uncompressed length as little-endian u64s.
+const RECORD_LEN: usize = BLAKE_HASH_SIZE_BYTES + 3 * 8;
+
+/// When and how a block was last found to be correct.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub(crate) struct Verified {
+    /// Seconds since the Unix epoch.
+    pub time: u64,
+    pub compressed_len: u64,
+    pub uncompressed_len: u64,
+}
+
+#[derive(Debug, Default)]
+pub(crate) struct VerifiedBlocks {
+    pub blocks: HashMap<BlockHash, Verified>,
+}
+
+impl VerifiedBlocks {
+    /// Read the ledger from the archive directory, or return an empty ledger if there
+    /// is none, or if it can't be decoded.
+    pub fn read(transport: &dyn Transport) -> Result<VerifiedBlocks> {
+        let mut buf = Vec::new();
+        match transport.read_file(VERIFIED_FILENAME, &mut buf) {
+            Ok(()) => {}
+            Err(err) if err.kind() == io::ErrorKind::NotFound => {
+                return Ok(VerifiedBlocks::default())
+            }
+            Err(err) => return Err(err.into()),
+        }
+        Ok(decode(&buf).unwrap_or_else(|| {
+            ui::problem(&format!(
+                "Can't decode {:?}; all blocks will be checked",
+                VERIFIED_FILENAME
+            ));
+            VerifiedBlocks::default()
+        }))
+    }
+
+    pub fn write(&self, transport: &dyn Transport) -> Result<()> {
+        transport
+            .write_file(VERIFIED_FILENAME, &self.encode())
+            .map_err(|source| Error::WriteMetadata {
+                path: VERIFIED_FILENAME.to_owned(),
+                source,
+            })
+    }
+
+    fn encode(&self) -> Vec<u8> {
+        let mut buf = Vec::with_capacity(MAGIC.len() + 1 + self.blocks.len() * RECORD_LEN);
+        buf.extend_from_slice(MAGIC);
+        buf.push(FORMAT_VERSION);
+        for (hash, verified) in &self.blocks {
+            buf.extend_from_slice(hash.as_bytes());
+            buf.extend_from_slice(&verified.time.to_le_bytes());
+            buf.extend_from_slice(&verified.compressed_len.to_le_bytes());
+            buf.extend_from_slice(&verified.uncompressed_len.to_le_bytes());
+        }
+        buf
+    }
+}
+
+fn decode(buf: &[u8]) -> Option<VerifiedBlocks> {
+    let header_len = MAGIC.len() + 1;
+    if buf.len() < header_len
+        || &buf[..MAGIC.len()] != MAGIC
+        || buf[MAGIC.len()] != FORMAT_VERSION
+        || (buf.len() - header_len) % RECORD_LEN != 0
+    {
+        return None;
+    }
+    let u64_at = |r: &[u8], i: usize| {
+        let start = BLAKE_HASH_SIZE_BYTES + i * 8;
+        u64::from_le_bytes(r[start..(start + 8)].try_into().unwrap())
+    };
+    let blocks = buf[header_len..]
+        .chunks_exact(RECORD_LEN)
+        .map(|r| {
+            (
+                BlockHash::from_bytes(&r[..BLAKE_HASH_SIZE_BYTES]),
+                Verified {
+                    time: u64_at(r, 0),
+                    compressed_len: u64_at(r, 1),
+                    uncompressed_len: u64_at(r, 2),
+                },
+            )
+        })
+        .collect();
+    Some(VerifiedBlocks { blocks })
+}
+
+/// Seconds since the Unix epoch.
+pub(crate) fn unix_now() -> u64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs())
+        .unwrap_or_default()
+}
+
+/// Chooses which previously verified blocks should be checked again.
+#[derive(Debug)]
+pub(crate) struct Reverify {
+    now: u64,
+    /// Re-check blocks whose hash, offset by this, falls in the sampled fraction, so that
+    /// each run samples different blocks.
+    seed: u64,
+    /// Re-check this many in a million blocks.
+    sample_per_million: u64,
+    older_than: Option<Duration>,
+}
+
+impl Reverify {
+    pub fn new(fraction: f64, older_than: Option<Duration>) -> Reverify {
+        let now = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .unwrap_or_default();
+        Reverify {
+            now: now.as_secs(),
+            seed: now.as_nanos() as u64,
+            sample_per_million: (fraction.max(0.0).min(1.0) * 1e6) as u64,
+            older_than,
+        }
+    }
+
+    pub fn should_reverify(&self, hash: &BlockHash, verified: &Verified) -> bool {
+        if let Some(older_than) = self.older_than {
+            if self.now.saturating_sub(verified.time) >= older_than.as_secs() {
+                return true;
+            }
+        }
+        hash.prefix_u64().wrapping_add(self.seed) % 1_000_000 < self.sample_per_million
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::transport::local::LocalTransport;
+
+    fn hash(i: u8) -> BlockHash {
+        BlockHash::from_bytes(&[i; BLAKE_HASH_SIZE_BYTES])
+    }
+
+    #[test]
+    fn round_trip() {
+        let temp = tempfile::tempdir().unwrap();
+        let transport = LocalTransport::new(temp.path());
+        assert!(VerifiedBlocks::read(&transport).unwrap().blocks.is_empty());
+
+        let mut ledger = VerifiedBlocks::default();
+        for i in 0..10 {
+            ledger.blocks.insert(
+                hash(i),
+                Verified {
+                    time: 1_600_000_000 + u64::from(i),
+                    compressed_len: 100,
+                    uncompressed_len: 200 + u64::from(i),
+                },
+            );
+        }
+        ledger.write(&transport).unwrap();
+        let reread = VerifiedBlocks::read(&transport).unwrap();
+        assert_eq!(reread.blocks, ledger.blocks);
+    }
+
+    #[test]
+    fn undecodable_ledger_is_empty() {
+        assert!(decode(b"CVER").is_none());
+        assert!(decode(b"CVER\x01truncated").is_none());
+        assert!(decode(b"CVER\x01").unwrap().blocks.is_empty());
+    }
+
+    #[test]
+    fn reverify_old_and_sampled_blocks() {
+        let verified = Verified {
+            time: unix_now() - 3600,
+            compressed_len: 1,
+            uncompressed_len: 1,
+        };
+        let never = Reverify::new(0.0, None);
+        assert!(!never.should_reverify(&hash(1), &verified));
+        let always = Reverify::new(1.0, None);
+        assert!(always.should_reverify(&hash(1), &verified));
+        let old = Reverify::new(0.0, Some(Duration::from_secs(60)));
+        assert!(old.should_reverify(&hash(1), &verified));
+        let recent = Reverify::new(0.0, Some(Duration::from_secs(86400)));
+        assert!(!recent.should_reverify(&hash(1), &verified));
+    }
+}
@@ -207,6 +207,98 @@ fn large_file() {
     assert_eq!(large_content, content);
 }
 
+#[test]
+fn preloaded_block_names_avoid_existence_checks() {
+    let af = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    tf.create_file_with_contents("large", &vec![b'a'; 4 << 20]);
+    let options = BackupOptions {
+        preload_block_names: true,
+        ..BackupOptions::default()
+    };
+
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.block_presence_misses, 1);
+    assert_eq!(stats.block_presence_hits, 3);
+    assert_eq!(stats.written_blocks, 1);
+    assert_eq!(stats.deduplicated_blocks, 3);
+
+    tf.create_file_with_contents("copy", &vec![b'a'; 2 << 20]);
+    tf.create_file_with_contents("other", &vec![b'b'; 1 << 20]);
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.block_presence_hits, 2);
+    assert_eq!(stats.block_presence_misses, 1);
+    assert_eq!(stats.written_blocks, 1);
+    assert_eq!(stats.deduplicated_blocks, 2);
+}
+
+#[test]
+fn large_file_with_parallel_jobs() {
+    let af = ScratchArchive::new();
+    let tf = TreeFixture::new();
+
+    let large_content: Vec<u8> = (0..(5 << 20) + 1234)
+        .map(|i: usize| (i / 1000 % 251) as u8)
+        .collect();
+    tf.create_file_with_contents("large", &large_content);
+
+    let options = BackupOptions {
+        jobs: 4,
+        ..BackupOptions::default()
+    };
+    let backup_stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(backup_stats.new_files, 1);
+    assert_eq!(backup_stats.multi_block_files, 1);
+    assert_eq!(backup_stats.written_blocks, 6);
+    assert_eq!(backup_stats.uncompressed_bytes, large_content.len() as u64);
+    assert_eq!(backup_stats.errors, 0);
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    let content = std::fs::read(rd.path().join("large")).unwrap();
+    assert_eq!(large_content, content);
+}
+
+#[test]
+fn content_chunking_deduplicates_after_insertion() {
+    let af = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    let mut x: u32 = 1;
+    let mut content: Vec<u8> = (0..(6 << 20))
+        .map(|_| {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            (x >> 24) as u8
+        })
+        .collect();
+    tf.create_file_with_contents("image", &content);
+    let options = BackupOptions {
+        content_chunking: Some(ContentChunking::default()),
+        ..BackupOptions::default()
+    };
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert!(stats.written_blocks >= 6);
+    assert_eq!(stats.deduplicated_blocks, 0);
+
+    content.insert(1000, b'!');
+    tf.create_file_with_contents("image", &content);
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.modified_files, 1);
+    assert!(stats.written_blocks <= 2, "{:?}", stats);
+    assert!(stats.deduplicated_blocks >= 4, "{:?}", stats);
+
+    let band = Band::open(&af, &BandId::new(&[1])).unwrap();
+    assert_eq!(
+        band.get_info().unwrap().content_chunking,
+        Some(ContentChunking::default())
+    );
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(std::fs::read(rd.path().join("image")).unwrap(), content);
+}
+
 /// If some files are unreadable, others are stored and the backup completes with warnings.
 #[cfg(unix)]
 #[test]
@@ -390,24 +482,90 @@ fn small_files_combined_two_backups() {
     srcdir.create_file("file2");
 
     let stats1 = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).unwrap();
-    // Although the two files have the same content, we do not yet dedupe them
-    // within a combined block, so the block is different to when one identical
-    // file is stored alone. This could be fixed.
+    // The two files have the same content, so it's stored only once in the
+    // combined block.
     assert_eq!(stats1.combined_blocks, 1);
     assert_eq!(stats1.new_files, 2);
     assert_eq!(stats1.written_blocks, 1);
-    assert_eq!(stats1.new_files, 2);
+    assert_eq!(stats1.deduplicated_small_files, 1);
+    assert_eq!(stats1.uncompressed_bytes, 8);
 
-    // Add one more file, also identical, but it is not combined with the previous blocks.
-    // This is a shortcoming of the current dedupe approach.
+    // Add one more file, also identical. It's alone in its combined block, which is the
+    // same as the previous block.
     srcdir.create_file("file3");
     let stats2 = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).unwrap();
     assert_eq!(stats2.new_files, 1);
     assert_eq!(stats2.unmodified_files, 2);
-    assert_eq!(stats2.written_blocks, 1);
+    assert_eq!(stats2.written_blocks, 0);
+    assert_eq!(stats2.deduplicated_blocks, 1);
     assert_eq!(stats2.combined_blocks, 1);
 
-    assert_eq!(af.block_dir().block_names().unwrap().count(), 2);
+    assert_eq!(af.block_dir().block_names().unwrap().count(), 1);
+}
+
+#[test]
+fn small_files_deduplicated_across_combined_blocks() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    // Enough distinct content to fill more than one combined block.
+    let content = |i: usize| format!("{:05}", i).repeat(18_000);
+    for i in 0..20 {
+        srcdir.create_file_with_contents(&format!("a{:02}", i), content(i).as_bytes());
+    }
+    // A copy of the first file, which is in an earlier combined block.
+    srcdir.create_file_with_contents("b", content(0).as_bytes());
+
+    let stats = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).unwrap();
+    assert!(stats.combined_blocks > 1, "{:?}", stats);
+    assert_eq!(stats.deduplicated_small_files, 1);
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(
+        std::fs::read(rd.path().join("b")).unwrap(),
+        content(0).as_bytes()
+    );
+}
+
+#[test]
+fn touched_small_files_deduplicated_from_basis() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    for i in 0..10 {
+        srcdir.create_file_with_contents(&format!("file{}", i), format!("small {}", i).as_bytes());
+    }
+    let options = BackupOptions {
+        dedup_small_files_from_basis: true,
+        ..BackupOptions::default()
+    };
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    assert_eq!(stats.written_blocks, 1);
+
+    // Rewrite some files with the same content but a different mtime, and change one.
+    let later = FileTime::from_unix_time(1_600_000_000, 0);
+    for i in 0..3 {
+        let path = srcdir
+            .create_file_with_contents(&format!("file{}", i), format!("small {}", i).as_bytes());
+        set_file_mtime(&path, later).unwrap();
+    }
+    let path = srcdir.create_file_with_contents("file9", b"small X");
+    set_file_mtime(&path, later).unwrap();
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    assert_eq!(stats.modified_files, 4);
+    assert_eq!(stats.deduplicated_small_files, 3);
+    // Only the changed file is stored.
+    assert_eq!(stats.written_blocks, 1);
+    assert_eq!(stats.uncompressed_bytes, 7);
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    for i in 0..9 {
+        assert_eq!(
+            std::fs::read(rd.path().join(format!("file{}", i))).unwrap(),
+            format!("small {}", i).as_bytes()
+        );
+    }
+    assert_eq!(std::fs::read(rd.path().join("file9")).unwrap(), b"small X");
 }
 
 #[test]
@@ -477,9 +635,13 @@ pub fn mixed_medium_small_files_two_hunks() {
     assert_eq!(stats.new_files, 1999);
     assert_eq!(stats.single_block_files, 20);
     assert_eq!(stats.small_combined_files, 1999 - 20);
+    assert_eq!(stats.deduplicated_small_files, 1999 - 20 - 1);
     assert_eq!(stats.errors, 0);
-    // There's one deduped block for all the large files, and then one per hunk for all the small combined files.
-    assert_eq!(stats.written_blocks, 3);
+    // There's one deduped block for all the large files, and then one for all the small
+    // files, which are identical: files in the second hunk refer to the block written in
+    // the first.
+    assert_eq!(stats.written_blocks, 2);
+    assert_eq!(stats.combined_blocks, 1);
 
     let tree = af.open_stored_tree(BandSelectionPolicy::Latest).unwrap();
     let mut entry_iter = tree.iter_entries(None, excludes_nothing()).unwrap();
@@ -548,3 +710,318 @@ fn detect_unchanged_from_stitched_index() {
     assert_eq!(stats.unmodified_files, 2, "both files are unmodified");
     assert_eq!(stats.index_builder_stats.index_hunks, 3);
 }
+
+#[test]
+fn binary_index_format_backup_and_restore() {
+    let af = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    tf.create_dir("subdir");
+    tf.create_file_with_contents("subdir/a", b"a content");
+    tf.create_file_with_contents("b", b"b content");
+    let options = BackupOptions {
+        index_format: IndexFormat::Binary,
+        ..BackupOptions::default()
+    };
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.index_builder_stats.index_hunks, 1);
+    assert_eq!(stats.files, 2);
+
+    // An incremental json backup can be made on top of the binary band.
+    let stats = backup(&af, &tf.live_tree(), &BackupOptions::default()).expect("backup");
+    assert_eq!(stats.unmodified_files, 2);
+
+    let validate_stats = af.validate(&ValidateOptions::default()).unwrap();
+    assert!(!validate_stats.has_problems());
+
+    let rd = TempDir::new().unwrap();
+    let options = RestoreOptions {
+        band_selection: BandSelectionPolicy::Specified(BandId::new(&[0])),
+        ..RestoreOptions::default()
+    };
+    restore(&af, rd.path(), &options).expect("restore");
+    assert_eq!(
+        std::fs::read(rd.path().join("subdir").join("a")).unwrap(),
+        b"a content"
+    );
+}
+
+#[test]
+fn zstd_compressed_backup_and_restore() {
+    let af = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    let text = b"some very repetitive text ".repeat(10_000);
+    tf.create_file_with_contents("text", &text);
+    let options = BackupOptions {
+        compression: Compression::Zstd { level: 9 },
+        ..BackupOptions::default()
+    };
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.files, 1);
+    assert!(stats.compressed_bytes < stats.uncompressed_bytes / 10);
+    // Later bands can refer to zstd blocks, so older versions can't read the archive.
+    assert!(std::fs::read_to_string(af.path().join("CONSERVE"))
+        .unwrap()
+        .contains("\"conserve_archive_version\":\"0.6.15\""));
+
+    // Snappy backups can follow, and both kinds of block are read back.
+    tf.create_file_with_contents("more", b"more content");
+    backup(&af, &tf.live_tree(), &BackupOptions::default()).expect("backup");
+
+    let validate_stats = af.validate(&ValidateOptions::default()).unwrap();
+    assert!(!validate_stats.has_problems());
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(std::fs::read(rd.path().join("text")).unwrap(), text);
+    assert_eq!(
+        std::fs::read(rd.path().join("more")).unwrap(),
+        b"more content"
+    );
+}
+
+#[test]
+fn packed_backup_and_restore() {
+    let af = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    for i in 0..20 {
+        tf.create_file_with_contents(
+            &format!("file{:02}", i),
+            format!("content {}", i).as_bytes(),
+        );
+    }
+    let options = BackupOptions {
+        pack_blocks: true,
+        ..BackupOptions::default()
+    };
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.files, 20);
+    assert!(af.path().join("d").join("pack").is_dir());
+    // Later bands can refer to packed blocks, so older versions can't read the archive.
+    assert!(std::fs::read_to_string(af.path().join("CONSERVE"))
+        .unwrap()
+        .contains("\"conserve_archive_version\":\"0.6.15\""));
+    assert_eq!(
+        af.block_dir().block_names().unwrap().count(),
+        stats.written_blocks
+    );
+
+    // A second packed backup writes no new blocks for unchanged content.
+    let stats = backup(&af, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(stats.written_blocks, 0);
+
+    let validate_stats = af.validate(&ValidateOptions::default()).unwrap();
+    assert!(!validate_stats.has_problems());
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    for i in 0..20 {
+        assert_eq!(
+            std::fs::read(rd.path().join(format!("file{:02}", i))).unwrap(),
+            format!("content {}", i).as_bytes()
+        );
+    }
+}
+
+#[test]
+fn blake3_archive_backup_restore_validate() {
+    let temp = TempDir::new().unwrap();
+    let archive_path = temp.path().join("archive");
+    let af = Archive::create_with_options(
+        open_transport(archive_path.to_str().unwrap()).unwrap(),
+        &ArchiveOptions {
+            block_hash: HashAlgorithm::Blake3,
+        },
+    )
+    .unwrap();
+    let srcdir = TreeFixture::new();
+    srcdir.create_file("hello");
+    srcdir.create_file_with_contents("large", &vec![b'a'; 3 << 20]);
+
+    let stats = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).expect("backup");
+    assert_eq!(stats.written_blocks, 2);
+    assert_eq!(stats.deduplicated_blocks, 2);
+    // Blocks are named by their BLAKE3 hash, not BLAKE2b.
+    let names: Vec<String> = af
+        .block_dir()
+        .block_names()
+        .unwrap()
+        .map(|hash| hash.to_string())
+        .collect();
+    assert!(!names.contains(&HELLO_HASH.to_owned()));
+
+    // It can be reopened, validated and restored.
+    let af = Archive::open_path(&archive_path).unwrap();
+    let validate_stats = af.validate(&ValidateOptions::default()).unwrap();
+    assert!(!validate_stats.has_problems());
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(std::fs::read(rd.path().join("hello")).unwrap(), b"contents");
+    assert_eq!(
+        std::fs::read(rd.path().join("large")).unwrap(),
+        vec![b'a'; 3 << 20]
+    );
+}
+
+/// Hashing large BLAKE3 blocks runs on rayon, so while one block is checked the thread
+/// may pick up another block read: this must not reuse the first read's buffers.
+#[test]
+fn blake3_multi_block_validate_and_restore_on_many_threads() {
+    let temp = TempDir::new().unwrap();
+    let archive_path = temp.path().join("archive");
+    let af = Archive::create_with_options(
+        open_transport(archive_path.to_str().unwrap()).unwrap(),
+        &ArchiveOptions {
+            block_hash: HashAlgorithm::Blake3,
+        },
+    )
+    .unwrap();
+    let srcdir = TreeFixture::new();
+    // Distinct content, so that each 1MB block is different.
+    let mut x: u32 = 1;
+    let content: Vec<u8> = (0..(8 << 20))
+        .map(|_| {
+            x = x.wrapping_mul(1_103_515_245).wrapping_add(12345);
+            (x >> 24) as u8
+        })
+        .collect();
+    srcdir.create_file_with_contents("large", &content);
+    let stats = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).expect("backup");
+    assert_eq!(stats.written_blocks, 8);
+
+    let pool = rayon::ThreadPoolBuilder::new()
+        .num_threads(4)
+        .build()
+        .unwrap();
+    pool.install(|| {
+        let validate_stats = af.validate(&ValidateOptions::default()).unwrap();
+        assert!(!validate_stats.has_problems());
+        assert_eq!(validate_stats.block_error_count, 0);
+
+        let rd = TempDir::new().unwrap();
+        let options = RestoreOptions {
+            jobs: 4,
+            ..RestoreOptions::default()
+        };
+        restore(&af, rd.path(), &options).expect("restore");
+        assert_eq!(std::fs::read(rd.path().join("large")).unwrap(), content);
+    });
+}
+
+#[cfg(unix)]
+#[test]
+fn stat_cache_detects_rewrite_with_same_mtime() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    let cache_dir = TempDir::new().unwrap();
+    let cache_path = cache_dir.path().join("stat-cache");
+    let mtime = FileTime::from_unix_time(1_600_000_000, 0);
+    for name in &["a", "b"] {
+        let path = srcdir.create_file(name);
+        set_file_mtime(&path, mtime).unwrap();
+    }
+    let options = BackupOptions {
+        stat_cache: Some(cache_path.clone()),
+        ..BackupOptions::default()
+    };
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    assert_eq!(stats.new_files, 2);
+    assert!(cache_path.is_file());
+
+    // Rewrite b with the same length and mtime, which mtime and size alone can't detect.
+    let path = srcdir.create_file_with_contents("b", b"CONTENTS");
+    set_file_mtime(&path, mtime).unwrap();
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    // Both files were changed within a second of the first backup, so they weren't
+    // recorded in the cache, and they're both read again.
+    assert_eq!(stats.unmodified_files, 0);
+    assert_eq!(stats.modified_files, 2);
+    assert_eq!(stats.stat_cache_changed_files, 2);
+
+    let rd = TempDir::new().unwrap();
+    restore(&af, rd.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(std::fs::read(rd.path().join("b")).unwrap(), b"CONTENTS");
+}
+
+#[test]
+fn resume_incomplete_band() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    srcdir.create_file("a");
+    srcdir.create_dir("b");
+    srcdir.create_file("b/1");
+    srcdir.create_file("b/2");
+    srcdir.create_file("c");
+    let options = BackupOptions {
+        max_entries_per_hunk: 1,
+        resume: true,
+        ..Default::default()
+    };
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    assert_eq!(stats.index_builder_stats.index_hunks, 6);
+    assert_eq!(stats.resumed_index_hunks, 0);
+
+    // Pretend the backup was interrupted after writing hunks for "/", "/a", "/b", and
+    // "/c", and also the hunk for "/b/2", but not the one between them.
+    af.transport().remove_file("b0000/BANDTAIL").unwrap();
+    af.transport().remove_file("b0000/i/SUMMARY").unwrap();
+    af.transport()
+        .remove_file("b0000/i/00000/000000004")
+        .unwrap();
+
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    assert_eq!(stats.resumed_index_hunks, 4);
+    assert_eq!(stats.index_builder_stats.index_hunks, 2);
+    // Only the entries after "/c" were walked and stored.
+    assert_eq!(stats.files, 2);
+    assert_eq!(stats.directories, 0);
+    assert_eq!(stats.new_files, 2);
+
+    // The same band was completed, rather than starting a new one.
+    assert_eq!(af.list_band_ids().unwrap(), [BandId::zero()]);
+    assert!(af.band_is_closed(&BandId::zero()).unwrap());
+    let validate_stats = af.validate(&ValidateOptions::default()).unwrap();
+    assert!(!validate_stats.has_problems());
+    let names: Vec<String> = af
+        .open_stored_tree(BandSelectionPolicy::Latest)
+        .unwrap()
+        .iter_entries(None, excludes_nothing())
+        .unwrap()
+        .map(|entry| entry.apath().to_string())
+        .collect();
+    assert_eq!(names, ["/", "/a", "/b", "/c", "/b/1", "/b/2"]);
+
+    // A later backup with nothing to resume makes a new band as usual.
+    let stats = backup(&af, &srcdir.live_tree(), &options).unwrap();
+    assert_eq!(stats.resumed_index_hunks, 0);
+    assert_eq!(stats.unmodified_files, 4);
+    assert_eq!(af.list_band_ids().unwrap().len(), 2);
+}
+
+#[test]
+fn tree_stats_recorded_in_band_tail() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    srcdir.create_file("hello");
+    srcdir.create_file("hello2");
+    srcdir.create_dir("subdir");
+    srcdir.create_file("subdir/subfile");
+    let stats = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).unwrap();
+
+    // All three files have the same content, so they refer to one stored copy.
+    let expected = TreeStats {
+        files: 3,
+        directories: 2,
+        symlinks: 0,
+        file_bytes: 24,
+        referenced_block_bytes: 8,
+    };
+    assert_eq!(stats.index_builder_stats.tree, expected);
+    let band = Band::open(&af, &BandId::zero()).unwrap();
+    assert_eq!(band.get_info().unwrap().tree_stats, Some(expected));
+
+    // The size from the tail matches walking the index.
+    let tree = af.open_stored_tree(BandSelectionPolicy::Latest).unwrap();
+    assert_eq!(tree.size(excludes_nothing()).unwrap().file_bytes, 24);
+    let excludes = excludes::from_strings(&["/nothing"]).unwrap();
+    assert_eq!(tree.size(excludes).unwrap().file_bytes, 24);
+}
@@ -33,6 +33,7 @@ fn missing_block_skip_block_hashes() -> Result<()> {
 
     let validate_stats = archive.validate(&ValidateOptions {
         skip_block_hashes: true,
+        ..ValidateOptions::default()
     })?;
     assert_eq!(validate_stats.has_problems(), true);
     assert_eq!(validate_stats.block_missing_count, 1);
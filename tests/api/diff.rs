@@ -56,3 +56,98 @@ fn diff_unchanged() {
     let des: Vec<DiffEntry> = diff(&st, &lt, &options).unwrap().collect();
     assert_eq!(des.len(), 0);
 }
+
+#[test]
+fn diff_stored_trees() {
+    let a = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    tf.create_file_with_contents("changed", b"old contents");
+    tf.create_file_with_contents("deleted", b"going away");
+    tf.create_file_with_contents("same", b"unchanged");
+    backup(&a, &tf.live_tree(), &BackupOptions::default()).unwrap();
+
+    tf.create_file_with_contents("changed", b"new and longer contents");
+    std::fs::remove_file(tf.path().join("deleted")).unwrap();
+    tf.create_file_with_contents("new", b"just arrived");
+    backup(&a, &tf.live_tree(), &BackupOptions::default()).unwrap();
+
+    let st0 = a
+        .open_stored_tree(BandSelectionPolicy::Specified(BandId::new(&[0])))
+        .unwrap();
+    let st1 = a.open_stored_tree(BandSelectionPolicy::Latest).unwrap();
+    let des: Vec<DiffEntry> = diff_stored(&st0, &st1, &DiffOptions::default())
+        .unwrap()
+        .collect();
+    assert_eq!(
+        des,
+        [
+            DiffEntry {
+                apath: "/changed".into(),
+                kind: DiffKind::Changed,
+            },
+            DiffEntry {
+                apath: "/deleted".into(),
+                kind: DiffKind::Deleted,
+            },
+            DiffEntry {
+                apath: "/new".into(),
+                kind: DiffKind::New,
+            },
+        ]
+    );
+
+    let options = DiffOptions {
+        include_unchanged: true,
+        ..DiffOptions::default()
+    };
+    let des: Vec<DiffEntry> = diff_stored(&st0, &st1, &options).unwrap().collect();
+    assert_eq!(des.len(), 5);
+    assert_eq!(des[0].kind, DiffKind::Unchanged);
+    assert_eq!(des[4].apath, "/same");
+    assert_eq!(des[4].kind, DiffKind::Unchanged);
+}
+
+#[test]
+fn diff_stored_skips_identical_hunks() {
+    let a = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    for i in 0..100 {
+        tf.create_file_with_contents(&format!("file{:03}", i), b"some content");
+    }
+    let options = BackupOptions {
+        max_entries_per_hunk: 10,
+        ..BackupOptions::default()
+    };
+    backup(&a, &tf.live_tree(), &options).unwrap();
+    tf.create_file_with_contents("file050", b"different content");
+    backup(&a, &tf.live_tree(), &options).unwrap();
+
+    let st0 = a
+        .open_stored_tree(BandSelectionPolicy::Specified(BandId::new(&[0])))
+        .unwrap();
+    let st1 = a.open_stored_tree(BandSelectionPolicy::Latest).unwrap();
+    let des: Vec<DiffEntry> = diff_stored(&st0, &st1, &DiffOptions::default())
+        .unwrap()
+        .collect();
+    assert_eq!(
+        des,
+        [DiffEntry {
+            apath: "/file050".into(),
+            kind: DiffKind::Changed,
+        }]
+    );
+
+    // Reading every entry finds the same changes.
+    let all: Vec<DiffEntry> = diff_stored(
+        &st0,
+        &st1,
+        &DiffOptions {
+            include_unchanged: true,
+            ..DiffOptions::default()
+        },
+    )
+    .unwrap()
+    .filter(|de| de.kind != DiffKind::Unchanged)
+    .collect();
+    assert_eq!(all, des);
+}
@@ -12,6 +12,10 @@
 
 //! Test garbage collection.
 
+use std::time::{Duration, SystemTime};
+
+use filetime::FileTime;
+
 use conserve::test_fixtures::{ScratchArchive, TreeFixture};
 use conserve::*;
 
@@ -52,6 +56,7 @@ fn unreferenced_blocks() {
             deletion_errors: 0,
             deleted_block_count: 0,
             deleted_band_count: 0,
+            rewritten_pack_count: 0,
             elapsed: delete_stats.elapsed,
         }
     );
@@ -71,6 +76,7 @@ fn unreferenced_blocks() {
             deletion_errors: 0,
             deleted_block_count: 1,
             deleted_band_count: 0,
+            rewritten_pack_count: 0,
             elapsed: delete_stats.elapsed,
         }
     );
@@ -85,6 +91,7 @@ fn unreferenced_blocks() {
             deletion_errors: 0,
             deleted_block_count: 0,
             deleted_band_count: 0,
+            rewritten_pack_count: 0,
             elapsed: delete_stats.elapsed,
         }
     );
@@ -121,3 +128,67 @@ fn backup_prevented_by_gc_lock() -> Result<()> {
 
     Ok(())
 }
+
+#[test]
+fn compact_packs() {
+    let archive = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    tf.create_file_with_contents("keep", &vec![b'k'; 200_000]);
+    tf.create_file_with_contents("drop", &vec![b'd'; 200_000]);
+    let options = BackupOptions {
+        pack_blocks: true,
+        ..BackupOptions::default()
+    };
+    backup(&archive, &tf.live_tree(), &options).expect("backup");
+    std::fs::remove_file(tf.path().join("drop")).unwrap();
+    backup(&archive, &tf.live_tree(), &options).expect("backup");
+    assert_eq!(archive.block_dir().block_names().unwrap().count(), 2);
+
+    let delete_stats = archive
+        .delete_bands(&[BandId::new(&[0])], &DeleteOptions::default())
+        .unwrap();
+    assert_eq!(delete_stats.deleted_band_count, 1);
+    assert_eq!(delete_stats.unreferenced_block_count, 1);
+    assert_eq!(delete_stats.deleted_block_count, 1);
+    assert_eq!(delete_stats.rewritten_pack_count, 1);
+    assert_eq!(delete_stats.deletion_errors, 0);
+
+    // The surviving block is still readable from a fresh view of the archive.
+    let archive = Archive::open_path(archive.path()).unwrap();
+    assert_eq!(archive.block_dir().block_names().unwrap().count(), 1);
+    assert!(archive.unreferenced_blocks().unwrap().next().is_none());
+    let validate_stats = archive.validate(&ValidateOptions::default()).unwrap();
+    assert!(!validate_stats.has_problems());
+}
+
+#[test]
+fn only_old_unindexed_packs_are_deleted() {
+    let archive = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    tf.create_file_with_contents("file", &vec![b'f'; 200_000]);
+    let options = BackupOptions {
+        pack_blocks: true,
+        ..BackupOptions::default()
+    };
+    backup(&archive, &tf.live_tree(), &options).expect("backup");
+
+    // A pack without an index from before the GC started was abandoned, but one
+    // modified since may belong to a backup that's still running.
+    let pack_dir = archive.path().join("d").join("pack");
+    let old_pack = pack_dir.join("old.pack");
+    let new_pack = pack_dir.join("new.pack");
+    std::fs::write(&old_pack, b"interrupted").unwrap();
+    std::fs::write(&new_pack, b"in progress").unwrap();
+    let now = SystemTime::now();
+    let hour = Duration::from_secs(3600);
+    filetime::set_file_mtime(&old_pack, FileTime::from_system_time(now - hour)).unwrap();
+    filetime::set_file_mtime(&new_pack, FileTime::from_system_time(now + hour)).unwrap();
+
+    let archive = Archive::open_path(archive.path()).unwrap();
+    let delete_stats = archive
+        .delete_bands(&[], &DeleteOptions::default())
+        .unwrap();
+    assert_eq!(delete_stats.deletion_errors, 0);
+    assert!(!old_pack.exists());
+    assert!(new_pack.exists());
+}
@@ -22,3 +22,4 @@ mod gc;
 mod old_archives;
 mod restore;
 mod transport;
+mod validate;
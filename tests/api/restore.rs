@@ -144,3 +144,140 @@ fn restore_symlink() {
         PathBuf::from("target")
     );
 }
+
+#[test]
+fn parallel_restore_many_files() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    for d in 0..5 {
+        srcdir.create_dir(&format!("d{}", d));
+        srcdir.create_dir(&format!("d{}/sub", d));
+        for f in 0..300 {
+            srcdir.create_file_with_contents(
+                &format!("d{}/sub/f{}", d, f),
+                format!("content of {} {}", d, f).as_bytes(),
+            );
+        }
+    }
+    let dir_mtime = FileTime::from_unix_time(1_000_000_000, 0);
+    filetime::set_file_mtime(srcdir.path().join("d3").join("sub"), dir_mtime).unwrap();
+    backup(&af, &srcdir.live_tree(), &BackupOptions::default()).expect("backup");
+
+    let destdir = TempDir::new().unwrap();
+    let options = RestoreOptions {
+        jobs: 4,
+        ..RestoreOptions::default()
+    };
+    let stats = restore(&af, destdir.path(), &options).expect("restore");
+    assert_eq!(stats.files, 1500);
+    assert_eq!(stats.directories, 11);
+    assert_eq!(stats.errors, 0);
+
+    for d in 0..5 {
+        for f in 0..300 {
+            let path = destdir
+                .path()
+                .join(format!("d{}", d))
+                .join("sub")
+                .join(format!("f{}", f));
+            assert_eq!(
+                std::fs::read_to_string(path).unwrap(),
+                format!("content of {} {}", d, f)
+            );
+        }
+    }
+    // Directory mtimes are set after all their files are written.
+    let restored_mtime = FileTime::from_last_modification_time(
+        &std::fs::metadata(destdir.path().join("d3").join("sub")).unwrap(),
+    );
+    assert_eq!(restored_mtime, dir_mtime);
+}
+
+#[test]
+fn small_files_share_cached_block() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    for i in 0..10 {
+        srcdir.create_file_with_contents(&format!("f{}", i), format!("small {}", i).as_bytes());
+    }
+    let backup_stats = backup(&af, &srcdir.live_tree(), &BackupOptions::default()).unwrap();
+    assert_eq!(backup_stats.written_blocks, 1);
+
+    let destdir = TempDir::new().unwrap();
+    let stats = restore(&af, destdir.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(stats.files, 10);
+    assert_eq!(stats.block_cache_misses, 1);
+    assert_eq!(stats.block_cache_hits, 9);
+    assert_eq!(
+        std::fs::read_to_string(destdir.path().join("f7")).unwrap(),
+        "small 7"
+    );
+
+    // A new archive object has a new, empty, cache; and it can be turned off.
+    let archive = Archive::open_path(af.path()).unwrap();
+    let destdir = TempDir::new().unwrap();
+    let options = RestoreOptions {
+        block_cache_bytes: 0,
+        ..RestoreOptions::default()
+    };
+    let stats = restore(&archive, destdir.path(), &options).expect("restore");
+    assert_eq!(stats.block_cache_misses, 10);
+    assert_eq!(stats.block_cache_hits, 0);
+    // The limit only applies during that restore.
+    assert_eq!(
+        archive.block_dir().block_cache_limit(),
+        RestoreOptions::default().block_cache_bytes
+    );
+
+    // Large files are read in whole blocks, which are never cached, so they aren't
+    // counted as misses.
+    let srcdir = TreeFixture::new();
+    srcdir.create_file_with_contents("large", &vec![b'x'; 3 << 20]);
+    let af = ScratchArchive::new();
+    backup(&af, &srcdir.live_tree(), &BackupOptions::default()).unwrap();
+    let destdir = TempDir::new().unwrap();
+    let stats = restore(&af, destdir.path(), &RestoreOptions::default()).expect("restore");
+    assert_eq!(stats.block_cache_misses, 0);
+    assert_eq!(stats.block_cache_hits, 0);
+}
+
+#[test]
+fn sparse_and_preallocated_restores_have_same_content() {
+    let af = ScratchArchive::new();
+    let srcdir = TreeFixture::new();
+    let mut zeros = vec![0u8; 1 << 20];
+    zeros[100_000] = 1;
+    srcdir.create_file_with_contents("zeros", &zeros);
+    srcdir.create_file_with_contents(
+        "ends_in_zeros",
+        &[b"hello".as_ref(), &[0; 100_000]].concat(),
+    );
+    srcdir.create_file_with_contents("small", b"small");
+    srcdir.create_file_with_contents("empty", b"");
+    let options = BackupOptions {
+        drop_source_cache: true,
+        ..BackupOptions::default()
+    };
+    backup(&af, &srcdir.live_tree(), &options).expect("backup");
+
+    for &(preallocate, sparse) in &[(true, false), (false, true)] {
+        let destdir = TempDir::new().unwrap();
+        let options = RestoreOptions {
+            preallocate,
+            sparse,
+            ..RestoreOptions::default()
+        };
+        let stats = restore(&af, destdir.path(), &options).expect("restore");
+        assert_eq!(stats.errors, 0);
+        for name in &["zeros", "ends_in_zeros", "small", "empty"] {
+            assert_eq!(
+                std::fs::read(destdir.path().join(name)).unwrap(),
+                std::fs::read(srcdir.path().join(name)).unwrap(),
+                "{} restored with preallocate={} sparse={}",
+                name,
+                preallocate,
+                sparse
+            );
+        }
+    }
+}
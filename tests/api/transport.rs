@@ -28,6 +28,35 @@ fn parse_location() {
     let _transport = location.open();
 }
 
+#[test]
+fn parse_unsupported_url() {
+    use conserve::transport::Location;
+    use std::str::FromStr;
+    assert!(Location::from_str("ftp://example.com/backup").is_err());
+    assert!(Location::from_str("s3:///no-bucket").is_err());
+}
+
+#[cfg(feature = "s3")]
+#[test]
+fn parse_s3_url() {
+    use conserve::transport::Location;
+    use std::str::FromStr;
+    assert_eq!(
+        Location::from_str("s3://bucket/some/prefix/").unwrap(),
+        Location::S3 {
+            bucket: "bucket".to_owned(),
+            prefix: "some/prefix".to_owned()
+        }
+    );
+    assert_eq!(
+        Location::from_str("s3://bucket").unwrap(),
+        Location::S3 {
+            bucket: "bucket".to_owned(),
+            prefix: String::new()
+        }
+    );
+}
+
 #[test]
 fn list_dir_names() {
     let temp = assert_fs::TempDir::new().unwrap();
@@ -46,3 +75,47 @@ fn list_dir_names() {
 
     temp.close().unwrap();
 }
+
+#[test]
+fn batched_operations() {
+    let temp = assert_fs::TempDir::new().unwrap();
+    let transport = Location::Local((&temp.path()).to_path_buf())
+        .open()
+        .unwrap();
+
+    let files: Vec<(String, Vec<u8>)> = (0..50)
+        .map(|i| {
+            (
+                format!("file{:02}", i),
+                format!("content {}", i).into_bytes(),
+            )
+        })
+        .collect();
+    assert!(transport.write_many(&files).iter().all(|r| r.is_ok()));
+
+    let mut paths: Vec<String> = files.iter().map(|(path, _)| path.clone()).collect();
+    paths.push("nonexistent".to_owned());
+    let exists: Vec<bool> = transport
+        .exists_many(&paths)
+        .into_iter()
+        .map(|r| r.unwrap())
+        .collect();
+    assert_eq!(exists.iter().filter(|e| **e).count(), 50);
+    assert!(!exists[50]);
+
+    let contents = transport.read_many(&paths);
+    for ((_, expected), content) in files.iter().zip(&contents) {
+        assert_eq!(content.as_ref().unwrap(), expected);
+    }
+    assert!(contents[50].is_err());
+
+    let lens = transport.metadata_many(&paths[..2]);
+    assert_eq!(lens[0].as_ref().unwrap().len, 9);
+
+    let removed = transport.remove_many(&paths);
+    assert!(removed[..50].iter().all(|r| r.is_ok()));
+    assert!(removed[50].is_err());
+    assert!(transport.list_dir_names("").unwrap().files.is_empty());
+
+    temp.close().unwrap();
+}
@@ -0,0 +1,94 @@
+// Conserve backup system.
+// Copyright 2021 Martin Pool.
+
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+//! Test incremental validation.
+
+use std::fs;
+
+use conserve::test_fixtures::{ScratchArchive, TreeFixture};
+use conserve::*;
+
+fn incremental() -> ValidateOptions {
+    ValidateOptions {
+        incremental: true,
+        ..ValidateOptions::default()
+    }
+}
+
+fn archive_with_two_blocks() -> ScratchArchive {
+    let archive = ScratchArchive::new();
+    let tf = TreeFixture::new();
+    tf.create_file_with_contents("a", b"some content");
+    backup(&archive, &tf.live_tree(), &BackupOptions::default()).unwrap();
+    tf.create_file_with_contents("b", b"some more content");
+    backup(&archive, &tf.live_tree(), &BackupOptions::default()).unwrap();
+    assert_eq!(archive.block_dir().block_names().unwrap().count(), 2);
+    archive
+}
+
+#[test]
+fn incremental_validate_skips_verified_blocks() {
+    let archive = archive_with_two_blocks();
+
+    let stats = archive.validate(&incremental()).unwrap();
+    assert!(!stats.has_problems());
+    assert_eq!(stats.block_read_count, 2);
+    assert_eq!(stats.block_previously_verified_count, 0);
+    assert!(archive.path().join("VERIFIED").is_file());
+
+    let stats = archive.validate(&incremental()).unwrap();
+    assert!(!stats.has_problems());
+    assert_eq!(stats.block_read_count, 0);
+    assert_eq!(stats.block_previously_verified_count, 2);
+
+    // Non-incremental validation still reads everything, and accepts the ledger file.
+    let stats = archive.validate(&ValidateOptions::default()).unwrap();
+    assert!(!stats.has_problems());
+    assert_eq!(stats.unexpected_files, 0);
+    assert_eq!(stats.block_read_count, 2);
+}
+
+#[test]
+fn incremental_validate_reverifies_sample() {
+    let archive = archive_with_two_blocks();
+    archive.validate(&incremental()).unwrap();
+
+    let stats = archive
+        .validate(&ValidateOptions {
+            reverify_fraction: 1.0,
+            ..incremental()
+        })
+        .unwrap();
+    assert_eq!(stats.block_read_count, 2);
+    assert_eq!(stats.block_previously_verified_count, 0);
+}
+
+#[test]
+fn incremental_validate_rechecks_changed_block() {
+    let archive = archive_with_two_blocks();
+    archive.validate(&incremental()).unwrap();
+
+    let hash = archive.block_dir().block_names().unwrap().next().unwrap();
+    let hex = hash.to_string();
+    fs::write(
+        archive.path().join("d").join(&hex[..3]).join(&hex),
+        b"not a valid block",
+    )
+    .unwrap();
+
+    let stats = archive.validate(&incremental()).unwrap();
+    assert!(stats.has_problems());
+    assert_eq!(stats.block_read_count, 1);
+    assert_eq!(stats.block_error_count, 1);
+    assert_eq!(stats.block_previously_verified_count, 1);
+}
@@ -33,3 +33,52 @@ fn backup_verbose() {
         .success()
         .stdout("/\n/subdir/\n/subdir/a (new)\n/subdir/b (new)\n");
 }
+
+#[test]
+fn backup_metrics_json() {
+    let af = ScratchArchive::new();
+    let src = TreeFixture::new();
+    src.create_file("a");
+    let metrics_dir = tempfile::tempdir().unwrap();
+    let metrics_path = metrics_dir.path().join("metrics.json");
+
+    run_conserve()
+        .args(&["backup", "--no-stats"])
+        .arg(af.path())
+        .arg(src.path())
+        .arg("--metrics-json")
+        .arg(&metrics_path)
+        .assert()
+        .success();
+
+    let metrics: serde_json::Value =
+        serde_json::from_slice(&std::fs::read(&metrics_path).unwrap()).unwrap();
+    let phases = &metrics["phases"];
+    assert!(phases["walk_source_dir"]["ops"].as_u64().unwrap() >= 1);
+    assert!(phases["transport_write"]["bytes"].as_u64().unwrap() > 0);
+    assert!(phases["store_blocks"]["seconds"].is_f64());
+}
+
+#[test]
+fn backup_with_ops_limit_is_throttled() {
+    let af = ScratchArchive::new();
+    let src = TreeFixture::new();
+    src.create_file("a");
+    src.create_file("b");
+    let metrics_dir = tempfile::tempdir().unwrap();
+    let metrics_path = metrics_dir.path().join("metrics.json");
+
+    run_conserve()
+        .args(&["backup", "--no-stats", "--limit-ops-per-sec", "4"])
+        .arg(af.path())
+        .arg(src.path())
+        .arg("--metrics-json")
+        .arg(&metrics_path)
+        .assert()
+        .success();
+
+    let metrics: serde_json::Value =
+        serde_json::from_slice(&std::fs::read(&metrics_path).unwrap()).unwrap();
+    // The backup does more than the one-second burst of operations.
+    assert!(metrics["phases"]["throttle"]["ops"].as_u64().unwrap() >= 1);
+}
@@ -168,6 +168,37 @@ fn change_file_content() {
         .stderr(predicate::str::is_empty());
 }
 
+#[test]
+fn diff_to_other_backup() {
+    let (af, tf) = setup();
+    tf.create_file_with_contents("hello.c", b"int main() { abort(); }");
+    tf.create_file_with_contents("new.c", b"int x;");
+    run_conserve()
+        .arg("backup")
+        .arg(af.path())
+        .arg(tf.path())
+        .assert()
+        .success();
+
+    run_conserve()
+        .arg("diff")
+        .arg(af.path())
+        .args(&["-b", "b0", "--to", "b1"])
+        .assert()
+        .success()
+        .stdout("*\t/hello.c\n+\t/new.c\n")
+        .stderr(predicate::str::is_empty());
+
+    run_conserve()
+        .arg("diff")
+        .arg(af.path())
+        .args(&["--backup", "b1", "--to", "b1"])
+        .assert()
+        .success()
+        .stdout("")
+        .stderr(predicate::str::is_empty());
+}
+
 #[cfg(unix)]
 #[test]
 pub fn symlink_unchanged() {